@@ -0,0 +1,176 @@
+#!/bin/bash
+# Run a representative workload of transfers and commands against the server and client
+# in a build directory, over loopback, and report how long it took.
+#
+# Usage: scripts/workload.sh [-r rounds] [-n runs] build_directory...
+#   -r  rounds of the workload in each run (default 3)
+#   -n  runs per build directory; the fastest counts (default 1)
+#
+# Every run starts a fresh server.out from the build directory in a scratch directory,
+# with its own users.txt, so it does not touch bin/server. The server is stopped with
+# SIGTERM at the end, so instrumented builds write their profiles. With several build
+# directories, the speedup of each one against the first is reported.
+#
+# The control port (2100) must be free.
+
+set -e
+
+rounds=3
+runs=1
+while getopts "r:n:" option; do
+    case $option in
+        r) rounds=$OPTARG ;;
+        n) runs=$OPTARG ;;
+        *) echo "Usage: $0 [-r rounds] [-n runs] build_directory..." >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    echo "Usage: $0 [-r rounds] [-n runs] build_directory..." >&2
+    exit 1
+fi
+
+control_port=2100
+file_size_mb=4
+small_file_count=16
+
+run_dir=""
+server_pid=""
+cleanup() {
+    if [ -n "$server_pid" ]; then
+        kill -TERM "$server_pid" 2>/dev/null || true
+        wait "$server_pid" 2>/dev/null || true
+    fi
+    if [ -n "$run_dir" ]; then
+        rm -rf "$run_dir"
+    fi
+}
+trap cleanup EXIT
+
+# Create the local files of every round, and the client commands that transfer them
+prepare_run() {
+    run_dir=$(mktemp -d "${TMPDIR:-/tmp}/ftp-workload.XXXXXX")
+    mkdir -p "$run_dir/server" "$run_dir/local"
+    echo "workload workload" > "$run_dir/server/users.txt"
+
+    local commands="$run_dir/commands.txt"
+    printf "USER workload\nPASS workload\n" > "$commands"
+    for round in $(seq 1 "$rounds"); do
+        local dir="$run_dir/local/$round"
+        mkdir -p "$dir/v1" "$dir/v2" "$dir/small"
+        head -c $((file_size_mb * 1024 * 1024)) /dev/urandom > "$dir/file.bin"
+
+        # The second version changes a few blocks, so that storing it sends a delta
+        head -c $((file_size_mb * 1024 * 1024)) /dev/urandom > "$dir/v1/delta.bin"
+        cp "$dir/v1/delta.bin" "$dir/v2/delta.bin"
+        for block in 1 17 42; do
+            head -c 4096 /dev/urandom | dd of="$dir/v2/delta.bin" bs=4096 seek=$block conv=notrunc status=none
+        done
+
+        for i in $(seq 1 "$small_file_count"); do
+            head -c $((i * 1024)) /dev/urandom > "$dir/small/s$i.txt"
+        done
+
+        cat >> "$commands" <<EOF
+MKD r$round
+CWD r$round
+!CWD $dir
+STOR file.bin
+RETR file.bin
+SIZE file.bin
+MDTM file.bin
+HASH file.bin
+OPTS HASH CRC32C
+HASH file.bin
+OPTS HASH XXH64
+HASH file.bin
+OPTS HASH SHA-256
+SITE COPY file.bin copy.bin
+RNFR copy.bin
+RNTO renamed.bin
+DELE renamed.bin
+!CWD $dir/v1
+STOR delta.bin
+!CWD $dir/v2
+STOR delta.bin
+RETR delta.bin
+!CWD $dir/small
+MPUT *.txt
+MGET *.txt
+MGET *.txt
+LIST
+SITE QUOTA
+PWD
+CWD ..
+EOF
+    done
+    echo "QUIT" >> "$commands"
+}
+
+# Start the server of a build directory and wait until it accepts connections
+start_server() {
+    (cd "$run_dir" && exec "$1/server.out" > "$run_dir/server.log" 2>&1) &
+    server_pid=$!
+    for attempt in $(seq 1 100); do
+        if (exec 3<>/dev/tcp/127.0.0.1/$control_port) 2>/dev/null; then
+            return 0
+        fi
+        if ! kill -0 "$server_pid" 2>/dev/null; then
+            break
+        fi
+        sleep 0.1
+    done
+    echo "The server of $1 did not start:" >&2
+    cat "$run_dir/server.log" >&2
+    exit 1
+}
+
+stop_server() {
+    kill -TERM "$server_pid"
+    wait "$server_pid" || true
+    server_pid=""
+}
+
+# Run the workload once with a build directory, and set workload_ms to its duration
+run_workload() {
+    local build_dir
+    build_dir=$(cd "$1" && pwd)
+    prepare_run
+    start_server "$build_dir"
+
+    local start end
+    start=$(date +%s%N)
+    (cd "$run_dir" && "$build_dir/client.out" -t "$run_dir/server/cert.pem" < "$run_dir/commands.txt" > "$run_dir/client.log" 2>&1)
+    end=$(date +%s%N)
+    stop_server
+
+    # A failed command would make the timing (and a profile) meaningless
+    if grep -qE "(^|> )[45][0-9][0-9] |Error" "$run_dir/client.log"; then
+        echo "The workload failed with $1:" >&2
+        grep -E "(^|> )[45][0-9][0-9] |Error" "$run_dir/client.log" >&2
+        exit 1
+    fi
+
+    rm -rf "$run_dir"
+    run_dir=""
+    workload_ms=$(((end - start) / 1000000))
+}
+
+baseline_ms=""
+for build in "$@"; do
+    best_ms=""
+    for run in $(seq 1 "$runs"); do
+        run_workload "$build"
+        if [ -z "$best_ms" ] || [ "$workload_ms" -lt "$best_ms" ]; then
+            best_ms=$workload_ms
+        fi
+    done
+
+    if [ -z "$baseline_ms" ]; then
+        baseline_ms=$best_ms
+        printf "%-16s %8d ms\n" "$build" "$best_ms"
+    else
+        printf "%-16s %8d ms  %sx faster than %s\n" "$build" "$best_ms" \
+            "$(awk "BEGIN { printf \"%.2f\", $baseline_ms / $best_ms }")" "$1"
+    fi
+done
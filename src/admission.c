@@ -0,0 +1,250 @@
+#include "admission.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+struct admission* admission_create(int reactor_count) {
+    size_t size = sizeof(struct admission) + (size_t)reactor_count * sizeof(struct admission_table);
+
+    // Pages are only touched by the reactors that use them, so the unused parts of the tables cost nothing
+    struct admission *admission = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (admission == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&(admission->lock), &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    admission->reactor_count = reactor_count;
+    return admission;
+}
+
+static void lock_admission(struct admission *admission) {
+    if (pthread_mutex_lock(&(admission->lock)) == EOWNERDEAD) {
+        // A reactor died while holding the lock; the counters it was changing
+        // are cleared when it is restarted
+        pthread_mutex_consistent(&(admission->lock));
+    }
+}
+
+void admission_reset(struct admission *admission, int reactor_id) {
+    lock_admission(admission);
+    memset(&(admission->tables[reactor_id]), 0, sizeof(struct admission_table));
+    pthread_mutex_unlock(&(admission->lock));
+}
+
+uint64_t admission_ip_key(in_addr_t addr) {
+    // Tagged so that IP and user keys never collide, and never 0
+    return ((uint64_t)addr << 2) | 2;
+}
+
+uint64_t admission_user_key(const char *username) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const char *c = username; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 0x100000001b3ull;
+    }
+    return (hash << 2) | 1;
+}
+
+static uint64_t mix_key(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key;
+}
+
+/**
+ * @brief Find the entry of the key in the table
+ * 
+ * @param create Whether to create the entry if it does not exist
+ * @return The entry, or NULL if it does not exist (or the table is full)
+ */
+static struct admission_entry* find_entry(struct admission_table *table, uint64_t key, int create) {
+    uint32_t mask = ADMISSION_TABLE_SIZE - 1;
+    for (uint32_t i = mix_key(key) & mask, probes = 0; probes < ADMISSION_TABLE_SIZE; i = (i + 1) & mask, probes++) {
+        struct admission_entry *entry = &(table->entries[i]);
+        if (entry->key == key) {
+            return entry;
+        }
+        if (entry->key == 0) {
+            if (!create) {
+                return NULL;
+            }
+            entry->key = key;
+            table->used++;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Rebuild the table without the entries whose counters dropped to zero.
+ * Entries are not removed one by one, since that would break the probe sequences.
+ */
+static void compact_table(struct admission_table *table) {
+    static struct admission_entry live[ADMISSION_TABLE_SIZE];
+    int live_count = 0;
+    for (int i = 0; i < ADMISSION_TABLE_SIZE; i++) {
+        struct admission_entry *entry = &(table->entries[i]);
+        if (entry->key != 0 && (entry->sessions > 0 || entry->transfers > 0)) {
+            live[live_count++] = *entry;
+        }
+    }
+
+    memset(table->entries, 0, sizeof(table->entries));
+    table->used = 0;
+    for (int i = 0; i < live_count; i++) {
+        *find_entry(table, live[i].key, 1) = live[i];
+    }
+}
+
+/**
+ * @brief Make room for new entries in the table of a reactor when it gets crowded.
+ * Invalidates pointers to its entries.
+ */
+static void reserve_entries(struct admission_table *table) {
+    if (table->used >= ADMISSION_TABLE_SIZE / 4 * 3) {
+        compact_table(table);
+    }
+}
+
+/**
+ * @brief Sum the counters of the key over all reactors
+ */
+static void sum_entries(struct admission *admission, uint64_t key, int *sessions, int *transfers) {
+    *sessions = 0;
+    *transfers = 0;
+    for (int r = 0; r < admission->reactor_count; r++) {
+        struct admission_entry *entry = find_entry(&(admission->tables[r]), key, 0);
+        if (entry != NULL) {
+            *sessions += entry->sessions;
+            *transfers += entry->transfers;
+        }
+    }
+}
+
+static void sum_totals(struct admission *admission, int *sessions, int *transfers) {
+    *sessions = 0;
+    *transfers = 0;
+    for (int r = 0; r < admission->reactor_count; r++) {
+        *sessions += admission->tables[r].sessions;
+        *transfers += admission->tables[r].transfers;
+    }
+}
+
+int admission_acquire_session(struct admission *admission, int reactor_id, uint64_t ip_key) {
+    struct admission_table *table = &(admission->tables[reactor_id]);
+    int sessions, transfers, ip_sessions, ip_transfers;
+
+    lock_admission(admission);
+    sum_totals(admission, &sessions, &transfers);
+    sum_entries(admission, ip_key, &ip_sessions, &ip_transfers);
+    struct admission_entry *entry = NULL;
+    if (sessions < ADMISSION_MAX_SESSIONS && ip_sessions < ADMISSION_MAX_SESSIONS_PER_IP) {
+        reserve_entries(table);
+        entry = find_entry(table, ip_key, 1);
+    }
+    if (entry != NULL) {
+        entry->sessions++;
+        table->sessions++;
+    }
+    pthread_mutex_unlock(&(admission->lock));
+
+    return entry != NULL ? 0 : -1;
+}
+
+void admission_release_session(struct admission *admission, int reactor_id, uint64_t ip_key) {
+    struct admission_table *table = &(admission->tables[reactor_id]);
+
+    lock_admission(admission);
+    struct admission_entry *entry = find_entry(table, ip_key, 0);
+    if (entry != NULL && entry->sessions > 0) {
+        entry->sessions--;
+        table->sessions--;
+    }
+    pthread_mutex_unlock(&(admission->lock));
+}
+
+int admission_acquire_user_session(struct admission *admission, int reactor_id, uint64_t user_key) {
+    struct admission_table *table = &(admission->tables[reactor_id]);
+    int user_sessions, user_transfers;
+
+    lock_admission(admission);
+    sum_entries(admission, user_key, &user_sessions, &user_transfers);
+    struct admission_entry *entry = NULL;
+    if (user_sessions < ADMISSION_MAX_SESSIONS_PER_USER) {
+        reserve_entries(table);
+        entry = find_entry(table, user_key, 1);
+    }
+    if (entry != NULL) {
+        entry->sessions++;
+    }
+    pthread_mutex_unlock(&(admission->lock));
+
+    return entry != NULL ? 0 : -1;
+}
+
+void admission_release_user_session(struct admission *admission, int reactor_id, uint64_t user_key) {
+    lock_admission(admission);
+    struct admission_entry *entry = find_entry(&(admission->tables[reactor_id]), user_key, 0);
+    if (entry != NULL && entry->sessions > 0) {
+        entry->sessions--;
+    }
+    pthread_mutex_unlock(&(admission->lock));
+}
+
+int admission_acquire_transfer(struct admission *admission, int reactor_id, uint64_t ip_key, uint64_t user_key) {
+    struct admission_table *table = &(admission->tables[reactor_id]);
+    int sessions, transfers, ip_sessions, ip_transfers, user_sessions, user_transfers;
+
+    lock_admission(admission);
+    sum_totals(admission, &sessions, &transfers);
+    sum_entries(admission, ip_key, &ip_sessions, &ip_transfers);
+    sum_entries(admission, user_key, &user_sessions, &user_transfers);
+    struct admission_entry *ip_entry = NULL, *user_entry = NULL;
+    if (transfers < ADMISSION_MAX_TRANSFERS && ip_transfers < ADMISSION_MAX_TRANSFERS_PER_IP
+        && user_transfers < ADMISSION_MAX_TRANSFERS_PER_USER) {
+        reserve_entries(table);
+        ip_entry = find_entry(table, ip_key, 1);
+        user_entry = find_entry(table, user_key, 1);
+    }
+    int admitted = ip_entry != NULL && user_entry != NULL;
+    if (admitted) {
+        ip_entry->transfers++;
+        user_entry->transfers++;
+        table->transfers++;
+    }
+    pthread_mutex_unlock(&(admission->lock));
+
+    return admitted ? 0 : -1;
+}
+
+void admission_release_transfer(struct admission *admission, int reactor_id, uint64_t ip_key, uint64_t user_key) {
+    struct admission_table *table = &(admission->tables[reactor_id]);
+
+    lock_admission(admission);
+    struct admission_entry *ip_entry = find_entry(table, ip_key, 0);
+    struct admission_entry *user_entry = find_entry(table, user_key, 0);
+    if (ip_entry != NULL && ip_entry->transfers > 0) {
+        ip_entry->transfers--;
+    }
+    if (user_entry != NULL && user_entry->transfers > 0) {
+        user_entry->transfers--;
+    }
+    if (table->transfers > 0) {
+        table->transfers--;
+    }
+    pthread_mutex_unlock(&(admission->lock));
+}
@@ -0,0 +1,113 @@
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Limits on concurrent control connections (sessions), over all reactors
+// (each reactor also serves at most SERVER_REACTOR_MAX_SESSIONS, see server.h)
+#define ADMISSION_MAX_SESSIONS (4096)
+#define ADMISSION_MAX_SESSIONS_PER_IP (64)
+#define ADMISSION_MAX_SESSIONS_PER_USER (32)
+// Limits on concurrent data transfers (processes), over all reactors
+#define ADMISSION_MAX_TRANSFERS (64)
+#define ADMISSION_MAX_TRANSFERS_PER_IP (16)
+#define ADMISSION_MAX_TRANSFERS_PER_USER (8)
+// Number of per-IP and per-user counters each reactor can hold (a power of two)
+#define ADMISSION_TABLE_SIZE (16384)
+
+/**
+ * @brief Counters of one IP address or user in one reactor
+ */
+struct admission_entry {
+    uint64_t key;       // admission_ip_key() or admission_user_key(), or 0 if the entry is empty
+    int sessions;
+    int transfers;
+};
+
+/**
+ * @brief Counters of one reactor. Every reactor only changes its own table, so that
+ * a reactor that crashed and was restarted can simply clear what it held.
+ */
+struct admission_table {
+    int sessions;       // Sessions of this reactor
+    int transfers;      // Transfers of this reactor
+    int used;           // Number of non-empty entries
+    struct admission_entry entries[ADMISSION_TABLE_SIZE]; // Open addressing, linear probing
+};
+
+/**
+ * @brief Admission control state shared by all reactors
+ */
+struct admission {
+    pthread_mutex_t lock;   // Process-shared, robust lock protecting all tables
+    int reactor_count;
+    struct admission_table tables[];
+};
+
+/**
+ * @brief Create the admission control state in shared anonymous memory. Must be called
+ * before forking the reactors.
+ * 
+ * @param reactor_count 
+ * @return The state (exits the process on failure)
+ */
+struct admission* admission_create(int reactor_count);
+
+/**
+ * @brief Forget all sessions and transfers of a reactor, when it (re)starts
+ * 
+ * @param admission 
+ * @param reactor_id 
+ */
+void admission_reset(struct admission *admission, int reactor_id);
+
+/**
+ * @brief Get the key identifying an IP address
+ */
+uint64_t admission_ip_key(in_addr_t addr);
+
+/**
+ * @brief Get the key identifying a user
+ */
+uint64_t admission_user_key(const char *username);
+
+/**
+ * @brief Admit a new control connection from the IP address, within the global and per-IP limits
+ * 
+ * @param admission 
+ * @param reactor_id 
+ * @param ip_key 
+ * @return 0 if admitted, -1 if a limit has been reached
+ */
+int admission_acquire_session(struct admission *admission, int reactor_id, uint64_t ip_key);
+
+void admission_release_session(struct admission *admission, int reactor_id, uint64_t ip_key);
+
+/**
+ * @brief Admit a login of the user, within the per-user limit
+ * 
+ * @param admission 
+ * @param reactor_id 
+ * @param user_key 
+ * @return 0 if admitted, -1 if the limit has been reached
+ */
+int admission_acquire_user_session(struct admission *admission, int reactor_id, uint64_t user_key);
+
+void admission_release_user_session(struct admission *admission, int reactor_id, uint64_t user_key);
+
+/**
+ * @brief Admit a data transfer, within the global, per-IP and per-user limits
+ * 
+ * @param admission 
+ * @param reactor_id 
+ * @param ip_key 
+ * @param user_key 
+ * @return 0 if admitted, -1 if a limit has been reached
+ */
+int admission_acquire_transfer(struct admission *admission, int reactor_id, uint64_t ip_key, uint64_t user_key);
+
+void admission_release_transfer(struct admission *admission, int reactor_id, uint64_t ip_key, uint64_t user_key);
+
+#endif
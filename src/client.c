@@ -1,45 +1,155 @@
 #include "client.h"
 #include "common.h"
+#include "tls.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <glob.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 const char *COMMAND_LIST_CLIENT = "!LIST";
 const char *COMMAND_CHANGE_DIRECTORY_CLIENT = "!CWD";
 const char *COMMAND_PRINT_DIRECTORY_CLIENT = "!PWD";
+const char *COMMAND_PARALLEL_CLIENT = "!PARALLEL";
+const char *COMMAND_MULTIPLE_STORE_CLIENT = "MPUT";
+const char *COMMAND_MULTIPLE_RETRIEVE_CLIENT = "MGET";
+const char *COMMAND_MIRROR_CLIENT = "MIRROR";
+
+int main(int argc, char **argv) {
+    const char *trusted_certificate_path = parse_client_options(argc, argv);
+
+    // The context is shared by all sessions of the client
+    int verified = tls_create_client_context(trusted_certificate_path, TLS_CERTIFICATE_IP);
+    if (verified == -1) {
+        fprintf(stderr, "Error: Could not load the trusted certificate %s\n", trusted_certificate_path);
+        exit(EXIT_FAILURE);
+    } else if (verified == 0) {
+        printf("Warning: The server certificate will not be verified (-k)\n");
+    }
 
-int main() {
     struct client_state client;
     client.control_sockfd = -1;
     client.data_listen_sockfd = -1;
     client.data_listen_port = -1;
     client.data_sockfd = -1;
+    client.has_credentials = 0;
+    client.session_count = CLIENT_DEFAULT_SESSIONS;
     
     // Connect to the server
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET; // IPV4
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    server_addr.sin_port = htons(SERVER_CONTROL_PORT);
+    memset(&(client.server_addr), 0, sizeof(client.server_addr));
+    client.server_addr.sin_family = AF_INET; // IPV4
+    client.server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    client.server_addr.sin_port = htons(SERVER_CONTROL_PORT);
 
-    connect_to_addr(server_addr, &(client.control_sockfd), &(client.control_port));
+    connect_to_addr(client.server_addr, &(client.control_sockfd), &(client.control_port));
     
     if (!receive_message_then_print_then_check_first_token(client.control_sockfd, "220")) {
         // Server didn't reply with proper welcome message
         exit(EXIT_FAILURE);
     }
 
+    if (secure_control_connection(&client) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
     get_commands(&client);
 
     return EXIT_SUCCESS;
 }
 
+const char* parse_client_options(int argc, char **argv) {
+    const char *trusted_certificate_path = NULL;
+    int insecure = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "t:k")) != -1) {
+        if (option == 't') {
+            trusted_certificate_path = optarg;
+        } else if (option == 'k') {
+            insecure = 1;
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    // Not verifying the server must be asked for
+    if (optind != argc || (trusted_certificate_path == NULL) == !insecure) {
+        fprintf(stderr, "Usage: %s -t trusted.pem | -k\n", argv[0]);
+        fprintf(stderr, "  -t  verify the server against this certificate (from bin: server/cert.pem)\n");
+        fprintf(stderr, "  -k  do not verify the server\n");
+        exit(EXIT_FAILURE);
+    }
+    return trusted_certificate_path;
+}
+
+int open_session(struct client_state *client, struct client_state *session) {
+    static char buf[COMMAND_STR_MAX];
+
+    *session = *client;
+    session->data_listen_sockfd = -1;
+    session->data_listen_port = -1;
+    session->data_sockfd = -1;
+
+    connect_to_addr(client->server_addr, &(session->control_sockfd), &(session->control_port));
+    if (!receive_message_then_print_then_check_first_token(session->control_sockfd, "220")
+        || secure_control_connection(session) == -1) {
+        return -1;
+    }
+    if (!client->has_credentials) {
+        return 0;
+    }
+
+    if (snprintf(buf, sizeof(buf), "%s %s", COMMAND_USERNAME, client->username) >= (int)sizeof(buf)) {
+        return -1;
+    }
+    send_message(session->control_sockfd, buf);
+    if (!receive_message_then_print_then_check_first_token(session->control_sockfd, "331")) {
+        return -1;
+    }
+    if (snprintf(buf, sizeof(buf), "%s %s", COMMAND_PASSWORD, client->password) >= (int)sizeof(buf)) {
+        return -1;
+    }
+    send_message(session->control_sockfd, buf);
+    return receive_message_then_print_then_check_first_token(session->control_sockfd, "230")
+        ? 0
+        : -1;
+}
+
+int secure_control_connection(struct client_state *client) {
+    send_message(client->control_sockfd, "AUTH TLS");
+    if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "234")) {
+        return -1;
+    }
+    if (tls_connect(client->control_sockfd, -1) == -1) {
+        fprintf(stderr, "Error: TLS handshake with the server failed\n");
+        return -1;
+    }
+
+    send_message(client->control_sockfd, "PBSZ 0");
+    if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "200")) {
+        return -1;
+    }
+    send_message(client->control_sockfd, "PROT P");
+    if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "200")) {
+        return -1;
+    }
+    return 0;
+}
+
 void get_commands(struct client_state *client) {
     static char command[COMMAND_STR_MAX];
 
@@ -71,6 +181,18 @@ void get_commands(struct client_state *client) {
             execute_command_store(client, command);
         } else if (check_first_token(command, COMMAND_RETRIEVE)) {
             execute_command_retrieve(client, command);
+        } else if (check_first_token(command, COMMAND_PARALLEL_CLIENT)) {
+            execute_command_parallel(client, command);
+        } else if (check_first_token(command, COMMAND_MULTIPLE_STORE_CLIENT)) {
+            execute_command_multiple_store(client, command);
+        } else if (check_first_token(command, COMMAND_MULTIPLE_RETRIEVE_CLIENT)) {
+            execute_command_multiple_retrieve(client, command);
+        } else if (check_first_token(command, COMMAND_MIRROR_CLIENT)) {
+            execute_command_mirror(client, command);
+        } else if (check_first_token(command, COMMAND_USERNAME)) {
+            execute_command_username(client, command);
+        } else if (check_first_token(command, COMMAND_PASSWORD)) {
+            execute_command_password(client, command);
         } else {
             // Whichever command it is, it is handled by sending it to the server
             // and just printing the response
@@ -140,7 +262,7 @@ int send_data_listen_port(struct client_state *client) {
         : -1;
 }
 
-void initiate_data_transfer(struct client_state *client) {
+int initiate_data_transfer(struct client_state *client) {
     // Wait for server to ask to establish TCP connection, and accept it
     struct sockaddr_in server_addr;
     socklen_t addr_len = sizeof(server_addr);
@@ -152,9 +274,22 @@ void initiate_data_transfer(struct client_state *client) {
     }
     
     client->data_sockfd = data_sockfd;
+
+    // Resuming the session of the control connection shows the server that this is the same client
+    if (tls_connect(data_sockfd, client->control_sockfd) == -1) {
+        fprintf(stderr, "Error: Could not secure the data connection\n");
+        close(data_sockfd);
+        client->data_sockfd = -1;
+        close(client->data_listen_sockfd);
+        client->data_listen_sockfd = -1;
+        receive_message_then_print(client->control_sockfd);
+        return -1;
+    }
+    return 0;
 }
 
 void end_data_transfer(struct client_state *client) {
+    tls_shutdown(client->data_sockfd);
     close(client->data_sockfd);
     client->data_sockfd = -1;
 }
@@ -174,7 +309,9 @@ void execute_command_list(struct client_state *client) {
 
     // Initiate the data connection, wait for the server to connect,
     // receive and print the list of files, then close the connection
-    initiate_data_transfer(client);
+    if (initiate_data_transfer(client) == -1) {
+        return;
+    }
     receive_message_then_print(client->data_sockfd);
     end_data_transfer(client);
 
@@ -186,53 +323,250 @@ void execute_command_list(struct client_state *client) {
     receive_message_then_print(client->control_sockfd);
 }
 
-void execute_command_store(struct client_state *client, char *command) {
-    static char buf[COMMAND_STR_MAX];
-
-    // Extract the path from the command and ensure it points to a file
+int execute_command_store(struct client_state *client, char *command) {
+    // Extract the path from the command
     strtok(command, " ");
     char *path = strtok(NULL, " ");
+    if (path == NULL) {
+        printf("Error: Give the path of a file\n");
+        return -1;
+    }
+    return store_file(client, path);
+}
+
+int store_file(struct client_state *client, const char *path) {
+    static char buf[COMMAND_STR_MAX];
+    static char path_copy[PATH_MAX];
+
+    // Ensure the path points to a file
     if (!is_path_file(path)) {
         printf("Error: Given path is not a file\n");
-        return;
+        return -1;
     }
 
     // Extract the filename from the path
     // Compose the message to send to the server
-    char *filename = basename(path);
+    snprintf(path_copy, sizeof(path_copy), "%s", path);
+    char *filename = basename(path_copy);
     sprintf(buf, "%s %s", COMMAND_STORE, filename);
 
+    // Announce the content first; if the server has it already, no data needs to be sent,
+    // and the server completes the STOR without a data connection (250 rather than 226)
+    if (send_content_hash(client, path) == 0) {
+        send_message(client->control_sockfd, buf);
+        return receive_message_then_print_then_check_first_token(client->control_sockfd, "250")
+            ? 0
+            : -1;
+    }
+
+    // If the server has an older version, send only what changed
+    int status = store_file_delta(client, path, filename);
+    if (status != 1) {
+        return status;
+    }
+
     // Start listening on some port for data, send the port
     listen_on_next_free_port(client);
     if (send_data_listen_port(client) == -1) {
-        return;
+        return -1;
     }
 
+    // Announce the size so the server can preallocate the file
+    send_allocation_size(client, path);
+
     // Send the command message, get server response
     send_message(client->control_sockfd, buf);
     if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "150")) {
-        return;
+        return -1;
     }
     
     // Initiate the data connection, wait for server to connect, then send the file
-    initiate_data_transfer(client);
-    send_file(client->data_sockfd, path);
+    struct hash_ctx checksum;
+    hash_init(&checksum, TRANSFER_CHECKSUM_ALGORITHM);
+    if (initiate_data_transfer(client) == -1) {
+        return -1;
+    }
+    send_file(client->data_sockfd, path, &checksum);
     end_data_transfer(client);
 
     // Stop listening for new connections
     close(client->data_listen_sockfd);
     client->data_listen_sockfd = -1;
     
-    // Receive and print (hopefully) success message
+    // Receive and print (hopefully) success message, and verify the checksum
+    return receive_transfer_result(client, &checksum);
+}
+
+int store_file_delta(struct client_state *client, const char *path, const char *filename) {
+    int fd = open(path, O_RDONLY);
+    struct stat stat_result;
+    if (fd == -1 || fstat(fd, &stat_result) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (stat_result.st_size < DELTA_MIN_FILE_SIZE) {
+        close(fd);
+        return 1;
+    }
+
+    // Without a version on the server, or with nothing in common, there is nothing to gain.
+    // Most files are new, so a missing version is not worth a reply on the screen.
+    struct delta_signature signature;
+    int saved_stdout = silence_output();
+    int status = fetch_signature(client, filename, &signature);
+    restore_output(saved_stdout);
+    if (status == -1) {
+        close(fd);
+        return 1;
+    }
+    if (signature.block_count == 0) {
+        delta_free_signature(&signature);
+        close(fd);
+        return 1;
+    }
+
+    // The rolling checksum looks at every byte position, so map the whole file
+    uint8_t *data = mmap(NULL, stat_result.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        delta_free_signature(&signature);
+        return 1;
+    }
+    madvise(data, stat_result.st_size, MADV_SEQUENTIAL);
+
+    status = send_delta(client, path, filename, &signature, data, stat_result.st_size);
+    munmap(data, stat_result.st_size);
+    delta_free_signature(&signature);
+    return status;
+}
+
+int send_delta(struct client_state *client, const char *path, const char *filename,
+    const struct delta_signature *signature, const uint8_t *data, off_t size) {
+    static char buf[COMMAND_STR_MAX];
+
+    // Start listening on some port for data, send the port
+    listen_on_next_free_port(client);
+    if (send_data_listen_port(client) == -1) {
+        close(client->data_listen_sockfd);
+        client->data_listen_sockfd = -1;
+        return 1;
+    }
+
+    // Announce the size so the server can preallocate the file
+    send_allocation_size(client, path);
+
+    // Send the command message, get server response
+    sprintf(buf, "%s %s", COMMAND_DELTA_STORE, filename);
+    send_message(client->control_sockfd, buf);
+    if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "150")) {
+        close(client->data_listen_sockfd);
+        client->data_listen_sockfd = -1;
+        return 1;
+    }
+
+    // Initiate the data connection, wait for server to connect, then send the delta
+    if (initiate_data_transfer(client) == -1) {
+        return -1;
+    }
+    struct hash_ctx checksum;
+    hash_init(&checksum, TRANSFER_CHECKSUM_ALGORITHM);
+    struct delta_stats stats;
+    delta_send(client->data_sockfd, signature, data, size, &checksum, &stats);
+    end_data_transfer(client);
+
+    // Stop listening for new connections
+    close(client->data_listen_sockfd);
+    client->data_listen_sockfd = -1;
+    printf("Delta: %.1f MB unchanged, %.1f MB sent\n", stats.copied_bytes / 1e6, stats.literal_bytes / 1e6);
+
+    // Whatever went wrong (e.g. the file changed on the server in between), a full upload remains
+    return receive_transfer_result(client, &checksum) == 0 ? 0 : 1;
+}
+
+int fetch_signature(struct client_state *client, const char *filename, struct delta_signature *signature) {
+    static char buf[COMMAND_STR_MAX];
+
+    // Start listening on some port for data, send the port
+    listen_on_next_free_port(client);
+    int status = send_data_listen_port(client);
+    if (status == 0) {
+        sprintf(buf, "%s %s", COMMAND_SIGNATURE, filename);
+        send_message(client->control_sockfd, buf);
+        status = receive_message_then_print_then_check_first_token(client->control_sockfd, "150") ? 0 : -1;
+    }
+    if (status == 0) {
+        status = initiate_data_transfer(client);
+    }
+    if (status == -1) {
+        close(client->data_listen_sockfd);
+        client->data_listen_sockfd = -1;
+        return -1;
+    }
+
+    status = delta_receive_signature(client->data_sockfd, signature);
+    end_data_transfer(client);
+
+    // Stop listening for new connections
+    close(client->data_listen_sockfd);
+    client->data_listen_sockfd = -1;
+
+    if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "226")) {
+        if (status == 0) {
+            delta_free_signature(signature);
+        }
+        return -1;
+    }
+    return status;
+}
+
+void send_allocation_size(struct client_state *client, const char *path) {
+    static char buf[COMMAND_STR_MAX];
+
+    struct stat stat_result;
+    if (stat(path, &stat_result) == -1) {
+        return;
+    }
+
+    sprintf(buf, "%s %lld", COMMAND_ALLOCATE, (long long)stat_result.st_size);
+    send_message(client->control_sockfd, buf);
     receive_message_then_print(client->control_sockfd);
 }
 
-void execute_command_retrieve(struct client_state *client, char *command) {
+int send_content_hash(struct client_state *client, const char *path) {
     static char buf[COMMAND_STR_MAX];
+    static char hex[SHA256_HEX_SIZE];
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    if (sha256_file(path, digest) == -1) {
+        return -1;
+    }
+    bytes_to_hex(digest, SHA256_DIGEST_SIZE, hex);
 
+    sprintf(buf, "%s %s", COMMAND_CONTENT_HASH, hex);
+    send_message(client->control_sockfd, buf);
+
+    // 213 means the server stores a file with this content already
+    return receive_message_then_print_then_check_first_token(client->control_sockfd, "213")
+        ? 0
+        : -1;
+}
+
+int execute_command_retrieve(struct client_state *client, char *command) {
     // Extract the filename
     strtok(command, " ");
     char *filename = strtok(NULL, " ");
+    if (filename == NULL) {
+        printf("Error: Give the name of a file\n");
+        return -1;
+    }
+    return retrieve_file(client, filename);
+}
+
+int retrieve_file(struct client_state *client, const char *filename) {
+    static char buf[COMMAND_STR_MAX];
 
     // Ensure only a file is being asked for (no directory changing or relative paths)
     // char *last_slash = strrchr(filename, '/');
@@ -244,7 +578,7 @@ void execute_command_retrieve(struct client_state *client, char *command) {
     // Start listening on some port for data, send the port
     listen_on_next_free_port(client);
     if (send_data_listen_port(client) == -1) {
-        return;
+        return -1;
     }
 
     // Prepare the command message to send;
@@ -252,19 +586,57 @@ void execute_command_retrieve(struct client_state *client, char *command) {
     sprintf(buf, "%s %s", COMMAND_RETRIEVE, filename);
     send_message(client->control_sockfd, buf);
     if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "150")) {
-        return;
+        return -1;
     }
 
-    initiate_data_transfer(client);
-    save_file(client->data_sockfd, filename);
+    struct hash_ctx checksum;
+    hash_init(&checksum, TRANSFER_CHECKSUM_ALGORITHM);
+    if (initiate_data_transfer(client) == -1) {
+        return -1;
+    }
+    save_file(client->data_sockfd, filename, &checksum);
     end_data_transfer(client);
 
     // Stop listening for new connections
     close(client->data_listen_sockfd);
     client->data_listen_sockfd = -1;
     
-    // Receive and print (hopefully) success message
-    receive_message_then_print(client->control_sockfd);
+    // Receive and print (hopefully) success message, and verify the checksum
+    return receive_transfer_result(client, &checksum);
+}
+
+int receive_transfer_result(struct client_state *client, struct hash_ctx *checksum) {
+    static char buf[COMMAND_STR_MAX];
+    static char expected[16 + HASH_HEX_MAX];
+
+    receive_message(client->control_sockfd, buf, sizeof(buf));
+    printf("%s\n", buf);
+    if (!check_first_token(buf, "226")) {
+        return -1;
+    }
+
+    // Find the checksum computed by the server, named by its algorithm
+    format_transfer_checksum(checksum, expected);
+    size_t name_length = strcspn(expected, "=");
+    char *reported = buf;
+    while ((reported = strstr(reported, " ")) != NULL) {
+        reported++;
+        if (strncmp(reported, expected, name_length + 1) == 0) {
+            break;
+        }
+    }
+    if (reported == NULL) {
+        // The server did not report a checksum; nothing to verify
+        return 0;
+    }
+
+    // Compare with the checksum of what was sent or received here
+    size_t reported_length = strcspn(reported, " \r\n");
+    if (reported_length != strlen(expected) || strncmp(reported, expected, reported_length) != 0) {
+        printf("Error: Checksum mismatch, expected %s\n", expected);
+        return -1;
+    }
+    return 0;
 }
 
 void execute_command_change_directory_client(char *command) {
@@ -313,3 +685,673 @@ void print_files_current_directory() {
     // Print the result
     printf("%s\n", result);
 }
+
+void execute_command_username(struct client_state *client, char *command) {
+    // Remember the name, so that more sessions can log in with it once the password is accepted
+    client->has_credentials = 0;
+    char *username = command + strlen(COMMAND_USERNAME);
+    username += strspn(username, " ");
+    strcpy(client->username, username);
+
+    send_message(client->control_sockfd, command);
+    receive_message_then_print(client->control_sockfd);
+}
+
+void execute_command_password(struct client_state *client, char *command) {
+    send_message(client->control_sockfd, command);
+    if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "230")) {
+        return;
+    }
+
+    char *password = command + strlen(COMMAND_PASSWORD);
+    password += strspn(password, " ");
+    strcpy(client->password, password);
+    client->has_credentials = 1;
+}
+
+void execute_command_parallel(struct client_state *client, char *command) {
+    strtok(command, " ");
+    char *count = strtok(NULL, " ");
+    if (count == NULL) {
+        printf("Sessions: %d\n", client->session_count);
+        return;
+    }
+
+    int session_count = atoi(count);
+    if (session_count < 1 || session_count > CLIENT_MAX_SESSIONS) {
+        printf("Error: Give a number of sessions from 1 to %d\n", CLIENT_MAX_SESSIONS);
+        return;
+    }
+    client->session_count = session_count;
+    printf("Sessions: %d\n", client->session_count);
+}
+
+void execute_command_multiple_store(struct client_state *client, char *command) {
+    static char remote_dir[PATH_MAX];
+    static char local_path[PATH_MAX];
+
+    if (get_remote_directory(client, remote_dir) == -1) {
+        return;
+    }
+
+    struct transfer_plan plan;
+    plan_init(&plan, TRANSFER_DIRECTION_UPLOAD);
+
+    // Every regular file matching one of the patterns goes into the current remote directory
+    strtok(command, " ");
+    char *pattern;
+    while ((pattern = strtok(NULL, " ")) != NULL) {
+        glob_t matches;
+        if (glob(pattern, 0, NULL, &matches) != 0) {
+            printf("Error: No local file matches %s\n", pattern);
+            continue;
+        }
+        for (size_t i = 0; i < matches.gl_pathc; i++) {
+            struct stat stat_result;
+            if (stat(matches.gl_pathv[i], &stat_result) == -1 || !S_ISREG(stat_result.st_mode)
+                || realpath(matches.gl_pathv[i], local_path) == NULL) {
+                continue;
+            }
+            if (plan_check_name(&plan, local_path, strrchr(local_path, '/') + 1)) {
+                plan_add(&plan, local_path, remote_dir, stat_result.st_size);
+            }
+        }
+        globfree(&matches);
+    }
+
+    run_transfer_plan(client, &plan);
+    plan_free(&plan);
+}
+
+void execute_command_multiple_retrieve(struct client_state *client, char *command) {
+    static char remote_dir[PATH_MAX];
+    static char local_dir[PATH_MAX];
+    static char local_path[PATH_MAX];
+
+    if (get_remote_directory(client, remote_dir) == -1 || getcwd(local_dir, sizeof(local_dir)) == NULL) {
+        return;
+    }
+
+    int saved_stdout = silence_output();
+    char *listing = fetch_remote_listing(client);
+    restore_output(saved_stdout);
+    if (listing == NULL) {
+        printf("Error: Could not list the current remote directory\n");
+        return;
+    }
+
+    struct transfer_plan plan;
+    plan_init(&plan, TRANSFER_DIRECTION_DOWNLOAD);
+
+    // Every file of the current remote directory matching one of the patterns
+    // goes into the current local directory
+    strtok(command, " ");
+    char *patterns[COMMAND_STR_MAX / 2];
+    int pattern_count = 0;
+    char *pattern;
+    while ((pattern = strtok(NULL, " ")) != NULL) {
+        patterns[pattern_count++] = pattern;
+    }
+
+    char *line = strtok(listing, "\r\n");
+    while (line != NULL) {
+        char *next_line = strtok(NULL, "\r\n");
+        int is_directory;
+        off_t size;
+        char *name = parse_remote_listing_line(line, &is_directory, &size);
+        for (int i = 0; name != NULL && !is_directory && i < pattern_count; i++) {
+            if (fnmatch(patterns[i], name, 0) == 0) {
+                if (plan_check_name(&plan, name, name)
+                    && snprintf(local_path, sizeof(local_path), "%s/%s", local_dir, name) < (int)sizeof(local_path)) {
+                    plan_add(&plan, local_path, remote_dir, size);
+                }
+                break;
+            }
+        }
+        line = next_line;
+    }
+    free(listing);
+
+    run_transfer_plan(client, &plan);
+    plan_free(&plan);
+}
+
+void execute_command_mirror(struct client_state *client, char *command) {
+    static char start_remote_dir[PATH_MAX];
+    static char remote_dir[PATH_MAX];
+    static char local_path[PATH_MAX];
+    static char buf[COMMAND_STR_MAX];
+
+    strtok(command, " ");
+    char *direction = strtok(NULL, " ");
+    char *path = strtok(NULL, " ");
+    if (direction == NULL || path == NULL
+        || (strcmp(direction, "PUT") != 0 && strcmp(direction, "GET") != 0)) {
+        printf("Error: Use MIRROR PUT <local directory> or MIRROR GET <remote directory>\n");
+        return;
+    }
+    if (get_remote_directory(client, start_remote_dir) == -1) {
+        return;
+    }
+
+    struct transfer_plan plan;
+    int status;
+    if (strcmp(direction, "PUT") == 0) {
+        if (!is_path_directory(path) || realpath(path, local_path) == NULL) {
+            printf("Error: Given path is not a directory\n");
+            return;
+        }
+        if (!is_name_sendable(basename(local_path))) {
+            printf("Error: The name of the directory cannot be sent (it has a space or line break)\n");
+            return;
+        }
+
+        // The directory keeps its name in the current remote directory
+        snprintf(remote_dir, sizeof(remote_dir), "%s%s%s",
+            start_remote_dir, start_remote_dir[0] == '\0' ? "" : "/", basename(local_path));
+        plan_init(&plan, TRANSFER_DIRECTION_UPLOAD);
+
+        // Create the whole remote tree up front, so that the sessions only transfer files
+        int saved_stdout = silence_output();
+        sprintf(buf, "%s /%s", COMMAND_MAKE_DIRECTORY, remote_dir);
+        send_message(client->control_sockfd, buf);
+        receive_message_then_print(client->control_sockfd);
+        status = plan_local_tree(client, &plan, local_path, remote_dir);
+        restore_output(saved_stdout);
+    } else {
+        if (strchr(path, '/') != NULL || strcmp(path, "..") == 0 || strcmp(path, ".") == 0) {
+            printf("Error: Give the name of a directory in the current remote directory\n");
+            return;
+        }
+        if (getcwd(local_path, sizeof(local_path)) == NULL) {
+            perror("getcwd");
+            return;
+        }
+
+        // The directory keeps its name in the current local directory
+        snprintf(remote_dir, sizeof(remote_dir), "%s%s%s",
+            start_remote_dir, start_remote_dir[0] == '\0' ? "" : "/", path);
+        size_t length = strlen(local_path);
+        snprintf(local_path + length, sizeof(local_path) - length, "/%s", path);
+        plan_init(&plan, TRANSFER_DIRECTION_DOWNLOAD);
+
+        // Walking the remote tree changes directories; go back to where the user was afterwards
+        int saved_stdout = silence_output();
+        status = plan_remote_tree(client, &plan, remote_dir, local_path);
+        change_remote_directory(client, start_remote_dir);
+        restore_output(saved_stdout);
+    }
+
+    if (status == -1) {
+        printf("Error: Could not walk the directory tree\n");
+    } else {
+        run_transfer_plan(client, &plan);
+    }
+    plan_free(&plan);
+}
+
+int plan_local_tree(struct client_state *client, struct transfer_plan *plan, const char *local_path, const char *remote_dir) {
+    static char buf[COMMAND_STR_MAX];
+
+    DIR *dir = opendir(local_path);
+    if (dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+
+    // Each level needs its own paths, as they outlive the recursion
+    char *child_local_path = malloc(PATH_MAX);
+    char *child_remote_dir = malloc(PATH_MAX);
+    if (child_local_path == NULL || child_remote_dir == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int status = 0;
+    struct dirent *entry;
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child_local_path, PATH_MAX, "%s/%s", local_path, entry->d_name);
+
+        // Symbolic links are not followed, so that the walk cannot loop or leave the tree
+        struct stat stat_result;
+        if (lstat(child_local_path, &stat_result) == -1) {
+            continue;
+        }
+        if ((S_ISREG(stat_result.st_mode) || S_ISDIR(stat_result.st_mode))
+            && !plan_check_name(plan, child_local_path, entry->d_name)) {
+            continue;
+        }
+        if (S_ISREG(stat_result.st_mode)) {
+            plan_add(plan, child_local_path, remote_dir, stat_result.st_size);
+        } else if (S_ISDIR(stat_result.st_mode)) {
+            snprintf(child_remote_dir, PATH_MAX, "%s/%s", remote_dir, entry->d_name);
+            sprintf(buf, "%s /%s", COMMAND_MAKE_DIRECTORY, child_remote_dir);
+            send_message(client->control_sockfd, buf);
+            receive_message_then_print(client->control_sockfd);
+            status = plan_local_tree(client, plan, child_local_path, child_remote_dir);
+        }
+    }
+
+    free(child_local_path);
+    free(child_remote_dir);
+    closedir(dir);
+    return status;
+}
+
+int plan_remote_tree(struct client_state *client, struct transfer_plan *plan, const char *remote_dir, const char *local_path) {
+    if (mkdir(local_path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error: Could not create %s\n", local_path);
+        return -1;
+    }
+    if (change_remote_directory(client, remote_dir) == -1) {
+        fprintf(stderr, "Error: Could not enter remote directory /%s\n", remote_dir);
+        return -1;
+    }
+    char *listing = fetch_remote_listing(client);
+    if (listing == NULL) {
+        return -1;
+    }
+
+    // Each level needs its own paths, as they outlive the recursion
+    char *child_local_path = malloc(PATH_MAX);
+    char *child_remote_dir = malloc(PATH_MAX);
+    if (child_local_path == NULL || child_remote_dir == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Files first: the recursion reuses strtok()
+    int status = 0;
+    char *line;
+    char *rest = listing;
+    while (status == 0 && (line = strtok_r(rest, "\r\n", &rest)) != NULL) {
+        int is_directory;
+        off_t size;
+        char *name = parse_remote_listing_line(line, &is_directory, &size);
+        if (name == NULL || !plan_check_name(plan, name, name)) {
+            continue;
+        }
+        snprintf(child_local_path, PATH_MAX, "%s/%s", local_path, name);
+        if (!is_directory) {
+            plan_add(plan, child_local_path, remote_dir, size);
+        } else {
+            snprintf(child_remote_dir, PATH_MAX, "%s/%s", remote_dir, name);
+            status = plan_remote_tree(client, plan, child_remote_dir, child_local_path);
+        }
+    }
+
+    free(child_local_path);
+    free(child_remote_dir);
+    free(listing);
+    return status;
+}
+
+void plan_init(struct transfer_plan *plan, int direction) {
+    memset(plan, 0, sizeof(*plan));
+    plan->direction = direction;
+}
+
+/**
+ * @brief Copy a string to the end of the strings of the plan
+ * 
+ * @return Its offset in the strings
+ */
+static size_t plan_add_string(struct transfer_plan *plan, const char *string) {
+    size_t length = strlen(string) + 1;
+    if (plan->strings_length + length > plan->strings_capacity) {
+        size_t capacity = plan->strings_capacity == 0 ? PATH_MAX : plan->strings_capacity;
+        while (plan->strings_length + length > capacity) {
+            capacity *= 2;
+        }
+        plan->strings = realloc(plan->strings, capacity);
+        if (plan->strings == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        plan->strings_capacity = capacity;
+    }
+
+    size_t offset = plan->strings_length;
+    memcpy(plan->strings + offset, string, length);
+    plan->strings_length += length;
+    return offset;
+}
+
+void plan_add(struct transfer_plan *plan, const char *local_path, const char *remote_dir, off_t size) {
+    if (plan->job_count == plan->job_capacity) {
+        plan->job_capacity = plan->job_capacity == 0 ? 64 : plan->job_capacity * 2;
+        plan->jobs = realloc(plan->jobs, plan->job_capacity * sizeof(struct transfer_job));
+        if (plan->jobs == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct transfer_job *job = &(plan->jobs[plan->job_count++]);
+    job->size = size;
+    job->local_path = plan_add_string(plan, local_path);
+    job->remote_dir = plan_add_string(plan, remote_dir);
+    plan->total_size += size;
+}
+
+int is_name_sendable(const char *name) {
+    return name[0] != '\0' && strpbrk(name, " \r\n") == NULL;
+}
+
+int plan_check_name(struct transfer_plan *plan, const char *path, const char *name) {
+    if (is_name_sendable(name)) {
+        return 1;
+    }
+
+    // Planning may run with the output silenced, so report on stderr
+    fprintf(stderr, "Error: Skipped %s: names with spaces or line breaks cannot be sent\n", path);
+    plan->skipped_count++;
+    return 0;
+}
+
+void plan_free(struct transfer_plan *plan) {
+    free(plan->jobs);
+    free(plan->strings);
+    plan_init(plan, plan->direction);
+}
+
+static int compare_jobs_largest_first(const void *a, const void *b) {
+    off_t size_a = ((const struct transfer_job *)a)->size;
+    off_t size_b = ((const struct transfer_job *)b)->size;
+    return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void run_transfer_plan(struct client_state *client, struct transfer_plan *plan) {
+    if (plan->job_count == 0) {
+        printf("Nothing to transfer");
+        if (plan->skipped_count > 0) {
+            printf(" (%zu skipped)", plan->skipped_count);
+        }
+        printf("\n");
+        return;
+    }
+
+    // Taking the largest files first keeps one big file from being left to a single
+    // session at the end, while the others sit idle
+    qsort(plan->jobs, plan->job_count, sizeof(struct transfer_job), compare_jobs_largest_first);
+
+    // The sessions take jobs from, and report to, memory shared with this process
+    struct transfer_progress *progress = mmap(NULL, sizeof(struct transfer_progress),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (progress == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+    memset(progress, 0, sizeof(*progress));
+    pthread_mutexattr_t lock_attributes;
+    pthread_mutexattr_init(&lock_attributes);
+    pthread_mutexattr_setpshared(&lock_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&(progress->lock), &lock_attributes);
+    pthread_mutexattr_destroy(&lock_attributes);
+
+    int session_count = client->session_count;
+    if ((size_t)session_count > plan->job_count) {
+        session_count = plan->job_count;
+    }
+    printf("Transferring %zu files (%.1f MB) on %d sessions\n",
+        plan->job_count, plan->total_size / 1e6, session_count);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fflush(stdout);
+    int running = 0;
+    for (int i = 0; i < session_count; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            break;
+        } else if (pid == 0) {
+            run_transfer_worker(client, plan, progress);
+        }
+        running++;
+    }
+
+    // Report the progress until every session is done
+    double last_report = 0;
+    while (running > 0) {
+        usleep(100 * 1000);
+        while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0) {
+            running--;
+        }
+
+        double elapsed = elapsed_seconds(&start);
+        if (running > 0 && (elapsed - last_report) * 1000 >= CLIENT_PROGRESS_INTERVAL_MS) {
+            print_transfer_progress(plan, progress, elapsed, 0);
+            last_report = elapsed;
+        }
+    }
+    print_transfer_progress(plan, progress, elapsed_seconds(&start), 1);
+
+    pthread_mutex_destroy(&(progress->lock));
+    munmap(progress, sizeof(struct transfer_progress));
+}
+
+void run_transfer_worker(struct client_state *client, struct transfer_plan *plan, struct transfer_progress *progress) {
+    static char current_remote_dir[PATH_MAX];
+    static char local_dir[PATH_MAX];
+
+    // The replies of the transfers would be interleaved; the parent reports the progress
+    silence_output();
+
+    // The control connection belongs to the parent
+    tls_detach(client->control_sockfd);
+    close(client->control_sockfd);
+
+    struct client_state session;
+    if (open_session(client, &session) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    int has_remote_dir = 0;
+    while (1) {
+        pthread_mutex_lock(&(progress->lock));
+        size_t i = progress->next_job++;
+        pthread_mutex_unlock(&(progress->lock));
+        if (i >= plan->job_count) {
+            break;
+        }
+
+        struct transfer_job *job = &(plan->jobs[i]);
+        const char *local_path = plan->strings + job->local_path;
+        const char *remote_dir = plan->strings + job->remote_dir;
+
+        // Jobs of the same directory tend to follow each other
+        int status = 0;
+        if (!has_remote_dir || strcmp(current_remote_dir, remote_dir) != 0) {
+            status = change_remote_directory(&session, remote_dir);
+            has_remote_dir = status == 0;
+            strcpy(current_remote_dir, remote_dir);
+        }
+
+        if (status == 0 && plan->direction == TRANSFER_DIRECTION_UPLOAD) {
+            status = store_file(&session, local_path);
+        } else if (status == 0) {
+            // Files are retrieved into the working directory
+            strcpy(local_dir, local_path);
+            if (chdir(dirname(local_dir)) == -1) {
+                status = -1;
+            } else {
+                status = retrieve_file(&session, strrchr(local_path, '/') + 1);
+            }
+        }
+
+        pthread_mutex_lock(&(progress->lock));
+        if (status == 0) {
+            progress->files_done++;
+            progress->bytes_done += job->size;
+        } else {
+            progress->files_failed++;
+        }
+        pthread_mutex_unlock(&(progress->lock));
+    }
+
+    send_message(session.control_sockfd, COMMAND_QUIT);
+    receive_message_then_print(session.control_sockfd);
+    exit(EXIT_SUCCESS);
+}
+
+void print_transfer_progress(struct transfer_plan *plan, struct transfer_progress *progress, double elapsed, int final) {
+    pthread_mutex_lock(&(progress->lock));
+    size_t files_done = progress->files_done;
+    size_t files_failed = progress->files_failed;
+    off_t bytes_done = progress->bytes_done;
+    pthread_mutex_unlock(&(progress->lock));
+
+    double throughput = elapsed > 0 ? bytes_done / 1e6 / elapsed : 0;
+    if (!final) {
+        printf("Progress: %zu/%zu files, %.1f/%.1f MB, %.1f MB/s\n",
+            files_done + files_failed, plan->job_count, bytes_done / 1e6, plan->total_size / 1e6, throughput);
+        fflush(stdout);
+        return;
+    }
+
+    printf("Done: %zu/%zu files (%zu failed", files_done, plan->job_count, files_failed);
+    if (files_done + files_failed < plan->job_count) {
+        // Sessions that could not be opened, or that lost their connection
+        printf(", %zu not attempted", plan->job_count - files_done - files_failed);
+    }
+    if (plan->skipped_count > 0) {
+        printf(", %zu skipped", plan->skipped_count);
+    }
+    printf("), %.1f MB in %.2f s, %.1f MB/s\n", bytes_done / 1e6, elapsed, throughput);
+}
+
+char* fetch_remote_listing(struct client_state *client) {
+    // Start listening on some port for data, send the port
+    listen_on_next_free_port(client);
+    if (send_data_listen_port(client) == -1) {
+        return NULL;
+    }
+
+    send_message(client->control_sockfd, COMMAND_MACHINE_LIST);
+    if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "150")) {
+        return NULL;
+    }
+    if (initiate_data_transfer(client) == -1) {
+        return NULL;
+    }
+
+    // Unlike LIST, the listing is not limited to one message: read until the server closes
+    size_t capacity = COMMAND_STR_MAX;
+    size_t length = 0;
+    char *listing = malloc(capacity);
+    if (listing == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    ssize_t bytes_received;
+    while ((bytes_received = tls_recv(client->data_sockfd, listing + length, capacity - length - 1)) > 0) {
+        length += bytes_received;
+        if (capacity - length - 1 == 0) {
+            capacity *= 2;
+            listing = realloc(listing, capacity);
+            if (listing == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    listing[length] = '\0';
+    end_data_transfer(client);
+
+    // Stop listening for new connections
+    close(client->data_listen_sockfd);
+    client->data_listen_sockfd = -1;
+
+    if (!receive_message_then_print_then_check_first_token(client->control_sockfd, "226") || bytes_received == -1) {
+        free(listing);
+        return NULL;
+    }
+    return listing;
+}
+
+char* parse_remote_listing_line(char *line, int *is_directory, off_t *size) {
+    // "fact=value;fact=value; name"
+    char *name = strstr(line, "; ");
+    if (name == NULL) {
+        return NULL;
+    }
+    *name = '\0';
+    name += 2;
+
+    int has_type = 0;
+    *size = 0;
+    char *rest = line;
+    char *fact;
+    while ((fact = strtok_r(rest, ";", &rest)) != NULL) {
+        if (strcmp(fact, "type=file") == 0) {
+            has_type = 1;
+            *is_directory = 0;
+        } else if (strcmp(fact, "type=dir") == 0) {
+            has_type = 1;
+            *is_directory = 1;
+        } else if (strncmp(fact, "size=", 5) == 0) {
+            *size = strtoll(fact + 5, NULL, 10);
+        }
+    }
+    return has_type ? name : NULL;
+}
+
+int get_remote_directory(struct client_state *client, char *result) {
+    static char buf[COMMAND_STR_MAX];
+
+    send_message(client->control_sockfd, COMMAND_PRINT_DIRECTORY);
+    receive_message(client->control_sockfd, buf, sizeof(buf));
+    if (!check_first_token(buf, "257")) {
+        printf("%s\n", buf);
+        return -1;
+    }
+
+    // "257 /Users/<name>/<path>": keep only the path
+    char *path = strstr(buf, "/Users/");
+    if (path == NULL) {
+        return -1;
+    }
+    path = strchr(path + strlen("/Users/"), '/');
+    strcpy(result, path == NULL ? "" : path + 1);
+    return 0;
+}
+
+int change_remote_directory(struct client_state *client, const char *remote_dir) {
+    static char buf[COMMAND_STR_MAX];
+
+    // Absolute paths start from the user's directory
+    sprintf(buf, "%s /%s", COMMAND_CHANGE_DIRECTORY, remote_dir);
+    send_message(client->control_sockfd, buf);
+    return receive_message_then_print_then_check_first_token(client->control_sockfd, "200")
+        ? 0
+        : -1;
+}
+
+int silence_output() {
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd != -1) {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+    return saved_stdout;
+}
+
+void restore_output(int saved_stdout) {
+    fflush(stdout);
+    if (saved_stdout != -1) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+}
@@ -2,11 +2,31 @@
 #define CLIENT_H_
 
 #include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "delta.h"
+#include "hash.h"
+
+// Number of sessions MPUT, MGET and MIRROR transfer files on at the same time,
+// unless changed with !PARALLEL
+#define CLIENT_DEFAULT_SESSIONS (4)
+#define CLIENT_MAX_SESSIONS (32)
+// How often MPUT, MGET and MIRROR report their progress
+#define CLIENT_PROGRESS_INTERVAL_MS (1000)
+
+#define TRANSFER_DIRECTION_UPLOAD (0)
+#define TRANSFER_DIRECTION_DOWNLOAD (1)
 
 extern const char
     *COMMAND_LIST_CLIENT,
     *COMMAND_CHANGE_DIRECTORY_CLIENT,
-    *COMMAND_PRINT_DIRECTORY_CLIENT;
+    *COMMAND_PRINT_DIRECTORY_CLIENT,
+    *COMMAND_PARALLEL_CLIENT,
+    *COMMAND_MULTIPLE_STORE_CLIENT,
+    *COMMAND_MULTIPLE_RETRIEVE_CLIENT,
+    *COMMAND_MIRROR_CLIENT;
 
 /**
  * @brief State of the client
@@ -18,8 +38,79 @@ struct client_state {
                             // connections to establish a data connection to the server
     int data_listen_port;   // The port associated with data_listen_sockfd
     int data_sockfd;        // The socket used for the current established data connection
+    struct sockaddr_in server_addr; // The address of the server, for opening more sessions
+    int has_credentials;    // Whether the user logged in, so that more sessions can log in the same way
+    char username[COMMAND_STR_MAX];
+    char password[COMMAND_STR_MAX];
+    int session_count;      // Number of sessions used by MPUT, MGET and MIRROR
+};
+
+/**
+ * @brief A file to transfer with MPUT, MGET or MIRROR
+ */
+struct transfer_job {
+    off_t size;             // Size of the file, for ordering and progress
+    size_t local_path;      // Offset of the absolute local path in the strings of the plan
+    size_t remote_dir;      // Offset of the remote directory in the strings of the plan, relative to
+                            // the user's directory ("" for the directory itself); the remote file
+                            // has the same name as the local one
 };
 
+/**
+ * @brief All files to transfer with one MPUT, MGET or MIRROR
+ */
+struct transfer_plan {
+    int direction;              // TRANSFER_DIRECTION_UPLOAD or TRANSFER_DIRECTION_DOWNLOAD
+    struct transfer_job *jobs;
+    size_t job_count;
+    size_t job_capacity;
+    char *strings;              // Paths of all jobs, null-terminated, one after another
+    size_t strings_length;
+    size_t strings_capacity;
+    off_t total_size;           // Sum of the sizes of all jobs
+    size_t skipped_count;       // Files and directories left out because their names cannot be sent
+};
+
+/**
+ * @brief Progress of a plan, shared by the processes running its sessions
+ */
+struct transfer_progress {
+    pthread_mutex_t lock;   // Process-shared lock protecting everything below
+    size_t next_job;        // Index of the next job to be taken by a session
+    size_t files_done;
+    size_t files_failed;
+    off_t bytes_done;       // Sum of the sizes of the files done
+};
+
+/**
+ * @brief Parse the command line. Usage:
+ * client.out -t trusted.pem | -k
+ * The server is verified against the certificate given with -t; -k explicitly
+ * connects without verifying it.
+ *
+ * @return The trusted certificate, or NULL with -k (exits the process on invalid arguments)
+ */
+const char* parse_client_options(int argc, char **argv);
+
+/**
+ * @brief Connect to the server, secure the connection and, if the client has
+ * logged in, log the new session in with the same credentials
+ * 
+ * @param client 
+ * @param session The state of the new session
+ * @return 0 on success, -1 on failure
+ */
+int open_session(struct client_state *client, struct client_state *session);
+
+/**
+ * @brief Secure the control connection (AUTH TLS) and ask for secured data
+ * connections (PBSZ, PROT P), as required by the server
+ * 
+ * @param client 
+ * @return 0 on success, -1 on failure
+ */
+int secure_control_connection(struct client_state *client);
+
 /**
  * @brief Present a CLI. Receive commands from stdin and handle / execute them
  * 
@@ -46,24 +137,270 @@ int send_data_listen_port(struct client_state *client);
 
 /**
  * @brief Initiate a data transfer by waiting for the server to establish a TCP
- * connection to the data listening socket, and accepting it
+ * connection to the data listening socket, accepting it, and securing it with
+ * the TLS session of the control connection
  * 
  * @param client 
+ * @return 0 on success, -1 if the connection could not be secured
  */
-void initiate_data_transfer(struct client_state *client);
+int initiate_data_transfer(struct client_state *client);
 
 /**
- * @brief End a data transfer by closing the data socket
+ * @brief End a data transfer by ending its TLS session and closing the data socket
  * 
  * @param client 
  */
 void end_data_transfer(struct client_state *client);
 
+/**
+ * @brief Send the size of the file at path to the server (ALLO) ahead of storing it
+ * 
+ * @param client 
+ * @param path 
+ */
+void send_allocation_size(struct client_state *client, const char *path);
+
+/**
+ * @brief Send the SHA-256 of the file at path to the server ahead of storing it
+ * 
+ * @param client 
+ * @param path 
+ * @return 0 if the server already stores a file with this content, so that the
+ * following STOR needs no data connection, -1 otherwise
+ */
+int send_content_hash(struct client_state *client, const char *path);
+
+/**
+ * @brief Receive and print the final reply of a file transfer, and compare the
+ * checksum reported by the server with the one computed locally
+ * 
+ * @param client 
+ * @param checksum The checksum computation over the data sent or received locally
+ * @return 0 if the transfer succeeded and the checksums match (or the server
+ * reported none), -1 otherwise
+ */
+int receive_transfer_result(struct client_state *client, struct hash_ctx *checksum);
+
 void execute_command_list(struct client_state *client);
 
-void execute_command_store(struct client_state *client, char *command);
+/**
+ * @brief Store a local file on the server (STOR)
+ * 
+ * @param client 
+ * @param command "STOR <local path>"; the remote file gets the same name
+ * @return 0 if the file was stored, -1 otherwise
+ */
+int execute_command_store(struct client_state *client, char *command);
+
+/**
+ * @brief Store a local file on the server, under the same name
+ * 
+ * @param client 
+ * @param path The local file, whose name must pass is_name_sendable()
+ * @return 0 if the file was stored, -1 otherwise
+ */
+int store_file(struct client_state *client, const char *path);
+
+/**
+ * @brief Store a file by sending only what changed since the version on the server:
+ * get the block signatures of that version (XSIG), then send a delta against it (XDLT).
+ * The content must have been announced with XSHA.
+ * 
+ * @param client 
+ * @param path The local file
+ * @param filename The name of the file on the server
+ * @return 0 if the file was stored, 1 if it must be sent whole instead (it is too small,
+ * the server has no version of it, or the delta did not work out), -1 on failure
+ */
+int store_file_delta(struct client_state *client, const char *path, const char *filename);
+
+/**
+ * @brief Send a delta of the file against the signature of the version on the server (XDLT)
+ * 
+ * @param client 
+ * @param path The local file
+ * @param filename The name of the file on the server
+ * @param signature 
+ * @param data The contents of the local file
+ * @param size 
+ * @return 0 if the file was stored, 1 if it must be sent whole instead, -1 on failure
+ */
+int send_delta(struct client_state *client, const char *path, const char *filename,
+    const struct delta_signature *signature, const uint8_t *data, off_t size);
+
+/**
+ * @brief Get the block signatures of a file on the server (XSIG)
+ * 
+ * @param client 
+ * @param filename 
+ * @param signature Location to store the signature, to be freed with delta_free_signature
+ * @return 0 on success, -1 on failure
+ */
+int fetch_signature(struct client_state *client, const char *filename, struct delta_signature *signature);
+
+/**
+ * @brief Retrieve a file from the server (RETR) into the local working directory
+ * 
+ * @param client 
+ * @param command "RETR <remote name>"
+ * @return 0 if the file was retrieved, -1 otherwise
+ */
+int execute_command_retrieve(struct client_state *client, char *command);
+
+/**
+ * @brief Retrieve a file of the current remote directory into the local working directory
+ * 
+ * @param client 
+ * @param filename The remote name, which must pass is_name_sendable()
+ * @return 0 if the file was retrieved, -1 otherwise
+ */
+int retrieve_file(struct client_state *client, const char *filename);
+
+/**
+ * @brief Check whether a file name can be sent as the argument of a command. The server
+ * splits commands at spaces, and a line break would end the command.
+ * 
+ * @param name 
+ * @return 1 if it can, 0 otherwise
+ */
+int is_name_sendable(const char *name);
+
+/**
+ * @brief Check a name found while planning a transfer, and report it if it cannot be sent
+ * 
+ * @param plan Counts the names that cannot be sent
+ * @param path The local path or remote name to report
+ * @param name Its last component
+ * @return 1 if the name can be sent, 0 otherwise
+ */
+int plan_check_name(struct transfer_plan *plan, const char *path, const char *name);
+
+void execute_command_username(struct client_state *client, char *command);
+
+void execute_command_password(struct client_state *client, char *command);
+
+void execute_command_parallel(struct client_state *client, char *command);
+
+/**
+ * @brief MPUT: store the local files matching the given patterns in the current remote directory
+ * 
+ * @param client 
+ * @param command 
+ */
+void execute_command_multiple_store(struct client_state *client, char *command);
+
+/**
+ * @brief MGET: retrieve the remote files matching the given patterns into the current local directory
+ * 
+ * @param client 
+ * @param command 
+ */
+void execute_command_multiple_retrieve(struct client_state *client, char *command);
+
+/**
+ * @brief MIRROR PUT <local directory>: store the directory with everything in it in the
+ * current remote directory. MIRROR GET <remote directory>: retrieve the directory of the
+ * current remote directory with everything in it into the current local directory.
+ * 
+ * @param client 
+ * @param command 
+ */
+void execute_command_mirror(struct client_state *client, char *command);
+
+/**
+ * @brief Add the files beneath a local directory to the plan, creating the remote
+ * directories on the way
+ * 
+ * @param client 
+ * @param plan 
+ * @param local_path Absolute path of the local directory
+ * @param remote_dir The remote directory it corresponds to, relative to the user's directory
+ * @return 0 on success, -1 on failure
+ */
+int plan_local_tree(struct client_state *client, struct transfer_plan *plan, const char *local_path, const char *remote_dir);
+
+/**
+ * @brief Add the files beneath a remote directory to the plan, creating the local
+ * directories on the way
+ * 
+ * @param client 
+ * @param plan 
+ * @param remote_dir The remote directory, relative to the user's directory
+ * @param local_path Absolute path of the local directory it corresponds to
+ * @return 0 on success, -1 on failure
+ */
+int plan_remote_tree(struct client_state *client, struct transfer_plan *plan, const char *remote_dir, const char *local_path);
+
+void plan_init(struct transfer_plan *plan, int direction);
+
+void plan_add(struct transfer_plan *plan, const char *local_path, const char *remote_dir, off_t size);
+
+void plan_free(struct transfer_plan *plan);
+
+/**
+ * @brief Run the plan on a pool of sessions, largest files first, reporting the progress
+ * 
+ * @param client 
+ * @param plan 
+ */
+void run_transfer_plan(struct client_state *client, struct transfer_plan *plan);
+
+/**
+ * @brief Body of the processes running the sessions of a plan: take the next job until
+ * there are none left. Never returns.
+ * 
+ * @param client 
+ * @param plan 
+ * @param progress 
+ */
+void run_transfer_worker(struct client_state *client, struct transfer_plan *plan, struct transfer_progress *progress);
+
+void print_transfer_progress(struct transfer_plan *plan, struct transfer_progress *progress, double elapsed, int final);
+
+/**
+ * @brief Get the machine-readable listing of the current remote directory (MLSD)
+ * 
+ * @param client 
+ * @return The listing, to be freed by the caller, or NULL on failure
+ */
+char* fetch_remote_listing(struct client_state *client);
+
+/**
+ * @brief Parse the next line of an MLSD listing
+ * 
+ * @param line The line; the facts are overwritten
+ * @param is_directory Location to store whether the entry is a directory
+ * @param size Location to store the size of the entry
+ * @return The name of the entry, or NULL if it is neither a file nor a directory
+ */
+char* parse_remote_listing_line(char *line, int *is_directory, off_t *size);
+
+/**
+ * @brief Get the current remote directory, relative to the user's directory (PWD)
+ * 
+ * @param client 
+ * @param result Buffer of at least PATH_MAX bytes
+ * @return 0 on success, -1 on failure
+ */
+int get_remote_directory(struct client_state *client, char *result);
+
+/**
+ * @brief Change the current remote directory (CWD)
+ * 
+ * @param client 
+ * @param remote_dir The directory, relative to the user's directory
+ * @return 0 on success, -1 on failure
+ */
+int change_remote_directory(struct client_state *client, const char *remote_dir);
+
+/**
+ * @brief Stop printing to stdout, e.g. the many replies of walking a remote tree
+ * 
+ * @return Descriptor to pass to restore_output
+ */
+int silence_output();
 
-void execute_command_retrieve(struct client_state *client, char *command);
+void restore_output(int saved_stdout);
 
 void execute_command_change_directory_client(char *command);
 
@@ -1,6 +1,9 @@
 #include "common.h"
+#include "tls.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +11,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 const char *COMMAND_USERNAME = "USER";
 const char *COMMAND_PASSWORD = "PASS";
@@ -18,6 +26,23 @@ const char *COMMAND_LIST = "LIST";
 const char *COMMAND_CHANGE_DIRECTORY = "CWD";
 const char *COMMAND_PRINT_DIRECTORY = "PWD";
 const char *COMMAND_QUIT = "QUIT";
+const char *COMMAND_CONTENT_HASH = "XSHA";
+const char *COMMAND_HASH = "HASH";
+const char *COMMAND_OPTIONS = "OPTS";
+const char *COMMAND_ALLOCATE = "ALLO";
+const char *COMMAND_AUTHENTICATE = "AUTH";
+const char *COMMAND_PROTECTION_BUFFER_SIZE = "PBSZ";
+const char *COMMAND_PROTECTION_LEVEL = "PROT";
+const char *COMMAND_MAKE_DIRECTORY = "MKD";
+const char *COMMAND_MACHINE_LIST = "MLSD";
+const char *COMMAND_SIGNATURE = "XSIG";
+const char *COMMAND_DELTA_STORE = "XDLT";
+const char *COMMAND_SIZE = "SIZE";
+const char *COMMAND_MODIFICATION_TIME = "MDTM";
+const char *COMMAND_RENAME_FROM = "RNFR";
+const char *COMMAND_RENAME_TO = "RNTO";
+const char *COMMAND_SITE = "SITE";
+const char *COMMAND_DELETE = "DELE";
 
 void create_directory_if_not_exists(char *path) {
     // Check if the directory exists
@@ -38,15 +63,35 @@ void create_directory_if_not_exists(char *path) {
 }
 
 int list_directory(char *path, char *result, int result_size) {
+    // Open the directory
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    int status = list_directory_fd(dirfd, result, result_size);
+    close(dirfd);
+
+    return status;
+}
+
+int list_directory_fd(int dirfd, char *result, int result_size) {
     if (result_size == 0) {
         fprintf(stderr, "result_size must be positive\n");
         exit(EXIT_FAILURE);
     }
 
-    // Open the current directory
-    DIR *dir = opendir(path);
+    // Open the directory again so that reading it does not move the position of dirfd
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror("openat");
+        return -1;
+    }
+    DIR *dir = fdopendir(fd);
     if (dir == NULL) {
-        perror("opendir");
+        perror("fdopendir");
+        close(fd);
         return -1;
     }
 
@@ -71,7 +116,7 @@ int list_directory(char *path, char *result, int result_size) {
         p += sprintf(result + p, "%s%s", p == 0 ? "" : "\n", entry->d_name); 
     }
 
-    // Close the directory
+    // Close the directory (and fd)
     closedir(dir);
 
     return 0;
@@ -88,7 +133,7 @@ int is_path_directory(char *path) {
     }
 }
 
-int is_path_file(char *path) {
+int is_path_file(const char *path) {
     struct stat stat_result;
     if (stat(path, &stat_result) == -1) {
         return 0;
@@ -167,7 +212,10 @@ int get_next_free_port(int port) {
     return -1;
 }
 
-int listen_port(int port, int *result_sockfd, int *result_port) {
+/**
+ * @brief Shared implementation of listen_port and listen_port_reuseport
+ */
+static int listen_port_with_options(int port, int reuseport, int *result_sockfd, int *result_port) {
     // Get socket file descriptor
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == -1) {
@@ -181,6 +229,12 @@ int listen_port(int port, int *result_sockfd, int *result_port) {
         exit(EXIT_FAILURE);
     }
 
+    // Allow several sockets to bind to the same port, if asked for
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) == -1) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
     // Specify socket parameters
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -190,6 +244,7 @@ int listen_port(int port, int *result_sockfd, int *result_port) {
     
     // Bind socket to port
     if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(sockfd);
         return -1;
     }
 
@@ -214,6 +269,14 @@ int listen_port(int port, int *result_sockfd, int *result_port) {
     return 0;
 }
 
+int listen_port(int port, int *result_sockfd, int *result_port) {
+    return listen_port_with_options(port, 0, result_sockfd, result_port);
+}
+
+int listen_port_reuseport(int port, int *result_sockfd, int *result_port) {
+    return listen_port_with_options(port, 1, result_sockfd, result_port);
+}
+
 void connect_to_addr(struct sockaddr_in addr, int *result_sockfd, int *result_port) {
     // Get socket file descriptor
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -247,77 +310,493 @@ void connect_to_addr(struct sockaddr_in addr, int *result_sockfd, int *result_po
     }
 }
 
+int connect_to_addr_nonblocking(struct sockaddr_in addr, int *result_sockfd) {
+    // Get socket file descriptor
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    // Set socket options to avoid bind() errors
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) == -1) {
+        perror("setsockopt");
+        close(sockfd);
+        return -1;
+    }
+
+    int status = 0;
+    if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        if (errno != EINPROGRESS) {
+            perror("connect");
+            close(sockfd);
+            return -1;
+        }
+        status = 1;
+    }
+
+    *result_sockfd = sockfd;
+    return status;
+}
+
+void set_socket_timeout(int sockfd, int timeout_ms) {
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1
+        || setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        perror("setsockopt");
+    }
+}
+
 void send_message(int sockfd, const char *message) {
-    // Send the message through the socket
-    if (send(sockfd, message, strlen(message), 0) == -1) {
+    // Send the message through the socket (and its TLS session, if any)
+    if (tls_send(sockfd, message, strlen(message)) == -1) {
         perror("send");
+        if (fcntl(sockfd, F_GETFL) & O_NONBLOCK) {
+            // The loop serving this socket serves others too; it sees the end of the connection
+            shutdown(sockfd, SHUT_RDWR);
+            return;
+        }
         exit(EXIT_FAILURE);
     }
 }
 
-void send_file(int sockfd, const char *path) {
-    static char buf[FILE_TRANSFER_BUFFER_SIZE];
-
+void send_file(int sockfd, const char *path, struct hash_ctx *hash) {
     // Open the file for reading in binary format (text format is covered by this)
-    FILE *file = fopen(path, "rb");
-    if (file == NULL) {
-        perror("fopen");
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
         exit(EXIT_FAILURE);
     }
 
-    size_t bytes_read;
+    // Holes are only looked for in files that have some
+    struct stat stat_result;
+    if (fstat(fd, &stat_result) == -1) {
+        perror("fstat");
+        exit(EXIT_FAILURE);
+    }
+    int status = is_file_sparse(&stat_result)
+        ? send_sparse_file_fd(sockfd, fd, hash, hash != NULL)
+        : send_file_fd(sockfd, fd, hash, hash != NULL);
+    if (status == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Close the file
+    close(fd);
+}
+
+int send_file_fd(int sockfd, int fd, struct hash_ctx *hashes, int hash_count) {
+    static char buf[FILE_TRANSFER_BUFFER_SIZE];
+
+    ssize_t bytes_read;
 
     // Read bytes from the file into the buffer
-    while ((bytes_read = fread(buf, 1, sizeof(buf), file)) > 0) {
+    while ((bytes_read = read(fd, buf, sizeof(buf))) > 0) {
+        // Hash the bytes while they are still in the cache
+        for (int i = 0; i < hash_count; i++) {
+            hash_update(&hashes[i], buf, bytes_read);
+        }
+
         // Send bytes through the socket
-        int bytes_sent = send(sockfd, buf, bytes_read, 0);
-        if (bytes_sent == -1) {
-            perror("send");
-            exit(EXIT_FAILURE);
+        if (send_all(sockfd, buf, bytes_read) == -1) {
+            return -1;
         }
     }
+    if (bytes_read == -1) {
+        perror("read");
+        return -1;
+    }
 
-    // Close the file
-    fclose(file);
+    return 0;
 }
 
-void save_file(int sockfd, const char *path) {
+int send_sparse_file_fd(int sockfd, int fd, struct hash_ctx *hashes, int hash_count) {
     static char buf[FILE_TRANSFER_BUFFER_SIZE];
 
-    // Open the file for reading in binary format (text format is covered by this)
-    FILE *file = fopen(path, "wb");
-    if (file == NULL) {
-        perror("fopen");
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1) {
+        perror("lseek");
+        return -1;
+    }
+    off_t data_end = offset;
+    while (1) {
+        // At the end of an extent of data, send the hole after it without reading it
+        if (offset == data_end) {
+            off_t data_start;
+            if (find_file_data(fd, offset, &data_start, &data_end) == -1
+                || send_zeros(sockfd, data_start - offset, hashes, hash_count) == -1) {
+                return -1;
+            }
+            offset = data_start;
+        }
+
+        // Read no further than the extent, which is empty at the end of the file
+        size_t count = sizeof(buf);
+        if ((off_t)count > data_end - offset) {
+            count = data_end - offset;
+        }
+        ssize_t bytes_read = read(fd, buf, count);
+        if (bytes_read == -1) {
+            perror("read");
+            return -1;
+        } else if (bytes_read == 0) {
+            break;
+        }
+
+        for (int i = 0; i < hash_count; i++) {
+            hash_update(&hashes[i], buf, bytes_read);
+        }
+        if (send_all(sockfd, buf, bytes_read) == -1) {
+            return -1;
+        }
+        offset += bytes_read;
+    }
+
+    return 0;
+}
+
+void save_file(int sockfd, const char *path, struct hash_ctx *hash) {
+    // Open the file for writing in binary format (text format is covered by this)
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror("open");
         exit(EXIT_FAILURE);
     }
 
-    size_t bytes_received;
+    if (save_file_fd(sockfd, fd, hash, hash != NULL) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Close the file
+    close(fd);
+}
+
+int save_file_fd(int sockfd, int fd, struct hash_ctx *hashes, int hash_count) {
+    static char buf[FILE_TRANSFER_BUFFER_SIZE];
+
+    ssize_t bytes_received;
+    struct sparse_writer writer;
+    sparse_writer_init(&writer, fd, 0);
 
     // Receive bytes through the socket into the buffer
-    while ((bytes_received = recv(sockfd, buf, FILE_TRANSFER_BUFFER_SIZE, 0)) > 0) {
-        // Write the bytes into the file
-        if (fwrite(buf, 1, bytes_received, file) == 0) {
-            perror("fwrite");
-            exit(EXIT_FAILURE);
+    while ((bytes_received = tls_recv(sockfd, buf, sizeof(buf))) > 0) {
+        // Hash the bytes while they are still in the cache
+        for (int i = 0; i < hash_count; i++) {
+            hash_update(&hashes[i], buf, bytes_received);
         }
+
+        // Write the bytes into the file, leaving blocks of zeros as holes
+        if (sparse_write(&writer, buf, bytes_received) == -1) {
+            return -1;
+        }
+    }
+    if (bytes_received == -1) {
+        perror("recv");
+        return -1;
     }
 
-    // Close the file
-    fclose(file);
+    return sparse_writer_finish(&writer);
 }
 
-void receive_message_then_print(int sockfd) {
-    static char buf[COMMAND_STR_MAX];
+void format_transfer_checksum(struct hash_ctx *hash, char *result) {
+    static char hex[HASH_HEX_MAX];
+    hash_final_hex(hash, hex);
+    sprintf(result, "%s=%s", hash_algorithm_name(hash->algorithm), hex);
+}
 
-    // Receive response
-    int bytes_received = (int)recv(sockfd, buf, COMMAND_STR_MAX - 1, 0);
+int send_all(int sockfd, const char *buf, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_sent = tls_send(sockfd, buf, length);
+        if (bytes_sent == -1) {
+            perror("send");
+            return -1;
+        }
+        buf += bytes_sent;
+        length -= bytes_sent;
+    }
+    return 0;
+}
+
+int receive_all(int sockfd, char *buf, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_received = tls_recv(sockfd, buf, length);
+        if (bytes_received == -1) {
+            perror("recv");
+            return -1;
+        } else if (bytes_received == 0) {
+            return -1;
+        }
+        buf += bytes_received;
+        length -= bytes_received;
+    }
+    return 0;
+}
+
+int write_all(int fd, const char *buf, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_written = write(fd, buf, length);
+        if (bytes_written == -1) {
+            perror("write");
+            return -1;
+        }
+        buf += bytes_written;
+        length -= bytes_written;
+    }
+    return 0;
+}
+
+static int buffer_is_zero_portable(const uint8_t *bytes, size_t length) {
+    // OR 8 bytes at a time, and check once per 64 bytes
+    while (length >= 64) {
+        uint64_t words[8];
+        memcpy(words, bytes, sizeof(words));
+        if ((words[0] | words[1] | words[2] | words[3] | words[4] | words[5] | words[6] | words[7]) != 0) {
+            return 0;
+        }
+        bytes += 64;
+        length -= 64;
+    }
+    while (length > 0) {
+        if (*bytes++ != 0) {
+            return 0;
+        }
+        length--;
+    }
+    return 1;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static int buffer_is_zero_avx2(const uint8_t *bytes, size_t length) {
+    // OR 128 bytes at a time, and test the result with one instruction
+    while (length >= 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)bytes);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(bytes + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(bytes + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(bytes + 96));
+        __m256i x = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(x, x)) {
+            return 0;
+        }
+        bytes += 128;
+        length -= 128;
+    }
+    return buffer_is_zero_portable(bytes, length);
+}
+#endif
+
+int buffer_is_zero(const void *buf, size_t length) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        return buffer_is_zero_avx2(buf, length);
+    }
+#endif
+    return buffer_is_zero_portable(buf, length);
+}
+
+int is_file_sparse(const struct stat *stat_result) {
+    // st_blocks counts 512-byte units
+    return S_ISREG(stat_result->st_mode) && (off_t)stat_result->st_blocks * 512 < stat_result->st_size;
+}
+
+int find_file_data(int fd, off_t offset, off_t *data_start, off_t *data_end) {
+    *data_start = lseek(fd, offset, SEEK_DATA);
+    if (*data_start == -1 && errno != ENXIO) {
+        // Holes cannot be found (the position is unchanged): the rest of the file is data
+        *data_start = offset;
+        *data_end = lseek(fd, 0, SEEK_END);
+        if (*data_end == -1 || lseek(fd, offset, SEEK_SET) == -1) {
+            perror("lseek");
+            return -1;
+        }
+        if (*data_end < offset) {
+            *data_end = offset;
+        }
+        return 0;
+    } else if (*data_start == -1) {
+        // No data after offset, so the rest of the file is a hole
+        *data_start = lseek(fd, 0, SEEK_END);
+        if (*data_start == -1) {
+            perror("lseek");
+            return -1;
+        }
+        if (*data_start < offset) {
+            *data_start = offset;
+        }
+        *data_end = *data_start;
+        return 0;
+    }
+
+    // There is always a hole at the end of the file
+    *data_end = lseek(fd, *data_start, SEEK_HOLE);
+    if (*data_end == -1 || lseek(fd, *data_start, SEEK_SET) == -1) {
+        perror("lseek");
+        return -1;
+    }
+    return 0;
+}
+
+int send_zeros(int sockfd, off_t length, struct hash_ctx *hashes, int hash_count) {
+    static const char zeros[FILE_TRANSFER_BUFFER_SIZE];
+
+    while (length > 0) {
+        size_t count = length < (off_t)sizeof(zeros) ? (size_t)length : sizeof(zeros);
+        for (int i = 0; i < hash_count; i++) {
+            hash_update(&hashes[i], zeros, count);
+        }
+        if (send_all(sockfd, zeros, count) == -1) {
+            return -1;
+        }
+        length -= count;
+    }
+    return 0;
+}
+
+void sparse_writer_init(struct sparse_writer *writer, int fd, int punch_holes) {
+    writer->fd = fd;
+    writer->offset = 0;
+    writer->hole_start = -1;
+    writer->punch_holes = punch_holes;
+    writer->block_length = 0;
+}
+
+/**
+ * @brief Turn the zeros skipped up to hole_end into a hole, now that the file
+ * extends past them
+ */
+static void end_hole(struct sparse_writer *writer, off_t hole_end) {
+    // Preallocated blocks read as zeros, so failing to punch them out only costs space
+    if (writer->punch_holes && fallocate(writer->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        writer->hole_start, hole_end - writer->hole_start) == -1 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        perror("fallocate");
+    }
+    writer->hole_start = -1;
+}
+
+/**
+ * @brief Write data at the writer's offset, after the zeros skipped so far
+ */
+static int write_data(struct sparse_writer *writer, const char *buf, size_t length) {
+    off_t hole_end = writer->offset;
+    if (writer->hole_start != -1 && lseek(writer->fd, hole_end, SEEK_SET) == -1) {
+        perror("lseek");
+        return -1;
+    }
+    if (write_all(writer->fd, buf, length) == -1) {
+        return -1;
+    }
+    if (writer->hole_start != -1) {
+        end_hole(writer, hole_end);
+    }
+    writer->offset += length;
+    return 0;
+}
+
+/**
+ * @brief Write whole blocks at the writer's offset, which is aligned, skipping the
+ * blocks of zeros
+ */
+static int write_blocks(struct sparse_writer *writer, const char *buf, size_t length) {
+    while (length > 0) {
+        // Gather the data up to the next block of zeros
+        size_t data_length = 0;
+        while (data_length < length && !buffer_is_zero(buf + data_length, SPARSE_BLOCK_SIZE)) {
+            data_length += SPARSE_BLOCK_SIZE;
+        }
+        if (data_length > 0) {
+            if (write_data(writer, buf, data_length) == -1) {
+                return -1;
+            }
+            buf += data_length;
+            length -= data_length;
+        }
+
+        // Skip the block of zeros
+        if (length > 0) {
+            if (writer->hole_start == -1) {
+                writer->hole_start = writer->offset;
+            }
+            writer->offset += SPARSE_BLOCK_SIZE;
+            buf += SPARSE_BLOCK_SIZE;
+            length -= SPARSE_BLOCK_SIZE;
+        }
+    }
+    return 0;
+}
+
+int sparse_write(struct sparse_writer *writer, const char *buf, size_t length) {
+    // Complete the block that earlier calls started
+    if (writer->block_length > 0) {
+        size_t missing = SPARSE_BLOCK_SIZE - writer->block_length;
+        size_t count = missing < length ? missing : length;
+        memcpy(writer->block + writer->block_length, buf, count);
+        writer->block_length += count;
+        buf += count;
+        length -= count;
+        if (writer->block_length < SPARSE_BLOCK_SIZE) {
+            return 0;
+        }
+        if (write_blocks(writer, writer->block, SPARSE_BLOCK_SIZE) == -1) {
+            return -1;
+        }
+        writer->block_length = 0;
+    }
+
+    // The whole blocks are taken from the buffer, and the rest waits for the next call
+    size_t whole_length = length - length % SPARSE_BLOCK_SIZE;
+    if (whole_length > 0 && write_blocks(writer, buf, whole_length) == -1) {
+        return -1;
+    }
+    memcpy(writer->block, buf + whole_length, length - whole_length);
+    writer->block_length = length - whole_length;
+    return 0;
+}
+
+int sparse_writer_finish(struct sparse_writer *writer) {
+    // The last, partial block is only written if it holds data
+    if (writer->block_length > 0 && !buffer_is_zero(writer->block, writer->block_length)) {
+        if (write_data(writer, writer->block, writer->block_length) == -1) {
+            return -1;
+        }
+    } else if (writer->block_length > 0) {
+        if (writer->hole_start == -1) {
+            writer->hole_start = writer->offset;
+        }
+        writer->offset += writer->block_length;
+    }
+    writer->block_length = 0;
+    if (writer->hole_start == -1) {
+        return 0;
+    }
+
+    // The file ends with skipped zeros: extend it over them without writing
+    if (ftruncate(writer->fd, writer->offset) == -1) {
+        perror("ftruncate");
+        return -1;
+    }
+    end_hole(writer, writer->offset);
+    return 0;
+}
+
+int receive_message(int sockfd, char *buf, int buf_size) {
+    int bytes_received = (int)tls_recv(sockfd, buf, buf_size - 1);
     if (bytes_received == -1) {
         perror("recv");
         exit(EXIT_FAILURE);
     }
 
-    // Null-terminate the response
+    // Null-terminate the message
     buf[bytes_received] = '\0';
+    return bytes_received;
+}
+
+void receive_message_then_print(int sockfd) {
+    static char buf[COMMAND_STR_MAX];
+
+    // Receive response
+    receive_message(sockfd, buf, sizeof(buf));
     
     // Print the response
     printf("%s\n", buf);
@@ -326,14 +805,7 @@ void receive_message_then_print(int sockfd) {
 int receive_message_then_print_then_check_first_token(int sockfd, const char *expected) {
     static char buf[COMMAND_STR_MAX];
 
-    int bytes_received = recv(sockfd, buf, COMMAND_STR_MAX - 1, 0);
-    if (bytes_received == -1) {
-        perror("recv");
-        exit(EXIT_FAILURE);
-    }
-    
-    // Null-terminate the response
-    buf[bytes_received] = '\0';
+    receive_message(sockfd, buf, sizeof(buf));
 
     // Print the response
     printf("%s\n", buf);
@@ -2,7 +2,12 @@
 #define _COMMON_H_
 
 #include <limits.h>
+#include <stddef.h>
 #include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "hash.h"
 
 // NOTE: To have the ports be 21 and 20, you must run the server with 'sudo' privileges
 // in order for the server to connect to these ports.
@@ -14,7 +19,29 @@
 
 #define COMMAND_STR_MAX (2 * PATH_MAX)
 
-#define FILE_TRANSFER_BUFFER_SIZE (1024)
+#define FILE_TRANSFER_BUFFER_SIZE (256 * 1024)
+
+// Files are saved sparsely: an aligned block of zeros this large is left as a hole
+// instead of being written
+#define SPARSE_BLOCK_SIZE (4096)
+
+// Checksum computed on the fly during every file transfer, and reported in the
+// final 226 reply as "<algorithm>=<checksum>" so the client can verify the transfer
+#define TRANSFER_CHECKSUM_ALGORITHM (HASH_ALGORITHM_CRC32C)
+
+/**
+ * @brief A file being written from its start, where aligned blocks of zeros are skipped
+ * and left as holes
+ */
+struct sparse_writer {
+    int fd;
+    off_t offset;               // Where the next byte goes
+    off_t hole_start;           // Where the zeros skipped since the last write begin, or -1
+    int punch_holes;            // Whether skipped blocks may have been preallocated (with
+                                // fallocate()), and must be punched out to become holes
+    char block[SPARSE_BLOCK_SIZE];  // The start of the aligned block at offset, kept until
+    size_t block_length;            // the block is complete and can be checked for zeros
+};
 
 extern const char
     *COMMAND_USERNAME,
@@ -25,7 +52,24 @@ extern const char
     *COMMAND_LIST,
     *COMMAND_CHANGE_DIRECTORY,
     *COMMAND_PRINT_DIRECTORY,
-    *COMMAND_QUIT;
+    *COMMAND_QUIT,
+    *COMMAND_CONTENT_HASH,
+    *COMMAND_HASH,
+    *COMMAND_OPTIONS,
+    *COMMAND_ALLOCATE,
+    *COMMAND_AUTHENTICATE,
+    *COMMAND_PROTECTION_BUFFER_SIZE,
+    *COMMAND_PROTECTION_LEVEL,
+    *COMMAND_MAKE_DIRECTORY,
+    *COMMAND_MACHINE_LIST,
+    *COMMAND_SIGNATURE,
+    *COMMAND_DELTA_STORE,
+    *COMMAND_SIZE,
+    *COMMAND_MODIFICATION_TIME,
+    *COMMAND_RENAME_FROM,
+    *COMMAND_RENAME_TO,
+    *COMMAND_SITE,
+    *COMMAND_DELETE;
 
 /**
  * @brief Create the directory if it does not exist yet
@@ -43,6 +87,17 @@ void create_directory_if_not_exists(char *path);
  */
 int list_directory(char *path, char *result, int result_size);
 
+/**
+ * @brief Same as list_directory, but for an already opened directory. The position
+ * of dirfd is not changed, and dirfd may have been opened with O_PATH.
+ * 
+ * @param dirfd 
+ * @param result 
+ * @param result_size 
+ * @return int 0 on success, -1 if the directory could not be listed.
+ */
+int list_directory_fd(int dirfd, char *result, int result_size);
+
 /**
  * @brief Check whether the path exists and is a directory
  * 
@@ -57,7 +112,7 @@ int is_path_directory(char *path);
  * @param path 
  * @return 1 if true, 0 otherwise.
  */
-int is_path_file(char *path);
+int is_path_file(const char *path);
 
 /**
  * @brief Check if the first token, if interpreting the string as a space-separated
@@ -96,6 +151,18 @@ int get_next_free_port(int port);
  */
 int listen_port(int port, int *result_sockfd, int *result_port);
 
+/**
+ * @brief Same as listen_port, but the socket is created with SO_REUSEPORT so that
+ * several sockets (e.g. one per server reactor) can be bound to the same port. The
+ * kernel then spreads incoming connections across all of them.
+ * 
+ * @param port The port to bind the socket to.
+ * @param result_sockfd Location to store the new socket file descriptor.
+ * @param result_port Location to store the port the socket was bound to.
+ * @return 0 if success, -1 if fail (port was being used without SO_REUSEPORT)
+ */
+int listen_port_reuseport(int port, int *result_sockfd, int *result_port);
+
 /**
  * @brief Connect to the address and port specified
  * 
@@ -106,7 +173,28 @@ int listen_port(int port, int *result_sockfd, int *result_port);
 void connect_to_addr(struct sockaddr_in addr, int *result_sockfd, int *result_port);
 
 /**
- * @brief Send a message of bytes through the socket
+ * @brief Start connecting a non-blocking socket to the address and port specified
+ * 
+ * @param addr Structure containing the information necessary to connect
+ * @param result_sockfd Location to store the new socket file descriptor
+ * @return 0 if connected already, 1 if the connection is in progress
+ * (the socket becomes writable once it completes), -1 if it failed
+ */
+int connect_to_addr_nonblocking(struct sockaddr_in addr, int *result_sockfd);
+
+/**
+ * @brief Make blocking sends and receives on the socket fail (with EAGAIN)
+ * if they cannot make any progress for the given time
+ * 
+ * @param sockfd 
+ * @param timeout_ms 
+ */
+void set_socket_timeout(int sockfd, int timeout_ms);
+
+/**
+ * @brief Send a message of bytes through the socket (and its TLS session, if one is attached).
+ * Exits the process on failure, except on a non-blocking socket, whose connection is shut
+ * down instead so that the loop serving it drops it.
  * 
  * @param sockfd 
  * @param message 
@@ -118,16 +206,176 @@ void send_message(int sockfd, const char *message);
  * 
  * @param sockfd 
  * @param path 
+ * @param hash If not NULL, every sent byte is also added to this hash computation
+ */
+void send_file(int sockfd, const char *path, struct hash_ctx *hash);
+
+/**
+ * @brief Send the contents of an open file through the socket
+ * 
+ * @param sockfd 
+ * @param fd 
+ * @param hashes Hash computations to add every sent byte to, while it is in the buffer
+ * @param hash_count Number of hash computations (may be 0)
+ * @return 0 on success, -1 if reading or sending failed
+ */
+int send_file_fd(int sockfd, int fd, struct hash_ctx *hashes, int hash_count);
+
+/**
+ * @brief Same as send_file_fd, but only read the extents of the file that hold data,
+ * and send its holes as zeros without reading them
+ * 
+ * @param sockfd 
+ * @param fd 
+ * @param hashes Hash computations to add every sent byte to, zeros of holes included
+ * @param hash_count Number of hash computations (may be 0)
+ * @return 0 on success, -1 if reading or sending failed
  */
-void send_file(int sockfd, const char *path);
+int send_sparse_file_fd(int sockfd, int fd, struct hash_ctx *hashes, int hash_count);
 
 /**
  * @brief Receive a file through the socket and write it to the given path
  * 
  * @param sockfd 
  * @param path 
+ * @param hash If not NULL, every received byte is also added to this hash computation
+ */
+void save_file(int sockfd, const char *path, struct hash_ctx *hash);
+
+/**
+ * @brief Receive a file through the socket and write it sparsely to an open file
+ * 
+ * @param sockfd 
+ * @param fd An empty file
+ * @param hashes Hash computations to add every received byte to, while it is in the buffer
+ * @param hash_count Number of hash computations (may be 0)
+ * @return 0 on success, -1 if receiving or writing failed
+ */
+int save_file_fd(int sockfd, int fd, struct hash_ctx *hashes, int hash_count);
+
+/**
+ * @brief Write "<algorithm>=<checksum>" for the finished hash computation, as
+ * appended to the 226 reply of a transfer
+ * 
+ * @param hash 
+ * @param result Buffer of at least 16 + HASH_HEX_MAX bytes
+ */
+void format_transfer_checksum(struct hash_ctx *hash, char *result);
+
+/**
+ * @brief Send the whole buffer through the socket, retrying on partial sends
+ * 
+ * @param sockfd 
+ * @param buf 
+ * @param length 
+ * @return 0 on success, -1 on failure
+ */
+int send_all(int sockfd, const char *buf, size_t length);
+
+/**
+ * @brief Receive exactly length bytes through the socket, retrying on partial receives
+ * 
+ * @param sockfd 
+ * @param buf 
+ * @param length 
+ * @return 0 on success, -1 on failure or if the connection was closed first
+ */
+int receive_all(int sockfd, char *buf, size_t length);
+
+/**
+ * @brief Write the whole buffer to the file, retrying on partial writes
+ * 
+ * @param fd 
+ * @param buf 
+ * @param length 
+ * @return 0 on success, -1 on failure
+ */
+int write_all(int fd, const char *buf, size_t length);
+
+/**
+ * @brief Check whether every byte of the buffer is zero, with SIMD instructions where
+ * the processor has them
+ * 
+ * @param buf 
+ * @param length 
+ * @return 1 if true, 0 otherwise
+ */
+int buffer_is_zero(const void *buf, size_t length);
+
+/**
+ * @brief Check whether a file takes fewer blocks than its size, which means it has holes
+ * (or is compressed by the filesystem)
+ * 
+ * @param stat_result The metadata of the file
+ * @return 1 if true, 0 otherwise
+ */
+int is_file_sparse(const struct stat *stat_result);
+
+/**
+ * @brief Find the next extent of a file that holds data, with SEEK_DATA and SEEK_HOLE.
+ * Filesystems that do not track holes report the whole file as data.
+ * 
+ * @param fd 
+ * @param offset Where to start looking
+ * @param data_start Location to store where the data begins; the end of the file if
+ * there is no data after offset. The position of fd is moved there.
+ * @param data_end Location to store where the data ends (the next hole, or the end of the file)
+ * @return 0 on success, -1 on failure
+ */
+int find_file_data(int fd, off_t offset, off_t *data_start, off_t *data_end);
+
+/**
+ * @brief Send zeros through the socket, in place of a hole of a file
+ * 
+ * @param sockfd 
+ * @param length 
+ * @param hashes Hash computations to add the zeros to
+ * @param hash_count Number of hash computations (may be 0)
+ * @return 0 on success, -1 on failure
+ */
+int send_zeros(int sockfd, off_t length, struct hash_ctx *hashes, int hash_count);
+
+/**
+ * @brief Start writing an empty file sparsely
+ * 
+ * @param writer 
+ * @param fd An empty file, written from its start
+ * @param punch_holes Whether space may have been preallocated for the file, in which
+ * case skipped blocks are punched out of it
+ */
+void sparse_writer_init(struct sparse_writer *writer, int fd, int punch_holes);
+
+/**
+ * @brief Write the buffer at the end of the file, skipping the aligned blocks of
+ * SPARSE_BLOCK_SIZE zeros in it. A block split across calls is kept in the writer
+ * until it is complete, so blocks are found wherever the buffers start and end
+ * 
+ * @param writer 
+ * @param buf 
+ * @param length 
+ * @return 0 on success, -1 on failure
+ */
+int sparse_write(struct sparse_writer *writer, const char *buf, size_t length);
+
+/**
+ * @brief Finish the file: write its last, partial block, or if it ends with skipped
+ * zeros, extend it to its full size
+ * 
+ * @param writer 
+ * @return 0 on success, -1 on failure
+ */
+int sparse_writer_finish(struct sparse_writer *writer);
+
+/**
+ * @brief Receive a message through the socket (and its TLS session, if one is attached)
+ * into the buffer, null-terminated
+ * 
+ * @param sockfd 
+ * @param buf 
+ * @param buf_size 
+ * @return The length of the message (0 if the connection was closed)
  */
-void save_file(int sockfd, const char *path);
+int receive_message(int sockfd, char *buf, int buf_size);
 
 /**
  * @brief Receive a message through the socket and print it
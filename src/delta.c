@@ -0,0 +1,496 @@
+#include "delta.h"
+#include "common.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Size of a block in the signature as sent: weak and strong checksum
+#define DELTA_BLOCK_RECORD_SIZE (4 + 8)
+
+/**
+ * @brief Buffer collecting small instructions, so that each does not become its own TLS record
+ */
+struct delta_output {
+    int sockfd;
+    size_t length;
+    uint8_t buf[FILE_TRANSFER_BUFFER_SIZE];
+};
+
+static void put_u32(uint8_t *p, uint32_t x) {
+    for (int i = 3; i >= 0; i--, x >>= 8) {
+        p[i] = x & 0xff;
+    }
+}
+
+static void put_u64(uint8_t *p, uint64_t x) {
+    for (int i = 7; i >= 0; i--, x >>= 8) {
+        p[i] = x & 0xff;
+    }
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+static int output_flush(struct delta_output *output) {
+    int status = send_all(output->sockfd, (const char *)output->buf, output->length);
+    output->length = 0;
+    return status;
+}
+
+static int output_write(struct delta_output *output, const void *data, size_t length) {
+    if (output->length + length > sizeof(output->buf) && output_flush(output) == -1) {
+        return -1;
+    }
+
+    // Large pieces go out directly instead of through the buffer
+    if (length > sizeof(output->buf)) {
+        return send_all(output->sockfd, data, length);
+    }
+    memcpy(output->buf + output->length, data, length);
+    output->length += length;
+    return 0;
+}
+
+static uint64_t strong_checksum(const uint8_t *data, size_t length) {
+    struct xxh64_ctx ctx;
+    xxh64_init(&ctx);
+    xxh64_update(&ctx, data, length);
+    return xxh64_final(&ctx);
+}
+
+uint32_t delta_block_size(off_t file_size) {
+    uint32_t block_size = DELTA_MIN_BLOCK_SIZE;
+    while (block_size < DELTA_MAX_BLOCK_SIZE && (off_t)block_size * block_size < file_size) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+uint32_t delta_weak_checksum(const uint8_t *data, size_t length) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < length; i++) {
+        a += data[i];
+        b += (uint32_t)(length - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t length) {
+    uint32_t a = weak & 0xffff, b = weak >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)length * out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+int delta_send_signature(int sockfd, int fd, off_t size) {
+    static struct delta_output output;
+    static uint8_t block[DELTA_MAX_BLOCK_SIZE];
+
+    uint32_t block_size = delta_block_size(size);
+    uint64_t block_count = size / block_size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    output.sockfd = sockfd;
+    output.length = 0;
+    uint8_t header[4 + 8];
+    put_u32(header, block_size);
+    put_u64(header + 4, block_count);
+    if (output_write(&output, header, sizeof(header)) == -1) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < block_count; i++) {
+        size_t total = 0;
+        while (total < block_size) {
+            ssize_t bytes_read = read(fd, block + total, block_size - total);
+            if (bytes_read == -1) {
+                perror("read");
+                return -1;
+            } else if (bytes_read == 0) {
+                // The file was truncated since fstat()
+                fprintf(stderr, "Error: File changed while computing its signature\n");
+                return -1;
+            }
+            total += bytes_read;
+        }
+
+        uint8_t record[DELTA_BLOCK_RECORD_SIZE];
+        put_u32(record, delta_weak_checksum(block, block_size));
+        put_u64(record + 4, strong_checksum(block, block_size));
+        if (output_write(&output, record, sizeof(record)) == -1) {
+            return -1;
+        }
+    }
+
+    return output_flush(&output);
+}
+
+int delta_receive_signature(int sockfd, struct delta_signature *signature) {
+    static uint8_t records[FILE_TRANSFER_BUFFER_SIZE / DELTA_BLOCK_RECORD_SIZE * DELTA_BLOCK_RECORD_SIZE];
+
+    uint8_t header[4 + 8];
+    if (receive_all(sockfd, (char *)header, sizeof(header)) == -1) {
+        return -1;
+    }
+    signature->block_size = get_u32(header);
+    uint64_t block_count = get_u64(header + 4);
+    if (signature->block_size < DELTA_MIN_BLOCK_SIZE || signature->block_size > DELTA_MAX_BLOCK_SIZE
+        || block_count > DELTA_MAX_BLOCK_COUNT) {
+        fprintf(stderr, "Error: Invalid signature\n");
+        return -1;
+    }
+    signature->block_count = block_count;
+
+    signature->blocks = malloc((block_count > 0 ? block_count : 1) * sizeof(struct delta_block));
+    if (signature->blocks == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    size_t i = 0;
+    while (i < signature->block_count) {
+        size_t count = signature->block_count - i;
+        if (count > sizeof(records) / DELTA_BLOCK_RECORD_SIZE) {
+            count = sizeof(records) / DELTA_BLOCK_RECORD_SIZE;
+        }
+        if (receive_all(sockfd, (char *)records, count * DELTA_BLOCK_RECORD_SIZE) == -1) {
+            delta_free_signature(signature);
+            return -1;
+        }
+        for (size_t j = 0; j < count; j++, i++) {
+            signature->blocks[i].weak = get_u32(records + j * DELTA_BLOCK_RECORD_SIZE);
+            signature->blocks[i].strong = get_u64(records + j * DELTA_BLOCK_RECORD_SIZE + 4);
+        }
+    }
+    return 0;
+}
+
+void delta_free_signature(struct delta_signature *signature) {
+    free(signature->blocks);
+    signature->blocks = NULL;
+    signature->block_count = 0;
+}
+
+/**
+ * @brief Index of the blocks of a signature by rolling checksum: chains of block
+ * indices, one per bucket
+ */
+struct delta_index {
+    int32_t *heads;     // First block of each bucket, or -1
+    int32_t *next;      // Next block in the same bucket, or -1
+    uint32_t mask;      // Number of buckets - 1
+};
+
+static uint32_t index_bucket(const struct delta_index *index, uint32_t weak) {
+    // The low bits of the sum of bytes alone would crowd few buckets
+    return (weak * 2654435761u) >> 7 & index->mask;
+}
+
+static int index_build(struct delta_index *index, const struct delta_signature *signature) {
+    uint32_t bucket_count = 1024;
+    while (bucket_count < 2 * signature->block_count) {
+        bucket_count *= 2;
+    }
+    index->mask = bucket_count - 1;
+    index->heads = malloc(bucket_count * sizeof(int32_t));
+    index->next = malloc((signature->block_count > 0 ? signature->block_count : 1) * sizeof(int32_t));
+    if (index->heads == NULL || index->next == NULL) {
+        perror("malloc");
+        free(index->heads);
+        free(index->next);
+        return -1;
+    }
+    memset(index->heads, 0xff, bucket_count * sizeof(int32_t));
+
+    // Insert in reverse, so that chains list the earlier blocks first
+    for (size_t i = signature->block_count; i-- > 0;) {
+        uint32_t bucket = index_bucket(index, signature->blocks[i].weak);
+        index->next[i] = index->heads[bucket];
+        index->heads[bucket] = (int32_t)i;
+    }
+    return 0;
+}
+
+static void index_free(struct delta_index *index) {
+    free(index->heads);
+    free(index->next);
+}
+
+/**
+ * @brief Find a block of the old file with the same content as the data
+ *
+ * @param preferred The block to take if it matches, so that runs of blocks stay together
+ * @return Index of the block, or -1 if none matches
+ */
+static int64_t find_block(const struct delta_index *index, const struct delta_signature *signature,
+    uint32_t weak, const uint8_t *data, int64_t preferred) {
+    // The strong checksum is only computed once the rolling checksum matches
+    int has_strong = 0;
+    uint64_t strong = 0;
+
+    if (preferred >= 0 && (size_t)preferred < signature->block_count && signature->blocks[preferred].weak == weak) {
+        strong = strong_checksum(data, signature->block_size);
+        has_strong = 1;
+        if (signature->blocks[preferred].strong == strong) {
+            return preferred;
+        }
+    }
+
+    for (int32_t i = index->heads[index_bucket(index, weak)]; i != -1; i = index->next[i]) {
+        if (signature->blocks[i].weak != weak) {
+            continue;
+        }
+        if (!has_strong) {
+            strong = strong_checksum(data, signature->block_size);
+            has_strong = 1;
+        }
+        if (signature->blocks[i].strong == strong) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int send_literal(struct delta_output *output, const uint8_t *data, size_t length, struct hash_ctx *checksum) {
+    hash_update(checksum, data, length);
+    while (length > 0) {
+        size_t piece = length < DELTA_MAX_LITERAL_SIZE ? length : DELTA_MAX_LITERAL_SIZE;
+        uint8_t op[1 + 4];
+        op[0] = DELTA_OP_LITERAL;
+        put_u32(op + 1, piece);
+        if (output_write(output, op, sizeof(op)) == -1 || output_write(output, data, piece) == -1) {
+            return -1;
+        }
+        data += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+static int send_copy(struct delta_output *output, uint64_t block_index, uint32_t block_count) {
+    uint8_t op[1 + 8 + 4];
+    op[0] = DELTA_OP_COPY;
+    put_u64(op + 1, block_index);
+    put_u32(op + 9, block_count);
+    return output_write(output, op, sizeof(op));
+}
+
+int delta_send(int sockfd, const struct delta_signature *signature, const uint8_t *data, size_t size,
+    struct hash_ctx *checksum, struct delta_stats *stats) {
+    static struct delta_output output;
+
+    struct delta_index index;
+    if (index_build(&index, signature) == -1) {
+        return -1;
+    }
+
+    output.sockfd = sockfd;
+    output.length = 0;
+    stats->copied_bytes = 0;
+    stats->literal_bytes = 0;
+
+    uint8_t header[4];
+    put_u32(header, signature->block_size);
+    int status = output_write(&output, header, sizeof(header));
+
+    // Slide a window of one block over the new file. Where it matches a block of the
+    // old file, copy that block and jump past it; otherwise move on by one byte, and
+    // the byte that falls out of the window becomes part of a literal.
+    size_t block_size = signature->block_size;
+    size_t position = 0;
+    size_t literal_start = 0;
+    int64_t copy_index = -1;    // The run of copied blocks not sent yet
+    uint32_t copy_count = 0;
+    int has_weak = 0;
+    uint32_t weak = 0;
+    while (status == 0 && position + block_size <= size) {
+        if (!has_weak) {
+            weak = delta_weak_checksum(data + position, block_size);
+            has_weak = 1;
+        }
+
+        int64_t match = find_block(&index, signature, weak, data + position, copy_count > 0 ? copy_index + copy_count : -1);
+        if (match == -1) {
+            if (position + block_size < size) {
+                weak = delta_roll(weak, data[position], data[position + block_size], block_size);
+            }
+            position++;
+            continue;
+        }
+
+        // Send what came before the match, then extend the run of copies or start a new one
+        if (literal_start < position) {
+            if (copy_count > 0) {
+                status = send_copy(&output, copy_index, copy_count);
+                copy_count = 0;
+            }
+            if (status == 0) {
+                status = send_literal(&output, data + literal_start, position - literal_start, checksum);
+            }
+            stats->literal_bytes += position - literal_start;
+        }
+        if (copy_count > 0 && match == copy_index + copy_count && copy_count < UINT32_MAX) {
+            copy_count++;
+        } else {
+            if (copy_count > 0 && status == 0) {
+                status = send_copy(&output, copy_index, copy_count);
+            }
+            copy_index = match;
+            copy_count = 1;
+        }
+        hash_update(checksum, data + position, block_size);
+        stats->copied_bytes += block_size;
+
+        position += block_size;
+        literal_start = position;
+        has_weak = 0;
+    }
+
+    // Send the last run of copies, the rest of the file, and its size for a final check
+    if (status == 0 && copy_count > 0) {
+        status = send_copy(&output, copy_index, copy_count);
+    }
+    if (status == 0 && literal_start < size) {
+        status = send_literal(&output, data + literal_start, size - literal_start, checksum);
+        stats->literal_bytes += size - literal_start;
+    }
+    if (status == 0) {
+        uint8_t op[1 + 8];
+        op[0] = DELTA_OP_END;
+        put_u64(op + 1, size);
+        status = output_write(&output, op, sizeof(op));
+    }
+    if (status == 0) {
+        status = output_flush(&output);
+    }
+
+    index_free(&index);
+    return status;
+}
+
+/**
+ * @brief Append blocks of the old file to the new one
+ */
+static int apply_copy(int basis_fd, int fd, off_t offset, off_t length, struct hash_ctx *hashes, int hash_count) {
+    static char buf[FILE_TRANSFER_BUFFER_SIZE];
+
+    while (length > 0) {
+        size_t piece = length < (off_t)sizeof(buf) ? (size_t)length : sizeof(buf);
+        ssize_t bytes_read = pread(basis_fd, buf, piece, offset);
+        if (bytes_read == -1) {
+            perror("pread");
+            return -1;
+        } else if ((size_t)bytes_read != piece) {
+            // The old file was truncated since its signature was sent
+            fprintf(stderr, "Error: Delta refers past the end of the file\n");
+            return -1;
+        }
+        for (int i = 0; i < hash_count; i++) {
+            hash_update(&hashes[i], buf, piece);
+        }
+
+        // Let the kernel copy the data, so that filesystems that can share extents do
+        // not write them again; otherwise write what was read for the hashes
+        off_t copy_offset = offset;
+        size_t copied = 0;
+        while (copied < piece) {
+            ssize_t bytes_copied = copy_file_range(basis_fd, &copy_offset, fd, NULL, piece - copied, 0);
+            if (bytes_copied <= 0) {
+                break;
+            }
+            copied += bytes_copied;
+        }
+        if (copied < piece && write_all(fd, buf + copied, piece - copied) == -1) {
+            return -1;
+        }
+
+        offset += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+int delta_apply(int sockfd, int basis_fd, int fd, struct hash_ctx *hashes, int hash_count) {
+    static char buf[DELTA_MAX_LITERAL_SIZE];
+
+    uint8_t header[4];
+    if (receive_all(sockfd, (char *)header, sizeof(header)) == -1) {
+        return -1;
+    }
+    uint32_t block_size = get_u32(header);
+    if (block_size < DELTA_MIN_BLOCK_SIZE || block_size > DELTA_MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Error: Invalid delta\n");
+        return -1;
+    }
+
+    off_t basis_size = lseek(basis_fd, 0, SEEK_END);
+    if (basis_size == -1) {
+        perror("lseek");
+        return -1;
+    }
+    uint64_t basis_block_count = basis_size / block_size;
+
+    uint64_t size = 0;
+    while (1) {
+        uint8_t op[1 + 8 + 4];
+        if (receive_all(sockfd, (char *)op, 1) == -1) {
+            return -1;
+        }
+
+        if (op[0] == DELTA_OP_COPY) {
+            if (receive_all(sockfd, (char *)op + 1, 8 + 4) == -1) {
+                return -1;
+            }
+            uint64_t block_index = get_u64(op + 1);
+            uint32_t block_count = get_u32(op + 9);
+            if (block_index > basis_block_count || block_count > basis_block_count - block_index) {
+                fprintf(stderr, "Error: Delta refers past the end of the file\n");
+                return -1;
+            }
+            off_t length = (off_t)block_count * block_size;
+            if (apply_copy(basis_fd, fd, (off_t)block_index * block_size, length, hashes, hash_count) == -1) {
+                return -1;
+            }
+            size += length;
+        } else if (op[0] == DELTA_OP_LITERAL) {
+            if (receive_all(sockfd, (char *)op + 1, 4) == -1) {
+                return -1;
+            }
+            uint32_t length = get_u32(op + 1);
+            if (length > sizeof(buf)) {
+                fprintf(stderr, "Error: Invalid delta\n");
+                return -1;
+            }
+            if (receive_all(sockfd, buf, length) == -1) {
+                return -1;
+            }
+            for (int i = 0; i < hash_count; i++) {
+                hash_update(&hashes[i], buf, length);
+            }
+            if (write_all(fd, buf, length) == -1) {
+                return -1;
+            }
+            size += length;
+        } else if (op[0] == DELTA_OP_END) {
+            if (receive_all(sockfd, (char *)op + 1, 8) == -1) {
+                return -1;
+            }
+            if (get_u64(op + 1) != size) {
+                fprintf(stderr, "Error: Delta does not add up to the size of the file\n");
+                return -1;
+            }
+            return 0;
+        } else {
+            fprintf(stderr, "Error: Invalid delta\n");
+            return -1;
+        }
+    }
+}
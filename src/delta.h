@@ -0,0 +1,128 @@
+#ifndef DELTA_H_
+#define DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+// Blocks are a power of two between these sizes: about the square root of the file
+// size, which balances the size of the signature against the size of the literals.
+// Being multiples of the filesystem block size, copied blocks can share extents with
+// the old file on filesystems that support it.
+#define DELTA_MIN_BLOCK_SIZE (4 * 1024)
+#define DELTA_MAX_BLOCK_SIZE (256 * 1024)
+
+// The client only sends a delta for files at least this large; smaller ones are sent whole
+#define DELTA_MIN_FILE_SIZE (1024 * 1024)
+
+// Largest signature accepted, in blocks (a 1 TiB file has 4M blocks of the largest size)
+#define DELTA_MAX_BLOCK_COUNT (16 * 1024 * 1024)
+
+// Instructions of a delta. All numbers are big-endian.
+// The delta starts with the block size (4 bytes), then:
+#define DELTA_OP_COPY 'C'       // Block index (8 bytes), block count (4 bytes): copy blocks of the old file
+#define DELTA_OP_LITERAL 'L'    // Length (4 bytes), then that many bytes of new data
+#define DELTA_OP_END 'E'        // Size of the new file (8 bytes)
+
+// Longest literal of one instruction
+#define DELTA_MAX_LITERAL_SIZE (256 * 1024)
+
+/**
+ * @brief Checksums of one block of the old file
+ */
+struct delta_block {
+    uint32_t weak;      // Rolling checksum, cheap to update one byte at a time
+    uint64_t strong;    // XXH64, to confirm a match of the rolling checksum
+};
+
+/**
+ * @brief Checksums of all full blocks of the old file, in order. A partial block
+ * at the end is left out and is sent as a literal.
+ */
+struct delta_signature {
+    uint32_t block_size;
+    size_t block_count;
+    struct delta_block *blocks;
+};
+
+/**
+ * @brief What a delta is made of, for reporting
+ */
+struct delta_stats {
+    off_t copied_bytes;     // Bytes that the server takes from the old file
+    off_t literal_bytes;    // Bytes that are sent
+};
+
+/**
+ * @brief Block size of the signature of a file of the given size
+ */
+uint32_t delta_block_size(off_t file_size);
+
+/**
+ * @brief Compute the rolling checksum of a block: two 16-bit sums in the style
+ * of rsync, one of the bytes and one weighted by their position
+ */
+uint32_t delta_weak_checksum(const uint8_t *data, size_t length);
+
+/**
+ * @brief Move the block of the rolling checksum one byte forward
+ *
+ * @param weak The checksum of the block
+ * @param out The first byte of the block, which leaves it
+ * @param in The byte after the block, which enters it
+ * @param length The block size
+ * @return The checksum of the block starting one byte later
+ */
+uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t length);
+
+/**
+ * @brief Compute and send the signature of a file
+ *
+ * @param sockfd
+ * @param fd The file, read from its current position
+ * @param size The size of the file
+ * @return 0 on success, -1 if reading or sending failed
+ */
+int delta_send_signature(int sockfd, int fd, off_t size);
+
+/**
+ * @brief Receive a signature sent by delta_send_signature
+ *
+ * @param sockfd
+ * @param signature Location to store the signature, to be freed with delta_free_signature
+ * @return 0 on success, -1 on failure
+ */
+int delta_receive_signature(int sockfd, struct delta_signature *signature);
+
+void delta_free_signature(struct delta_signature *signature);
+
+/**
+ * @brief Find the parts of the new file that the old file has, and send the delta:
+ * copy instructions for those parts, and literals for the rest
+ *
+ * @param sockfd
+ * @param signature The signature of the old file
+ * @param data The new file
+ * @param size The size of the new file
+ * @param checksum Hash computation to add the new file to
+ * @param stats Location to store what the delta is made of
+ * @return 0 on success, -1 if sending failed
+ */
+int delta_send(int sockfd, const struct delta_signature *signature, const uint8_t *data, size_t size,
+    struct hash_ctx *checksum, struct delta_stats *stats);
+
+/**
+ * @brief Receive a delta and build the new file from it and the old file
+ *
+ * @param sockfd
+ * @param basis_fd The old file
+ * @param fd The new file, written from its current position
+ * @param hashes Hash computations to add every byte of the new file to
+ * @param hash_count Number of hash computations (may be 0)
+ * @return 0 on success, -1 if receiving, reading or writing failed, or the delta is invalid
+ */
+int delta_apply(int sockfd, int basis_fd, int fd, struct hash_ctx *hashes, int hash_count);
+
+#endif
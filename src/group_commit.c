@@ -0,0 +1,200 @@
+#include "group_commit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct group_commit* group_commit_create() {
+    struct group_commit *group = mmap(NULL, sizeof(struct group_commit), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (group == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&(group->collect_lock), &mutex_attr);
+    pthread_mutex_init(&(group->flush_lock), &mutex_attr);
+    pthread_mutex_init(&(group->lock), &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(group->flushed), &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    group->collecting_generation = 1;
+    group->done_generation = 0;
+    group->flushed_generation = 0;
+    group->has_leader = 0;
+    group->device = 0;
+
+    return group;
+}
+
+/**
+ * @brief Lock a robust mutex, making it consistent if its owner died
+ *
+ * @return 1 if the previous owner died holding it, 0 otherwise
+ */
+static int lock_robust(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        // Only counters and flags change under these locks, so they are still consistent
+        pthread_mutex_consistent(mutex);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Check whether a live leader holds the lock
+ *
+ * @return 1 if true, 0 otherwise
+ */
+static int is_held(pthread_mutex_t *mutex) {
+    int status = pthread_mutex_trylock(mutex);
+    if (status == EBUSY) {
+        return 1;
+    }
+    if (status == EOWNERDEAD) {
+        pthread_mutex_consistent(mutex);
+    }
+    if (status == 0 || status == EOWNERDEAD) {
+        pthread_mutex_unlock(mutex);
+    }
+    return 0;
+}
+
+/**
+ * @brief Wait on the condition with the lock held, for at most GROUP_COMMIT_LIVENESS_CHECK_MS
+ * or until the deadline if it is sooner
+ *
+ * @return 0 if woken (or the check interval passed), ETIMEDOUT once the deadline passed
+ */
+static int wait_group(struct group_commit *group, const struct timespec *deadline) {
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_nsec += GROUP_COMMIT_LIVENESS_CHECK_MS * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    int at_deadline = deadline != NULL && (deadline->tv_sec < until.tv_sec
+        || (deadline->tv_sec == until.tv_sec && deadline->tv_nsec <= until.tv_nsec));
+    if (at_deadline) {
+        until = *deadline;
+    }
+
+    int status = pthread_cond_timedwait(&(group->flushed), &(group->lock), &until);
+    if (status == EOWNERDEAD) {
+        pthread_mutex_consistent(&(group->lock));
+        status = 0;
+    }
+    return status == ETIMEDOUT && at_deadline ? ETIMEDOUT : 0;
+}
+
+int group_commit_sync(struct group_commit *group, int fd) {
+    struct stat stat_result;
+    if (fstat(fd, &stat_result) == -1) {
+        perror("fstat");
+        return -1;
+    }
+
+    lock_robust(&(group->lock));
+    uint64_t generation = group->collecting_generation;
+
+    if (!group->has_leader) {
+        // Lead this batch: give others a moment to join
+        group->has_leader = 1;
+        group->device = stat_result.st_dev;
+        lock_robust(&(group->collect_lock));
+        pthread_mutex_unlock(&(group->lock));
+
+        usleep(GROUP_COMMIT_WINDOW_US);
+
+        // Flush one batch at a time; the files that arrive meanwhile join this one
+        int previous_died = lock_robust(&(group->flush_lock));
+
+        // Close the batch. If the leader of the previous batch died, its members are
+        // told to flush by themselves.
+        lock_robust(&(group->lock));
+        if (previous_died && group->done_generation < generation - 1) {
+            group->done_generation = generation - 1;
+            pthread_cond_broadcast(&(group->flushed));
+        }
+        group->collecting_generation++;
+        group->has_leader = 0;
+        pthread_mutex_unlock(&(group->collect_lock));
+        pthread_mutex_unlock(&(group->lock));
+
+        // One flush of the filesystem commits the files and directory entries of the
+        // whole batch, since their data was already written back
+        int status = syncfs(fd);
+        if (status == -1) {
+            perror("syncfs");
+        }
+
+        // Members of a batch that failed flush by themselves
+        lock_robust(&(group->lock));
+        group->done_generation = generation;
+        if (status == 0 && group->flushed_generation < generation) {
+            group->flushed_generation = generation;
+        }
+        pthread_cond_broadcast(&(group->flushed));
+        pthread_mutex_unlock(&(group->lock));
+        pthread_mutex_unlock(&(group->flush_lock));
+        return status;
+    }
+
+    // Join the batch, unless its flush does not cover this file
+    int joined = stat_result.st_dev == group->device;
+
+    // Wait for the leader to flush this batch (a later flush covers it as well)
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += GROUP_COMMIT_MEMBER_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (GROUP_COMMIT_MEMBER_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (joined && group->done_generation < generation) {
+        if (wait_group(group, &deadline) == ETIMEDOUT) {
+            break;
+        }
+        if (group->done_generation >= generation) {
+            break;
+        }
+
+        // Give up on a batch whose leader died. A batch being collected is abandoned,
+        // so that the next upload starts a new one with a live leader.
+        if (generation == group->collecting_generation && !is_held(&(group->collect_lock))) {
+            group->collecting_generation++;
+            group->has_leader = 0;
+            group->done_generation = generation;
+            pthread_cond_broadcast(&(group->flushed));
+        } else if (generation < group->collecting_generation && !is_held(&(group->flush_lock))) {
+            group->done_generation = generation;
+            pthread_cond_broadcast(&(group->flushed));
+        }
+    }
+    int flushed = joined && group->flushed_generation >= generation;
+    pthread_mutex_unlock(&(group->lock));
+
+    if (!flushed && syncfs(fd) == -1) {
+        perror("syncfs");
+        return -1;
+    }
+    return 0;
+}
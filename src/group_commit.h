@@ -0,0 +1,58 @@
+#ifndef GROUP_COMMIT_H_
+#define GROUP_COMMIT_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// How long the first upload of a batch waits for other uploads to join it
+#define GROUP_COMMIT_WINDOW_US (2000)
+// How often members check that the leader of their batch is still alive
+#define GROUP_COMMIT_LIVENESS_CHECK_MS (100)
+// How long a member waits for the leader of its batch before flushing by itself
+// (only happens if the leader is stuck)
+#define GROUP_COMMIT_MEMBER_TIMEOUT_MS (5000)
+
+/**
+ * @brief Shared state for committing uploads from many processes with one flush.
+ * The first process to arrive becomes the leader of a batch: it waits for a short
+ * window and for the previous batch to be flushed, closes the batch, and flushes the
+ * whole filesystem once with syncfs(), which covers the files and directory entries of
+ * every member. Everyone who joined the batch then continues.
+ * A leader holds collect_lock until it closes its batch and flush_lock until the
+ * flush is done, so members find out that it died when a lock reports EOWNERDEAD, and
+ * flush by themselves.
+ */
+struct group_commit {
+    pthread_mutex_t collect_lock;   // Held by the leader of the collecting batch
+    pthread_mutex_t flush_lock;     // Held by the leader of the batch being flushed
+    pthread_mutex_t lock;           // Process-shared lock protecting everything below
+    pthread_cond_t flushed;         // Signalled whenever a batch is done flushing
+    uint64_t collecting_generation; // The batch new members join
+    uint64_t done_generation;       // The latest batch whose flush is over, even if it failed
+    uint64_t flushed_generation;    // The latest batch known to be durable
+    int has_leader;                 // Whether the collecting batch has a leader
+    dev_t device;                   // The filesystem of the collecting batch
+};
+
+/**
+ * @brief Create the group commit state in shared anonymous memory. Must be called
+ * before forking the processes that share it.
+ *
+ * @return The state (exits the process on failure)
+ */
+struct group_commit* group_commit_create();
+
+/**
+ * @brief Make the file durable along with the changes already made to its directory,
+ * as fdatasync() and an fsync() of the directory do, batching the flush with other
+ * processes doing the same at the same time. The file's data should already have been
+ * written back with sync_file_range(), so that the shared flush has little left to do.
+ *
+ * @param group
+ * @param fd The file
+ * @return 0 on success, -1 if the flush failed
+ */
+int group_commit_sync(struct group_commit *group, int fd);
+
+#endif
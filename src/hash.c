@@ -0,0 +1,374 @@
+#include "hash.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/**
+ * @brief The libcrypto SHA-256 implementation, fetched at the first use
+ */
+static EVP_MD *sha256_md = NULL;
+
+void sha256_init(struct sha256_ctx *ctx) {
+    if (sha256_md == NULL) {
+        sha256_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+    }
+    ctx->md_ctx = EVP_MD_CTX_new();
+    if (sha256_md == NULL || ctx->md_ctx == NULL || EVP_DigestInit_ex(ctx->md_ctx, sha256_md, NULL) != 1) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t length) {
+    EVP_DigestUpdate(ctx->md_ctx, data, length);
+}
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    EVP_DigestFinal_ex(ctx->md_ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx->md_ctx);
+    ctx->md_ctx = NULL;
+}
+
+int sha256_file(const char *path, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    static uint8_t buf[64 * 1024];
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buf, sizeof(buf))) > 0) {
+        sha256_update(&ctx, buf, bytes_read);
+    }
+    close(fd);
+    sha256_final(&ctx, digest);
+    if (bytes_read == -1) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Table for the portable CRC32C implementation (reflected polynomial 0x82f63b78)
+ */
+static uint32_t crc32c_table[256];
+
+static void crc32c_build_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_portable(uint32_t crc, const uint8_t *bytes, size_t length) {
+    if (crc32c_table[1] == 0) {
+        crc32c_build_table();
+    }
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32c_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t *bytes, size_t length) {
+    uint64_t crc64 = crc;
+
+    // Align to 8 bytes, then process 8 bytes per instruction
+    while (length > 0 && ((uintptr_t)bytes & 7) != 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *bytes++);
+        length--;
+    }
+    while (length >= 8) {
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)bytes);
+        bytes += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *bytes++);
+        length--;
+    }
+    return (uint32_t)crc64;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_hardware(crc, data, length);
+    }
+#endif
+    return ~crc32c_portable(crc, data, length);
+}
+
+static const uint64_t XXH64_PRIME_1 = 0x9e3779b185ebca87ull;
+static const uint64_t XXH64_PRIME_2 = 0xc2b2ae3d27d4eb4full;
+static const uint64_t XXH64_PRIME_3 = 0x165667b19e3779f9ull;
+static const uint64_t XXH64_PRIME_4 = 0x85ebca77c2b2ae63ull;
+static const uint64_t XXH64_PRIME_5 = 0x27d4eb2f165667c5ull;
+
+static uint64_t rotate_left_64(uint64_t x, int n) {
+    return (x << n) | (x >> (64 - n));
+}
+
+static uint64_t read_64(const uint8_t *bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint32_t read_32(const uint8_t *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint64_t xxh64_round(uint64_t accumulator, uint64_t input) {
+    accumulator += input * XXH64_PRIME_2;
+    accumulator = rotate_left_64(accumulator, 31);
+    return accumulator * XXH64_PRIME_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t hash, uint64_t accumulator) {
+    hash ^= xxh64_round(0, accumulator);
+    return hash * XXH64_PRIME_1 + XXH64_PRIME_4;
+}
+
+/**
+ * @brief Process one 32-byte stripe, 8 bytes into each of the four independent lanes
+ */
+static void xxh64_stripe(uint64_t accumulators[4], const uint8_t *stripe) {
+    accumulators[0] = xxh64_round(accumulators[0], read_64(stripe));
+    accumulators[1] = xxh64_round(accumulators[1], read_64(stripe + 8));
+    accumulators[2] = xxh64_round(accumulators[2], read_64(stripe + 16));
+    accumulators[3] = xxh64_round(accumulators[3], read_64(stripe + 24));
+}
+
+void xxh64_init(struct xxh64_ctx *ctx) {
+    ctx->accumulators[0] = XXH64_PRIME_1 + XXH64_PRIME_2;
+    ctx->accumulators[1] = XXH64_PRIME_2;
+    ctx->accumulators[2] = 0;
+    ctx->accumulators[3] = -XXH64_PRIME_1;
+    ctx->length = 0;
+    ctx->buffer_length = 0;
+}
+
+void xxh64_update(struct xxh64_ctx *ctx, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    ctx->length += length;
+
+    // Complete a partially filled stripe first
+    if (ctx->buffer_length > 0) {
+        size_t take = 32 - ctx->buffer_length;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(ctx->buffer + ctx->buffer_length, bytes, take);
+        ctx->buffer_length += take;
+        bytes += take;
+        length -= take;
+
+        if (ctx->buffer_length < 32) {
+            return;
+        }
+        xxh64_stripe(ctx->accumulators, ctx->buffer);
+        ctx->buffer_length = 0;
+    }
+
+    // Hash full stripes straight from the input
+    while (length >= 32) {
+        xxh64_stripe(ctx->accumulators, bytes);
+        bytes += 32;
+        length -= 32;
+    }
+
+    // Keep the rest for later
+    memcpy(ctx->buffer, bytes, length);
+    ctx->buffer_length = length;
+}
+
+uint64_t xxh64_final(struct xxh64_ctx *ctx) {
+    uint64_t hash;
+    if (ctx->length >= 32) {
+        uint64_t *a = ctx->accumulators;
+        hash = rotate_left_64(a[0], 1) + rotate_left_64(a[1], 7) + rotate_left_64(a[2], 12) + rotate_left_64(a[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxh64_merge_round(hash, a[i]);
+        }
+    } else {
+        hash = XXH64_PRIME_5;
+    }
+    hash += ctx->length;
+
+    // Mix in the remaining bytes
+    const uint8_t *bytes = ctx->buffer;
+    size_t length = ctx->buffer_length;
+    while (length >= 8) {
+        hash ^= xxh64_round(0, read_64(bytes));
+        hash = rotate_left_64(hash, 27) * XXH64_PRIME_1 + XXH64_PRIME_4;
+        bytes += 8;
+        length -= 8;
+    }
+    if (length >= 4) {
+        hash ^= (uint64_t)read_32(bytes) * XXH64_PRIME_1;
+        hash = rotate_left_64(hash, 23) * XXH64_PRIME_2 + XXH64_PRIME_3;
+        bytes += 4;
+        length -= 4;
+    }
+    while (length > 0) {
+        hash ^= (*bytes) * XXH64_PRIME_5;
+        hash = rotate_left_64(hash, 11) * XXH64_PRIME_1;
+        bytes++;
+        length--;
+    }
+
+    // Final avalanche
+    hash ^= hash >> 33;
+    hash *= XXH64_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= XXH64_PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+void hash_init(struct hash_ctx *ctx, enum hash_algorithm algorithm) {
+    ctx->algorithm = algorithm;
+    switch (algorithm) {
+    case HASH_ALGORITHM_CRC32C:
+        ctx->state.crc32c = 0;
+        break;
+    case HASH_ALGORITHM_XXH64:
+        xxh64_init(&(ctx->state.xxh64));
+        break;
+    default:
+        sha256_init(&(ctx->state.sha256));
+        break;
+    }
+}
+
+void hash_update(struct hash_ctx *ctx, const void *data, size_t length) {
+    switch (ctx->algorithm) {
+    case HASH_ALGORITHM_CRC32C:
+        ctx->state.crc32c = crc32c_update(ctx->state.crc32c, data, length);
+        break;
+    case HASH_ALGORITHM_XXH64:
+        xxh64_update(&(ctx->state.xxh64), data, length);
+        break;
+    default:
+        sha256_update(&(ctx->state.sha256), data, length);
+        break;
+    }
+}
+
+void hash_final_hex(struct hash_ctx *ctx, char *hex) {
+    switch (ctx->algorithm) {
+    case HASH_ALGORITHM_CRC32C:
+        sprintf(hex, "%08x", ctx->state.crc32c);
+        break;
+    case HASH_ALGORITHM_XXH64:
+        sprintf(hex, "%016llx", (unsigned long long)xxh64_final(&(ctx->state.xxh64)));
+        break;
+    default: {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256_final(&(ctx->state.sha256), digest);
+        bytes_to_hex(digest, SHA256_DIGEST_SIZE, hex);
+        break;
+    }
+    }
+}
+
+int hash_file_fd(int fd, enum hash_algorithm algorithm, char *hex) {
+    static uint8_t buf[256 * 1024];
+
+    struct hash_ctx ctx;
+    hash_init(&ctx, algorithm);
+
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buf, sizeof(buf))) > 0) {
+        hash_update(&ctx, buf, bytes_read);
+    }
+
+    // Finish even after a failed read, which frees the state
+    hash_final_hex(&ctx, hex);
+    if (bytes_read == -1) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
+
+static const char *HASH_ALGORITHM_NAMES[HASH_ALGORITHM_COUNT] = {
+    [HASH_ALGORITHM_CRC32C] = "CRC32C",
+    [HASH_ALGORITHM_XXH64] = "XXH64",
+    [HASH_ALGORITHM_SHA256] = "SHA-256",
+};
+
+const char* hash_algorithm_name(enum hash_algorithm algorithm) {
+    return HASH_ALGORITHM_NAMES[algorithm];
+}
+
+int hash_algorithm_from_name(const char *name, enum hash_algorithm *result) {
+    for (int i = 0; i < HASH_ALGORITHM_COUNT; i++) {
+        if (strcasecmp(name, HASH_ALGORITHM_NAMES[i]) == 0) {
+            *result = (enum hash_algorithm)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void bytes_to_hex(const uint8_t *bytes, size_t length, char *hex) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < length; i++) {
+        hex[2 * i] = digits[bytes[i] >> 4];
+        hex[2 * i + 1] = digits[bytes[i] & 0xf];
+    }
+    hex[2 * length] = '\0';
+}
+
+/**
+ * @brief Value of a hexadecimal digit, or -1 if it is not one
+ */
+static int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int hex_to_bytes(const char *hex, uint8_t *bytes, size_t length) {
+    if (strlen(hex) != 2 * length) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        int high = hex_digit_value(hex[2 * i]);
+        int low = hex_digit_value(hex[2 * i + 1]);
+        if (high == -1 || low == -1) {
+            return -1;
+        }
+        bytes[i] = (uint8_t)((high << 4) | low);
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE (32)
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+// Largest digest of any supported algorithm
+#define HASH_DIGEST_MAX (SHA256_DIGEST_SIZE)
+#define HASH_HEX_MAX (2 * HASH_DIGEST_MAX + 1)
+
+/**
+ * @brief Hash algorithms supported by the HASH command
+ */
+enum hash_algorithm {
+    HASH_ALGORITHM_CRC32C,
+    HASH_ALGORITHM_XXH64,
+    HASH_ALGORITHM_SHA256,
+    HASH_ALGORITHM_COUNT
+};
+
+/**
+ * @brief State of an incremental XXH64 computation
+ */
+struct xxh64_ctx {
+    uint64_t accumulators[4];   // The four lanes
+    uint64_t length;            // Number of bytes hashed so far
+    uint8_t buffer[32];         // Bytes not yet hashed because they do not form a full stripe
+    size_t buffer_length;
+};
+
+/**
+ * @brief State of an incremental SHA-256 computation, which libcrypto does with the
+ * SHA extensions or AVX2 where the CPU has them
+ */
+struct sha256_ctx {
+    struct evp_md_ctx_st *md_ctx;   // The libcrypto digest context (EVP_MD_CTX), until sha256_final()
+};
+
+/**
+ * @brief Start a SHA-256 computation. It must be finished with sha256_final(),
+ * which frees its state (exits the process if libcrypto fails).
+ * 
+ * @param ctx 
+ */
+void sha256_init(struct sha256_ctx *ctx);
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t length);
+
+void sha256_final(struct sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * @brief Compute the SHA-256 digest of a whole file
+ * 
+ * @param path 
+ * @param digest 
+ * @return 0 on success, -1 if the file could not be read
+ */
+int sha256_file(const char *path, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * @brief Update a CRC32C (Castagnoli) checksum with more data. Start with a crc of 0;
+ * the value returned after the last update is the checksum. Uses the SSE 4.2 crc32
+ * instruction when the CPU supports it.
+ * 
+ * @param crc The checksum of the data so far
+ * @param data 
+ * @param length 
+ * @return The checksum including the new data
+ */
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length);
+
+void xxh64_init(struct xxh64_ctx *ctx);
+
+void xxh64_update(struct xxh64_ctx *ctx, const void *data, size_t length);
+
+uint64_t xxh64_final(struct xxh64_ctx *ctx);
+
+/**
+ * @brief State of an incremental computation with any supported algorithm
+ */
+struct hash_ctx {
+    enum hash_algorithm algorithm;
+    union {
+        uint32_t crc32c;
+        struct xxh64_ctx xxh64;
+        struct sha256_ctx sha256;
+    } state;
+};
+
+void hash_init(struct hash_ctx *ctx, enum hash_algorithm algorithm);
+
+void hash_update(struct hash_ctx *ctx, const void *data, size_t length);
+
+/**
+ * @brief Finish the computation and write the digest as a hexadecimal string
+ * (big-endian for the checksums, so that it reads like the number). Every computation
+ * must be finished, as SHA-256 holds state outside the context.
+ * 
+ * @param ctx 
+ * @param hex Buffer of at least HASH_HEX_MAX bytes
+ */
+void hash_final_hex(struct hash_ctx *ctx, char *hex);
+
+/**
+ * @brief Hash the rest of an open file
+ * 
+ * @param fd 
+ * @param algorithm 
+ * @param hex Buffer of at least HASH_HEX_MAX bytes for the digest
+ * @return 0 on success, -1 if the file could not be read
+ */
+int hash_file_fd(int fd, enum hash_algorithm algorithm, char *hex);
+
+/**
+ * @brief Name of the algorithm as used in the HASH command (e.g. "SHA-256")
+ */
+const char* hash_algorithm_name(enum hash_algorithm algorithm);
+
+/**
+ * @brief Find the algorithm with the given name, ignoring case
+ * 
+ * @param name 
+ * @param result 
+ * @return 0 on success, -1 if no algorithm has that name
+ */
+int hash_algorithm_from_name(const char *name, enum hash_algorithm *result);
+
+/**
+ * @brief Write the bytes as a null-terminated lowercase hexadecimal string
+ * 
+ * @param bytes 
+ * @param length 
+ * @param hex Buffer of at least 2 * length + 1 bytes
+ */
+void bytes_to_hex(const uint8_t *bytes, size_t length, char *hex);
+
+/**
+ * @brief Parse a hexadecimal string of exactly 2 * length digits
+ * 
+ * @param hex 
+ * @param bytes 
+ * @param length 
+ * @return 0 on success, -1 if the string is not valid
+ */
+int hex_to_bytes(const char *hex, uint8_t *bytes, size_t length);
+
+#endif
@@ -0,0 +1,248 @@
+#include "hot_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/**
+ * @brief Get the bucket heads, located right after the cache header
+ */
+static int* get_buckets(struct hot_cache *cache) {
+    return (int *)(cache + 1);
+}
+
+static struct hot_cache_entry* get_entries(struct hot_cache *cache) {
+    return (struct hot_cache_entry *)(get_buckets(cache) + cache->bucket_count);
+}
+
+static char* get_slot_data(struct hot_cache *cache, size_t slot) {
+    return (char *)(get_entries(cache) + cache->slot_count) + slot * HOT_CACHE_MAX_FILE_SIZE;
+}
+
+struct hot_cache* hot_cache_create() {
+    size_t slot_count = HOT_CACHE_MEMORY_CAP / HOT_CACHE_MAX_FILE_SIZE;
+    size_t bucket_count = slot_count * 2;
+    size_t size = sizeof(struct hot_cache)
+        + bucket_count * sizeof(int)
+        + slot_count * sizeof(struct hot_cache_entry)
+        + slot_count * HOT_CACHE_MAX_FILE_SIZE;
+
+    // Anonymous shared memory is inherited by forked processes;
+    // pages are only backed by memory once files are cached in them
+    struct hot_cache *cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    // The lock must work across processes, and survive a process dying while holding it
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&(cache->lock), &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    cache->slot_count = slot_count;
+    cache->bucket_count = bucket_count;
+
+    int *buckets = get_buckets(cache);
+    for (size_t i = 0; i < bucket_count; i++) {
+        buckets[i] = -1;
+    }
+
+    return cache;
+}
+
+static void lock_cache(struct hot_cache *cache) {
+    if (pthread_mutex_lock(&(cache->lock)) == EOWNERDEAD) {
+        // A process died while holding the lock. Entries are only marked used
+        // once they are complete, so the cache is still consistent.
+        pthread_mutex_consistent(&(cache->lock));
+    }
+}
+
+static void unlock_cache(struct hot_cache *cache) {
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+void hot_cache_make_key(struct hot_cache_key *key, const struct stat *stat_result) {
+    memset(key, 0, sizeof(*key));
+    key->dev = stat_result->st_dev;
+    key->ino = stat_result->st_ino;
+    key->mtime = stat_result->st_mtim;
+    key->size = stat_result->st_size;
+}
+
+static int keys_equal(const struct hot_cache_key *a, const struct hot_cache_key *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size
+        && a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+/**
+ * @brief Mix the key fields into a 64-bit hash
+ */
+static uint64_t hash_key(const struct hot_cache_key *key) {
+    uint64_t fields[] = {
+        (uint64_t)key->dev, (uint64_t)key->ino, (uint64_t)key->size,
+        (uint64_t)key->mtime.tv_sec, (uint64_t)key->mtime.tv_nsec,
+    };
+    uint64_t hash = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        hash ^= fields[i];
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+/**
+ * @brief Column of the sketch used for the hash in the given row (double hashing)
+ */
+static size_t sketch_index(uint64_t hash, int row) {
+    uint64_t step = (hash >> 32) | 1;
+    return (size_t)((hash + row * step) & (HOT_CACHE_SKETCH_WIDTH - 1));
+}
+
+/**
+ * @brief Count one access in the sketch, aging all counters periodically
+ */
+static void sketch_increment(struct hot_cache *cache, uint64_t hash) {
+    for (int row = 0; row < HOT_CACHE_SKETCH_DEPTH; row++) {
+        uint8_t *counter = &(cache->sketch[row][sketch_index(hash, row)]);
+        if (*counter < UINT8_MAX) {
+            (*counter)++;
+        }
+    }
+
+    if (++cache->accesses >= HOT_CACHE_AGING_FACTOR * cache->slot_count) {
+        for (int row = 0; row < HOT_CACHE_SKETCH_DEPTH; row++) {
+            for (size_t i = 0; i < HOT_CACHE_SKETCH_WIDTH; i++) {
+                cache->sketch[row][i] >>= 1;
+            }
+        }
+        cache->accesses = 0;
+    }
+}
+
+/**
+ * @brief Estimated recent access count (the minimum over all rows)
+ */
+static unsigned int sketch_estimate(struct hot_cache *cache, uint64_t hash) {
+    unsigned int estimate = UINT8_MAX;
+    for (int row = 0; row < HOT_CACHE_SKETCH_DEPTH; row++) {
+        unsigned int counter = cache->sketch[row][sketch_index(hash, row)];
+        if (counter < estimate) {
+            estimate = counter;
+        }
+    }
+    return estimate;
+}
+
+/**
+ * @brief Find the slot holding the key
+ * 
+ * @return The slot index, or -1 if not cached
+ */
+static int find_slot(struct hot_cache *cache, const struct hot_cache_key *key, uint64_t hash) {
+    struct hot_cache_entry *entries = get_entries(cache);
+    for (int slot = get_buckets(cache)[hash % cache->bucket_count]; slot != -1; slot = entries[slot].next) {
+        if (entries[slot].hash == hash && keys_equal(&(entries[slot].key), key)) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Remove the entry in the slot from its bucket and mark the slot free
+ */
+static void remove_slot(struct hot_cache *cache, int slot) {
+    struct hot_cache_entry *entries = get_entries(cache);
+    int *link = &(get_buckets(cache)[entries[slot].hash % cache->bucket_count]);
+    while (*link != slot) {
+        link = &(entries[*link].next);
+    }
+    *link = entries[slot].next;
+    entries[slot].used = 0;
+}
+
+int hot_cache_lookup(struct hot_cache *cache, const struct hot_cache_key *key, char *buf) {
+    uint64_t hash = hash_key(key);
+
+    lock_cache(cache);
+    sketch_increment(cache, hash);
+
+    int slot = find_slot(cache, key, hash);
+    if (slot != -1) {
+        // Copy out under the lock, so the slot cannot be reused while copying;
+        // the caller sends the data to the client after the lock is released
+        get_entries(cache)[slot].referenced = 1;
+        memcpy(buf, get_slot_data(cache, slot), key->size);
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+
+    unlock_cache(cache);
+    return slot != -1;
+}
+
+void hot_cache_admit(struct hot_cache *cache, const struct hot_cache_key *key, const char *data) {
+    if (key->size < 0 || key->size > HOT_CACHE_MAX_FILE_SIZE) {
+        return;
+    }
+
+    uint64_t hash = hash_key(key);
+    struct hot_cache_entry *entries = get_entries(cache);
+
+    lock_cache(cache);
+
+    // Another process may have cached the file in the meantime
+    if (find_slot(cache, key, hash) != -1) {
+        unlock_cache(cache);
+        return;
+    }
+
+    // Run the clock hand to find a free slot, or a victim that was not hit recently.
+    // This terminates within two rounds since it clears the referenced flags it passes.
+    int slot = -1;
+    for (size_t steps = 0; steps < 2 * cache->slot_count; steps++) {
+        size_t candidate = cache->clock_hand;
+        cache->clock_hand = (cache->clock_hand + 1) % cache->slot_count;
+
+        if (!entries[candidate].used) {
+            slot = (int)candidate;
+            break;
+        } else if (entries[candidate].referenced) {
+            entries[candidate].referenced = 0;
+        } else {
+            // TinyLFU admission: only replace the victim if the new file is more popular
+            if (sketch_estimate(cache, hash) <= sketch_estimate(cache, entries[candidate].hash)) {
+                unlock_cache(cache);
+                return;
+            }
+            remove_slot(cache, (int)candidate);
+            slot = (int)candidate;
+            break;
+        }
+    }
+    if (slot == -1) {
+        unlock_cache(cache);
+        return;
+    }
+
+    // Fill the slot, then make it visible
+    memcpy(get_slot_data(cache, slot), data, key->size);
+    entries[slot].key = *key;
+    entries[slot].hash = hash;
+    entries[slot].referenced = 0;
+    int *bucket = &(get_buckets(cache)[hash % cache->bucket_count]);
+    entries[slot].next = *bucket;
+    *bucket = slot;
+    entries[slot].used = 1;
+
+    unlock_cache(cache);
+}
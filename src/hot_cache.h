@@ -0,0 +1,100 @@
+#ifndef HOT_CACHE_H_
+#define HOT_CACHE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Total memory used for cached file contents, shared by all reactors
+#define HOT_CACHE_MEMORY_CAP (64 * 1024 * 1024)
+// Only files up to this size are cached; every cache slot has this size
+#define HOT_CACHE_MAX_FILE_SIZE (16 * 1024)
+// Width of each row of the frequency sketch (a power of two), and number of rows
+#define HOT_CACHE_SKETCH_WIDTH (32 * 1024)
+#define HOT_CACHE_SKETCH_DEPTH (4)
+// After this many recorded accesses per slot, all frequencies are halved so that
+// files that used to be hot can be replaced by files that are hot now
+#define HOT_CACHE_AGING_FACTOR (10)
+
+/**
+ * @brief Identity of a version of a file. If the file is modified, its mtime or
+ * size changes, and the old cached contents are simply never looked up again.
+ */
+struct hot_cache_key {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+};
+
+/**
+ * @brief Metadata of one cache slot
+ */
+struct hot_cache_entry {
+    struct hot_cache_key key;
+    uint64_t hash;          // Hash of the key
+    int next;               // Index of the next entry in the same bucket, or -1
+    int used;               // Whether the slot holds a file
+    int referenced;         // Set on every hit, cleared by the eviction clock hand
+};
+
+/**
+ * @brief Cache of the contents of small, frequently retrieved files. It lives in
+ * shared memory that is mapped before the reactors are forked, so all reactors and
+ * their transfer processes share it. New files are only admitted if they are
+ * accessed more often than the file they would evict (TinyLFU), estimated with a
+ * count-min sketch of recent accesses.
+ */
+struct hot_cache {
+    pthread_mutex_t lock;   // Process-shared lock protecting everything below
+    size_t slot_count;      // Number of slots of HOT_CACHE_MAX_FILE_SIZE bytes
+    size_t bucket_count;    // Number of hash buckets
+    size_t clock_hand;      // Next slot to consider for eviction
+    uint64_t accesses;      // Accesses recorded since the sketch was last aged
+    uint64_t hits;          // Statistics
+    uint64_t misses;
+    uint8_t sketch[HOT_CACHE_SKETCH_DEPTH][HOT_CACHE_SKETCH_WIDTH];
+    // Followed in the same mapping by:
+    // int buckets[bucket_count];
+    // struct hot_cache_entry entries[slot_count];
+    // char data[slot_count][HOT_CACHE_MAX_FILE_SIZE];
+};
+
+/**
+ * @brief Create the cache in shared anonymous memory. Must be called before forking
+ * the processes that share it.
+ * 
+ * @return The cache (exits the process on failure)
+ */
+struct hot_cache* hot_cache_create();
+
+/**
+ * @brief Fill the key from the result of fstat()
+ * 
+ * @param key 
+ * @param stat_result 
+ */
+void hot_cache_make_key(struct hot_cache_key *key, const struct stat *stat_result);
+
+/**
+ * @brief Record an access to the file and copy its contents into buf if it is cached.
+ * 
+ * @param cache 
+ * @param key 
+ * @param buf Buffer of at least HOT_CACHE_MAX_FILE_SIZE bytes
+ * @return 1 if the file was cached and copied into buf, 0 otherwise
+ */
+int hot_cache_lookup(struct hot_cache *cache, const struct hot_cache_key *key, char *buf);
+
+/**
+ * @brief Offer the contents of a file that missed the cache. It is stored only if
+ * there is a free slot or if it is accessed more often than the eviction victim.
+ * 
+ * @param cache 
+ * @param key 
+ * @param data The whole contents of the file, key->size bytes
+ */
+void hot_cache_admit(struct hot_cache *cache, const struct hot_cache_key *key, const char *data);
+
+#endif
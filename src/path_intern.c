@@ -0,0 +1,68 @@
+#include "path_intern.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct interned_path *buckets[PATH_INTERN_BUCKETS];
+
+/**
+ * @brief FNV-1a hash of a string
+ */
+static unsigned int hash_path(const char *path, size_t length) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+struct interned_path* path_intern(const char *path) {
+    size_t length = strlen(path);
+    unsigned int hash = hash_path(path, length);
+    struct interned_path **bucket = &buckets[hash % PATH_INTERN_BUCKETS];
+
+    // Look for an existing copy
+    for (struct interned_path *node = *bucket; node != NULL; node = node->next) {
+        if (node->hash == hash && node->length == length && memcmp(node->path, path, length) == 0) {
+            node->refcount++;
+            return node;
+        }
+    }
+
+    // Create a new copy and make it the head of the bucket
+    struct interned_path *interned = malloc(sizeof(struct interned_path) + length + 1);
+    if (interned == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    interned->refcount = 1;
+    interned->hash = hash;
+    interned->length = length;
+    memcpy(interned->path, path, length + 1);
+
+    interned->next = *bucket;
+    *bucket = interned;
+
+    return interned;
+}
+
+struct interned_path* path_retain(struct interned_path *interned) {
+    interned->refcount++;
+    return interned;
+}
+
+void path_release(struct interned_path *interned) {
+    if (--interned->refcount > 0) {
+        return;
+    }
+
+    // Unlink from its bucket, then free
+    struct interned_path **link = &buckets[interned->hash % PATH_INTERN_BUCKETS];
+    while (*link != interned) {
+        link = &(*link)->next;
+    }
+    *link = interned->next;
+    free(interned);
+}
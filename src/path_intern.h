@@ -0,0 +1,43 @@
+#ifndef PATH_INTERN_H_
+#define PATH_INTERN_H_
+
+// Number of buckets in the table of interned paths
+#define PATH_INTERN_BUCKETS (4096)
+
+/**
+ * @brief A path string shared by everyone who interned the same path.
+ * Sessions that are in the same directory point to the same structure.
+ */
+struct interned_path {
+    struct interned_path *next; // The next path in the same bucket
+    unsigned int refcount;      // How many holders the path has
+    unsigned int hash;          // Hash of the path, to speed up lookups
+    unsigned int length;        // Length of the path (without the null terminator)
+    char path[];                // The null-terminated path
+};
+
+/**
+ * @brief Get the shared copy of the path, creating it if needed. The caller
+ * holds a reference that must be given back with path_release.
+ * 
+ * @param path 
+ * @return The interned path
+ */
+struct interned_path* path_intern(const char *path);
+
+/**
+ * @brief Take another reference to an interned path
+ * 
+ * @param interned 
+ * @return The same interned path
+ */
+struct interned_path* path_retain(struct interned_path *interned);
+
+/**
+ * @brief Give back a reference to an interned path. It is freed once no one holds it.
+ * 
+ * @param interned 
+ */
+void path_release(struct interned_path *interned);
+
+#endif
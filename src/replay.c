@@ -0,0 +1,612 @@
+#include "replay.h"
+#include "common.h"
+#include "tls.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+/**
+ * @brief Replay recorded sessions (see SERVER_TRACES_DIRECTORY) against a server and
+ * report the latency of each command, compared with an earlier replay if given
+ */
+int main(int argc, char **argv) {
+    struct replay_options options;
+    int first_trace = parse_replay_options(argc, argv, &options);
+
+    // Load the traces, oldest session first
+    struct trace *traces = malloc(sizeof(struct trace) * (argc - first_trace));
+    if (traces == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int trace_count = 0;
+    for (int i = first_trace; i < argc; i++) {
+        if (trace_load(argv[i], &traces[trace_count]) == 0) {
+            trace_count++;
+        }
+    }
+    if (trace_count == 0) {
+        fprintf(stderr, "No traces to replay\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < trace_count; i++) {
+        struct trace trace = traces[i];
+        int j = i;
+        for (; j > 0 && traces[j - 1].start_us > trace.start_us; j--) {
+            traces[j] = traces[j - 1];
+        }
+        traces[j] = trace;
+    }
+
+    int user_count;
+    struct replay_user *users = load_replay_users(options.users_path, &user_count);
+
+    int verified = tls_create_client_context(options.trusted_certificate_path, inet_ntoa(options.server_addr.sin_addr));
+    if (verified == -1) {
+        fprintf(stderr, "Error: Could not load the trusted certificate %s\n", options.trusted_certificate_path);
+        exit(EXIT_FAILURE);
+    } else if (verified == 0) {
+        printf("Warning: The server certificate will not be verified (-k)\n");
+    }
+
+    struct replay_stats *stats = create_replay_stats();
+    uint64_t started = trace_now_us();
+    int failed_sessions = replay_traces(traces, trace_count, &options, users, user_count, stats);
+    uint64_t elapsed_us = trace_now_us() - started;
+
+    static struct replay_summary summaries[REPLAY_MAX_VERBS];
+    static struct replay_summary baseline[REPLAY_MAX_VERBS];
+    int count = summarize_replay_stats(stats, summaries);
+    int baseline_count = 0;
+    if (options.baseline_path != NULL) {
+        baseline_count = load_replay_report(options.baseline_path, baseline);
+        if (baseline_count == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("Replayed %d sessions in %.2f s\n", trace_count, elapsed_us / 1e6);
+    print_replay_report(summaries, count, baseline, baseline_count, stats->skipped, failed_sessions);
+    if (options.report_path != NULL && write_replay_report(options.report_path, summaries, count) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < trace_count; i++) {
+        trace_free(&traces[i]);
+    }
+    free(traces);
+    return failed_sessions == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int parse_replay_options(int argc, char **argv, struct replay_options *options) {
+    memset(&(options->server_addr), 0, sizeof(options->server_addr));
+    options->server_addr.sin_family = AF_INET; // IPV4
+    options->server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    options->server_addr.sin_port = htons(SERVER_CONTROL_PORT);
+    options->speed = 1;
+    options->concurrency = REPLAY_DEFAULT_CONCURRENCY;
+    options->users_path = REPLAY_DEFAULT_USERS_FILE;
+    options->report_path = NULL;
+    options->baseline_path = NULL;
+    options->trusted_certificate_path = NULL;
+    int insecure = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "s:c:u:o:b:h:p:t:k")) != -1) {
+        if (option == 's') {
+            options->speed = atof(optarg);
+        } else if (option == 'c') {
+            options->concurrency = atoi(optarg);
+        } else if (option == 'u') {
+            options->users_path = optarg;
+        } else if (option == 'o') {
+            options->report_path = optarg;
+        } else if (option == 'b') {
+            options->baseline_path = optarg;
+        } else if (option == 'h') {
+            options->server_addr.sin_addr.s_addr = inet_addr(optarg);
+        } else if (option == 'p') {
+            options->server_addr.sin_port = htons(atoi(optarg));
+        } else if (option == 't') {
+            options->trusted_certificate_path = optarg;
+        } else if (option == 'k') {
+            insecure = 1;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind >= argc || options->speed < 0 || options->concurrency < 1
+        || options->concurrency > REPLAY_MAX_CONCURRENCY || options->server_addr.sin_addr.s_addr == INADDR_NONE
+        || (options->trusted_certificate_path == NULL) == !insecure) {
+        fprintf(stderr, "Usage: %s (-t trusted.pem | -k) [-s speed] [-c concurrency] [-u users.txt] [-o report] "
+            "[-b baseline] [-h host] [-p port] trace...\n", argv[0]);
+        fprintf(stderr, "  -t  verify the server against this certificate (from bin: server/cert.pem)\n");
+        fprintf(stderr, "  -k  do not verify the server\n");
+        fprintf(stderr, "  -s  1 replays at the recorded pace, 10 ten times faster, 0 as fast as possible\n");
+        fprintf(stderr, "  -c  most sessions at the same time (1 to %d, default %d)\n",
+            REPLAY_MAX_CONCURRENCY, REPLAY_DEFAULT_CONCURRENCY);
+        fprintf(stderr, "  -o  write the latencies, to be given to a later replay with -b\n");
+        exit(EXIT_FAILURE);
+    }
+    return optind;
+}
+
+struct replay_user* load_replay_users(const char *path, int *count) {
+    *count = 0;
+    struct replay_user *users = NULL;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Warning: Could not read %s; redacted passwords are sent as they are\n", path);
+        return NULL;
+    }
+
+    int capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, file) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *username = strtok(line, " ");
+        char *password = strtok(NULL, " ");
+        if (username == NULL || password == NULL) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            users = realloc(users, capacity * sizeof(struct replay_user));
+            if (users == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        users[*count].username = strdup(username);
+        users[*count].password = strdup(password);
+        if (users[*count].username == NULL || users[*count].password == NULL) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        (*count)++;
+    }
+
+    free(line);
+    fclose(file);
+    return users;
+}
+
+struct replay_stats* create_replay_stats() {
+    struct replay_stats *stats = mmap(NULL, sizeof(struct replay_stats), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&(stats->lock), &attr);
+    pthread_mutexattr_destroy(&attr);
+    return stats;
+}
+
+static void lock_stats(struct replay_stats *stats) {
+    if (pthread_mutex_lock(&(stats->lock)) == EOWNERDEAD) {
+        // A session died while holding the lock; at worst one latency is lost
+        pthread_mutex_consistent(&(stats->lock));
+    }
+}
+
+/**
+ * @brief Sleep until the given monotonic time, in microseconds
+ */
+static void sleep_until(uint64_t time_us) {
+    struct timespec until;
+    until.tv_sec = time_us / 1000000;
+    until.tv_nsec = (time_us % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+}
+
+int replay_traces(struct trace *traces, int trace_count, const struct replay_options *options,
+    const struct replay_user *users, int user_count, struct replay_stats *stats) {
+    int running = 0;
+    int failed_sessions = 0;
+    int status;
+    uint64_t replay_start = trace_now_us();
+
+    for (int i = 0; i < trace_count; i++) {
+        // Wait for a free slot, then for the (scaled) time the session started at
+        while (running >= options->concurrency && wait(&status) > 0) {
+            running--;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                failed_sessions++;
+            }
+        }
+        if (options->speed > 0) {
+            sleep_until(replay_start + (uint64_t)((traces[i].start_us - traces[0].start_us) / options->speed));
+        }
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        } else if (pid == 0) {
+            exit(replay_session(&traces[i], options, users, user_count, stats) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        running++;
+    }
+
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            failed_sessions++;
+        }
+    }
+    return failed_sessions;
+}
+
+int replay_session(const struct trace *trace, const struct replay_options *options,
+    const struct replay_user *users, int user_count, struct replay_stats *stats) {
+    static char buf[COMMAND_STR_MAX];
+    static char verb[8];
+
+    struct replay_session session;
+    session.protect_data = 0;
+    session.username = NULL;
+    session.upload_size = REPLAY_DEFAULT_UPLOAD_SIZE;
+    connect_to_addr(options->server_addr, &(session.control_sockfd), NULL);
+    set_socket_timeout(session.control_sockfd, REPLAY_REPLY_TIMEOUT_MS);
+    if (receive_message(session.control_sockfd, buf, sizeof(buf)) == 0 || !check_first_token(buf, "220")) {
+        fprintf(stderr, "Error: The server did not greet the session\n");
+        close(session.control_sockfd);
+        return -1;
+    }
+
+    int status = 0;
+    uint64_t session_start = trace_now_us();
+    for (size_t i = 0; i < trace->command_count && status == 0; i++) {
+        const char *command = trace->commands[i].command;
+        if (options->speed > 0) {
+            sleep_until(session_start + (uint64_t)(trace->commands[i].offset_us / options->speed));
+        }
+
+        size_t verb_length = strcspn(command, " ");
+        if (verb_length == 0 || verb_length >= sizeof(verb)) {
+            continue;
+        }
+        memcpy(verb, command, verb_length);
+        verb[verb_length] = '\0';
+
+        // The data connections of the recorded client cannot be reused; each command
+        // that transfers data gets a port of this process instead
+        if (strcmp(verb, COMMAND_PORT) == 0) {
+            continue;
+        }
+        // A delta refers to the version of the file the recorded client had
+        if (strcmp(verb, COMMAND_DELTA_STORE) == 0) {
+            lock_stats(stats);
+            stats->skipped++;
+            pthread_mutex_unlock(&(stats->lock));
+            continue;
+        }
+
+        // Log in with the password of the users file in place of the redacted one
+        if (strcmp(verb, COMMAND_PASSWORD) == 0 && session.username != NULL) {
+            for (int j = 0; j < user_count; j++) {
+                if (strcmp(users[j].username, session.username) == 0
+                    && snprintf(buf, sizeof(buf), "%s %s", COMMAND_PASSWORD, users[j].password) < (int)sizeof(buf)) {
+                    command = buf;
+                    break;
+                }
+            }
+        }
+        if (strcmp(verb, COMMAND_USERNAME) == 0 && command[verb_length] == ' ') {
+            session.username = command + verb_length + 1;
+        }
+
+        status = replay_command(&session, command, verb, stats);
+        if (strcmp(verb, COMMAND_QUIT) == 0) {
+            break;
+        }
+    }
+
+    tls_detach(session.control_sockfd);
+    close(session.control_sockfd);
+    return status;
+}
+
+int replay_command(struct replay_session *session, const char *command, const char *verb,
+    struct replay_stats *stats) {
+    static char reply[COMMAND_STR_MAX];
+
+    int is_upload = strcmp(verb, COMMAND_STORE) == 0;
+    int is_transfer = is_upload || strcmp(verb, COMMAND_RETRIEVE) == 0 || strcmp(verb, COMMAND_LIST) == 0
+        || strcmp(verb, COMMAND_MACHINE_LIST) == 0 || strcmp(verb, COMMAND_SIGNATURE) == 0;
+
+    // Without a port, the command is still sent, and the server refuses it as it would have
+    int listen_sockfd = -1;
+    if (is_transfer) {
+        announce_data_port(session, &listen_sockfd);
+    }
+
+    uint64_t sent_us = trace_now_us();
+    send_message(session->control_sockfd, command);
+    if (receive_message(session->control_sockfd, reply, sizeof(reply)) == 0) {
+        fprintf(stderr, "Error: The server closed the session after %s\n", verb);
+        return -1;
+    }
+
+    // A preliminary reply means the data connection is coming; the final reply follows it
+    if (reply[0] == '1' && listen_sockfd != -1) {
+        int transferred = transfer_replay_data(session, listen_sockfd, is_upload);
+        if (receive_message(session->control_sockfd, reply, sizeof(reply)) == 0 || transferred == -1) {
+            fprintf(stderr, "Error: The data transfer of %s failed\n", verb);
+            close(listen_sockfd);
+            return -1;
+        }
+    }
+    int code = atoi(reply);
+    record_latency(stats, verb, trace_now_us() - sent_us, code >= 400);
+    if (listen_sockfd != -1) {
+        close(listen_sockfd);
+    }
+
+    // Keep the session in the state the recorded client had
+    if (strcmp(verb, COMMAND_AUTHENTICATE) == 0 && code == 234
+        && tls_connect(session->control_sockfd, -1) == -1) {
+        fprintf(stderr, "Error: TLS handshake with the server failed\n");
+        return -1;
+    }
+    if (strcmp(verb, COMMAND_PROTECTION_LEVEL) == 0 && code == 200) {
+        session->protect_data = strcmp(command + strlen(verb), " P") == 0;
+    }
+    if (strcmp(verb, COMMAND_ALLOCATE) == 0) {
+        long long size;
+        if (sscanf(command, "%*s %lld", &size) == 1 && size >= 0) {
+            session->upload_size = size;
+        }
+    }
+    if (is_upload) {
+        session->upload_size = REPLAY_DEFAULT_UPLOAD_SIZE;
+    }
+    return 0;
+}
+
+int announce_data_port(struct replay_session *session, int *listen_sockfd) {
+    static char buf[COMMAND_STR_MAX];
+
+    // The server connects to the address this process reaches it from
+    struct sockaddr_in local_addr;
+    socklen_t addr_len = sizeof(local_addr);
+    int port;
+    if (getsockname(session->control_sockfd, (struct sockaddr *) &local_addr, &addr_len) == -1
+        || listen_port(0, listen_sockfd, &port) == -1) {
+        *listen_sockfd = -1;
+        return -1;
+    }
+    set_socket_timeout(*listen_sockfd, REPLAY_REPLY_TIMEOUT_MS);
+
+    // Lay out the address as the client does, which is what the server expects
+    in_addr_t address = local_addr.sin_addr.s_addr;
+    snprintf(buf, sizeof(buf), "%s %u,%u,%u,%u,%d,%d", COMMAND_PORT, (address >> 24) & 0xff, (address >> 16) & 0xff,
+        (address >> 8) & 0xff, address & 0xff, (port >> 8) & 0xff, port & 0xff);
+    send_message(session->control_sockfd, buf);
+    if (receive_message(session->control_sockfd, buf, sizeof(buf)) == 0 || !check_first_token(buf, "200")) {
+        close(*listen_sockfd);
+        *listen_sockfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int transfer_replay_data(struct replay_session *session, int listen_sockfd, int upload) {
+    static char buf[FILE_TRANSFER_BUFFER_SIZE];
+
+    int data_sockfd = accept(listen_sockfd, NULL, NULL);
+    if (data_sockfd == -1) {
+        perror("accept");
+        return -1;
+    }
+    if (session->protect_data && tls_connect(data_sockfd, session->control_sockfd) == -1) {
+        close(data_sockfd);
+        return -1;
+    }
+
+    int status = 0;
+    if (upload) {
+        off_t remaining = session->upload_size;
+        while (remaining > 0 && status == 0) {
+            size_t length = remaining < (off_t)sizeof(buf) ? (size_t)remaining : sizeof(buf);
+            status = send_all(data_sockfd, buf, length);
+            remaining -= length;
+        }
+    } else {
+        ssize_t bytes_received;
+        while ((bytes_received = tls_recv(data_sockfd, buf, sizeof(buf))) > 0);
+        if (bytes_received == -1) {
+            status = -1;
+        }
+    }
+
+    tls_shutdown(data_sockfd);
+    close(data_sockfd);
+    return status;
+}
+
+static int histogram_bucket(uint64_t latency_us) {
+    // Exact below 2^SUB_BITS, then 2^SUB_BITS buckets per power of two
+    if (latency_us < (1u << REPLAY_HISTOGRAM_SUB_BITS)) {
+        return (int)latency_us;
+    }
+    int exponent = 63 - __builtin_clzll(latency_us);
+    int sub = (latency_us >> (exponent - REPLAY_HISTOGRAM_SUB_BITS)) & ((1 << REPLAY_HISTOGRAM_SUB_BITS) - 1);
+    int bucket = ((exponent - REPLAY_HISTOGRAM_SUB_BITS + 1) << REPLAY_HISTOGRAM_SUB_BITS) | sub;
+    return bucket < REPLAY_HISTOGRAM_BUCKETS ? bucket : REPLAY_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * @brief The latency a bucket stands for: the middle of its range
+ */
+static uint64_t bucket_latency(int bucket) {
+    if (bucket < (1 << REPLAY_HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> REPLAY_HISTOGRAM_SUB_BITS) - 1;
+    uint64_t lower = (uint64_t)((1 << REPLAY_HISTOGRAM_SUB_BITS) | (bucket & ((1 << REPLAY_HISTOGRAM_SUB_BITS) - 1)))
+        << shift;
+    return lower + ((1ull << shift) >> 1);
+}
+
+void record_latency(struct replay_stats *stats, const char *verb, uint64_t latency_us, int is_error) {
+    lock_stats(stats);
+    int i = 0;
+    while (i < stats->verb_count && strcmp(stats->verbs[i].verb, verb) != 0) {
+        i++;
+    }
+    if (i == stats->verb_count) {
+        if (i == REPLAY_MAX_VERBS) {
+            pthread_mutex_unlock(&(stats->lock));
+            return;
+        }
+        strcpy(stats->verbs[i].verb, verb);
+        stats->verb_count++;
+    }
+
+    struct replay_verb_stats *verb_stats = &(stats->verbs[i]);
+    verb_stats->count++;
+    verb_stats->errors += is_error ? 1 : 0;
+    verb_stats->total_us += latency_us;
+    verb_stats->histogram[histogram_bucket(latency_us)]++;
+    pthread_mutex_unlock(&(stats->lock));
+}
+
+static uint64_t percentile(const struct replay_verb_stats *verb_stats, double fraction) {
+    uint64_t target = (uint64_t)(verb_stats->count * fraction);
+    if (target < 1) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < REPLAY_HISTOGRAM_BUCKETS; bucket++) {
+        seen += verb_stats->histogram[bucket];
+        if (seen >= target) {
+            return bucket_latency(bucket);
+        }
+    }
+    return bucket_latency(REPLAY_HISTOGRAM_BUCKETS - 1);
+}
+
+int summarize_replay_stats(struct replay_stats *stats, struct replay_summary *summaries) {
+    int count = 0;
+    for (int i = 0; i < stats->verb_count; i++) {
+        const struct replay_verb_stats *verb_stats = &(stats->verbs[i]);
+        if (verb_stats->count == 0) {
+            continue;
+        }
+        struct replay_summary *summary = &summaries[count++];
+        strcpy(summary->verb, verb_stats->verb);
+        summary->count = verb_stats->count;
+        summary->errors = verb_stats->errors;
+        summary->mean_us = verb_stats->total_us / verb_stats->count;
+        summary->p50_us = percentile(verb_stats, 0.5);
+        summary->p99_us = percentile(verb_stats, 0.99);
+    }
+    return count;
+}
+
+int load_replay_report(const char *path, struct replay_summary *summaries) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    int count = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, file) != -1 && count < REPLAY_MAX_VERBS) {
+        struct replay_summary *summary = &summaries[count];
+        unsigned long long fields[5];
+        if (line[0] == '#' || sscanf(line, "%7s %llu %llu %llu %llu %llu", summary->verb, &fields[0], &fields[1],
+            &fields[2], &fields[3], &fields[4]) != 6) {
+            continue;
+        }
+        summary->count = fields[0];
+        summary->errors = fields[1];
+        summary->mean_us = fields[2];
+        summary->p50_us = fields[3];
+        summary->p99_us = fields[4];
+        count++;
+    }
+
+    free(line);
+    fclose(file);
+    return count;
+}
+
+int write_replay_report(const char *path, const struct replay_summary *summaries, int count) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fprintf(file, "# verb count errors mean_us p50_us p99_us\n");
+    for (int i = 0; i < count; i++) {
+        const struct replay_summary *summary = &summaries[i];
+        fprintf(file, "%s %llu %llu %llu %llu %llu\n", summary->verb, (unsigned long long)summary->count,
+            (unsigned long long)summary->errors, (unsigned long long)summary->mean_us,
+            (unsigned long long)summary->p50_us, (unsigned long long)summary->p99_us);
+    }
+    if (fclose(file) == EOF) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static void print_change(uint64_t value, uint64_t baseline) {
+    if (baseline == 0) {
+        printf(" %8s", "-");
+    } else {
+        printf(" %+7.1f%%", 100.0 * ((double)value - (double)baseline) / (double)baseline);
+    }
+}
+
+void print_replay_report(const struct replay_summary *summaries, int count,
+    const struct replay_summary *baseline, int baseline_count, uint64_t skipped, int failed_sessions) {
+    if (failed_sessions > 0 || skipped > 0) {
+        printf("%d sessions failed, %llu commands could not be replayed\n", failed_sessions,
+            (unsigned long long)skipped);
+    }
+
+    printf("%-6s %8s %8s %10s %10s %10s", "verb", "count", "errors", "mean_us", "p50_us", "p99_us");
+    if (baseline_count > 0) {
+        printf(" %8s %8s %8s", "mean", "p50", "p99");
+    }
+    printf("\n");
+
+    for (int i = 0; i < count; i++) {
+        const struct replay_summary *summary = &summaries[i];
+        printf("%-6s %8llu %8llu %10llu %10llu %10llu", summary->verb, (unsigned long long)summary->count,
+            (unsigned long long)summary->errors, (unsigned long long)summary->mean_us,
+            (unsigned long long)summary->p50_us, (unsigned long long)summary->p99_us);
+
+        // Change from the baseline, for the commands it has
+        for (int j = 0; j < baseline_count; j++) {
+            if (strcmp(baseline[j].verb, summary->verb) == 0) {
+                print_change(summary->mean_us, baseline[j].mean_us);
+                print_change(summary->p50_us, baseline[j].p50_us);
+                print_change(summary->p99_us, baseline[j].p99_us);
+                break;
+            }
+        }
+        printf("\n");
+    }
+}
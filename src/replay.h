@@ -0,0 +1,208 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "trace.h"
+
+// Passwords of the users in the traces, which are redacted in them
+#define REPLAY_DEFAULT_USERS_FILE "server/users.txt"
+
+// Number of sessions replayed at the same time, unless changed with -c
+#define REPLAY_DEFAULT_CONCURRENCY (16)
+#define REPLAY_MAX_CONCURRENCY (1024)
+// Bytes sent by STOR when the trace did not announce the size with ALLO
+#define REPLAY_DEFAULT_UPLOAD_SIZE (64 * 1024)
+// A session whose server does not answer for this long is given up
+#define REPLAY_REPLY_TIMEOUT_MS (60 * 1000)
+
+// Number of different commands whose latencies are counted
+#define REPLAY_MAX_VERBS (64)
+// Latencies are counted in a log-linear histogram: 8 buckets per power of two,
+// so every percentile is within 12.5% of the exact value
+#define REPLAY_HISTOGRAM_SUB_BITS (3)
+#define REPLAY_HISTOGRAM_BUCKETS (320)
+
+/**
+ * @brief Latencies of one command, over all sessions
+ */
+struct replay_verb_stats {
+    char verb[8];           // The command, such as "STOR"
+    uint64_t count;
+    uint64_t errors;        // Replies with a 4xx or 5xx code
+    uint64_t total_us;
+    uint64_t histogram[REPLAY_HISTOGRAM_BUCKETS]; // Counts of latencies, in microseconds
+};
+
+/**
+ * @brief Results of a replay, shared by the processes replaying the sessions
+ */
+struct replay_stats {
+    pthread_mutex_t lock;   // Process-shared, robust lock protecting everything below
+    int verb_count;
+    struct replay_verb_stats verbs[REPLAY_MAX_VERBS];
+    uint64_t skipped;       // Commands that cannot be replayed (XDLT needs the original data)
+};
+
+/**
+ * @brief Summary of the latencies of one command, as reported and read back as a baseline
+ */
+struct replay_summary {
+    char verb[8];
+    uint64_t count;
+    uint64_t errors;
+    uint64_t mean_us;
+    uint64_t p50_us;
+    uint64_t p99_us;
+};
+
+/**
+ * @brief Settings of a replay, from the command line
+ */
+struct replay_options {
+    struct sockaddr_in server_addr;
+    double speed;           // 1 replays at the recorded pace, 10 ten times faster, 0 as fast as possible
+    int concurrency;        // Most sessions replayed at the same time
+    const char *users_path;
+    const char *report_path;    // Where to write the summary, or NULL
+    const char *baseline_path;  // Summary of an earlier replay to compare with, or NULL
+    const char *trusted_certificate_path; // Certificate to verify the server against, or NULL with -k
+};
+
+/**
+ * @brief A user and password, to log in with in place of the redacted ones
+ */
+struct replay_user {
+    char *username;
+    char *password;
+};
+
+/**
+ * @brief State of one replayed session
+ */
+struct replay_session {
+    int control_sockfd;
+    int protect_data;       // Whether the session asked for secured data connections (PROT P)
+    const char *username;   // The user of the last USER command, or NULL
+    off_t upload_size;      // Bytes the next STOR sends
+};
+
+/**
+ * @brief Parse the command line. Usage:
+ * replay.out (-t trusted.pem | -k) [-s speed] [-c concurrency] [-u users.txt] [-o report]
+ *            [-b baseline] [-h host] [-p port] trace...
+ *
+ * @return The index of the first trace in argv (exits the process on invalid arguments)
+ */
+int parse_replay_options(int argc, char **argv, struct replay_options *options);
+
+/**
+ * @brief Load the users file, in the format of the server's users.txt
+ *
+ * @param path
+ * @param count Location to store the number of users
+ * @return The users (an empty list if the file cannot be read)
+ */
+struct replay_user* load_replay_users(const char *path, int *count);
+
+/**
+ * @brief Create the results in shared anonymous memory, before forking the sessions
+ */
+struct replay_stats* create_replay_stats();
+
+/**
+ * @brief Replay the traces, starting each session at its recorded time (scaled by the
+ * speed) or as soon as fewer than the maximum number of sessions are running
+ *
+ * @param traces The traces, sorted by start time
+ * @param trace_count
+ * @param options
+ * @param users
+ * @param user_count
+ * @param stats
+ * @return Number of sessions that failed
+ */
+int replay_traces(struct trace *traces, int trace_count, const struct replay_options *options,
+    const struct replay_user *users, int user_count, struct replay_stats *stats);
+
+/**
+ * @brief Replay one session, in its own process, adding the latency of each command to the results
+ *
+ * @return 0 on success, -1 if the session failed
+ */
+int replay_session(const struct trace *trace, const struct replay_options *options,
+    const struct replay_user *users, int user_count, struct replay_stats *stats);
+
+/**
+ * @brief Replay one command and measure the time until its final reply, including
+ * the data transfer it asks for
+ *
+ * @param session
+ * @param command The command to send
+ * @param verb The command name, for the results
+ * @param stats
+ * @return 0 on success, -1 if the session cannot go on
+ */
+int replay_command(struct replay_session *session, const char *command, const char *verb,
+    struct replay_stats *stats);
+
+/**
+ * @brief Open a data connection as the client does: listen, send PORT, and accept once
+ * the command is sent
+ *
+ * @param session
+ * @param listen_sockfd Location to store the listening socket
+ * @return 0 on success, -1 if the server refused PORT
+ */
+int announce_data_port(struct replay_session *session, int *listen_sockfd);
+
+/**
+ * @brief Accept the data connection of a command, send or receive its data, and close it
+ *
+ * @param session
+ * @param listen_sockfd
+ * @param upload Whether to send data (STOR) rather than receive it
+ * @return 0 on success, -1 on failure
+ */
+int transfer_replay_data(struct replay_session *session, int listen_sockfd, int upload);
+
+/**
+ * @brief Add a latency to the results
+ */
+void record_latency(struct replay_stats *stats, const char *verb, uint64_t latency_us, int is_error);
+
+/**
+ * @brief Summarize the latencies of every command
+ *
+ * @param stats
+ * @param summaries At least REPLAY_MAX_VERBS summaries
+ * @return Number of summaries
+ */
+int summarize_replay_stats(struct replay_stats *stats, struct replay_summary *summaries);
+
+/**
+ * @brief Load a report written by write_replay_report
+ *
+ * @param path
+ * @param summaries At least REPLAY_MAX_VERBS summaries
+ * @return Number of summaries, or -1 if the file cannot be read
+ */
+int load_replay_report(const char *path, struct replay_summary *summaries);
+
+/**
+ * @brief Write the summaries, to be used as the baseline of a later replay
+ *
+ * @return 0 on success, -1 on failure
+ */
+int write_replay_report(const char *path, const struct replay_summary *summaries, int count);
+
+/**
+ * @brief Print the summaries, with the change from the baseline if there is one
+ */
+void print_replay_report(const struct replay_summary *summaries, int count,
+    const struct replay_summary *baseline, int baseline_count, uint64_t skipped, int failed_sessions);
+
+#endif
@@ -0,0 +1,92 @@
+#include "sandbox.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+
+int sandbox_open(int dirfd, const char *path, int flags, mode_t mode) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags;
+    how.mode = (flags & (O_CREAT | O_TMPFILE)) ? mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    // glibc has no wrapper for openat2, so call it directly
+    return (int)syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+/**
+ * @brief Append a component to the normalized path, or pop one for ".."
+ * 
+ * @return 0 on success, -1 on failure
+ */
+static int apply_component(char *result, size_t *length, size_t result_size, const char *component, size_t component_length) {
+    if (component_length == 0 || (component_length == 1 && component[0] == '.')) {
+        // Nothing to do for empty components and "."
+        return 0;
+    }
+
+    if (component_length == 2 && component[0] == '.' && component[1] == '.') {
+        if (*length == 0) {
+            // Would leave the root directory
+            return -1;
+        }
+
+        // Remove the last component
+        char *last_slash = strrchr(result, '/');
+        *length = last_slash == NULL ? 0 : (size_t)(last_slash - result);
+        result[*length] = '\0';
+        return 0;
+    }
+
+    // Append "/component", or just "component" at the root
+    size_t needed = *length + (*length > 0) + component_length + 1;
+    if (needed > result_size) {
+        return -1;
+    }
+    if (*length > 0) {
+        result[(*length)++] = '/';
+    }
+    memcpy(result + *length, component, component_length);
+    *length += component_length;
+    result[*length] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Apply every component of a slash-separated path
+ */
+static int apply_path(char *result, size_t *length, size_t result_size, const char *path) {
+    while (*path != '\0') {
+        size_t component_length = strcspn(path, "/");
+        if (apply_component(result, length, result_size, path, component_length) == -1) {
+            return -1;
+        }
+
+        path += component_length;
+        if (*path == '/') {
+            path++;
+        }
+    }
+    return 0;
+}
+
+int sandbox_normalize_path(const char *current_path, const char *path, char *result, size_t result_size) {
+    if (result_size == 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    size_t length = 0;
+    result[0] = '\0';
+
+    // Relative paths start from the current directory, absolute ones from the root
+    if (path[0] != '/' && apply_path(result, &length, result_size, current_path) == -1) {
+        return -1;
+    }
+
+    return apply_path(result, &length, result_size, path);
+}
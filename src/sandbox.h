@@ -0,0 +1,35 @@
+#ifndef SANDBOX_H_
+#define SANDBOX_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @brief Open a path relative to the directory file descriptor, with the kernel
+ * guaranteeing that resolution never leaves that directory (openat2 with
+ * RESOLVE_BENEATH). Absolute paths, ".." above the directory and symlinks
+ * pointing outside of it all fail with EXDEV.
+ * 
+ * @param dirfd The directory the path must stay beneath
+ * @param path The path relative to dirfd
+ * @param flags Flags as for open()
+ * @param mode Mode as for open(), used when creating files
+ * @return The new file descriptor, or -1 with errno set
+ */
+int sandbox_open(int dirfd, const char *path, int flags, mode_t mode);
+
+/**
+ * @brief Lexically combine the current directory and a path given by a client into
+ * a normalized path relative to the client's root directory. "." and empty components
+ * are dropped and ".." removes the previous component. A path starting with '/' is
+ * taken relative to the root directory.
+ * 
+ * @param current_path The current directory, relative to the root ("" for the root)
+ * @param path The path given by the client
+ * @param result Location to store the normalized path ("" for the root)
+ * @param result_size 
+ * @return 0 on success, -1 if the path leaves the root directory or is too long
+ */
+int sandbox_normalize_path(const char *current_path, const char *path, char *result, size_t result_size);
+
+#endif
@@ -1,23 +1,41 @@
 #include "server.h"
 #include "common.h"
+#include "sandbox.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/fs.h>
 #include <netinet/in.h>
+#include <sys/inotify.h>
 #include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
+#include <sys/wait.h>
 
 int main() {
     struct server_state server;
     initialize_server_directories(&server);
-    read_auth_data(&server);
-    initialize_user_storage_directories(&server);
-    listen_port(SERVER_CONTROL_PORT, &(server.control_sockfd), NULL);
-    monitor_control_port(&server);
+    initialize_tls(&server);
+    load_user_database(&server);
+    open_usage_table(&server);
+    sweep_blobs(&server);
+    server.hot_cache = hot_cache_create();
+    server.group_commit = group_commit_create();
+    server.admission = admission_create(get_reactor_count());
+    start_reactors(&server);
 }
 
 void initialize_server_directories(struct server_state *server) {
@@ -37,69 +55,461 @@ void initialize_server_directories(struct server_state *server) {
     strcat(buf, "/users");
     create_directory_if_not_exists(buf);
     strncpy(server->users_storage_path, buf, sizeof(buf));
+
+    // Create the content-addressed index of stored files, next to the users storage directory
+    strcpy(buf, server->base_path);
+    strcat(buf, "/blobs");
+    create_directory_if_not_exists(buf);
+    server->blobs_dirfd = open(buf, O_PATH | O_DIRECTORY);
+    if (server->blobs_dirfd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    // Sessions are recorded only if the traces directory exists
+    strcpy(buf, server->base_path);
+    strcat(buf, "/" SERVER_TRACES_DIRECTORY);
+    server->traces_dirfd = open(buf, O_PATH | O_DIRECTORY);
+
+    // Keep the users storage directory open; user directories are opened relative to it
+    server->users_storage_dirfd = open(server->users_storage_path, O_PATH | O_DIRECTORY);
+    if (server->users_storage_dirfd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+#if SERVER_STORAGE_BACKEND == STORAGE_BACKEND_RAM
+    storage_create_ram(&(server->storage));
+#else
+    storage_create_posix(&(server->storage), server->users_storage_dirfd);
+#endif
+}
+
+void open_usage_table(struct server_state *server) {
+    static char usage_path[PATH_MAX];
+    format_base_file_path(server, "usage.db", usage_path);
+
+    // Files in memory start out empty, so there is nothing to count or keep
+    if (!server->storage.uses_fds) {
+        server->usage = usage_create();
+        return;
+    }
+
+    server->usage = usage_open(usage_path);
+    if (server->usage == NULL) {
+        // First start: count what the users have stored so far, once
+        printf("Counting the disk usage of every user...\n");
+        fflush(stdout);
+        server->usage = usage_build(usage_path, server->users_storage_dirfd, get_reactor_count(),
+            UPLOAD_TEMP_NAME_PREFIX);
+    }
+}
+
+int get_reactor_count() {
+    int count = SERVER_REACTOR_COUNT;
+    if (count <= 0) {
+        // One reactor per online CPU
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (int)cpus : 1;
+    }
+    if (count > SERVER_REACTORS_MAX) {
+        count = SERVER_REACTORS_MAX;
+    }
+    return count;
+}
+
+void start_reactors(struct server_state *server) {
+    static pid_t reactor_pids[SERVER_REACTORS_MAX];
+    static time_t reactor_start_times[SERVER_REACTORS_MAX];
+
+    // Make sure the control port can be bound before starting any reactor,
+    // so that a port conflict is reported once instead of by every reactor
+    int probe_sockfd;
+    if (listen_port_reuseport(SERVER_CONTROL_PORT, &probe_sockfd, NULL) == -1) {
+        fprintf(stderr, "Could not bind to control port %d\n", SERVER_CONTROL_PORT);
+        exit(EXIT_FAILURE);
+    }
+    close(probe_sockfd);
+
+    // The supervisor handles child exits, reload and stop requests in its loop below.
+    // Reactors inherit the blocked mask and make their own signalfd.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    server->signal_fd = signalfd(-1, &signals, 0);
+    if (server->signal_fd == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    server->inotify_fd = watch_user_database(server);
+
+    // Start all reactors
+    int reactor_count = get_reactor_count();
+    for (int i = 0; i < reactor_count; i++) {
+        reactor_pids[i] = spawn_reactor(server, i);
+        reactor_start_times[i] = time(NULL);
+    }
+
+    pid_t builder_pid = -1;     // The process compiling users.txt, if any
+    int rebuild_pending = 0;    // Whether users.txt changed again while it was being compiled
+
+    // Supervise the reactors, restarting any of them that exits
+    while (1) {
+        fd_set ready_fds;
+        FD_ZERO(&ready_fds);
+        FD_SET(server->signal_fd, &ready_fds);
+        int max_fd = server->signal_fd;
+        if (server->inotify_fd != -1) {
+            FD_SET(server->inotify_fd, &ready_fds);
+            if (server->inotify_fd > max_fd) {
+                max_fd = server->inotify_fd;
+            }
+        }
+
+        if (select(max_fd + 1, &ready_fds, NULL, NULL, NULL) == -1) {
+            if (errno == EINTR) continue;
+            perror("select");
+            exit(EXIT_FAILURE);
+        }
+
+        int rebuild = 0;    // Whether users.txt should be compiled
+        int publish = 0;    // Whether users.db was replaced and should be reloaded everywhere
+
+        if (server->inotify_fd != -1 && FD_ISSET(server->inotify_fd, &ready_fds)) {
+            static char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t length = read(server->inotify_fd, events, sizeof(events));
+            for (char *p = events; length > 0 && p < events + length; ) {
+                struct inotify_event *event = (struct inotify_event *)p;
+                if (event->len > 0 && strcmp(event->name, "users.txt") == 0) {
+                    rebuild = 1;
+                } else if (event->len > 0 && strcmp(event->name, "users.db") == 0) {
+                    publish = 1;
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+
+        if (FD_ISSET(server->signal_fd, &ready_fds)) {
+            struct signalfd_siginfo info;
+            if (read(server->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGHUP) {
+                    rebuild = 1;
+                } else if (info.ssi_signo == SIGTERM) {
+                    stop_reactors(reactor_pids, reactor_count);
+                    exit(EXIT_SUCCESS);
+                }
+            }
+
+            // Reap every child that exited (signals of the same kind are merged)
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                if (pid == builder_pid) {
+                    builder_pid = -1;
+                    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                        fprintf(stderr, "Could not compile users.txt, keeping the current user database\n");
+                    } else if (server->inotify_fd == -1) {
+                        // Without inotify, the rename of users.db is not noticed otherwise
+                        publish = 1;
+                    }
+                    if (rebuild_pending) {
+                        rebuild_pending = 0;
+                        rebuild = 1;
+                    }
+                    continue;
+                }
+
+                for (int i = 0; i < reactor_count; i++) {
+                    if (reactor_pids[i] != pid) continue;
+
+                    fprintf(stderr, "Reactor %d (pid %d) exited, restarting it\n", i, (int)pid);
+
+                    // Avoid restarting in a tight loop if the reactor keeps failing right away
+                    if (time(NULL) - reactor_start_times[i] < 1) {
+                        sleep(1);
+                    }
+
+                    reactor_pids[i] = spawn_reactor(server, i);
+                    reactor_start_times[i] = time(NULL);
+                    break;
+                }
+            }
+        }
+
+        // Compile in the background; a change during compilation is compiled afterwards
+        if (rebuild) {
+            if (builder_pid != -1) {
+                rebuild_pending = 1;
+            } else {
+                builder_pid = spawn_user_database_builder(server);
+            }
+        }
+
+        // Switch to the new database here (for reactors started later) and in every reactor
+        if (publish && reload_user_database(server) == 0) {
+            for (int i = 0; i < reactor_count; i++) {
+                kill(reactor_pids[i], SIGHUP);
+            }
+        }
+    }
+}
+
+void stop_reactors(const pid_t *reactor_pids, int reactor_count) {
+    for (int i = 0; i < reactor_count; i++) {
+        kill(reactor_pids[i], SIGTERM);
+    }
+
+    // Wait for the reactors, and for a users.txt compilation that may be running
+    pid_t pid;
+    do {
+        pid = wait(NULL);
+    } while (pid > 0 || errno == EINTR);
+}
+
+pid_t spawn_reactor(struct server_state *server, int reactor_id) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        // This is the reactor process
+        run_reactor(server, reactor_id);
+    }
+
+    return pid;
+}
+
+void run_reactor(struct server_state *server, int reactor_id) {
+    server->reactor_id = reactor_id;
+
+    // Replace the descriptors of the supervisor with a signalfd for reload requests
+    close(server->signal_fd);
+    if (server->inotify_fd != -1) {
+        close(server->inotify_fd);
+        server->inotify_fd = -1;
+    }
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGTERM);
+    server->signal_fd = signalfd(-1, &signals, 0);
+    if (server->signal_fd == -1) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+
+    // Sending to a connection that was shut down or reset fails instead of ending the reactor
+    signal(SIGPIPE, SIG_IGN);
+
+    slab_init(&(server->client_allocator), sizeof(struct server_client_state), SERVER_CLIENTS_PER_SLAB);
+
+    // Nothing is running or queued yet; forget what a previous instance of this reactor held
+    admission_reset(server->admission, reactor_id);
+    server->transfer_count = 0;
+    server->transfer_queue_length = 0;
+    timer_init(&(server->transfer_queue_timer), handle_transfer_queue_timeout, server);
+    server->transfer_queue = malloc(sizeof(struct queued_transfer) * SERVER_TRANSFER_QUEUE_LENGTH);
+    if (server->transfer_queue == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    stat_cache_init(&(server->stat_cache));
+
+    // Every reactor has its own listener on the same port;
+    // the kernel balances new connections between them
+    if (listen_port_reuseport(SERVER_CONTROL_PORT, &(server->control_sockfd), NULL) == -1) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    monitor_control_port(server);
+    exit(EXIT_SUCCESS);
 }
 
 void monitor_control_port(struct server_state *server) {
     // No clients connected initially
     server->clients = NULL;
+    server->client_count = 0;
 
     // Initialize listening sockets
     // Initially, only control socket is present
     // Add it to the set of sockets to monitor
     FD_ZERO(&(server->listen_sockfds));
     FD_SET(server->control_sockfd, &(server->listen_sockfds));
+    FD_SET(server->signal_fd, &(server->listen_sockfds));
+
+    // Data connections still being established are watched for writability
+    FD_ZERO(&(server->connect_sockfds));
 
-    int max_sockfd_so_far = server->control_sockfd;
+    server->max_sockfd = server->control_sockfd > server->signal_fd ? server->control_sockfd : server->signal_fd;
+
+    // Changes to the directories of the stat cache
+    if (server->stat_cache.inotify_fd != -1) {
+        FD_SET(server->stat_cache.inotify_fd, &(server->listen_sockfds));
+        if (server->stat_cache.inotify_fd > server->max_sockfd) {
+            server->max_sockfd = server->stat_cache.inotify_fd;
+        }
+    }
+
+    timer_wheel_init(&(server->timers), timer_now_ms());
 
     while (1) {
         fd_set ready_sockfds = server->listen_sockfds;
+        fd_set connected_sockfds = server->connect_sockfds;
 
-        // Find out which sockets have incoming data
-        if (select(max_sockfd_so_far + 1, &ready_sockfds, NULL, NULL, NULL) == -1) {
+        // Wait no longer than until the next timer is due
+        struct timeval timeout;
+        int64_t timeout_ms = timer_wheel_next_timeout_ms(&(server->timers), timer_now_ms());
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+
+        // Find out which sockets have incoming data or finished connecting
+        if (select(server->max_sockfd + 1, &ready_sockfds, &connected_sockfds, NULL, timeout_ms == -1 ? NULL : &timeout) == -1) {
+            if (errno == EINTR) continue;
             perror("select");
             exit(EXIT_FAILURE);
         }
 
-        for (int sockfd = 0; sockfd <= max_sockfd_so_far; sockfd++) {
+        // Apply changes to cached directories before any command can look at them.
+        // A transfer that changed a file finished it before its reply reached the client,
+        // so the change is known by the time the client asks about the file.
+        if (server->stat_cache.inotify_fd != -1 && FD_ISSET(server->stat_cache.inotify_fd, &ready_sockfds)) {
+            stat_cache_handle_events(&(server->stat_cache));
+            FD_CLR(server->stat_cache.inotify_fd, &ready_sockfds);
+        }
+
+        for (int sockfd = 0; sockfd <= server->max_sockfd; sockfd++) {
+            if (FD_ISSET(sockfd, &connected_sockfds)) {
+                // A data connection was established or failed
+                // (it may have been given up on already while handling an earlier socket)
+                struct transfer *transfer = find_transfer_by_data_sockfd(server, sockfd);
+                if (transfer != NULL && transfer->pid == 0) {
+                    handle_data_connection_ready(server, transfer);
+                }
+                continue;
+            }
+
             // Ensure this socket has incoming data
             if (!FD_ISSET(sockfd, &ready_sockfds)) continue;
 
             if (sockfd == server->control_sockfd) {
                 // A new client wants to connect
 
-                // Accept connection and add its socket to the set
-                int client_sockfd = accept(server->control_sockfd, 0, 0);
+                // Accept connection
+                struct sockaddr_in client_addr;
+                socklen_t client_addr_len = sizeof(client_addr);
+                int client_sockfd = accept(server->control_sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
+                if (client_sockfd == -1) {
+                    perror("accept");
+                    continue;
+                }
+
+                // Refuse the connection if there are too many already, in this reactor or in total
+                // (a descriptor select() cannot watch is refused in any case)
+                uint64_t ip_key = admission_ip_key(client_addr.sin_addr.s_addr);
+                if (server->client_count >= SERVER_REACTOR_MAX_SESSIONS || client_sockfd >= FD_SETSIZE
+                    || admission_acquire_session(server->admission, server->reactor_id, ip_key) == -1) {
+                    send_message(client_sockfd, "421 Too many connections; try again later.");
+                    close(client_sockfd);
+                    continue;
+                }
+
+                // Add its socket to the set
                 FD_SET(client_sockfd, &(server->listen_sockfds));
-                if (client_sockfd > max_sockfd_so_far) {
-                    max_sockfd_so_far = client_sockfd;
+                if (client_sockfd > server->max_sockfd) {
+                    server->max_sockfd = client_sockfd;
                 }
 
                 // Add to list of clients
-                add_new_client(server, client_sockfd);
+                add_new_client(server, client_sockfd)->ip_key = ip_key;
 
                 // Send ready message
                 send_message(client_sockfd, "220 Service ready for new user.");
+            } else if (sockfd == server->signal_fd) {
+                // The supervisor asks to reload the user database
+                handle_reactor_signal(server);
             } else {
-                // A client is sending data
+                // A client is sending data, or a process forked for a client sent a reply
+                // (it may have been removed already while handling an earlier socket)
                 struct server_client_state *client = find_client_by_control_sockfd(server, sockfd);
-                handle_client_sending_data(server, client);
+                if (client != NULL) {
+                    handle_client_sending_data(server, client);
+                } else if ((client = find_client_by_reply_relay_sockfd(server, sockfd)) != NULL) {
+                    relay_reply(client);
+                }
             }
         }
+
+        // Close the connections that timed out
+        timer_wheel_advance(&(server->timers), timer_now_ms());
+    }
+}
+
+void handle_reactor_signal(struct server_state *server) {
+    struct signalfd_siginfo info;
+    if (read(server->signal_fd, &info, sizeof(info)) != sizeof(info)) {
+        return;
+    }
+
+    // Mapping the new database is cheap, so it is done right here in the loop
+    if (info.ssi_signo == SIGHUP) {
+        reload_user_database(server);
+    } else if (info.ssi_signo == SIGCHLD) {
+        reap_transfer_processes(server);
+        start_queued_transfers(server);
+    } else if (info.ssi_signo == SIGTERM) {
+        // The supervisor is stopping the server; running transfers finish on their own
+        exit(EXIT_SUCCESS);
+    }
+}
+
+void handle_client_idle_timeout(struct timer *timer, void *data) {
+    struct server_state *server = data;
+    struct server_client_state *client = (struct server_client_state *)((char *)timer
+        - offsetof(struct server_client_state, idle_timer));
+
+    // A client waiting for its transfers is not idle
+    if (client->transfer_count > 0) {
+        timer_schedule(&(server->timers), timer, timer_now_ms() + SERVER_IDLE_TIMEOUT_MS);
+        return;
+    }
+
+    // A client stuck in the TLS handshake cannot be sent anything
+    if (client->tls_state != SERVER_TLS_STATE_HANDSHAKE) {
+        send_message(client->control_sockfd, "421 Timeout; closing control connection.");
     }
+    remove_client(server, client);
 }
 
 void handle_client_sending_data(struct server_state *server, struct server_client_state *client) {
     static char command[COMMAND_STR_MAX];
+
+    if (client->tls_state == SERVER_TLS_STATE_HANDSHAKE) {
+        continue_tls_handshake(server, client);
+        return;
+    }
     
-    int bytes_received = (int)recv(client->control_sockfd, command, COMMAND_STR_MAX - 1, 0);
+    int bytes_received = (int)tls_recv(client->control_sockfd, command, COMMAND_STR_MAX - 1);
     if (bytes_received == -1) {
+        if (errno == EAGAIN) {
+            // Only part of a TLS record arrived so far
+            return;
+        }
+        // The connection or its TLS session failed
         perror("recv");
-        exit(EXIT_FAILURE);
+        remove_client(server, client);
     } else if (bytes_received == 0) {
         // Client closed the connection
         // Remove all its data
         remove_client(server, client);
     } else {
+        // The client is active; restart its idle timeout
+        timer_schedule(&(server->timers), &(client->idle_timer), timer_now_ms() + SERVER_IDLE_TIMEOUT_MS);
+
         // Null-terminate the command
         command[bytes_received] = '\0';
         // Handle the command
@@ -107,42 +517,118 @@ void handle_client_sending_data(struct server_state *server, struct server_clien
     }
 }
 
-void add_new_client(struct server_state *server, int client_sockfd) {
+struct server_client_state* add_new_client(struct server_state *server, int client_sockfd) {
     // Initialize structure
-    struct server_client_state *client = malloc(sizeof(struct server_client_state));
+    struct server_client_state *client = slab_alloc(&(server->client_allocator));
     client->control_sockfd = client_sockfd;
     client->state = SERVER_CLIENT_STATE_NEED_USERNAME;
-    client->auth_data = NULL;
+    client->users = NULL;
+    client->user = NULL;
+    client->current_path = NULL;
+    client->rename_from = NULL;
+    client->storage = &(server->storage);
+    client->root_dirfd = -1;
+    client->current_dirfd = -1;
     client->has_data_addr = 0;
     client->data_addr.sin_family = AF_INET; // IPV4
+    client->has_content_hash = 0;
+    client->hash_algorithm = HASH_ALGORITHM_SHA256;
+    client->allocation_size = 0;
+    timer_init(&(client->idle_timer), handle_client_idle_timeout, server);
+    timer_schedule(&(server->timers), &(client->idle_timer), timer_now_ms() + SERVER_IDLE_TIMEOUT_MS);
+    client->ip_key = 0;
+    client->user_key = 0;
+    client->usage = NULL;
+    client->transfer_count = 0;
+    client->tls_state = SERVER_TLS_STATE_NONE;
+    client->has_protection_buffer_size = 0;
+    client->protect_data = 0;
+    client->reply_relay_sockfds[0] = -1;
+    client->reply_relay_sockfds[1] = -1;
+
+    // Record the session if recording is on
+    client->trace_fd = server->traces_dirfd == -1 ? -1 : trace_create(server->traces_dirfd);
+    client->trace_start_us = trace_now_us();
     
     // Make structure head of linked list
     client->next = server->clients;
     server->clients = client;
+    server->client_count++;
+
+    return client;
 }
 
 void remove_client(struct server_state *server, struct server_client_state *client) {
-    // Close the socket
+    // Close the socket, freeing its TLS session before the number can be reused
+    tls_detach(client->control_sockfd);
     close(client->control_sockfd);
     
     // Remove socket from listening sockets
     FD_CLR(client->control_sockfd, &(server->listen_sockfds));
 
+    // Stop its timeout
+    timer_cancel(&(server->timers), &(client->idle_timer));
+
+    if (client->trace_fd != -1) {
+        close(client->trace_fd);
+    }
+
+    // Stop relaying replies; processes still running for the client get EPIPE
+    if (client->reply_relay_sockfds[0] != -1) {
+        FD_CLR(client->reply_relay_sockfds[0], &(server->listen_sockfds));
+        close(client->reply_relay_sockfds[0]);
+        close(client->reply_relay_sockfds[1]);
+    }
+
+    // Drop its queued transfers; running ones keep their slots until their process exits
+    int kept = 0;
+    for (int i = 0; i < server->transfer_queue_length; i++) {
+        if (server->transfer_queue[i].client != client) {
+            if (kept != i) {
+                server->transfer_queue[kept] = server->transfer_queue[i];
+            }
+            kept++;
+        }
+    }
+    server->transfer_queue_length = kept;
+    for (int i = 0; i < ADMISSION_MAX_TRANSFERS; i++) {
+        struct transfer *transfer = &(server->transfers[i]);
+        if (!transfer->in_use || transfer->client != client) continue;
+
+        if (transfer->pid == 0) {
+            // Still connecting: nobody is waiting for this transfer anymore
+            abort_transfer(server, transfer, NULL);
+        } else {
+            transfer->client = NULL;
+        }
+    }
+
+    // Let other sessions in
+    if (client->user_key != 0) {
+        admission_release_user_session(server->admission, server->reactor_id, client->user_key);
+    }
+    admission_release_session(server->admission, server->reactor_id, client->ip_key);
+
+    // Let go of the working directory and the user database snapshot
+    release_current_path(client);
+    release_user(client);
+
     // Remove client from list
     if (server->clients == client) {
         // It is the head node of the list
         server->clients = client->next;
-        free(client);
+        slab_free(&(server->client_allocator), client);
     } else {
         // It is not the head node of the list
         for (struct server_client_state *node = server->clients; node != NULL; node = node->next) {
             if (node->next == client) {
                 node->next = client->next;
-                free(client);
+                slab_free(&(server->client_allocator), client);
                 break;
             }
         }
     }
+    server->client_count--;
 }
 
 struct server_client_state* find_client_by_control_sockfd(struct server_state *server, int control_sockfd) {
@@ -156,66 +642,9 @@ struct server_client_state* find_client_by_control_sockfd(struct server_state *s
     return NULL;
 }
 
-void read_auth_data(struct server_state *server) {
-    server->users_auth_data = NULL;
-
-    // Construct the path for the the users.txt file
-    static char users_txt_path[PATH_MAX * 2];
-    sprintf(users_txt_path, "%s/users.txt", server->base_path);
-
-    // If path is too long, error since system will error later anyway
-    size_t users_txt_path_length = strlen(users_txt_path);
-    if (users_txt_path_length > PATH_MAX) {
-        fprintf(stderr, "users.txt path too long\n");
-        exit(EXIT_FAILURE);
-    }
-
-    // Try to open the file
-    FILE *file = fopen(users_txt_path, "r");
-    if (file == NULL) {
-        // The file could not be opened or is missing
-        // Fail silently
-        return;
-    }
-
-    // Read each line from the file and parse username and password
-    static char line[AUTH_STR_MAX + 1 + AUTH_STR_MAX];
-    while (fgets(line, sizeof(line), file) != NULL) {
-        // Remove trailing newline
-        line[strcspn(line, "\n")] = '\0';
-
-        // Extract username and password
-        char *username = strtok(line, " ");
-        char *password = strtok(NULL, " ");
-
-        // Skip line if it is invalid or empty
-        if (username == NULL || password == NULL) {
-            continue;
-        }
-
-        // Add the auth data
-        add_auth_data(server, username, password);
-    }
-
-    // Close the file
-    fclose(file);
-}
-
-void add_auth_data(struct server_state *server, char *username, char *password) {
-    // Create structure
-    struct user_auth_data *t = malloc(sizeof(struct user_auth_data));
-    strcpy(t->username, username);
-    strcpy(t->password, password);
-
-    // Make structure head of linked list
-    t->next = server->users_auth_data;
-    server->users_auth_data = t;
-}
-
-struct user_auth_data* find_auth_data_by_username(struct server_state *server, char *username) {
-    // Go through the list until the user_auth_data with the given username is found
-    for (struct user_auth_data *node = server->users_auth_data; node != NULL; node = node->next) {
-        if (strcmp(node->username, username) == 0) {
+struct server_client_state* find_client_by_reply_relay_sockfd(struct server_state *server, int relay_sockfd) {
+    for (struct server_client_state *node = server->clients; node != NULL; node = node->next) {
+        if (node->reply_relay_sockfds[0] == relay_sockfd) {
             return node;
         }
     }
@@ -223,312 +652,2270 @@ struct user_auth_data* find_auth_data_by_username(struct server_state *server, c
     return NULL;
 }
 
-void initialize_user_storage_directories(struct server_state *server) {
-    static char buf[PATH_MAX + 1 + AUTH_STR_MAX];
-
-    for (struct user_auth_data *auth_data = server->users_auth_data; auth_data != NULL; auth_data = auth_data->next) {
-        // Construct the path to the user's base directory
-        sprintf(buf, "%s/%s", server->users_storage_path, auth_data->username);
-        // Create the directory if it does not exist
-        create_directory_if_not_exists(buf);
-    }
-}
-
-void initialize_current_path(struct server_state *server, struct server_client_state *client) {
-    static char buf[PATH_MAX + 1 + AUTH_STR_MAX];
-    
-    // Initialize the current path of the user to the user's base directory
-    sprintf(buf, "%s/%s", server->users_storage_path, client->auth_data->username);
-    strcpy(client->current_path, buf);
-}
+void initialize_tls(struct server_state *server) {
+    static char certificate_path[PATH_MAX];
+    static char private_key_path[PATH_MAX];
 
-void handle_command(struct server_state *server, struct server_client_state *client, char *command) {
-    // Handle command based on which one it is
-    if (check_first_token(command, COMMAND_USERNAME)) {
-        handle_command_username(server, client, command);
-    } else if (check_first_token(command, COMMAND_PASSWORD)) {
-        handle_command_password(server, client, command);
-    } else if (check_first_token(command, COMMAND_PORT)) {
-        handle_command_port(client, command);
-    } else if (check_first_token(command, COMMAND_STORE)) {
-        handle_command_store(client, command);
-    } else if (check_first_token(command, COMMAND_RETRIEVE)) {
-        handle_command_retrieve(client, command);
-    } else if (check_first_token(command, COMMAND_LIST)) {
-        handle_command_list(client);
-    } else if (check_first_token(command, COMMAND_CHANGE_DIRECTORY)) {
-        handle_command_change_directory(server, client, command);
-    } else if (check_first_token(command, COMMAND_PRINT_DIRECTORY)) {
-        handle_command_print_directory(server, client);
-    } else if (check_first_token(command, COMMAND_QUIT)) {
-        handle_command_quit(server, client);
-    } else {
-        // Command is not implemented
-        send_message(client->control_sockfd, "202 Command not implemented.");
+    format_base_file_path(server, SERVER_TLS_CERTIFICATE_FILE, certificate_path);
+    format_base_file_path(server, SERVER_TLS_PRIVATE_KEY_FILE, private_key_path);
+    server->tls_available = tls_create_server_context(certificate_path, private_key_path) == 0;
+    if (!server->tls_available) {
+        fprintf(stderr, "TLS is unavailable: could not load %s\n", certificate_path);
     }
 }
 
-void handle_command_username(struct server_state *server, struct server_client_state *client, char *command) {
-    if (client->state != SERVER_CLIENT_STATE_NEED_USERNAME) {
+void handle_command_authenticate(struct server_state *server, struct server_client_state *client, char *command) {
+    // The security exchange comes first; a session can only be secured once
+    if (client->tls_state != SERVER_TLS_STATE_NONE || client->state != SERVER_CLIENT_STATE_NEED_USERNAME) {
         send_message(client->control_sockfd, "503 Bad sequence of commands.");
         return;
     }
 
-    // Get the username from the command
+    // Get the mechanism from the command
     strtok(command, " ");
-    char *username = strtok(NULL, " ");
-    if (username == NULL) {
-        // No username provided
-        send_message(client->control_sockfd, "530 Not logged in.");
+    char *mechanism = strtok(NULL, " ");
+    if (mechanism == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
         return;
     }
-    
-    struct user_auth_data *auth_data = find_auth_data_by_username(server, username);
-    if (auth_data == NULL) {
-        // No user with the username was found
-        send_message(client->control_sockfd, "530 Not logged in.");
+    if (strcasecmp(mechanism, "TLS") != 0 && strcasecmp(mechanism, "TLS-C") != 0) {
+        send_message(client->control_sockfd, "504 Command not implemented for that parameter.");
+        return;
+    }
+    if (!server->tls_available) {
+        send_message(client->control_sockfd, "431 Need some unavailable resource to process security.");
         return;
     }
 
-    // Update client state
-    client->state = SERVER_CLIENT_STATE_NEED_PASSWORD;
-    client->auth_data = auth_data;
+    send_message(client->control_sockfd, "234 AUTH TLS successful.");
 
-    send_message(client->control_sockfd, "331 Username OK, need password.");
+    // The handshake is driven by the loop as the client's messages arrive, so that a slow
+    // client does not hold up the reactor; it has a short time to complete it
+    fcntl(client->control_sockfd, F_SETFL, fcntl(client->control_sockfd, F_GETFL) | O_NONBLOCK);
+    client->tls_state = SERVER_TLS_STATE_HANDSHAKE;
+    timer_schedule(&(server->timers), &(client->idle_timer), timer_now_ms() + SERVER_TLS_HANDSHAKE_TIMEOUT_MS);
+    continue_tls_handshake(server, client);
 }
 
-void handle_command_password(struct server_state *server, struct server_client_state *client, char *command) {   
-    if (client->state != SERVER_CLIENT_STATE_NEED_PASSWORD) {
-        send_message(client->control_sockfd, "503 Bad sequence of commands.");
+void continue_tls_handshake(struct server_state *server, struct server_client_state *client) {
+    int status = tls_accept(client->control_sockfd, 1);
+    if (status == 0) {
+        // Wait for more of the handshake
+        return;
+    } else if (status == -1) {
+        remove_client(server, client);
         return;
     }
 
-    // Get the password from the command
-    strtok(command, " ");
-    char *password = strtok(NULL, " ");
-    if (password == NULL) {
-        // No username provided
-        send_message(client->control_sockfd, "530 Not logged in.");
+    // Processes forked for this client write their replies through the reactor,
+    // unless the kernel encrypts for them
+    if (!tls_is_send_offloaded(client->control_sockfd) && open_reply_relay(server, client) == -1) {
+        remove_client(server, client);
         return;
     }
-    
-    if (strcmp(client->auth_data->password, password) == 0) {
-        // Password matches
-        client->state = SERVER_CLIENT_STATE_AUTHENTICATED;
-        initialize_current_path(server, client);
-        send_message(client->control_sockfd, "230 User logged in, proceed.");
-    } else {
-        // Password does not match
-        client->state = SERVER_CLIENT_STATE_NEED_USERNAME;
-        client->auth_data = NULL;
-        send_message(client->control_sockfd, "530 Not logged in.");
-    }
+
+    client->tls_state = SERVER_TLS_STATE_ACTIVE;
+    timer_schedule(&(server->timers), &(client->idle_timer), timer_now_ms() + SERVER_IDLE_TIMEOUT_MS);
 }
 
-void handle_command_port(struct server_client_state *client, char *command) {
-    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
-        send_message(client->control_sockfd, "532 Need account for storing files.");
+void handle_command_protection_buffer_size(struct server_client_state *client, char *command) {
+    if (client->tls_state != SERVER_TLS_STATE_ACTIVE) {
+        send_message(client->control_sockfd, "503 Bad sequence of commands.");
         return;
     }
 
-    // Parse the command for the address and port (in host order)
-    int h1, h2, h3, h4, p1, p2;
-    
-    int scanned_count = sscanf(command, "%*s %d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2);
-    if (scanned_count < 6) {
-        // Message not in expected format
+    strtok(command, " ");
+    char *size = strtok(NULL, " ");
+    if (size == NULL) {
         send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
         return;
     }
 
-    in_addr_t address = (h1 << (3 * 8)) | (h2 << (2 * 8)) | (h3 << 8) | h4;
-    uint16_t port = (p1 << 8) | p2;
-
-    // Store address and port into state structure
-    client->has_data_addr = 1;
-
-    client->data_addr.sin_addr.s_addr = address;
-    client->data_addr.sin_port = htons(port);
-
-    send_message(client->control_sockfd, "200 PORT command successful.");
+    // TLS does its own framing, so no buffer is needed (RFC 4217)
+    client->has_protection_buffer_size = 1;
+    send_message(client->control_sockfd, "200 PBSZ=0");
 }
 
-void handle_command_store(struct server_client_state *client, char *command) {
-    static char buf[PATH_MAX + 1 + COMMAND_STR_MAX];
-
-    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
-        send_message(client->control_sockfd, "532 Need account for storing files.");
-        return;
-    }
-    if (!client->has_data_addr) {
+void handle_command_protection_level(struct server_client_state *client, char *command) {
+    if (!client->has_protection_buffer_size) {
         send_message(client->control_sockfd, "503 Bad sequence of commands.");
         return;
     }
 
-    // Fork a child process to handle the data transfer
-    pid_t child_pid = fork();
-    if (child_pid > 0) {
-        // This is the parent process, just exit
+    strtok(command, " ");
+    char *level = strtok(NULL, " ");
+    if (level == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
         return;
     }
 
-    // This is the child process
+    if (strcasecmp(level, "P") == 0) {
+        client->protect_data = 1;
+        send_message(client->control_sockfd, "200 Protection level set to P.");
+    } else if (strcasecmp(level, "C") == 0) {
+        if (SERVER_REQUIRE_TLS) {
+            send_message(client->control_sockfd, "534 Request denied for policy reasons.");
+            return;
+        }
+        client->protect_data = 0;
+        send_message(client->control_sockfd, "200 Protection level set to C.");
+    } else {
+        // Safe and Confidential only exist for other security mechanisms
+        send_message(client->control_sockfd, "536 Requested PROT level not supported by mechanism.");
+    }
+}
+
+int open_reply_relay(struct server_state *server, struct server_client_state *client) {
+    // Each reply is one packet, so replies of processes running at the same time do not mix
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, client->reply_relay_sockfds) == -1) {
+        perror("socketpair");
+        client->reply_relay_sockfds[0] = -1;
+        client->reply_relay_sockfds[1] = -1;
+        return -1;
+    }
+
+    FD_SET(client->reply_relay_sockfds[0], &(server->listen_sockfds));
+    if (client->reply_relay_sockfds[0] > server->max_sockfd) {
+        server->max_sockfd = client->reply_relay_sockfds[0];
+    }
+    return 0;
+}
+
+void relay_reply(struct server_client_state *client) {
+    static char reply[COMMAND_STR_MAX * 2];
+
+    ssize_t bytes_received = recv(client->reply_relay_sockfds[0], reply, sizeof(reply) - 1, 0);
+    if (bytes_received <= 0) {
+        return;
+    }
+    reply[bytes_received] = '\0';
+    send_message(client->control_sockfd, reply);
+}
+
+void detach_control_connection(struct server_client_state *client) {
+    if (!tls_is_attached(client->control_sockfd)) {
+        return;
+    }
+
+    // The session state of this process stops matching the connection as soon as
+    // the reactor sends anything, so only the reactor or the kernel may use it
+    tls_detach(client->control_sockfd);
+    if (client->reply_relay_sockfds[1] != -1) {
+        client->control_sockfd = client->reply_relay_sockfds[1];
+    }
+}
+
+int secure_data_connection(struct server_client_state *client, int data_sockfd) {
+    if (!client->protect_data) {
+        return 0;
+    }
+
+    // On this blocking socket, the handshake fails if the client stalls for DATA_STALL_TIMEOUT_MS
+    if (tls_accept(data_sockfd, 0) != 1) {
+        tls_detach(data_sockfd);
+        return -1;
+    }
+    if (!tls_is_resumed(data_sockfd)) {
+        fprintf(stderr, "Data connection did not resume the TLS session of the control connection\n");
+        tls_detach(data_sockfd);
+        return -1;
+    }
+    return 0;
+}
+
+void close_data_connection(int data_sockfd, int completed) {
+    if (completed) {
+        tls_shutdown(data_sockfd);
+    } else {
+        tls_detach(data_sockfd);
+    }
+    close(data_sockfd);
+}
+
+void format_base_file_path(struct server_state *server, const char *name, char *result) {
+    // If path is too long, error since system will error later anyway
+    if (snprintf(result, PATH_MAX, "%s/%s", server->base_path, name) >= PATH_MAX) {
+        fprintf(stderr, "%s path too long\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void load_user_database(struct server_state *server) {
+    static char users_txt_path[PATH_MAX];
+    static char users_db_path[PATH_MAX];
+    format_base_file_path(server, "users.txt", users_txt_path);
+    format_base_file_path(server, "users.db", users_db_path);
+
+    struct stat txt_stat, db_stat;
+    int has_txt = stat(users_txt_path, &txt_stat) == 0;
+    int has_db = stat(users_db_path, &db_stat) == 0;
+
+    // Map the compiled database unless users.txt was changed after it was compiled
+    struct userdb db;
+    if (has_db && (!has_txt || db_stat.st_mtim.tv_sec > txt_stat.st_mtim.tv_sec
+        || (db_stat.st_mtim.tv_sec == txt_stat.st_mtim.tv_sec && db_stat.st_mtim.tv_nsec >= txt_stat.st_mtim.tv_nsec))
+        && userdb_open(users_db_path, &db) == 0) {
+        server->users = userdb_snapshot_create(&db);
+        return;
+    }
+
+    // Compile users.txt, and keep the result so the next start can map it
+    if (userdb_compile_text(users_txt_path, &db) == 0) {
+        userdb_write(&db, users_db_path);
+    } else {
+        // The file could not be opened or is missing
+        // Fail silently, no user can log in
+        userdb_init_empty(&db);
+    }
+    server->users = userdb_snapshot_create(&db);
+}
+
+int reload_user_database(struct server_state *server) {
+    static char users_db_path[PATH_MAX];
+    format_base_file_path(server, "users.db", users_db_path);
+
+    struct userdb db;
+    if (userdb_open(users_db_path, &db) == -1) {
+        return -1;
+    }
+
+    // New logins use the new snapshot; the old one is closed when its last session ends
+    userdb_snapshot_release(server->users);
+    server->users = userdb_snapshot_create(&db);
+    return 0;
+}
+
+pid_t spawn_user_database_builder(struct server_state *server) {
+    static char users_txt_path[PATH_MAX];
+    static char users_db_path[PATH_MAX];
+    format_base_file_path(server, "users.txt", users_txt_path);
+    format_base_file_path(server, "users.db", users_db_path);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid > 0) {
+        return pid;
+    }
+
+    // This is the builder process
+    struct userdb db;
+    if (userdb_compile_text(users_txt_path, &db) == -1 || userdb_write(&db, users_db_path) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+int watch_user_database(struct server_state *server) {
+    int inotify_fd = inotify_init1(IN_NONBLOCK);
+    if (inotify_fd == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    // Watch the directory rather than the files, since both are usually replaced by a rename
+    if (inotify_add_watch(inotify_fd, server->base_path, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        perror("inotify_add_watch");
+        close(inotify_fd);
+        return -1;
+    }
+    return inotify_fd;
+}
+
+int open_user_storage_directory(struct server_state *server, struct server_client_state *client) {
+    const char *username = userdb_username(&(client->users->db), client->user);
+    struct storage *storage = &(server->storage);
+
+    int dirfd = storage_open(storage, storage->root, username, O_PATH | O_DIRECTORY | O_NOFOLLOW, 0);
+    if (dirfd == -1 && errno == ENOENT) {
+        // First login of this user; another session may be creating it at the same time
+        if (storage_mkdir(storage, storage->root, username, S_IRWXU | S_IRWXG | S_IRWXO) == -1 && errno != EEXIST) {
+            perror("mkdirat");
+            return -1;
+        }
+        dirfd = storage_open(storage, storage->root, username, O_PATH | O_DIRECTORY | O_NOFOLLOW, 0);
+    }
+    if (dirfd == -1) {
+        perror("openat");
+    }
+    return dirfd;
+}
+
+int initialize_current_path(struct server_state *server, struct server_client_state *client) {
+    release_current_path(client);
+
+    // Open the user's base directory; everything the user accesses is opened beneath it
+    client->root_dirfd = open_user_storage_directory(server, client);
+    if (client->root_dirfd == -1) {
+        return -1;
+    }
+
+    // Initialize the current path of the user to the user's base directory
+    client->current_dirfd = storage_open(client->storage, client->root_dirfd, ".", O_PATH | O_DIRECTORY, 0);
+    struct stat stat_result;
+    if (client->current_dirfd == -1 || storage_stat(client->storage, client->current_dirfd, NULL, &stat_result) == -1) {
+        perror("openat");
+        release_current_path(client);
+        return -1;
+    }
+    client->current_dev = stat_result.st_dev;
+    client->current_ino = stat_result.st_ino;
+    client->current_path = path_intern("");
+
+    return 0;
+}
+
+void release_current_path(struct server_client_state *client) {
+    if (client->rename_from != NULL) {
+        path_release(client->rename_from);
+        client->rename_from = NULL;
+    }
+    if (client->current_path != NULL) {
+        path_release(client->current_path);
+        client->current_path = NULL;
+    }
+    if (client->current_dirfd != -1) {
+        storage_close(client->storage, client->current_dirfd);
+        client->current_dirfd = -1;
+    }
+    if (client->root_dirfd != -1) {
+        storage_close(client->storage, client->root_dirfd);
+        client->root_dirfd = -1;
+    }
+}
+
+void release_user(struct server_client_state *client) {
+    if (client->users != NULL) {
+        userdb_snapshot_release(client->users);
+        client->users = NULL;
+    }
+    client->user = NULL;
+    client->usage = NULL;
+}
+
+void format_client_directory(struct server_client_state *client, char *result) {
+    int p = snprintf(result, PATH_MAX, "/Users/%s", userdb_username(&(client->users->db), client->user));
+    if (client->current_path->length > 0 && p < PATH_MAX) {
+        snprintf(result + p, PATH_MAX - p, "/%s", client->current_path->path);
+    }
+}
+
+void handle_command(struct server_state *server, struct server_client_state *client, char *command) {
+    if (client->trace_fd != -1) {
+        trace_record(client->trace_fd, trace_now_us() - client->trace_start_us, command);
+    }
+
+    // RNTO must come right after RNFR
+    if (client->rename_from != NULL && !check_first_token(command, COMMAND_RENAME_TO)) {
+        path_release(client->rename_from);
+        client->rename_from = NULL;
+    }
+
+    // Handle command based on which one it is
+    if (check_first_token(command, COMMAND_AUTHENTICATE)) {
+        handle_command_authenticate(server, client, command);
+    } else if (check_first_token(command, COMMAND_PROTECTION_BUFFER_SIZE)) {
+        handle_command_protection_buffer_size(client, command);
+    } else if (check_first_token(command, COMMAND_PROTECTION_LEVEL)) {
+        handle_command_protection_level(client, command);
+    } else if (SERVER_REQUIRE_TLS && client->tls_state != SERVER_TLS_STATE_ACTIVE && !check_first_token(command, COMMAND_QUIT)) {
+        // Nothing, least of all the password, may be sent in the clear
+        send_message(client->control_sockfd, "530 Please secure the control connection with AUTH TLS first.");
+    } else if (check_first_token(command, COMMAND_USERNAME)) {
+        handle_command_username(server, client, command);
+    } else if (check_first_token(command, COMMAND_PASSWORD)) {
+        handle_command_password(server, client, command);
+    } else if (check_first_token(command, COMMAND_PORT)) {
+        handle_command_port(client, command);
+    } else if (check_first_token(command, COMMAND_STORE) || check_first_token(command, COMMAND_RETRIEVE)
+        || check_first_token(command, COMMAND_LIST) || check_first_token(command, COMMAND_MACHINE_LIST)
+        || check_first_token(command, COMMAND_SIGNATURE) || check_first_token(command, COMMAND_DELTA_STORE)
+        || check_first_token(command, COMMAND_HASH) || check_site_command(command, SITE_COMMAND_COPY)) {
+        handle_transfer_command(server, client, command);
+    } else if (check_first_token(command, COMMAND_CHANGE_DIRECTORY)) {
+        handle_command_change_directory(client, command);
+    } else if (check_first_token(command, COMMAND_PRINT_DIRECTORY)) {
+        handle_command_print_directory(client);
+    } else if (check_first_token(command, COMMAND_MAKE_DIRECTORY)) {
+        handle_command_make_directory(client, command);
+    } else if (check_first_token(command, COMMAND_RENAME_FROM)) {
+        handle_command_rename_from(client, command);
+    } else if (check_first_token(command, COMMAND_RENAME_TO)) {
+        handle_command_rename_to(server, client, command);
+    } else if (check_first_token(command, COMMAND_DELETE)) {
+        handle_command_delete(server, client, command);
+    } else if (check_first_token(command, COMMAND_SITE)) {
+        handle_command_site(server, client, command);
+    } else if (check_first_token(command, COMMAND_SIZE)) {
+        handle_command_size(server, client, command);
+    } else if (check_first_token(command, COMMAND_MODIFICATION_TIME)) {
+        handle_command_modification_time(server, client, command);
+    } else if (check_first_token(command, COMMAND_QUIT)) {
+        handle_command_quit(server, client);
+    } else if (check_first_token(command, COMMAND_CONTENT_HASH)) {
+        handle_command_content_hash(server, client, command);
+    } else if (check_first_token(command, COMMAND_OPTIONS)) {
+        handle_command_options(client, command);
+    } else if (check_first_token(command, COMMAND_ALLOCATE)) {
+        handle_command_allocate(client, command);
+    } else {
+        // Command is not implemented
+        send_message(client->control_sockfd, "202 Command not implemented.");
+    }
+}
+
+int check_site_command(const char *command, const char *site_command) {
+    if (!check_first_token(command, COMMAND_SITE)) {
+        return 0;
+    }
+
+    // Skip the spaces after SITE, as strtok does
+    const char *rest = command + strlen(COMMAND_SITE);
+    while (*rest == ' ') {
+        rest++;
+    }
+    size_t length = strlen(site_command);
+    return strncasecmp(rest, site_command, length) == 0 && (rest[length] == ' ' || rest[length] == '\0');
+}
+
+void handle_transfer_command(struct server_state *server, struct server_client_state *client, char *command) {
+    // Commands that are refused anyway do not need a slot
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        start_transfer(server, client, command);
+        return;
+    }
+    int has_data_connection = !check_first_token(command, COMMAND_HASH) && !check_first_token(command, COMMAND_SITE);
+    if (SERVER_REQUIRE_TLS && !client->protect_data && has_data_connection) {
+        send_message(client->control_sockfd, "521 Data connections must be protected; use PROT P.");
+        return;
+    }
+
+    // Start right away unless earlier commands are waiting or a limit has been reached
+    if (server->transfer_queue_length == 0 && server->transfer_count < ADMISSION_MAX_TRANSFERS
+        && admission_acquire_transfer(server->admission, server->reactor_id, client->ip_key, client->user_key) == 0) {
+        start_transfer(server, client, command);
+        return;
+    }
+
+    // Otherwise wait for a running transfer to finish
+    if (server->transfer_queue_length == SERVER_TRANSFER_QUEUE_LENGTH) {
+        send_message(client->control_sockfd, "450 Requested file action not taken. Too many transfers; try again later.");
+        return;
+    }
+    struct queued_transfer *queued = &(server->transfer_queue[server->transfer_queue_length++]);
+    queued->client = client;
+    strncpy(queued->command, command, sizeof(queued->command) - 1);
+    queued->command[sizeof(queued->command) - 1] = '\0';
+    client->transfer_count++;
+
+    if (!server->transfer_queue_timer.scheduled) {
+        timer_schedule(&(server->timers), &(server->transfer_queue_timer), timer_now_ms() + SERVER_TRANSFER_QUEUE_RETRY_MS);
+    }
+}
+
+void start_transfer(struct server_state *server, struct server_client_state *client, char *command) {
+    int started = 0;
+    if (check_first_token(command, COMMAND_STORE)) {
+        started = handle_command_store(server, client, command);
+    } else if (check_first_token(command, COMMAND_RETRIEVE)) {
+        started = handle_command_retrieve(server, client, command);
+    } else if (check_first_token(command, COMMAND_LIST)) {
+        started = handle_command_list(server, client, command, TRANSFER_KIND_LIST);
+    } else if (check_first_token(command, COMMAND_MACHINE_LIST)) {
+        started = handle_command_list(server, client, command, TRANSFER_KIND_MACHINE_LIST);
+    } else if (check_first_token(command, COMMAND_SIGNATURE)) {
+        started = handle_command_signature(server, client, command);
+    } else if (check_first_token(command, COMMAND_DELTA_STORE)) {
+        started = handle_command_delta_store(server, client, command);
+    } else if (check_first_token(command, COMMAND_HASH)) {
+        started = handle_command_hash(server, client, command);
+    } else if (check_first_token(command, COMMAND_SITE)) {
+        started = handle_command_site(server, client, command);
+    }
+
+    // Refused, or completed without a data transfer (no slot is taken before login)
+    if (!started && client->state == SERVER_CLIENT_STATE_AUTHENTICATED) {
+        admission_release_transfer(server->admission, server->reactor_id, client->ip_key, client->user_key);
+    }
+}
+
+void reap_transfer_processes(struct server_state *server) {
+    // Signals of the same kind are merged, so reap every child that exited
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < ADMISSION_MAX_TRANSFERS; i++) {
+            struct transfer *transfer = &(server->transfers[i]);
+            if (transfer->in_use && transfer->pid == pid) {
+                free_transfer(server, transfer);
+                break;
+            }
+        }
+    }
+}
+
+void start_queued_transfers(struct server_state *server) {
+    static char command[COMMAND_STR_MAX];
+
+    // Go through the queue in order, skipping commands whose IP address or user is still at its limit
+    int i = 0;
+    while (i < server->transfer_queue_length && server->transfer_count < ADMISSION_MAX_TRANSFERS) {
+        struct queued_transfer *queued = &(server->transfer_queue[i]);
+        struct server_client_state *client = queued->client;
+        if (admission_acquire_transfer(server->admission, server->reactor_id, client->ip_key, client->user_key) == -1) {
+            i++;
+            continue;
+        }
+
+        // Take the command out of the queue before running it
+        strcpy(command, queued->command);
+        memmove(queued, queued + 1, (server->transfer_queue_length - i - 1) * sizeof(struct queued_transfer));
+        server->transfer_queue_length--;
+        client->transfer_count--;
+
+        start_transfer(server, client, command);
+    }
+
+    // Try again later for what is left
+    if (server->transfer_queue_length > 0) {
+        timer_schedule(&(server->timers), &(server->transfer_queue_timer), timer_now_ms() + SERVER_TRANSFER_QUEUE_RETRY_MS);
+    } else {
+        timer_cancel(&(server->timers), &(server->transfer_queue_timer));
+    }
+}
+
+void handle_transfer_queue_timeout(struct timer *timer, void *data) {
+    (void)timer;
+    start_queued_transfers(data);
+}
+
+void handle_command_username(struct server_state *server, struct server_client_state *client, char *command) {
+    if (client->state != SERVER_CLIENT_STATE_NEED_USERNAME) {
+        send_message(client->control_sockfd, "503 Bad sequence of commands.");
+        return;
+    }
+
+    // Get the username from the command
+    strtok(command, " ");
+    char *username = strtok(NULL, " ");
+    if (username == NULL) {
+        // No username provided
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return;
+    }
+    
+    const struct userdb_record *user = userdb_find(&(server->users->db), username);
+    if (user == NULL) {
+        // No user with the username was found
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return;
+    }
+
+    // Update client state
+    client->state = SERVER_CLIENT_STATE_NEED_PASSWORD;
+    client->users = userdb_snapshot_retain(server->users);
+    client->user = user;
+
+    send_message(client->control_sockfd, "331 Username OK, need password.");
+}
+
+void handle_command_password(struct server_state *server, struct server_client_state *client, char *command) {   
+    if (client->state != SERVER_CLIENT_STATE_NEED_PASSWORD) {
+        send_message(client->control_sockfd, "503 Bad sequence of commands.");
+        return;
+    }
+
+    // Get the password from the command
+    strtok(command, " ");
+    char *password = strtok(NULL, " ");
+    if (password == NULL) {
+        // No username provided
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return;
+    }
+    
+    if (strcmp(userdb_password(&(client->users->db), client->user), password) == 0) {
+        // Password matches, log in unless the user has too many sessions already
+        uint64_t user_key = admission_user_key(userdb_username(&(client->users->db), client->user));
+        if (admission_acquire_user_session(server->admission, server->reactor_id, user_key) == -1) {
+            send_message(client->control_sockfd, "421 Too many sessions for this user; closing control connection.");
+            remove_client(server, client);
+            return;
+        }
+        client->user_key = user_key;
+
+        if (initialize_current_path(server, client) == -1) {
+            client->state = SERVER_CLIENT_STATE_NEED_USERNAME;
+            release_user(client);
+            send_message(client->control_sockfd, "530 Not logged in.");
+            return;
+        }
+
+        // Uploads are charged to the user's account, against the quota of the user database
+        client->usage = usage_find(server->usage, user_key);
+        if (client->usage != NULL) {
+            __atomic_store_n(&(client->usage->quota), (int64_t)userdb_quota(&(client->users->db), client->user),
+                __ATOMIC_RELAXED);
+        }
+
+        client->state = SERVER_CLIENT_STATE_AUTHENTICATED;
+        send_message(client->control_sockfd, "230 User logged in, proceed.");
+    } else {
+        // Password does not match
+        client->state = SERVER_CLIENT_STATE_NEED_USERNAME;
+        release_user(client);
+        send_message(client->control_sockfd, "530 Not logged in.");
+    }
+}
+
+void handle_command_port(struct server_client_state *client, char *command) {
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "532 Need account for storing files.");
+        return;
+    }
+
+    // Parse the command for the address and port (in host order)
+    int h1, h2, h3, h4, p1, p2;
+    
+    int scanned_count = sscanf(command, "%*s %d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2);
+    if (scanned_count < 6) {
+        // Message not in expected format
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return;
+    }
+
+    in_addr_t address = (h1 << (3 * 8)) | (h2 << (2 * 8)) | (h3 << 8) | h4;
+    uint16_t port = (p1 << 8) | p2;
+
+    // Store address and port into state structure
+    client->has_data_addr = 1;
+
+    client->data_addr.sin_addr.s_addr = address;
+    client->data_addr.sin_port = htons(port);
+
+    send_message(client->control_sockfd, "200 PORT command successful.");
+}
+
+int handle_command_store(struct server_state *server, struct server_client_state *client, char *command) {
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "532 Need account for storing files.");
+        return 0;
+    }
+
+    // Extract the filename from the command
+    strtok(command, " ");
+    char *filename = strtok(NULL, " ");
+    if (filename == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return 0;
+    }
+
+    // Ensure the filename has no slashes
+    char *last_slash = strrchr(filename, '/');
+    if (last_slash != NULL) {
+        send_message(client->control_sockfd, "550 Requested action not taken. File name not allowed.");
+        return 0;
+    }
+
+    // What ALLO and XSHA announced applies to this STOR only
+    off_t allocation_size = client->allocation_size;
+    client->allocation_size = 0;
+    int has_content_hash = client->has_content_hash;
+    client->has_content_hash = 0;
+
+    // Reject the upload up front if its announced size does not fit in the quota
+    if (check_upload_quota(client, client->current_dirfd, filename, allocation_size) == -1) {
+        return 0;
+    }
+
+    // If the client announced the content and it is stored already, skip the transfer
+    if (has_content_hash && client->storage->uses_fds) {
+        if (materialize_blob(server, client, client->content_hash, filename) == 0) {
+            send_message(client->control_sockfd, "250 Requested file action okay, completed.");
+            return 0;
+        } else if (errno == EDQUOT) {
+            send_message(client->control_sockfd, "552 Requested file action aborted. Exceeded storage allocation.");
+            return 0;
+        }
+    }
+
+    if (!client->has_data_addr) {
+        send_message(client->control_sockfd, "503 Bad sequence of commands.");
+        return 0;
+    }
+
+    // Receive into a temporary file in the same directory, preallocated to the announced size,
+    // which replaces the target only once it is complete
+    struct transfer *transfer = create_transfer(server, client, TRANSFER_KIND_STORE);
+    transfer->fd = create_upload_file(client->storage, client->current_dirfd, transfer->temp_name, allocation_size);
+    if (transfer->fd == -1) {
+        transfer->temp_name[0] = '\0';
+        free_transfer(server, transfer);
+        send_message(client->control_sockfd, "550 Requested action not taken. File unavailable.");
+        // The slot was given back with the transfer
+        return 1;
+    }
+    transfer->allocation_size = allocation_size;
+    strncpy(transfer->filename, filename, NAME_MAX);
+    transfer->filename[NAME_MAX] = '\0';
+
+    start_data_connection(server, transfer);
+    return 1;
+}
+
+void run_store_transfer(struct server_state *server, struct server_client_state *client, struct transfer *transfer) {
+    struct storage *storage = client->storage;
+    int fd = transfer->fd;
+    const char *temp_name = transfer->temp_name;
+    const char *filename = transfer->filename;
+
+    // Receive the file and save it, computing the transfer checksum and
+    // the SHA-256 for the content-addressed index along the way
+    struct hash_ctx hashes[2];
+    hash_init(&hashes[0], TRANSFER_CHECKSUM_ALGORITHM);
+    hash_init(&hashes[1], HASH_ALGORITHM_SHA256);
+    int status = receive_stored_file(storage, transfer->data_sockfd, fd, hashes, 2);
+
+    // Disconnect
+    close_data_connection(transfer->data_sockfd, status == 0);
+
+    // Notify client whether the data transfer is complete
+    if (status == -1) {
+        storage_close(storage, fd);
+        storage_unlink(storage, client->current_dirfd, temp_name);
+        send_message(client->control_sockfd, "426 Connection closed; transfer aborted.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Give back preallocated space that was not used
+    struct stat stat_result;
+    if (transfer->allocation_size > 0 && storage_stat(storage, fd, NULL, &stat_result) == 0
+        && transfer->allocation_size > stat_result.st_size && storage_truncate(storage, fd, stat_result.st_size) == -1) {
+        perror("ftruncate");
+    }
+
+    // Make the file durable and put it in place
+    if (commit_upload_file_durably(server, client->current_dirfd, fd, temp_name, filename, client->usage) == -1) {
+        storage_close(storage, fd);
+        send_upload_failed(client);
+        exit(EXIT_FAILURE);
+    }
+
+    if (storage->uses_fds) {
+        uint8_t content_hash[SHA256_DIGEST_SIZE];
+        sha256_final(&(hashes[1].state.sha256), content_hash);
+        index_blob(server, client, fd, content_hash);
+    }
+    storage_close(storage, fd);
+
+    send_transfer_completed(client, &hashes[0]);
+
+    // Since this is a child process of the server, exit successfully
+    exit(EXIT_SUCCESS);
+}
+
+struct transfer* create_transfer(struct server_state *server, struct server_client_state *client, int kind) {
+    // There is a free entry, since every entry holds one of at most ADMISSION_MAX_TRANSFERS slots
+    struct transfer *transfer = NULL;
+    for (int i = 0; i < ADMISSION_MAX_TRANSFERS; i++) {
+        if (!server->transfers[i].in_use) {
+            transfer = &(server->transfers[i]);
+            break;
+        }
+    }
+
+    transfer->in_use = 1;
+    transfer->kind = kind;
+    transfer->pid = 0;
+    transfer->client = client;
+    transfer->ip_key = client->ip_key;
+    transfer->user_key = client->user_key;
+    transfer->data_sockfd = -1;
+    transfer->fd = -1;
+    transfer->basis_fd = -1;
+    transfer->allocation_size = 0;
+    transfer->temp_name[0] = '\0';
+    transfer->filename[0] = '\0';
+    timer_init(&(transfer->connect_timer), handle_data_connect_timeout, server);
+
+    server->transfer_count++;
+    client->transfer_count++;
+    return transfer;
+}
+
+void free_transfer(struct server_state *server, struct transfer *transfer) {
+    timer_cancel(&(server->timers), &(transfer->connect_timer));
+    if (transfer->data_sockfd != -1) {
+        FD_CLR(transfer->data_sockfd, &(server->connect_sockfds));
+        close(transfer->data_sockfd);
+    }
+    if (transfer->fd != -1) {
+        storage_close(&(server->storage), transfer->fd);
+    }
+    if (transfer->basis_fd != -1) {
+        storage_close(&(server->storage), transfer->basis_fd);
+    }
+    if (transfer->client != NULL) {
+        transfer->client->transfer_count--;
+    }
+
+    admission_release_transfer(server->admission, server->reactor_id, transfer->ip_key, transfer->user_key);
+    transfer->in_use = 0;
+    server->transfer_count--;
+}
+
+void start_data_connection(struct server_state *server, struct transfer *transfer) {
+    struct server_client_state *client = transfer->client;
+
+    // The address is used up by this transfer
+    client->has_data_addr = 0;
+
+    // Send ready response
+    send_message(client->control_sockfd, "150 File status okay; about to open data connection.");
+
+    int status = connect_to_addr_nonblocking(client->data_addr, &(transfer->data_sockfd));
+    if (status == -1) {
+        abort_transfer(server, transfer, "425 Can't open data connection.");
+    } else if (status == 0) {
+        // Connected right away (e.g. over loopback)
+        fork_transfer_process(server, transfer);
+    } else {
+        // Wait for the socket to become writable, but not forever
+        FD_SET(transfer->data_sockfd, &(server->connect_sockfds));
+        if (transfer->data_sockfd > server->max_sockfd) {
+            server->max_sockfd = transfer->data_sockfd;
+        }
+        timer_schedule(&(server->timers), &(transfer->connect_timer), timer_now_ms() + DATA_CONNECT_TIMEOUT_MS);
+    }
+}
+
+void handle_data_connection_ready(struct server_state *server, struct transfer *transfer) {
+    // Find out whether the connection attempt succeeded
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    if (getsockopt(transfer->data_sockfd, SOL_SOCKET, SO_ERROR, &error, &error_length) == -1 || error != 0) {
+        abort_transfer(server, transfer, "425 Can't open data connection.");
+        return;
+    }
+
+    FD_CLR(transfer->data_sockfd, &(server->connect_sockfds));
+    timer_cancel(&(server->timers), &(transfer->connect_timer));
+    fork_transfer_process(server, transfer);
+}
+
+void handle_data_connect_timeout(struct timer *timer, void *data) {
+    struct transfer *transfer = (struct transfer *)((char *)timer - offsetof(struct transfer, connect_timer));
+    abort_transfer(data, transfer, "425 Can't open data connection.");
+}
+
+void abort_transfer(struct server_state *server, struct transfer *transfer, const char *reply) {
+    struct server_client_state *client = transfer->client;
+
+    if (reply != NULL) {
+        send_message(client->control_sockfd, reply);
+    }
+
+    // Remove the partial upload
+    if (transfer->temp_name[0] != '\0') {
+        storage_unlink(client->storage, client->current_dirfd, transfer->temp_name);
+    }
+
+    free_transfer(server, transfer);
+}
+
+void fork_transfer_process(struct server_state *server, struct transfer *transfer) {
+    pid_t child_pid = fork();
+    if (child_pid == -1) {
+        perror("fork");
+        abort_transfer(server, transfer, "451 Requested action aborted: local error in processing.");
+        return;
+    } else if (child_pid > 0) {
+        // This is the parent process: the child owns the data connection and the file now
+        transfer->pid = child_pid;
+        close(transfer->data_sockfd);
+        transfer->data_sockfd = -1;
+        if (transfer->fd != -1) {
+            storage_close(&(server->storage), transfer->fd);
+            transfer->fd = -1;
+        }
+        if (transfer->basis_fd != -1) {
+            storage_close(&(server->storage), transfer->basis_fd);
+            transfer->basis_fd = -1;
+        }
+        return;
+    }
+
+    // This is the child process
+    detach_control_connection(transfer->client);
+
+    // From now on, a client that stops reading or sending aborts the transfer instead of blocking it forever
+    fcntl(transfer->data_sockfd, F_SETFL, fcntl(transfer->data_sockfd, F_GETFL) & ~O_NONBLOCK);
+    set_socket_timeout(transfer->data_sockfd, DATA_STALL_TIMEOUT_MS);
+
+    if (secure_data_connection(transfer->client, transfer->data_sockfd) == -1) {
+        close(transfer->data_sockfd);
+        if (transfer->temp_name[0] != '\0') {
+            storage_unlink(&(server->storage), transfer->client->current_dirfd, transfer->temp_name);
+        }
+        send_message(transfer->client->control_sockfd, "425 Can't open data connection.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (transfer->kind == TRANSFER_KIND_STORE) {
+        run_store_transfer(server, transfer->client, transfer);
+    } else if (transfer->kind == TRANSFER_KIND_RETRIEVE) {
+        run_retrieve_transfer(server, transfer->client, transfer);
+    } else if (transfer->kind == TRANSFER_KIND_LIST) {
+        run_list_transfer(transfer->client, transfer);
+    } else if (transfer->kind == TRANSFER_KIND_MACHINE_LIST) {
+        run_machine_list_transfer(transfer->client, transfer);
+    } else if (transfer->kind == TRANSFER_KIND_SIGNATURE) {
+        run_signature_transfer(transfer->client, transfer);
+    } else {
+        run_delta_store_transfer(server, transfer->client, transfer);
+    }
+}
+
+struct transfer* find_transfer_by_data_sockfd(struct server_state *server, int data_sockfd) {
+    for (int i = 0; i < ADMISSION_MAX_TRANSFERS; i++) {
+        struct transfer *transfer = &(server->transfers[i]);
+        if (transfer->in_use && transfer->data_sockfd == data_sockfd) {
+            return transfer;
+        }
+    }
+
+    return NULL;
+}
+
+void handle_command_allocate(struct server_client_state *client, char *command) {
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return;
+    }
+
+    // The size of the next upload: ALLO <size>
+    long long size;
+    if (sscanf(command, "%*s %lld", &size) != 1 || size < 0) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return;
+    }
+
+    client->allocation_size = (off_t)size;
+    send_message(client->control_sockfd, "200 ALLO command successful.");
+}
+
+void handle_command_content_hash(struct server_state *server, struct server_client_state *client, char *command) {
+    static char blob_name[BLOB_NAME_MAX];
+
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return;
+    }
+
+    // Extract the hash from the command
+    strtok(command, " ");
+    char *hash = strtok(NULL, " ");
+    if (hash == NULL || hex_to_bytes(hash, client->content_hash, SHA256_DIGEST_SIZE) == -1) {
+        client->has_content_hash = 0;
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return;
+    }
+    client->has_content_hash = 1;
+
+    // Tell the client whether it can skip sending the data
+    struct stat stat_result;
+    format_blob_name(client, client->content_hash, blob_name);
+    if (server->storage.uses_fds && fstatat(server->blobs_dirfd, blob_name, &stat_result, 0) == 0) {
+        send_message(client->control_sockfd, "213 Content already stored.");
+    } else {
+        send_message(client->control_sockfd, "200 Content hash noted.");
+    }
+}
+
+int materialize_blob(struct server_state *server, struct server_client_state *client,
+    const uint8_t *content_hash, const char *filename) {
+    static char blob_name[BLOB_NAME_MAX];
+    static char temp_name[NAME_MAX + 1];
+    format_blob_name(client, content_hash, blob_name);
+
+    int blob_fd = openat(server->blobs_dirfd, blob_name, O_RDONLY);
+    if (blob_fd == -1) {
+        return -1;
+    }
+
+    // Prefer a reflink, which gives the file its own inode but shares the data blocks
+    int fd = create_upload_file(client->storage, client->current_dirfd, temp_name, 0);
+    if (fd == -1) {
+        close(blob_fd);
+        return -1;
+    }
+    int status = ioctl(fd, FICLONE, blob_fd);
+    close(fd);
+    close(blob_fd);
+
+    // Fall back to a hard link to the blob
+    if (status == -1) {
+        unlinkat(client->current_dirfd, temp_name, 0);
+        if (linkat(server->blobs_dirfd, blob_name, client->current_dirfd, temp_name, 0) == -1) {
+            perror("linkat");
+            return -1;
+        }
+    }
+
+    // Replace any existing file atomically
+    return commit_upload_file(server, client->current_dirfd, temp_name, filename, client->usage);
+}
+
+int create_upload_file(const struct storage *storage, int dirfd, char *temp_name, off_t size_hint) {
+    static unsigned int counter = 0;
+
+    // The process id and a counter make the name unique among all server processes
+    snprintf(temp_name, NAME_MAX + 1, UPLOAD_TEMP_NAME_PREFIX "%d.%u", (int)getpid(), counter++);
+    int fd = storage_open(storage, dirfd, temp_name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd == -1) {
+        perror("openat2");
+        return -1;
+    }
+
+    // Reserve the space up front so the file gets contiguous extents. The file size
+    // itself is kept at 0; filesystems that cannot preallocate just skip this.
+    if (size_hint > 0 && storage->uses_fds && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size_hint) == -1
+        && errno != EOPNOTSUPP && errno != ENOSYS) {
+        perror("fallocate");
+        if (errno == ENOSPC) {
+            storage_close(storage, fd);
+            storage_unlink(storage, dirfd, temp_name);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+int commit_upload_file(struct server_state *server, int dirfd, const char *temp_name, const char *filename,
+    struct usage_account *account) {
+    static char blob_name[BLOB_NAME_MAX];
+    const struct storage *storage = &(server->storage);
+
+    // Charge the user for the growth: the new file, less the file it replaces
+    struct stat stat_result, replaced_stat;
+    if (storage_stat(storage, dirfd, temp_name, &stat_result) == -1) {
+        perror("fstatat");
+        storage_unlink(storage, dirfd, temp_name);
+        return -1;
+    }
+    int replaces_file = storage_stat(storage, dirfd, filename, &replaced_stat) == 0 && S_ISREG(replaced_stat.st_mode);
+    int64_t growth = stat_result.st_size - (replaces_file ? replaced_stat.st_size : 0);
+    int has_blob = replaces_file && find_file_blob(server, dirfd, filename, &replaced_stat, blob_name);
+    if (usage_charge(account, growth) == -1) {
+        storage_unlink(storage, dirfd, temp_name);
+        errno = EDQUOT;
+        return -1;
+    }
+
+    if (storage_rename(storage, dirfd, temp_name, dirfd, filename) == -1) {
+        perror("renameat");
+        usage_charge(account, -growth);
+        storage_unlink(storage, dirfd, temp_name);
+        return -1;
+    }
+
+    // If both names were already hard links to the same blob, rename() does nothing
+    // and the temporary name is left behind (only files on disk have hard links)
+    if (storage->uses_fds) {
+        unlinkat(dirfd, temp_name, 0);
+    }
+    if (has_blob) {
+        release_blob(server, blob_name);
+    }
+    return 0;
+}
+
+int commit_upload_file_durably(struct server_state *server, int dirfd, int fd,
+    const char *temp_name, const char *filename, struct usage_account *account) {
+    if (!server->storage.uses_fds) {
+        // Files in memory cannot be flushed, and do not survive a restart anyway
+        return commit_upload_file(server, dirfd, temp_name, filename, account);
+    }
+
+#if SERVER_DURABILITY_MODE == DURABILITY_PER_FILE
+    if (fdatasync(fd) == -1) {
+        perror("fdatasync");
+        unlinkat(dirfd, temp_name, 0);
+        return -1;
+    }
+    if (commit_upload_file(server, dirfd, temp_name, filename, account) == -1) {
+        return -1;
+    }
+    return sync_directory(dirfd);
+#elif SERVER_DURABILITY_MODE == DURABILITY_GROUP_COMMIT
+    // Write back this file now, so that its data is on disk before the rename makes it
+    // visible, and the shared flush has little left to do
+    if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+        | SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+        perror("sync_file_range");
+    }
+    if (commit_upload_file(server, dirfd, temp_name, filename, account) == -1) {
+        return -1;
+    }
+
+    // The shared flush covers the new directory entry along with the data
+    return group_commit_sync(server->group_commit, fd);
+#else
+    (void)fd;
+    return commit_upload_file(server, dirfd, temp_name, filename, account);
+#endif
+}
+
+off_t regular_file_size(const struct storage *storage, int dirfd, const char *name) {
+    struct stat stat_result;
+    if (storage_stat(storage, dirfd, name, &stat_result) == -1 || !S_ISREG(stat_result.st_mode)) {
+        return 0;
+    }
+    return stat_result.st_size;
+}
+
+int check_upload_quota(struct server_client_state *client, int dirfd, const char *filename, off_t size) {
+    if (usage_exceeds_quota(client->usage, size - regular_file_size(client->storage, dirfd, filename))) {
+        send_message(client->control_sockfd, "552 Requested file action aborted. Exceeded storage allocation.");
+        return -1;
+    }
+    return 0;
+}
+
+void send_upload_failed(struct server_client_state *client) {
+    send_message(client->control_sockfd, errno == EDQUOT
+        ? "552 Requested file action aborted. Exceeded storage allocation."
+        : "451 Requested action aborted: local error in processing.");
+}
+
+int sync_directory(int dirfd) {
+    // O_PATH descriptors cannot be flushed, so open the directory again for reading
+    int sync_fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY);
+    if (sync_fd == -1) {
+        perror("openat");
+        return -1;
+    }
+    int status = fsync(sync_fd);
+    if (status == -1) {
+        perror("fsync");
+    }
+    close(sync_fd);
+    return status;
+}
+
+void format_blob_name(struct server_client_state *client, const uint8_t *content_hash, char *result) {
+    static char hex[SHA256_HEX_SIZE];
+    bytes_to_hex(content_hash, SHA256_DIGEST_SIZE, hex);
+    sprintf(result, "%s/%s", userdb_username(&(client->users->db), client->user), hex);
+}
+
+void index_blob(struct server_state *server, struct server_client_state *client, int fd, const uint8_t *content_hash) {
+    static char blob_name[BLOB_NAME_MAX];
+    static char fd_path[64];
+
+    // Record the name in the inode first: a blob that removing its files could not find
+    // would never be freed, so files are only indexed where extended attributes work
+    format_blob_name(client, content_hash, blob_name);
+    if (fsetxattr(fd, BLOB_XATTR_NAME, blob_name, strlen(blob_name), 0) == -1) {
+        if (errno != ENOTSUP) {
+            perror("fsetxattr");
+        }
+        return;
+    }
+
+    // Link the inode of the open file into the index, through its /proc entry
+    sprintf(fd_path, "/proc/self/fd/%d", fd);
+    int status = linkat(AT_FDCWD, fd_path, server->blobs_dirfd, blob_name, AT_SYMLINK_FOLLOW);
+    if (status == -1 && errno == ENOENT) {
+        // First blob of this user; another process may be creating the directory at the same time
+        const char *username = userdb_username(&(client->users->db), client->user);
+        if (mkdirat(server->blobs_dirfd, username, S_IRWXU) == -1 && errno != EEXIST) {
+            perror("mkdirat");
+            return;
+        }
+        status = linkat(AT_FDCWD, fd_path, server->blobs_dirfd, blob_name, AT_SYMLINK_FOLLOW);
+    }
+    if (status == -1 && errno != EEXIST) {
+        perror("linkat");
+    }
+}
+
+int find_file_blob(struct server_state *server, int dirfd, const char *name, const struct stat *stat_result,
+    char *blob_name) {
+    // Only files on disk are indexed, and a file linked to its blob has at least one more name
+    if (!server->storage.uses_fds || !S_ISREG(stat_result->st_mode) || stat_result->st_nlink < 2) {
+        return 0;
+    }
+    int fd = storage_open(&(server->storage), dirfd, name, O_RDONLY | O_NONBLOCK, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t length = fgetxattr(fd, BLOB_XATTR_NAME, blob_name, BLOB_NAME_MAX - 1);
+    storage_close(&(server->storage), fd);
+    if (length <= 0) {
+        return 0;
+    }
+    blob_name[length] = '\0';
+
+    // The attribute names the blob the inode was indexed as; it counts only if it is still that blob
+    struct stat blob_stat;
+    return fstatat(server->blobs_dirfd, blob_name, &blob_stat, AT_SYMLINK_NOFOLLOW) == 0
+        && blob_stat.st_dev == stat_result->st_dev && blob_stat.st_ino == stat_result->st_ino;
+}
+
+void release_blob(struct server_state *server, const char *blob_name) {
+    // Once the index holds the only link left, the content is no longer stored by the user
+    struct stat stat_result;
+    if (fstatat(server->blobs_dirfd, blob_name, &stat_result, AT_SYMLINK_NOFOLLOW) == 0 && stat_result.st_nlink == 1
+        && unlinkat(server->blobs_dirfd, blob_name, 0) == -1 && errno != ENOENT) {
+        perror("unlinkat");
+    }
+}
+
+void sweep_blobs(struct server_state *server) {
+    if (!server->storage.uses_fds) {
+        return;
+    }
+    int fd = openat(server->blobs_dirfd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        perror("opendir");
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat stat_result;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+            || fstatat(server->blobs_dirfd, entry->d_name, &stat_result, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        if (S_ISDIR(stat_result.st_mode)) {
+            sweep_user_blobs(server, entry->d_name);
+        } else if (unlinkat(server->blobs_dirfd, entry->d_name, 0) == -1) {
+            // A blob shared by all users, which no lookup reaches any more
+            perror("unlinkat");
+        }
+    }
+    closedir(dir);
+}
+
+void sweep_user_blobs(struct server_state *server, const char *username) {
+    int fd = openat(server->blobs_dirfd, username, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (dir == NULL) {
+        perror("opendir");
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat stat_result;
+        if (fstatat(fd, entry->d_name, &stat_result, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(stat_result.st_mode)
+            && stat_result.st_nlink == 1 && unlinkat(fd, entry->d_name, 0) == -1) {
+            perror("unlinkat");
+        }
+    }
+    closedir(dir);
+}
+
+int receive_stored_file(const struct storage *storage, int data_sockfd, int fd, struct hash_ctx *hashes, int hash_count) {
+    static char buf[FILE_TRANSFER_BUFFER_SIZE];
+
+    // Files on disk are written sparsely, punching out the space ALLO preallocated
+    // for the blocks of zeros that are skipped
+    struct sparse_writer writer;
+    sparse_writer_init(&writer, fd, 1);
+
+    ssize_t bytes_received;
+    while ((bytes_received = tls_recv(data_sockfd, buf, sizeof(buf))) > 0) {
+        // Hash the bytes while they are still in the cache
+        for (int i = 0; i < hash_count; i++) {
+            hash_update(&hashes[i], buf, bytes_received);
+        }
+
+        if (storage->uses_fds) {
+            if (sparse_write(&writer, buf, bytes_received) == -1) {
+                return -1;
+            }
+        } else if (storage_write(storage, fd, buf, bytes_received) == -1) {
+            perror("write");
+            return -1;
+        }
+    }
+    if (bytes_received == -1) {
+        perror("recv");
+        return -1;
+    }
+
+    return storage->uses_fds ? sparse_writer_finish(&writer) : 0;
+}
+
+int handle_command_retrieve(struct server_state *server, struct server_client_state *client, char *command) {
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "532 Need account for storing files.");
+        return 0;
+    }
+    if (!client->has_data_addr) {
+        send_message(client->control_sockfd, "503 Bad sequence of commands.");
+        return 0;
+    }
+
+    // Extract the filename from the command
+    strtok(command, " ");
+    char *filename = strtok(NULL, " ");
+    if (filename == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return 0;
+    }
+    struct stat stat_result;
+    int fd = open_client_file(client, filename, &stat_result);
+    if (fd == -1) {
+        return 0;
+    }
+
+    struct transfer *transfer = create_transfer(server, client, TRANSFER_KIND_RETRIEVE);
+    transfer->fd = fd;
+    transfer->stat_result = stat_result;
+
+    start_data_connection(server, transfer);
+    return 1;
+}
+
+int open_client_file(struct server_client_state *client, const char *filename, struct stat *stat_result) {
+    // Ensure the filename has no slashes
+    char *last_slash = strrchr(filename, '/');
+    if (last_slash != NULL) {
+        send_message(client->control_sockfd, "550 Requested action not taken. File name not allowed.");
+        return -1;
+    }
+
+    // Open the file beneath the client directory
+    // (non-blocking, so that opening a FIFO cannot hang the reactor)
+    int fd = storage_open(client->storage, client->current_dirfd, filename, O_RDONLY | O_NONBLOCK, 0);
+    if (fd == -1 || storage_stat(client->storage, fd, NULL, stat_result) == -1) {
+        if (fd != -1) {
+            storage_close(client->storage, fd);
+        }
+        send_message(client->control_sockfd, "550 No such file or directory.");
+        return -1;
+    }
+
+    // Ensure the file is a regular file
+    if (!S_ISREG(stat_result->st_mode)) {
+        storage_close(client->storage, fd);
+        send_message(client->control_sockfd, S_ISDIR(stat_result->st_mode)
+            ? "504 Command not implemented for that parameter."
+            : "550 No such file or directory.");
+        return -1;
+    }
+    return fd;
+}
+
+void run_retrieve_transfer(struct server_state *server, struct server_client_state *client, struct transfer *transfer) {
+    // Send the file, going through the hot file cache for small files on disk
+    struct hash_ctx checksum;
+    hash_init(&checksum, TRANSFER_CHECKSUM_ALGORITHM);
+    int status;
+    if (!client->storage->uses_fds) {
+        status = send_stored_file(client->storage, transfer->data_sockfd, transfer->fd, &checksum);
+    } else if (transfer->stat_result.st_size <= HOT_CACHE_MAX_FILE_SIZE) {
+        status = send_small_file(server, transfer->data_sockfd, transfer->fd, &(transfer->stat_result), &checksum);
+    } else {
+        status = send_large_file(transfer->data_sockfd, transfer->fd, &(transfer->stat_result), &checksum);
+    }
+    storage_close(client->storage, transfer->fd);
+    
+    // Disconnect
+    close_data_connection(transfer->data_sockfd, status == 0);
+
+    // Notify client whether the data transfer is complete
+    if (status == -1) {
+        send_message(client->control_sockfd, "426 Connection closed; transfer aborted.");
+        exit(EXIT_FAILURE);
+    }
+    send_transfer_completed(client, &checksum);
+
+    // Since this is a child process of the server, exit successfully
+    exit(EXIT_SUCCESS);
+}
+
+int send_small_file(struct server_state *server, int data_sockfd, int fd, struct stat *stat_result,
+    struct hash_ctx *checksum) {
+    static char buf[HOT_CACHE_MAX_FILE_SIZE];
+
+    // Serve the file from memory if it is cached
+    struct hot_cache_key key;
+    hot_cache_make_key(&key, stat_result);
+    if (hot_cache_lookup(server->hot_cache, &key, buf)) {
+        hash_update(checksum, buf, key.size);
+        return send_all(data_sockfd, buf, key.size);
+    }
+
+    // Otherwise read the whole file into the buffer
+    size_t total = 0;
+    while (total < (size_t)key.size) {
+        ssize_t bytes_read = read(fd, buf + total, key.size - total);
+        if (bytes_read == -1) {
+            perror("read");
+            return -1;
+        } else if (bytes_read == 0) {
+            // The file was truncated since fstat()
+            break;
+        }
+        total += bytes_read;
+    }
+
+    // Send it, and offer it to the cache if it is still the version described by the key
+    hash_update(checksum, buf, total);
+    if (send_all(data_sockfd, buf, total) == -1) {
+        return -1;
+    }
+    if (total == (size_t)key.size) {
+        hot_cache_admit(server->hot_cache, &key, buf);
+    }
+
+    // Send anything appended to the file since fstat()
+    return send_file_fd(data_sockfd, fd, checksum, 1);
+}
+
+int send_large_file(int data_sockfd, int fd, struct stat *stat_result, struct hash_ctx *checksum) {
+    // Aligned so that it can be used for direct I/O
+    static char buf[FILE_TRANSFER_BUFFER_SIZE] __attribute__((aligned(4096)));
+
+    off_t size = stat_result->st_size;
+    int readahead = size >= RETRIEVE_READAHEAD_THRESHOLD;
+    int drop_cache = size >= RETRIEVE_DROP_CACHE_THRESHOLD;
+
+    // Very large files bypass the page cache, if the filesystem allows it
+    if (RETRIEVE_DIRECT_IO_THRESHOLD > 0 && size >= RETRIEVE_DIRECT_IO_THRESHOLD
+        && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0) {
+        readahead = 0;
+        drop_cache = 0;
+    }
+
+    // Ask for aggressive readahead of the first window
+    off_t advised_until = 0;
+    if (readahead) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, RETRIEVE_READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+        advised_until = RETRIEVE_READAHEAD_WINDOW;
+    }
+
+    // The holes of sparse files are sent as zeros without reading them
+    int sparse = is_file_sparse(stat_result);
+
+    off_t offset = 0;
+    off_t data_end = 0;
+    off_t dropped_until = 0;
+    ssize_t bytes_read;
+    while (1) {
+        if (sparse && offset == data_end) {
+            off_t data_start;
+            if (find_file_data(fd, offset, &data_start, &data_end) == -1
+                || send_zeros(data_sockfd, data_start - offset, checksum, 1) == -1) {
+                return -1;
+            }
+            offset = data_start;
+        }
+        size_t count = sizeof(buf);
+        if (sparse && (off_t)count > data_end - offset) {
+            count = data_end - offset;
+        }
+        if ((bytes_read = read(fd, buf, count)) <= 0) {
+            break;
+        }
+
+        hash_update(checksum, buf, bytes_read);
+        if (send_all(data_sockfd, buf, bytes_read) == -1) {
+            return -1;
+        }
+        offset += bytes_read;
+
+        // Keep a full window being read ahead of the reader
+        if (readahead && offset + RETRIEVE_READAHEAD_WINDOW / 2 >= advised_until) {
+            posix_fadvise(fd, advised_until, RETRIEVE_READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
+            advised_until += RETRIEVE_READAHEAD_WINDOW;
+        }
+
+        // Drop what has been sent, one window at a time
+        if (drop_cache && offset - dropped_until >= RETRIEVE_READAHEAD_WINDOW) {
+            posix_fadvise(fd, dropped_until, offset - dropped_until, POSIX_FADV_DONTNEED);
+            dropped_until = offset;
+        }
+    }
+    if (bytes_read == -1) {
+        perror("read");
+        return -1;
+    }
+
+    if (drop_cache) {
+        posix_fadvise(fd, dropped_until, 0, POSIX_FADV_DONTNEED);
+    }
+    return 0;
+}
+
+int send_stored_file(const struct storage *storage, int data_sockfd, int fd, struct hash_ctx *checksum) {
+    static char buf[FILE_TRANSFER_BUFFER_SIZE];
+
+    ssize_t bytes_read;
+    while ((bytes_read = storage_read(storage, fd, buf, sizeof(buf))) > 0) {
+        hash_update(checksum, buf, bytes_read);
+        if (send_all(data_sockfd, buf, bytes_read) == -1) {
+            return -1;
+        }
+    }
+    if (bytes_read == -1) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
+
+void send_transfer_completed(struct server_client_state *client, struct hash_ctx *checksum) {
+    static char formatted_checksum[16 + HASH_HEX_MAX];
+    static char response[COMMAND_STR_MAX];
+
+    format_transfer_checksum(checksum, formatted_checksum);
+    sprintf(response, "226 Transfer completed. %s", formatted_checksum);
+    send_message(client->control_sockfd, response);
+}
+
+int handle_command_signature(struct server_state *server, struct server_client_state *client, char *command) {
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return 0;
+    }
+    // Signatures and deltas work on the file descriptors of files on disk
+    if (!client->storage->uses_fds) {
+        send_message(client->control_sockfd, "502 Command not implemented.");
+        return 0;
+    }
+    if (!client->has_data_addr) {
+        send_message(client->control_sockfd, "503 Bad sequence of commands.");
+        return 0;
+    }
+
+    // Extract the filename from the command
+    strtok(command, " ");
+    char *filename = strtok(NULL, " ");
+    if (filename == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return 0;
+    }
+
+    struct stat stat_result;
+    int fd = open_client_file(client, filename, &stat_result);
+    if (fd == -1) {
+        return 0;
+    }
+
+    struct transfer *transfer = create_transfer(server, client, TRANSFER_KIND_SIGNATURE);
+    transfer->fd = fd;
+    transfer->stat_result = stat_result;
+
+    start_data_connection(server, transfer);
+    return 1;
+}
+
+void run_signature_transfer(struct server_client_state *client, struct transfer *transfer) {
+    int status = delta_send_signature(transfer->data_sockfd, transfer->fd, transfer->stat_result.st_size);
+    close(transfer->fd);
+
+    // Disconnect
+    close_data_connection(transfer->data_sockfd, status == 0);
+
+    // Notify client whether the data transfer is complete
+    if (status == -1) {
+        send_message(client->control_sockfd, "426 Connection closed; transfer aborted.");
+        exit(EXIT_FAILURE);
+    }
+    send_message(client->control_sockfd, "226 Transfer completed.");
+
+    // Since this is a child process of the server, exit successfully
+    exit(EXIT_SUCCESS);
+}
+
+int handle_command_delta_store(struct server_state *server, struct server_client_state *client, char *command) {
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "532 Need account for storing files.");
+        return 0;
+    }
+
+    // The announced content is used up by this command, whatever happens
+    off_t allocation_size = client->allocation_size;
+    client->allocation_size = 0;
+    int has_content_hash = client->has_content_hash;
+    client->has_content_hash = 0;
+    if (!client->storage->uses_fds) {
+        send_message(client->control_sockfd, "502 Command not implemented.");
+        return 0;
+    }
+    if (!has_content_hash || !client->has_data_addr) {
+        send_message(client->control_sockfd, "503 Bad sequence of commands.");
+        return 0;
+    }
+
     // Extract the filename from the command
     strtok(command, " ");
     char *filename = strtok(NULL, " ");
     if (filename == NULL) {
         send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return 0;
+    }
+
+    // The current version of the file, which the delta refers to
+    struct stat stat_result;
+    int basis_fd = open_client_file(client, filename, &stat_result);
+    if (basis_fd == -1) {
+        return 0;
+    }
+
+    // Reject the upload up front if its announced size does not fit in the quota
+    if (usage_exceeds_quota(client->usage, allocation_size - stat_result.st_size)) {
+        close(basis_fd);
+        send_message(client->control_sockfd, "552 Requested file action aborted. Exceeded storage allocation.");
+        return 0;
+    }
+
+    // Build the new version in a temporary file, as STOR does
+    struct transfer *transfer = create_transfer(server, client, TRANSFER_KIND_DELTA_STORE);
+    transfer->basis_fd = basis_fd;
+    transfer->fd = create_upload_file(client->storage, client->current_dirfd, transfer->temp_name, allocation_size);
+    if (transfer->fd == -1) {
+        transfer->temp_name[0] = '\0';
+        free_transfer(server, transfer);
+        send_message(client->control_sockfd, "550 Requested action not taken. File unavailable.");
+        // The slot was given back with the transfer
+        return 1;
+    }
+    transfer->allocation_size = allocation_size;
+    memcpy(transfer->content_hash, client->content_hash, SHA256_DIGEST_SIZE);
+    strncpy(transfer->filename, filename, NAME_MAX);
+    transfer->filename[NAME_MAX] = '\0';
+
+    start_data_connection(server, transfer);
+    return 1;
+}
+
+void run_delta_store_transfer(struct server_state *server, struct server_client_state *client, struct transfer *transfer) {
+    int fd = transfer->fd;
+    const char *temp_name = transfer->temp_name;
+
+    // Rebuild the file, computing the transfer checksum and the SHA-256 along the way
+    struct hash_ctx hashes[2];
+    hash_init(&hashes[0], TRANSFER_CHECKSUM_ALGORITHM);
+    hash_init(&hashes[1], HASH_ALGORITHM_SHA256);
+    int status = delta_apply(transfer->data_sockfd, transfer->basis_fd, fd, hashes, 2);
+    close(transfer->basis_fd);
+
+    // Disconnect
+    close_data_connection(transfer->data_sockfd, status == 0);
+
+    if (status == -1) {
+        close(fd);
+        unlinkat(client->current_dirfd, temp_name, 0);
+        send_message(client->control_sockfd, "426 Connection closed; transfer aborted.");
+        exit(EXIT_FAILURE);
+    }
+
+    // A delta against a version other than the one it was made for rebuilds the wrong file
+    uint8_t content_hash[SHA256_DIGEST_SIZE];
+    sha256_final(&(hashes[1].state.sha256), content_hash);
+    if (memcmp(content_hash, transfer->content_hash, SHA256_DIGEST_SIZE) != 0) {
+        close(fd);
+        unlinkat(client->current_dirfd, temp_name, 0);
+        send_message(client->control_sockfd, "550 Requested action not taken. Result does not match the announced content.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Give back preallocated space that was not used
+    off_t size = lseek(fd, 0, SEEK_CUR);
+    if (transfer->allocation_size > size && ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+    }
+
+    // Make the file durable and put it in place
+    if (commit_upload_file_durably(server, client->current_dirfd, fd, temp_name, transfer->filename,
+        client->usage) == -1) {
+        close(fd);
+        send_upload_failed(client);
+        exit(EXIT_FAILURE);
+    }
+    index_blob(server, client, fd, content_hash);
+    close(fd);
+
+    send_transfer_completed(client, &hashes[0]);
+
+    // Since this is a child process of the server, exit successfully
+    exit(EXIT_SUCCESS);
+}
+
+int handle_command_list(struct server_state *server, struct server_client_state *client, char *command, int kind) {
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return 0;
+    }
+    if (!client->has_data_addr) {
+        send_message(client->control_sockfd, "503 Bad sequence of commands.");
+        return 0;
+    }
+
+    // MLSD can only list the current directory (LIST ignores its arguments)
+    strtok(command, " ");
+    if (kind == TRANSFER_KIND_MACHINE_LIST && strtok(NULL, " ") != NULL) {
+        send_message(client->control_sockfd, "504 Command not implemented for that parameter.");
+        return 0;
+    }
+
+    // The directory is read by the transfer process
+    start_data_connection(server, create_transfer(server, client, kind));
+    return 1;
+}
+
+void run_list_transfer(struct server_client_state *client, struct transfer *transfer) {
+    static char buf[COMMAND_STR_MAX];
+
+    // List the files
+    struct directory_listing listing = { buf, sizeof(buf), 0, transfer->data_sockfd, 0 };
+    buf[0] = '\0';
+    if (storage_list(client->storage, client->current_dirfd, append_list_entry, &listing) == -1) {
+        perror("opendir");
+        // The client sees an empty listing, followed by the error
+        close_data_connection(transfer->data_sockfd, 1);
+        send_message(client->control_sockfd, "451 Requested action aborted: local error in processing.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Send the data
+    send_message(transfer->data_sockfd, buf);
+
+    // Disconnect
+    close_data_connection(transfer->data_sockfd, 1);
+
+    // Notify client that the data transfer is complete
+    send_message(client->control_sockfd, "226 Transfer completed.");
+
+    // Since this is a child process of the server, exit successfully
+    exit(EXIT_SUCCESS);
+}
+
+int append_list_entry(const char *name, const struct stat *stat_result, void *data) {
+    (void)stat_result;
+    struct directory_listing *listing = data;
+
+    // Stop once the buffer is full
+    size_t remaining_bytes = listing->size - listing->length - 1;
+    if (remaining_bytes < strlen(name) + 1) {
+        return 1;
+    }
+
+    listing->length += sprintf(listing->buf + listing->length, "%s%s", listing->length == 0 ? "" : "\n", name);
+    return 0;
+}
+
+void run_machine_list_transfer(struct server_client_state *client, struct transfer *transfer) {
+    static char buf[FILE_TRANSFER_BUFFER_SIZE];
+
+    // Stream one line of facts per entry, however large the directory is
+    struct directory_listing listing = { buf, sizeof(buf), 0, transfer->data_sockfd, 0 };
+    if (storage_list(client->storage, client->current_dirfd, append_machine_list_entry, &listing) == -1) {
+        perror("opendir");
+        close_data_connection(transfer->data_sockfd, 1);
+        send_message(client->control_sockfd, "451 Requested action aborted: local error in processing.");
+        exit(EXIT_FAILURE);
+    }
+    int status = listing.status;
+    if (status == 0) {
+        status = send_all(transfer->data_sockfd, buf, listing.length);
+    }
+
+    // Disconnect
+    close_data_connection(transfer->data_sockfd, status == 0);
+
+    if (status == -1) {
+        send_message(client->control_sockfd, "426 Connection closed; transfer aborted.");
+        exit(EXIT_FAILURE);
+    }
+    send_message(client->control_sockfd, "226 Transfer completed.");
+
+    // Since this is a child process of the server, exit successfully
+    exit(EXIT_SUCCESS);
+}
+
+int append_machine_list_entry(const char *name, const struct stat *stat_result, void *data) {
+    struct directory_listing *listing = data;
+
+    // Only files and directories are listed; symlinks are not followed
+    if (!S_ISREG(stat_result->st_mode) && !S_ISDIR(stat_result->st_mode)) {
+        return 0;
+    }
+
+    // Make room for the longest possible line
+    if (listing->size - listing->length < NAME_MAX + 128) {
+        listing->status = send_all(listing->data_sockfd, listing->buf, listing->length);
+        listing->length = 0;
+        if (listing->status == -1) {
+            return 1;
+        }
+    }
+
+    struct tm modified;
+    gmtime_r(&(stat_result->st_mtime), &modified);
+    listing->length += snprintf(listing->buf + listing->length, listing->size - listing->length,
+        "type=%s;size=%lld;modify=%04d%02d%02d%02d%02d%02d; %s\r\n",
+        S_ISDIR(stat_result->st_mode) ? "dir" : "file", (long long)stat_result->st_size,
+        modified.tm_year + 1900, modified.tm_mon + 1, modified.tm_mday,
+        modified.tm_hour, modified.tm_min, modified.tm_sec, name);
+    return 0;
+}
+
+void handle_command_options(struct server_client_state *client, char *command) {
+    static char response[COMMAND_STR_MAX];
+
+    // The only option is the algorithm of the HASH command: OPTS HASH [algorithm]
+    strtok(command, " ");
+    char *option = strtok(NULL, " ");
+    if (option == NULL || strcasecmp(option, COMMAND_HASH) != 0) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return;
+    }
+
+    char *algorithm_name = strtok(NULL, " ");
+    if (algorithm_name != NULL && hash_algorithm_from_name(algorithm_name, &(client->hash_algorithm)) == -1) {
+        send_message(client->control_sockfd, "504 Command not implemented for that parameter.");
         return;
     }
 
-    // Ensure the filename has no slashes
-    char *last_slash = strrchr(filename, '/');
-    if (last_slash != NULL) {
-        send_message(client->control_sockfd, "550 Requested action not taken. File name not allowed.");
-        return;
+    sprintf(response, "200 %s", hash_algorithm_name(client->hash_algorithm));
+    send_message(client->control_sockfd, response);
+}
+
+int handle_command_hash(struct server_state *server, struct server_client_state *client, char *command) {
+    static char hex[HASH_HEX_MAX];
+    static char response[COMMAND_STR_MAX * 2];
+
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return 0;
+    }
+
+    // Extract the filename from the command
+    strtok(command, " ");
+    char *filename = strtok(NULL, " ");
+    if (filename == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return 0;
+    }
+    if (strchr(filename, '/') != NULL) {
+        send_message(client->control_sockfd, "550 Requested action not taken. File name not allowed.");
+        return 0;
+    }
+
+    // Open the file beneath the client directory and ensure it is a regular file
+    struct storage *storage = client->storage;
+    int fd = storage_open(storage, client->current_dirfd, filename, O_RDONLY | O_NONBLOCK, 0);
+    struct stat stat_result;
+    if (fd == -1 || storage_stat(storage, fd, NULL, &stat_result) == -1 || !S_ISREG(stat_result.st_mode)) {
+        if (fd != -1) {
+            storage_close(storage, fd);
+        }
+        send_message(client->control_sockfd, "550 No such file or directory.");
+        return 0;
+    }
+
+    // Answer right away if the hash of this version of the file is cached
+    if (storage->uses_fds && read_cached_hash(fd, &stat_result, client->hash_algorithm, hex) == 0) {
+        storage_close(storage, fd);
+        snprintf(response, sizeof(response), "213 %s 0-%lld %s %s", hash_algorithm_name(client->hash_algorithm),
+            (long long)stat_result.st_size, hex, filename);
+        send_message(client->control_sockfd, response);
+        return 0;
+    }
+
+    // Otherwise, hash the file in a child process so that large files do not block the reactor;
+    // the process holds the transfer slot until it is reaped
+    struct transfer *transfer = create_transfer(server, client, TRANSFER_KIND_HASH);
+    transfer->fd = fd;
+    pid_t child_pid = fork();
+    if (child_pid == -1) {
+        perror("fork");
+        abort_transfer(server, transfer, "451 Requested action aborted: local error in processing.");
+        return 1;
+    } else if (child_pid > 0) {
+        // This is the parent process
+        transfer->pid = child_pid;
+        storage_close(storage, fd);
+        transfer->fd = -1;
+        return 1;
+    }
+
+    // This is the child process
+    detach_control_connection(client);
+    if (hash_stored_file(storage, fd, client->hash_algorithm, hex) == -1) {
+        send_message(client->control_sockfd, "451 Requested action aborted: local error in processing.");
+        exit(EXIT_FAILURE);
+    }
+    if (storage->uses_fds) {
+        write_cached_hash(fd, &stat_result, client->hash_algorithm, hex);
+    }
+    storage_close(storage, fd);
+
+    snprintf(response, sizeof(response), "213 %s 0-%lld %s %s", hash_algorithm_name(client->hash_algorithm),
+        (long long)stat_result.st_size, hex, filename);
+    send_message(client->control_sockfd, response);
+
+    // Since this is a child process of the server, exit successfully
+    exit(EXIT_SUCCESS);
+}
+
+int hash_stored_file(const struct storage *storage, int fd, enum hash_algorithm algorithm, char *hex) {
+    static uint8_t buf[256 * 1024];
+
+    struct hash_ctx ctx;
+    hash_init(&ctx, algorithm);
+
+    ssize_t bytes_read;
+    while ((bytes_read = storage_read(storage, fd, buf, sizeof(buf))) > 0) {
+        hash_update(&ctx, buf, bytes_read);
     }
 
-    // Send ready response
-    send_message(client->control_sockfd, "150 File status okay; about to open data connection.");
+    // Finish even after a failed read, which frees the state
+    hash_final_hex(&ctx, hex);
+    if (bytes_read == -1) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
 
-    // Connect
-    int data_sockfd;
-    connect_to_addr(client->data_addr, &data_sockfd, NULL);
+int read_cached_hash(int fd, const struct stat *stat_result, enum hash_algorithm algorithm, char *hex) {
+    static char name[64];
+    static char value[64 + HASH_HEX_MAX];
 
-    // Receive the file and save it at the client directory
-    sprintf(buf, "%s/%s", client->current_path, filename);
-    save_file(data_sockfd, buf);
+    sprintf(name, HASH_XATTR_PREFIX "%s", hash_algorithm_name(algorithm));
+    ssize_t length = fgetxattr(fd, name, value, sizeof(value) - 1);
+    if (length <= 0) {
+        return -1;
+    }
+    value[length] = '\0';
 
-    // Disconnect
-    close(data_sockfd);
-    client->has_data_addr = 0;
+    // The value is "<mtime seconds>.<mtime nanoseconds> <size> <hash>"
+    long long mtime_sec, mtime_nsec, size;
+    static char cached_hex[HASH_HEX_MAX];
+    if (sscanf(value, "%lld.%lld %lld %64s", &mtime_sec, &mtime_nsec, &size, cached_hex) != 4) {
+        return -1;
+    }
 
-    // Notify client that the data transfer is complete
-    send_message(client->control_sockfd, "226 Transfer completed.");
+    // The hash is only valid for the version of the file it was computed for
+    if (mtime_sec != (long long)stat_result->st_mtim.tv_sec || mtime_nsec != (long long)stat_result->st_mtim.tv_nsec
+        || size != (long long)stat_result->st_size) {
+        return -1;
+    }
 
-    // Since this is a child process of the server, exit successfully
-    exit(EXIT_SUCCESS);
+    strcpy(hex, cached_hex);
+    return 0;
+}
+
+void write_cached_hash(int fd, const struct stat *stat_result, enum hash_algorithm algorithm, const char *hex) {
+    static char name[64];
+    static char value[64 + HASH_HEX_MAX];
+
+    // Do not cache the hash if the file changed while it was being hashed
+    struct stat current;
+    if (fstat(fd, &current) == -1 || current.st_size != stat_result->st_size
+        || current.st_mtim.tv_sec != stat_result->st_mtim.tv_sec
+        || current.st_mtim.tv_nsec != stat_result->st_mtim.tv_nsec) {
+        return;
+    }
+
+    sprintf(name, HASH_XATTR_PREFIX "%s", hash_algorithm_name(algorithm));
+    int length = sprintf(value, "%lld.%lld %lld %s", (long long)stat_result->st_mtim.tv_sec,
+        (long long)stat_result->st_mtim.tv_nsec, (long long)stat_result->st_size, hex);
+
+    // Filesystems without extended attributes simply do not cache
+    fsetxattr(fd, name, value, length, 0);
 }
 
-void handle_command_retrieve(struct server_client_state *client, char *command) {
-    static char buf[PATH_MAX + 1 + COMMAND_STR_MAX];
+void handle_command_change_directory(struct server_client_state *client, char *command) {
+    static char new_path[PATH_MAX];
+    static char directory[PATH_MAX];
+    static char response[COMMAND_STR_MAX];
 
     if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
-        send_message(client->control_sockfd, "532 Need account for storing files.");
+        send_message(client->control_sockfd, "530 Not logged in.");
         return;
     }
-    if (!client->has_data_addr) {
-        send_message(client->control_sockfd, "503 Bad sequence of commands.");
+
+    // Extract the path from the command
+    strtok(command, " ");
+    char *path = strtok(NULL, " ");
+    if (path == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
         return;
     }
 
-    // Fork a child process to handle the data transfer
-    pid_t child_pid = fork();
-    if (child_pid > 0) {
-        // This is the parent process, just exit
+    // Construct the new working directory relative to the user's base directory
+    // Paths that would leave the base directory are rejected here already
+    if (sandbox_normalize_path(client->current_path->path, path, new_path, sizeof(new_path)) == -1) {
+        send_message(client->control_sockfd, "550 No such file or directory.");
         return;
     }
 
-    // This is the child process
-    // Extract the filename from the command
+    // Open the new working directory beneath the user's base directory;
+    // the kernel refuses symlinks that point outside of it
+    int dirfd = storage_open(client->storage, client->root_dirfd, new_path[0] == '\0' ? "." : new_path,
+        O_PATH | O_DIRECTORY, 0);
+    struct stat stat_result;
+    if (dirfd == -1 || storage_stat(client->storage, dirfd, NULL, &stat_result) == -1) {
+        if (dirfd != -1) {
+            storage_close(client->storage, dirfd);
+        }
+        send_message(client->control_sockfd, "550 No such file or directory.");
+        return;
+    }
+
+    // Update the user's working directory
+    storage_close(client->storage, client->current_dirfd);
+    client->current_dirfd = dirfd;
+    client->current_dev = stat_result.st_dev;
+    client->current_ino = stat_result.st_ino;
+    path_release(client->current_path);
+    client->current_path = path_intern(new_path);
+
+    // Prepare the response, then send it
+    format_client_directory(client, directory);
+    snprintf(response, sizeof(response), "200 directory changed to %s", directory);
+    send_message(client->control_sockfd, response);
+}
+
+void handle_command_print_directory(struct server_client_state *client) {
+    static char buf1[PATH_MAX], buf2[COMMAND_STR_MAX];
+
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return;
+    }
+
+    format_client_directory(client, buf1);
+    snprintf(buf2, sizeof(buf2), "257 %s", buf1);
+    send_message(client->control_sockfd, buf2);
+}
+
+int open_parent_directory(struct server_client_state *client, const char *path, const char **name) {
+    static char parent_path[PATH_MAX];
+
+    strcpy(parent_path, path);
+    char *last_slash = strrchr(parent_path, '/');
+    if (last_slash != NULL) {
+        *last_slash = '\0';
+        *name = path + (last_slash - parent_path) + 1;
+    } else {
+        strcpy(parent_path, ".");
+        *name = path;
+    }
+    return storage_open(client->storage, client->root_dirfd, parent_path, O_PATH | O_DIRECTORY, 0);
+}
+
+void handle_command_make_directory(struct server_client_state *client, char *command) {
+    static char new_path[PATH_MAX];
+    static char response[COMMAND_STR_MAX];
+
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return;
+    }
+
+    // Extract the path from the command
     strtok(command, " ");
-    char *filename = strtok(NULL, " ");
-    if (filename == NULL) {
+    char *path = strtok(NULL, " ");
+    if (path == NULL) {
         send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
         return;
     }
-    // Ensure the filename has no slashes
-    char *last_slash = strrchr(filename, '/');
-    if (last_slash != NULL) {
+
+    // Resolve the path as CWD does; the user's directory itself cannot be created
+    if (sandbox_normalize_path(client->current_path->path, path, new_path, sizeof(new_path)) == -1
+        || new_path[0] == '\0') {
         send_message(client->control_sockfd, "550 Requested action not taken. File name not allowed.");
         return;
     }
 
-    // Write the file path into the buffer
-    sprintf(buf, "%s/%s", client->current_path, filename);
-
-    // Ensure the file exists
-    if (is_path_directory(buf)) {
-        send_message(client->control_sockfd, "504 Command not implemented for that parameter.");
-        return;    
-    } else if (!is_path_file(buf)) {
+    // Open the parent directory beneath the user's directory, and create the new one in it
+    const char *name;
+    int parent_dirfd = open_parent_directory(client, new_path, &name);
+    if (parent_dirfd == -1) {
         send_message(client->control_sockfd, "550 No such file or directory.");
         return;
     }
+    int status = storage_mkdir(client->storage, parent_dirfd, name, 0755);
+    storage_close(client->storage, parent_dirfd);
+    if (status == -1) {
+        send_message(client->control_sockfd, errno == EEXIST
+            ? "550 Requested action not taken. File exists."
+            : "550 Requested action not taken.");
+        return;
+    }
 
-    // Send ready response
-    send_message(client->control_sockfd, "150 File status okay; about to open data connection.");
+    // Name it the way PWD does
+    snprintf(response, sizeof(response), "257 \"/Users/%s/%s\" created.",
+        userdb_username(&(client->users->db), client->user), new_path);
+    send_message(client->control_sockfd, response);
+}
 
-    // Connect
-    int data_sockfd;
-    connect_to_addr(client->data_addr, &data_sockfd, NULL);
+void handle_command_rename_from(struct server_client_state *client, char *command) {
+    static char from_path[PATH_MAX];
 
-    // Send the file
-    send_file(data_sockfd, buf);
-    
-    // Disconnect
-    close(data_sockfd);
-    client->has_data_addr = 0;
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return;
+    }
 
-    // Notify client that the data transfer is complete
-    send_message(client->control_sockfd, "226 Transfer completed.");
+    // Extract the path from the command
+    strtok(command, " ");
+    char *path = strtok(NULL, " ");
+    if (path == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return;
+    }
 
-    // Since this is a child process of the server, exit successfully
-    exit(EXIT_SUCCESS);
+    // Resolve the path as CWD does; the user's directory itself cannot be renamed
+    if (sandbox_normalize_path(client->current_path->path, path, from_path, sizeof(from_path)) == -1
+        || from_path[0] == '\0') {
+        send_message(client->control_sockfd, "550 Requested action not taken. File name not allowed.");
+        return;
+    }
+
+    // Ensure the file exists now, so the client learns of a mistake before sending RNTO
+    const char *name;
+    int parent_dirfd = open_parent_directory(client, from_path, &name);
+    struct stat stat_result;
+    if (parent_dirfd == -1 || storage_stat(client->storage, parent_dirfd, name, &stat_result) == -1) {
+        if (parent_dirfd != -1) {
+            storage_close(client->storage, parent_dirfd);
+        }
+        send_message(client->control_sockfd, "550 No such file or directory.");
+        return;
+    }
+    storage_close(client->storage, parent_dirfd);
+
+    if (client->rename_from != NULL) {
+        path_release(client->rename_from);
+    }
+    client->rename_from = path_intern(from_path);
+    send_message(client->control_sockfd, "350 Requested file action pending further information.");
 }
 
-void handle_command_list(struct server_client_state *client) {
-    static char buf[COMMAND_STR_MAX];
-    
+void handle_command_rename_to(struct server_state *server, struct server_client_state *client, char *command) {
+    static char to_path[PATH_MAX];
+    static char blob_name[BLOB_NAME_MAX];
+
     if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
         send_message(client->control_sockfd, "530 Not logged in.");
         return;
     }
-    if (!client->has_data_addr) {
+    if (client->rename_from == NULL) {
         send_message(client->control_sockfd, "503 Bad sequence of commands.");
         return;
     }
 
-    // Fork a child process to handle the data transfer
-    pid_t child_pid = fork();
-    if (child_pid > 0) {
-        // This is the parent process, nothing else to do for this client
+    // The source is used up by this command, whatever happens
+    struct interned_path *from = client->rename_from;
+    client->rename_from = NULL;
+
+    // Extract the path from the command
+    strtok(command, " ");
+    char *path = strtok(NULL, " ");
+    if (path == NULL) {
+        path_release(from);
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
         return;
     }
 
-    // This is the child process
-    // List the files
-    if (list_directory(client->current_path, buf, sizeof(buf)) == -1) {
-        send_message(client->control_sockfd, "550 Failed to open directory.");
+    // Resolve the new path as CWD does
+    if (sandbox_normalize_path(client->current_path->path, path, to_path, sizeof(to_path)) == -1
+        || to_path[0] == '\0') {
+        path_release(from);
+        send_message(client->control_sockfd, "553 Requested action not taken. File name not allowed.");
         return;
     }
 
-    // Send ready response
-    send_message(client->control_sockfd, "150 File status okay; about to open data connection.");
-
-    // Connect
-    int data_sockfd;
-    connect_to_addr(client->data_addr, &data_sockfd, NULL);
-
-    // Send the data
-    send_message(data_sockfd, buf);
+    // Open both parent directories beneath the user's directory; the kernel refuses
+    // symlinks in them that point outside of it, and renameat() follows no symlink itself
+    const char *from_name, *to_name;
+    int from_dirfd = open_parent_directory(client, from->path, &from_name);
+    if (from_dirfd == -1) {
+        path_release(from);
+        send_message(client->control_sockfd, "550 No such file or directory.");
+        return;
+    }
+    int to_dirfd = open_parent_directory(client, to_path, &to_name);
+    if (to_dirfd == -1) {
+        storage_close(client->storage, from_dirfd);
+        path_release(from);
+        send_message(client->control_sockfd, "550 No such file or directory.");
+        return;
+    }
+    // A file that is replaced no longer counts towards the user's usage
+    struct stat from_stat, to_stat;
+    off_t replaced_size = 0;
+    int has_blob = 0;
+    if (storage_stat(client->storage, from_dirfd, from_name, &from_stat) == 0
+        && storage_stat(client->storage, to_dirfd, to_name, &to_stat) == 0 && S_ISREG(to_stat.st_mode)
+        && (from_stat.st_dev != to_stat.st_dev || from_stat.st_ino != to_stat.st_ino)) {
+        replaced_size = to_stat.st_size;
+        has_blob = find_file_blob(server, to_dirfd, to_name, &to_stat, blob_name);
+    }
 
-    // Disconnect
-    close(data_sockfd);
-    client->has_data_addr = 0;
+    int status = storage_rename(client->storage, from_dirfd, from_name, to_dirfd, to_name);
+    int rename_errno = errno;
+    storage_close(client->storage, from_dirfd);
+    storage_close(client->storage, to_dirfd);
+    if (status == -1) {
+        path_release(from);
+        if (rename_errno == ENOENT) {
+            send_message(client->control_sockfd, "550 No such file or directory.");
+        } else if (rename_errno == EEXIST || rename_errno == ENOTEMPTY || rename_errno == EISDIR
+            || rename_errno == ENOTDIR || rename_errno == EINVAL) {
+            send_message(client->control_sockfd, "553 Requested action not taken. File name not allowed.");
+        } else {
+            send_message(client->control_sockfd, "550 Requested action not taken.");
+        }
+        return;
+    }
 
-    // Notify client that the data transfer is complete
-    send_message(client->control_sockfd, "226 Transfer completed.");
+    // If the current directory was moved, follow it so that PWD and relative paths stay right
+    size_t from_length = from->length;
+    const char *current = client->current_path->path;
+    if (strncmp(current, from->path, from_length) == 0
+        && (current[from_length] == '\0' || current[from_length] == '/')) {
+        static char moved_path[PATH_MAX];
+        if (snprintf(moved_path, sizeof(moved_path), "%s%s", to_path, current + from_length)
+            < (int)sizeof(moved_path)) {
+            path_release(client->current_path);
+            client->current_path = path_intern(moved_path);
+        }
+    }
+    path_release(from);
+    usage_charge(client->usage, -replaced_size);
+    if (has_blob) {
+        release_blob(server, blob_name);
+    }
 
-    // Since this is a child process of the server, exit successfully
-    exit(EXIT_SUCCESS);
+    send_message(client->control_sockfd, "250 Requested file action okay, completed.");
 }
 
-void handle_command_change_directory(struct server_state *server, struct server_client_state *client, char *command) {
-    static char buf[PATH_MAX];
-    static char working_dir_resolved[PATH_MAX];
-    static char user_dir_resolved[PATH_MAX];
-    static char response[COMMAND_STR_MAX];
+void handle_command_delete(struct server_state *server, struct server_client_state *client, char *command) {
+    static char file_path[PATH_MAX];
+    static char blob_name[BLOB_NAME_MAX];
 
     if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
         send_message(client->control_sockfd, "530 Not logged in.");
@@ -538,90 +2925,275 @@ void handle_command_change_directory(struct server_state *server, struct server_
     // Extract the path from the command
     strtok(command, " ");
     char *path = strtok(NULL, " ");
+    if (path == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return;
+    }
 
-    // Construct the expected new working directory for the user
-    {
-        int p = sprintf(buf, "%s", client->current_path);
-        p += sprintf(buf + p, "/%s", path);
+    // Resolve the path as CWD does
+    if (sandbox_normalize_path(client->current_path->path, path, file_path, sizeof(file_path)) == -1
+        || file_path[0] == '\0') {
+        send_message(client->control_sockfd, "550 Requested action not taken. File name not allowed.");
+        return;
     }
 
-    // Ensure the new working directory is a directory
-    if (!is_path_directory(buf)) {
+    // Only files are deleted; unlinkat() without AT_REMOVEDIR refuses directories
+    const char *name;
+    int parent_dirfd = open_parent_directory(client, file_path, &name);
+    struct stat stat_result;
+    if (parent_dirfd == -1 || storage_stat(client->storage, parent_dirfd, name, &stat_result) == -1) {
+        if (parent_dirfd != -1) {
+            storage_close(client->storage, parent_dirfd);
+        }
         send_message(client->control_sockfd, "550 No such file or directory.");
         return;
     }
+    int has_blob = find_file_blob(server, parent_dirfd, name, &stat_result, blob_name);
+    int status = storage_unlink(client->storage, parent_dirfd, name);
+    storage_close(client->storage, parent_dirfd);
+    if (status == -1) {
+        send_message(client->control_sockfd, "550 Requested action not taken. File unavailable.");
+        return;
+    }
+    if (S_ISREG(stat_result.st_mode)) {
+        usage_charge(client->usage, -stat_result.st_size);
+    }
+    if (has_blob) {
+        release_blob(server, blob_name);
+    }
 
-    // Resolve the new working directory
-    if (realpath(buf, working_dir_resolved) == NULL) {
-        perror("realpath");
-        exit(EXIT_FAILURE);
+    send_message(client->control_sockfd, "250 Requested file action okay, completed.");
+}
+
+int handle_command_site(struct server_state *server, struct server_client_state *client, char *command) {
+    if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
+        send_message(client->control_sockfd, "530 Not logged in.");
+        return 0;
+    }
+
+    // Dispatch on the site command, which follows SITE
+    strtok(command, " ");
+    char *site_command = strtok(NULL, " ");
+    if (site_command == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return 0;
+    }
+    if (strcasecmp(site_command, SITE_COMMAND_COPY) == 0) {
+        return handle_site_command_copy(server, client);
+    } else if (strcasecmp(site_command, SITE_COMMAND_QUOTA) == 0) {
+        handle_site_command_quota(client);
+    } else {
+        send_message(client->control_sockfd, "504 Command not implemented for that parameter.");
+    }
+    return 0;
+}
+
+int handle_site_command_copy(struct server_state *server, struct server_client_state *client) {
+    static char from_path[PATH_MAX];
+    static char to_path[PATH_MAX];
+    static char temp_name[NAME_MAX + 1];
+
+    // Extract both paths, continuing the tokenization of handle_command_site
+    char *from = strtok(NULL, " ");
+    char *to = strtok(NULL, " ");
+    if (from == NULL || to == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return 0;
     }
 
-    // Get the user's base directory and resolve it
-    {
-        int p = sprintf(buf, "%s", server->users_storage_path);
-        p += sprintf(buf + p, "/%s", client->auth_data->username);
+    // Resolve both paths as CWD does
+    if (sandbox_normalize_path(client->current_path->path, from, from_path, sizeof(from_path)) == -1
+        || sandbox_normalize_path(client->current_path->path, to, to_path, sizeof(to_path)) == -1
+        || to_path[0] == '\0') {
+        send_message(client->control_sockfd, "553 Requested action not taken. File name not allowed.");
+        return 0;
     }
-    if (realpath(buf, user_dir_resolved) == NULL) {
-        perror("realpath");
-        exit(EXIT_FAILURE);    
+
+    // Open the source beneath the user's directory and ensure it is a regular file
+    struct storage *storage = client->storage;
+    int from_fd = storage_open(storage, client->root_dirfd, from_path[0] == '\0' ? "." : from_path,
+        O_RDONLY | O_NONBLOCK, 0);
+    struct stat stat_result;
+    if (from_fd == -1 || storage_stat(storage, from_fd, NULL, &stat_result) == -1 || !S_ISREG(stat_result.st_mode)) {
+        if (from_fd != -1) {
+            storage_close(storage, from_fd);
+        }
+        send_message(client->control_sockfd, "550 No such file or directory.");
+        return 0;
     }
 
-    // Ensure the new path (resolved) starts with the user's base directory
-    size_t user_dir_resolved_length = strlen(user_dir_resolved);
-    if (strncmp(working_dir_resolved, user_dir_resolved, user_dir_resolved_length) != 0) {
-        // New path does not start with the user's base directory
+    const char *to_name;
+    int to_dirfd = open_parent_directory(client, to_path, &to_name);
+    if (to_dirfd == -1) {
+        storage_close(storage, from_fd);
         send_message(client->control_sockfd, "550 No such file or directory.");
-        return;
+        return 0;
+    }
+    if (check_upload_quota(client, to_dirfd, to_name, stat_result.st_size) == -1) {
+        storage_close(storage, from_fd);
+        storage_close(storage, to_dirfd);
+        return 0;
     }
 
-    // Update the user's working directory
-    strcpy(client->current_path, working_dir_resolved);
-
-    // Truncate the user's working directory from the user's base path
-    size_t current_path_length = strlen(client->current_path);
-    size_t users_storage_path_length = strlen(server->users_storage_path);
-    if (current_path_length < users_storage_path_length) {
-        fprintf(stderr, "User %s current path (%s) is shorter than users storage path (%s)\n",
-            client->auth_data->username, client->current_path, server->users_storage_path);
+    // Copy in a child process, so that filesystems that must copy the data do not block the reactor;
+    // the process holds the transfer slot until it is reaped
+    struct transfer *transfer = create_transfer(server, client, TRANSFER_KIND_COPY);
+    pid_t child_pid = fork();
+    if (child_pid == -1) {
+        perror("fork");
+        storage_close(storage, from_fd);
+        storage_close(storage, to_dirfd);
+        abort_transfer(server, transfer, "451 Requested action aborted: local error in processing.");
+        return 1;
+    } else if (child_pid > 0) {
+        // This is the parent process
+        transfer->pid = child_pid;
+        storage_close(storage, from_fd);
+        storage_close(storage, to_dirfd);
+        return 1;
+    }
+
+    // This is the child process
+    detach_control_connection(client);
+    int fd = create_upload_file(storage, to_dirfd, temp_name, 0);
+    if (fd == -1 || copy_file_data(storage, from_fd, fd, stat_result.st_size) == -1) {
+        if (fd != -1) {
+            storage_unlink(storage, to_dirfd, temp_name);
+        }
+        send_message(client->control_sockfd, "451 Requested action aborted: local error in processing.");
         exit(EXIT_FAILURE);
     }
+    if (commit_upload_file_durably(server, to_dirfd, fd, temp_name, to_name, client->usage) == -1) {
+        send_upload_failed(client);
+        exit(EXIT_FAILURE);
+    }
+    storage_close(storage, fd);
+    storage_close(storage, from_fd);
+    send_message(client->control_sockfd, "250 Requested file action okay, completed.");
 
-    size_t truncated_length = current_path_length - users_storage_path_length;
-    strcpy(buf, client->current_path);
-    memmove(buf, buf + users_storage_path_length + 1, truncated_length + 1);
-    
-    // Prepare the response, then send it
-    {
-        int p = sprintf(response, "200 directory changed to /Users/");
-        p += sprintf(response + p, "%s", buf);
+    // Since this is a child process of the server, exit successfully
+    exit(EXIT_SUCCESS);
+}
+
+void handle_site_command_quota(struct server_client_state *client) {
+    static char response[COMMAND_STR_MAX];
+
+    if (client->usage == NULL) {
+        send_message(client->control_sockfd, "200 Disk usage is not counted for this user.");
+        return;
+    }
+    long long bytes = __atomic_load_n(&(client->usage->bytes), __ATOMIC_RELAXED);
+    long long quota = __atomic_load_n(&(client->usage->quota), __ATOMIC_RELAXED);
+    if (quota > 0) {
+        snprintf(response, sizeof(response), "200 %lld of %lld bytes used.", bytes, quota);
+    } else {
+        snprintf(response, sizeof(response), "200 %lld bytes used, no quota.", bytes);
     }
     send_message(client->control_sockfd, response);
 }
 
-void handle_command_print_directory(struct server_state *server, struct server_client_state *client) {
-    static char buf1[COMMAND_STR_MAX], buf2[COMMAND_STR_MAX * 2];
+int copy_file_data(const struct storage *storage, int from_fd, int fd, off_t size) {
+    static char buf[FILE_TRANSFER_BUFFER_SIZE];
+
+    // A reflink shares all extents, so nothing is written
+    if (storage->uses_fds && ioctl(fd, FICLONE, from_fd) == 0) {
+        return 0;
+    }
+
+    // Otherwise let the kernel copy, which still shares extents on some filesystems
+    // and avoids a pass through userspace on the others
+    off_t copied = 0;
+    while (storage->uses_fds && copied < size) {
+        ssize_t bytes_copied = copy_file_range(from_fd, NULL, fd, NULL, size - copied, 0);
+        if (bytes_copied <= 0) {
+            break;
+        }
+        copied += bytes_copied;
+    }
+
+    // Copy the rest through userspace, if copy_file_range() is not supported here,
+    // and whatever was appended to the source in the meantime
+    ssize_t bytes_read;
+    while ((bytes_read = storage_read(storage, from_fd, buf, sizeof(buf))) > 0) {
+        if (storage_write(storage, fd, buf, bytes_read) == -1) {
+            perror("write");
+            return -1;
+        }
+    }
+    if (bytes_read == -1) {
+        perror("read");
+        return -1;
+    }
+    return 0;
+}
 
+int look_up_client_file(struct server_state *server, struct server_client_state *client, char *command,
+    struct stat_cache_info *info) {
     if (client->state != SERVER_CLIENT_STATE_AUTHENTICATED) {
         send_message(client->control_sockfd, "530 Not logged in.");
+        return -1;
+    }
+
+    // Extract the filename from the command
+    strtok(command, " ");
+    char *filename = strtok(NULL, " ");
+    if (filename == NULL) {
+        send_message(client->control_sockfd, "501 Syntax error in parameters or arguments.");
+        return -1;
+    }
+
+    // Ensure the filename has no slashes, as for RETR
+    if (strchr(filename, '/') != NULL || strcmp(filename, "..") == 0 || strcmp(filename, ".") == 0) {
+        send_message(client->control_sockfd, "550 Requested action not taken. File name not allowed.");
+        return -1;
+    }
+
+    // The stat cache is kept up to date with inotify, so only files on disk go through it
+    struct stat stat_result;
+    int status;
+    if (client->storage->uses_fds) {
+        status = stat_cache_lookup(&(server->stat_cache), client->current_dirfd, client->current_dev,
+            client->current_ino, filename, info);
+    } else if ((status = storage_stat(client->storage, client->current_dirfd, filename, &stat_result)) == 0) {
+        info->exists = 1;
+        info->mode = stat_result.st_mode;
+        info->size = stat_result.st_size;
+        info->mtime = stat_result.st_mtim;
+    }
+    if (status == -1 || !info->exists || !S_ISREG(info->mode)) {
+        send_message(client->control_sockfd, "550 No such file or directory.");
+        return -1;
+    }
+    return 0;
+}
+
+void handle_command_size(struct server_state *server, struct server_client_state *client, char *command) {
+    static char response[COMMAND_STR_MAX];
+
+    struct stat_cache_info info;
+    if (look_up_client_file(server, client, command, &info) == -1) {
         return;
     }
 
-    // Truncate the user's working directory from the user's base path
-    size_t current_path_length = strlen(client->current_path);
-    size_t users_storage_path_length = strlen(server->users_storage_path);
-    if (current_path_length < users_storage_path_length) {
-        fprintf(stderr, "User %s current path (%s) is shorter than users storage path (%s)\n",
-            client->auth_data->username, client->current_path, server->users_storage_path);
-        exit(EXIT_FAILURE);
+    snprintf(response, sizeof(response), "213 %lld", (long long)info.size);
+    send_message(client->control_sockfd, response);
+}
+
+void handle_command_modification_time(struct server_state *server, struct server_client_state *client, char *command) {
+    static char response[COMMAND_STR_MAX];
+
+    struct stat_cache_info info;
+    if (look_up_client_file(server, client, command, &info) == -1) {
+        return;
     }
 
-    size_t truncated_length = current_path_length - users_storage_path_length;
-    strcpy(buf1, client->current_path);
-    memmove(buf1, buf1 + users_storage_path_length + 1, truncated_length + 1);
-    
-    sprintf(buf2, "257 /Users/%s", buf1);
-    send_message(client->control_sockfd, buf2);
+    // YYYYMMDDHHMMSS, as in the modify fact of MLSD
+    struct tm modified;
+    gmtime_r(&(info.mtime.tv_sec), &modified);
+    snprintf(response, sizeof(response), "213 %04d%02d%02d%02d%02d%02d",
+        modified.tm_year + 1900, modified.tm_mon + 1, modified.tm_mday,
+        modified.tm_hour, modified.tm_min, modified.tm_sec);
+    send_message(client->control_sockfd, response);
 }
 
 void handle_command_quit(struct server_state *server, struct server_client_state *client) {
@@ -4,22 +4,121 @@
 #include <limits.h>
 #include <netinet/in.h>
 #include <sys/select.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
-#define AUTH_STR_MAX (128)
+#include "admission.h"
+#include "common.h"
+#include "delta.h"
+#include "group_commit.h"
+#include "hash.h"
+#include "hot_cache.h"
+#include "path_intern.h"
+#include "slab.h"
+#include "stat_cache.h"
+#include "storage.h"
+#include "trace.h"
+#include "usage.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "userdb.h"
+
+// Number of reactors (worker processes) that accept and serve control connections.
+// Each has its own SO_REUSEPORT listener and its own list of clients.
+// If 0, one reactor is started for each online CPU.
+#define SERVER_REACTOR_COUNT (0)
+#define SERVER_REACTORS_MAX (256)
+
+// Descriptors a session holds in its reactor: the control connection, the root and current
+// directories, the reply relay socket pair and the trace
+#define SERVER_SESSION_FDS (6)
+// Descriptors a transfer holds in its reactor until its process starts: the data connection,
+// the file and the basis of a delta
+#define SERVER_TRANSFER_FDS (3)
+// Descriptors of the reactor itself (listener, signalfd, inotify, directories of the server)
+#define SERVER_REACTOR_OWN_FDS (32)
+// Sessions of one reactor. select() cannot watch descriptors from FD_SETSIZE on, so everything
+// a reactor holds must stay below it; connections over this limit are refused like those over
+// the limits of admission.h.
+#define SERVER_REACTOR_MAX_SESSIONS ((FD_SETSIZE - SERVER_REACTOR_OWN_FDS \
+    - ADMISSION_MAX_TRANSFERS * SERVER_TRANSFER_FDS) / SERVER_SESSION_FDS)
+
+// Control connections that send no command for this long are closed
+#define SERVER_IDLE_TIMEOUT_MS (5 * 60 * 1000)
+// How long a transfer waits for the data connection to the client to be established
+#define DATA_CONNECT_TIMEOUT_MS (10 * 1000)
+// A transfer is aborted when no data could be sent or received for this long
+#define DATA_STALL_TIMEOUT_MS (60 * 1000)
+
+// Whether sessions must secure the control connection (AUTH TLS) before logging in,
+// and their data connections (PROT P) before transferring files
+#define SERVER_REQUIRE_TLS (1)
+// Certificate and private key of the server, in the base directory;
+// a self-signed pair is generated if they do not exist
+#define SERVER_TLS_CERTIFICATE_FILE "cert.pem"
+#define SERVER_TLS_PRIVATE_KEY_FILE "key.pem"
+// Time a client has to complete the TLS handshake after AUTH TLS
+#define SERVER_TLS_HANDSHAKE_TIMEOUT_MS (10 * 1000)
+
+// Number of transfer commands each reactor keeps waiting for admission; more are refused with 450
+#define SERVER_TRANSFER_QUEUE_LENGTH (256)
+// While commands are queued, admission is retried this often, since the transfers that
+// hold the slots may belong to other reactors
+#define SERVER_TRANSFER_QUEUE_RETRY_MS (200)
+
+// Number of client states allocated together in one slab
+#define SERVER_CLIENTS_PER_SLAB (256)
+
+// Files retrieved that are at least this large are read with sequential access hints,
+// asking the kernel to read ahead RETRIEVE_READAHEAD_WINDOW bytes in front of the reader
+#define RETRIEVE_READAHEAD_THRESHOLD (1024 * 1024)
+#define RETRIEVE_READAHEAD_WINDOW (8 * 1024 * 1024)
+// Files retrieved that are at least this large are dropped from the page cache behind the
+// reader, so that streaming them does not evict the small files other clients need
+#define RETRIEVE_DROP_CACHE_THRESHOLD (64 * 1024 * 1024)
+// Files retrieved that are at least this large bypass the page cache entirely (O_DIRECT).
+// 0 disables direct I/O.
+#define RETRIEVE_DIRECT_IO_THRESHOLD (0)
+
+// How STOR makes an upload durable before replying that the transfer is complete
+#define DURABILITY_NONE (0)         // Leave flushing to the kernel
+#define DURABILITY_PER_FILE (1)     // fdatasync() each file and fsync() its directory
+#define DURABILITY_GROUP_COMMIT (2) // Share one flush among all uploads finishing at about the same time
+#define SERVER_DURABILITY_MODE (DURABILITY_GROUP_COMMIT)
+
+// Where user files are kept (STORAGE_BACKEND_* in storage.h). The RAM backend starts empty
+// and does without the features that need file descriptors: the content-addressed index
+// (XSHA), deltas (XSIG, XDLT), the hot file cache, cached hashes, durable uploads and the
+// stat cache of SIZE and MDTM.
+#define SERVER_STORAGE_BACKEND (STORAGE_BACKEND_POSIX)
+
+// Directory of the base directory where every session is recorded, if it exists.
+// Replay the recordings with replay.out.
+#define SERVER_TRACES_DIRECTORY "traces"
+
+// Commands given with SITE
+#define SITE_COMMAND_COPY "COPY"    // SITE COPY <from> <to>: copy a file on the server
+#define SITE_COMMAND_QUOTA "QUOTA"  // SITE QUOTA: show the disk usage and quota of the user
+
+// Start of the names of unfinished uploads, which do not count towards disk usage
+#define UPLOAD_TEMP_NAME_PREFIX ".ftp-upload."
+
+// Prefix of the extended attributes that cache file hashes, followed by the algorithm name
+#define HASH_XATTR_PREFIX "user.ftp.hash."
+
+// Names of blobs beneath the content-addressed index: "<username>/<sha256>"
+#define BLOB_NAME_MAX (NAME_MAX + 1 + SHA256_HEX_SIZE)
+// Extended attribute holding the name of the blob in the inode that a file and its blob
+// share, so that removing the file can free the blob
+#define BLOB_XATTR_NAME "user.ftp.blob"
 
 #define SERVER_CLIENT_STATE_NEED_USERNAME (0)
 #define SERVER_CLIENT_STATE_NEED_PASSWORD (1)
 #define SERVER_CLIENT_STATE_AUTHENTICATED (2)
 
-/**
- * @brief Linked list of usernames and passwords
- */
-struct user_auth_data {
-    char username[AUTH_STR_MAX];
-    char password[AUTH_STR_MAX];
-
-    struct user_auth_data *next;
-};
+#define SERVER_TLS_STATE_NONE (0)
+#define SERVER_TLS_STATE_HANDSHAKE (1)
+#define SERVER_TLS_STATE_ACTIVE (2)
 
 /**
  * @brief Linked list of state of connected clients
@@ -27,24 +126,129 @@ struct user_auth_data {
 struct server_client_state {
     int control_sockfd;                 // The socket for the control connection to the client
     int state;                          // The state of the client (need username, need password, authenticated)
-    struct user_auth_data *auth_data;   // The authentication data for this client, partially or fully entered
-    char current_path[PATH_MAX];        // The current path (working directory) for the client on the server
+    struct userdb_snapshot *users;      // The user database the user was looked up in, kept until logout
+    const struct userdb_record *user;   // The user entered with USER, in that database
+    struct interned_path *current_path; // The current path (working directory) for the client on the server,
+                                        // relative to the user's storage directory ("" for the directory itself)
+    struct interned_path *rename_from;  // The path given with RNFR, until the next command, or NULL
+    struct storage *storage;            // The storage of the server, which user files are reached through
+    int root_dirfd;                     // The user's storage directory, opened once at login
+    int current_dirfd;                  // The current working directory, opened beneath root_dirfd
+                                        // (both are handles of the storage)
+    dev_t current_dev;                  // Identity of the current working directory, for the stat cache
+    ino_t current_ino;
     int has_data_addr;                  // Whether the client has given their data_addr
     struct sockaddr_in data_addr;       // The client's address for an impending data connection, received with the PORT command
+    int has_content_hash;               // Whether the client announced the content hash of its next upload
+    uint8_t content_hash[SHA256_DIGEST_SIZE]; // The SHA-256 of the next upload, received with the XSHA command
+    enum hash_algorithm hash_algorithm; // The algorithm used by the HASH command, selected with OPTS HASH
+    off_t allocation_size;              // The size announced for the next upload with ALLO, or 0
+    struct timer idle_timer;            // Closes the control connection after SERVER_IDLE_TIMEOUT_MS without commands
+    uint64_t ip_key;                    // Admission control key of the client's IP address
+    uint64_t user_key;                  // Admission control key of the logged in user, or 0
+    struct usage_account *usage;        // Disk usage and quota of the logged in user, or NULL if not counted
+    int trace_fd;                       // The recording of this session, or -1
+    uint64_t trace_start_us;            // When the session started, for the offsets of the recording
+    int transfer_count;                 // Number of transfers of this client that are queued or running
+    int tls_state;                      // Whether the control connection is plain, in the TLS handshake, or secured
+    int has_protection_buffer_size;     // Whether the client sent PBSZ, which must come before PROT
+    int protect_data;                   // Whether data connections are secured with TLS (PROT P)
+    int reply_relay_sockfds[2];         // Replies of the processes forked for this client are sent to the
+                                        // first socket and relayed by the reactor through the TLS session
+                                        // of the control connection, or -1 if they can write to it directly
 
     struct server_client_state *next;   // The next client_state in the linked list
 };
 
+// Kinds of data transfers
+#define TRANSFER_KIND_STORE (0)
+#define TRANSFER_KIND_RETRIEVE (1)
+#define TRANSFER_KIND_LIST (2)
+#define TRANSFER_KIND_MACHINE_LIST (3)
+#define TRANSFER_KIND_SIGNATURE (4)
+#define TRANSFER_KIND_DELTA_STORE (5)
+// Commands run in a child process without a data connection
+#define TRANSFER_KIND_HASH (6)
+#define TRANSFER_KIND_COPY (7)
+
+/**
+ * @brief A data transfer of a reactor, which holds a transfer slot from the time its data
+ * connection is started until its transfer process exits. The reactor connects to the client
+ * without blocking; once the data connection is established, a process is forked for the transfer.
+ */
+struct transfer {
+    int in_use;                         // Whether this entry of the reactor's transfers is used
+    int kind;                           // TRANSFER_KIND_*
+    pid_t pid;                          // The transfer process, or 0 while the data connection is established
+    struct server_client_state *client; // The client, or NULL if it disconnected while the process was running
+    uint64_t ip_key;                    // Admission control keys of the transfer slot
+    uint64_t user_key;
+    int data_sockfd;                    // The data connection while it is established, or -1
+    int fd;                             // The file to send or receive (a handle of the storage), or -1
+    int basis_fd;                       // XDLT: the current version of the file the delta applies to, or -1
+    struct stat stat_result;            // RETR, XSIG: the file to send or sign
+    off_t allocation_size;              // STOR, XDLT: the size announced with ALLO, or 0
+    char temp_name[NAME_MAX + 1];       // STOR, XDLT: the temporary file receiving the upload
+    char filename[NAME_MAX + 1];        // STOR, XDLT: the file to replace once the upload is complete
+    uint8_t content_hash[SHA256_DIGEST_SIZE]; // XDLT: the SHA-256 announced with XSHA, which the
+                                        // rebuilt file must have
+    struct timer connect_timer;         // Aborts the data connection after DATA_CONNECT_TIMEOUT_MS
+};
+
+/**
+ * @brief A transfer command waiting for admission
+ */
+struct queued_transfer {
+    struct server_client_state *client;
+    char command[COMMAND_STR_MAX];
+};
+
+/**
+ * @brief A directory listing being built by a LIST or MLSD transfer process
+ */
+struct directory_listing {
+    char *buf;                          // The listing, or the part of it not sent yet (MLSD)
+    size_t size;                        // Size of buf
+    size_t length;                      // Bytes used in buf
+    int data_sockfd;                    // MLSD: the data connection, which full buffers are sent to
+    int status;                         // MLSD: -1 once sending failed
+};
+
 /**
  * @brief State of the server
  */
 struct server_state {
     char base_path[PATH_MAX];               // The root directory for all server files
     char users_storage_path[PATH_MAX];      // The directory which will store a list of directories, one for each user
-    struct user_auth_data *users_auth_data; // All user authentication data
+    int users_storage_dirfd;                // The users storage directory, opened once at startup
+    struct storage storage;                 // Where user files are kept: the users storage directory,
+                                            // or shared memory (see SERVER_STORAGE_BACKEND)
+    int blobs_dirfd;                        // Content-addressed index: a directory per user, with one hard link
+                                            // per stored file content, named by the SHA-256 of the content
+    struct userdb_snapshot *users;          // The latest user database, replaced whenever users.db changes
+    struct usage_table *usage;              // Disk usage of every user, mapped from usage.db by all processes
+    int traces_dirfd;                       // Where sessions are recorded, or -1 if recording is off
+    int reactor_id;                         // The index of the reactor (worker process) this state belongs to
     int control_sockfd;                     // Socket for accepting new clients and establishing control connections
+    int signal_fd;                          // signalfd for the signals handled by the loop of this process
+    int inotify_fd;                         // Supervisor only: watches users.txt and users.db, or -1
     struct server_client_state *clients;    // All connected clients
+    int client_count;                       // Number of connected clients
+    struct slab_allocator client_allocator; // Allocator for the client states
+    struct timer_wheel timers;              // Timeouts of the clients of this reactor
+    struct admission *admission;            // Session and transfer counters shared by all reactors
+    struct transfer transfers[ADMISSION_MAX_TRANSFERS]; // Transfers of this reactor
+    int transfer_count;                     // Number of transfers of this reactor in use
+    struct queued_transfer *transfer_queue; // Transfer commands waiting for admission, oldest first
+    int transfer_queue_length;              // Number of waiting transfer commands
+    struct timer transfer_queue_timer;      // Retries the queued transfer commands
+    struct hot_cache *hot_cache;            // Cache of small, hot files shared by all reactors
+    struct group_commit *group_commit;      // Batches the flushes of uploads from all transfer processes
+    struct stat_cache stat_cache;           // Metadata of files looked up by SIZE and MDTM in this reactor
+    int tls_available;                      // Whether the TLS certificate could be loaded (for AUTH TLS)
     fd_set listen_sockfds;                  // Set of sockets to asynchronously listen to for incoming data
+    fd_set connect_sockfds;                 // Set of data sockets whose connection is being established
+    int max_sockfd;                         // The highest file descriptor that may be in one of the sets
 };
 
 /**
@@ -53,27 +257,107 @@ struct server_state {
 void initialize_server_directories(struct server_state *server);
 
 /**
- * @brief Initialize (create if they do not exist) the storage directories
- * for all users
+ * @brief Initialize the current path field of the client, setting it equal to their
+ * user storage directory, and open the directory file descriptors of the client
  * 
  * @param server 
+ * @param client 
+ * @return 0 on success, -1 if the user's storage directory could not be opened
  */
-void initialize_user_storage_directories(struct server_state *server);
+int initialize_current_path(struct server_state *server, struct server_client_state *client);
 
 /**
- * @brief Initialize the current path field of the client, setting it equal to their
- * user storage directory
+ * @brief Close the directory file descriptors of the client and forget its current path
+ * 
+ * @param client 
+ */
+void release_current_path(struct server_client_state *client);
+
+/**
+ * @brief Forget the user entered by the client and drop its user database snapshot
+ * 
+ * @param client 
+ */
+void release_user(struct server_client_state *client);
+
+/**
+ * @brief Map usage.db, the disk usage of every user. If it does not exist yet, build it
+ * by walking the user directories, with one worker process per reactor.
  * 
  * @param server 
+ */
+void open_usage_table(struct server_state *server);
+
+/**
+ * @brief Get the number of reactors to start, based on SERVER_REACTOR_COUNT
+ * and the number of online CPUs
+ */
+int get_reactor_count();
+
+/**
+ * @brief Fork the reactors, then supervise them forever, restarting any reactor
+ * that exits. The supervisor also rebuilds users.db in the background when
+ * users.txt changes or on SIGHUP, and tells the reactors to reload it.
+ * 
+ * @param server 
+ */
+void start_reactors(struct server_state *server);
+
+/**
+ * @brief Ask every reactor to exit, on SIGTERM, and wait until they have
+ *
+ * @param reactor_pids
+ * @param reactor_count
+ */
+void stop_reactors(const pid_t *reactor_pids, int reactor_count);
+
+/**
+ * @brief Fork a single reactor process with the given index
+ * 
+ * @param server 
+ * @param reactor_id 
+ * @return The pid of the reactor process (only returns in the parent)
+ */
+pid_t spawn_reactor(struct server_state *server, int reactor_id);
+
+/**
+ * @brief Body of a reactor process: open its own listener on the control port
+ * and serve the clients it accepts. Never returns.
+ * 
+ * @param server 
+ * @param reactor_id 
+ */
+void run_reactor(struct server_state *server, int reactor_id);
+
+/**
+ * @brief Get the client's current directory as shown to the client (/Users/<username>/...)
+ * 
  * @param client 
+ * @param result Buffer of at least PATH_MAX bytes
  */
-void initialize_current_path(struct server_state *server, struct server_client_state *client);
+void format_client_directory(struct server_client_state *client, char *result);
 
 /**
  * @brief Manage new incoming control connections and established connections
  */
 void monitor_control_port(struct server_state *server);
 
+/**
+ * @brief Handle a signal received by a reactor through its signalfd
+ * (SIGHUP: reload users.db, SIGCHLD: reap transfer processes, SIGTERM: exit)
+ * 
+ * @param server 
+ */
+void handle_reactor_signal(struct server_state *server);
+
+/**
+ * @brief Called when a client has not sent any command for SERVER_IDLE_TIMEOUT_MS
+ * 
+ * @param timer The idle timer of the client
+ * @param data The server state
+ */
+void handle_client_idle_timeout(struct timer *timer, void *data);
+
 /**
  * @brief Handle the receiving data from the client through its appropriate control socket
  * 
@@ -87,8 +371,9 @@ void handle_client_sending_data(struct server_state *server, struct server_clien
  * 
  * @param server 
  * @param client_sockfd 
+ * @return The new client state
  */
-void add_new_client(struct server_state *server, int client_sockfd);
+struct server_client_state* add_new_client(struct server_state *server, int client_sockfd);
 
 /**
  * @brief Remove the client from the list of clients
@@ -108,48 +393,756 @@ void remove_client(struct server_state *server, struct server_client_state *clie
 struct server_client_state* find_client_by_control_sockfd(struct server_state *server, int control_sockfd);
 
 /**
- * @brief Read the auth data usernames and passwords from the users.txt file and store them
+ * @brief Find a client by the socket its reply relay is read from
+ * 
+ * @param server 
+ * @param relay_sockfd 
+ * @return The client state, or NULL if not found 
  */
-void read_auth_data(struct server_state *server);
+struct server_client_state* find_client_by_reply_relay_sockfd(struct server_state *server, int relay_sockfd);
 
 /**
- * @brief Add authentication data with the given username and password
+ * @brief Load (or generate) the certificate of the server and create the TLS context,
+ * before the reactors are forked. If that fails, AUTH TLS is refused.
  * 
  * @param server 
- * @param username 
- * @param password 
  */
-void add_auth_data(struct server_state *server, char *username, char *password);
+void initialize_tls(struct server_state *server);
 
 /**
- * @brief Find authentication data with the given username
+ * @brief Reply to AUTH TLS and start the TLS handshake on the control connection
  * 
  * @param server 
- * @param username 
- * @return The authentication data, or NULL if not found
+ * @param client 
+ * @param command 
+ */
+void handle_command_authenticate(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Continue the TLS handshake of the control connection with what the client sent
+ * 
+ * @param server 
+ * @param client 
  */
-struct user_auth_data* find_auth_data_by_username(struct server_state *server, char *username);
+void continue_tls_handshake(struct server_state *server, struct server_client_state *client);
+
+void handle_command_protection_buffer_size(struct server_client_state *client, char *command);
+
+void handle_command_protection_level(struct server_client_state *client, char *command);
+
+/**
+ * @brief Without kTLS, only the reactor can write to the TLS session of a control connection.
+ * Open the relay through which processes forked for the client send their replies.
+ * 
+ * @param server 
+ * @param client 
+ * @return 0 on success, -1 on failure
+ */
+int open_reply_relay(struct server_state *server, struct server_client_state *client);
+
+/**
+ * @brief Send a reply that arrived through the relay of the client to the client
+ * 
+ * @param client 
+ */
+void relay_reply(struct server_client_state *client);
+
+/**
+ * @brief In a process forked from the reactor, stop using the TLS session of the control
+ * connection, and send the replies through the reply relay instead if there is one
+ * 
+ * @param client The copy of the client state in this process
+ */
+void detach_control_connection(struct server_client_state *client);
+
+/**
+ * @brief In a transfer process, secure the data connection if the client asked for it.
+ * The session of the control connection must be resumed, which proves that the data
+ * connection comes from the same client.
+ * 
+ * @param client 
+ * @param data_sockfd 
+ * @return 0 on success, -1 on failure
+ */
+int secure_data_connection(struct server_client_state *client, int data_sockfd);
+
+/**
+ * @brief Close a data connection, freeing its TLS session if it has one
+ * 
+ * @param data_sockfd 
+ * @param completed Whether all data was exchanged; if so, the TLS session is ended
+ * with close_notify, so that the client can tell the data is complete
+ */
+void close_data_connection(int data_sockfd, int completed);
+
+/**
+ * @brief Get the path of a file in the base directory
+ * 
+ * @param server 
+ * @param name 
+ * @param result Buffer of at least PATH_MAX bytes
+ */
+void format_base_file_path(struct server_state *server, const char *name, char *result);
+
+/**
+ * @brief Load the user database. users.db is mapped as is if it is at least as new as
+ * users.txt; otherwise users.txt is compiled and the result is saved to users.db for
+ * the next start.
+ */
+void load_user_database(struct server_state *server);
+
+/**
+ * @brief Map the current users.db and make it the snapshot used by new logins.
+ * Sessions that are already logged in keep their snapshot.
+ * 
+ * @param server 
+ * @return 0 on success, -1 if users.db could not be mapped (the old snapshot stays)
+ */
+int reload_user_database(struct server_state *server);
+
+/**
+ * @brief Fork a process that compiles users.txt into users.db, replacing it atomically
+ * 
+ * @param server 
+ * @return The pid of the process, or -1 if it could not be started
+ */
+pid_t spawn_user_database_builder(struct server_state *server);
+
+/**
+ * @brief Watch the base directory for changes to users.txt and users.db
+ * 
+ * @param server 
+ * @return The inotify file descriptor, or -1 if inotify is unavailable
+ */
+int watch_user_database(struct server_state *server);
+
+/**
+ * @brief Open the storage directory of the client's user, creating it at first login
+ * 
+ * @param server 
+ * @param client 
+ * @return The directory file descriptor (O_PATH), or -1 on failure
+ */
+int open_user_storage_directory(struct server_state *server, struct server_client_state *client);
 
 /**
  * @brief Handle an incoming client command
  */
 void handle_command(struct server_state *server, struct server_client_state *client, char *command);
 
+/**
+ * @brief Check whether the command is SITE with the given site command
+ * (which is case-insensitive, as in handle_command_site)
+ * 
+ * @param command 
+ * @param site_command One of the SITE_COMMAND_*
+ * @return 1 if it is, 0 otherwise
+ */
+int check_site_command(const char *command, const char *site_command);
+
+/**
+ * @brief Start a transfer command (STOR, RETR, LIST, and HASH and SITE COPY, which also
+ * run in a child process) if admission control allows it, or queue it until a running
+ * transfer finishes. Replies 450 if the queue is full.
+ * 
+ * @param server 
+ * @param client 
+ * @param command 
+ */
+void handle_transfer_command(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Run a transfer command that has been given a transfer slot.
+ * Gives the slot back if no transfer was started.
+ * 
+ * @param server 
+ * @param client 
+ * @param command 
+ */
+void start_transfer(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Reap the transfer processes that have exited and give back their transfer slots
+ * 
+ * @param server 
+ */
+void reap_transfer_processes(struct server_state *server);
+
+/**
+ * @brief Start the queued transfer commands that are admitted now, in order
+ * 
+ * @param server 
+ */
+void start_queued_transfers(struct server_state *server);
+
+/**
+ * @brief Called every SERVER_TRANSFER_QUEUE_RETRY_MS while transfer commands are queued
+ * 
+ * @param timer 
+ * @param data The server state
+ */
+void handle_transfer_queue_timeout(struct timer *timer, void *data);
+
 void handle_command_username(struct server_state *server, struct server_client_state *client, char *command);
 
 void handle_command_password(struct server_state *server, struct server_client_state *client, char *command);
 
 void handle_command_port(struct server_client_state *client, char *command);
 
-void handle_command_store(struct server_client_state *client, char *command);
+/**
+ * @brief Handle STOR. Transfer commands (STOR, RETR, LIST) are only called once
+ * admission control has given them a transfer slot.
+ * 
+ * @param server 
+ * @param client 
+ * @param command 
+ * @return 1 if a transfer was started (which then holds the transfer slot), 0 otherwise
+ */
+int handle_command_store(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Take an unused transfer entry of the reactor for the client, which inherits
+ * the client's transfer slot
+ * 
+ * @param server 
+ * @param client 
+ * @param kind TRANSFER_KIND_*
+ * @return The transfer
+ */
+struct transfer* create_transfer(struct server_state *server, struct server_client_state *client, int kind);
+
+/**
+ * @brief Give up the transfer entry and its transfer slot, closing what it still holds
+ * 
+ * @param server 
+ * @param transfer 
+ */
+void free_transfer(struct server_state *server, struct transfer *transfer);
+
+/**
+ * @brief Reply 150 and start connecting to the data address given by the client with PORT,
+ * without blocking. The reactor waits for the connection in its select() loop.
+ * 
+ * @param server 
+ * @param transfer 
+ */
+void start_data_connection(struct server_state *server, struct transfer *transfer);
+
+/**
+ * @brief Handle a data socket that became writable, i.e. whose connection attempt finished
+ * 
+ * @param server 
+ * @param transfer 
+ */
+void handle_data_connection_ready(struct server_state *server, struct transfer *transfer);
+
+/**
+ * @brief Called when a data connection could not be established within DATA_CONNECT_TIMEOUT_MS
+ * 
+ * @param timer The connect timer of the transfer
+ * @param data The server state
+ */
+void handle_data_connect_timeout(struct timer *timer, void *data);
+
+/**
+ * @brief Abort a transfer whose data connection is not established (yet): reply with
+ * the given message, remove a partial upload and free the transfer
+ * 
+ * @param server 
+ * @param transfer 
+ * @param reply The reply to send to the client, or NULL
+ */
+void abort_transfer(struct server_state *server, struct transfer *transfer, const char *reply);
+
+/**
+ * @brief Fork the process that runs the transfer over its established data connection
+ * 
+ * @param server 
+ * @param transfer 
+ */
+void fork_transfer_process(struct server_state *server, struct transfer *transfer);
+
+/**
+ * @brief Body of the transfer processes: receive a file (STOR), send a file (RETR) or
+ * send a directory listing (LIST, MLSD), then reply and exit. Never return.
+ */
+void run_store_transfer(struct server_state *server, struct server_client_state *client, struct transfer *transfer);
+
+void run_retrieve_transfer(struct server_state *server, struct server_client_state *client, struct transfer *transfer);
+
+void run_list_transfer(struct server_client_state *client, struct transfer *transfer);
+
+void run_machine_list_transfer(struct server_client_state *client, struct transfer *transfer);
+
+void run_signature_transfer(struct server_client_state *client, struct transfer *transfer);
+
+void run_delta_store_transfer(struct server_state *server, struct server_client_state *client, struct transfer *transfer);
+
+/**
+ * @brief Find the transfer whose data connection uses the socket
+ * 
+ * @param server 
+ * @param data_sockfd 
+ * @return The transfer, or NULL if not found
+ */
+struct transfer* find_transfer_by_data_sockfd(struct server_state *server, int data_sockfd);
+
+void handle_command_allocate(struct server_client_state *client, char *command);
+
+void handle_command_content_hash(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Create a new, uniquely named temporary file in a directory, into which an
+ * upload is written before it replaces the target file
+ * 
+ * @param storage
+ * @param dirfd The directory of the target file
+ * @param temp_name Location to store the name of the file, at least NAME_MAX + 1 bytes
+ * @param size_hint Expected size of the upload, preallocated on disk if positive
+ * @return The handle of the file, or -1 on failure
+ */
+int create_upload_file(const struct storage *storage, int dirfd, char *temp_name, off_t size_hint);
 
-void handle_command_retrieve(struct server_client_state *client, char *command);
+/**
+ * @brief Atomically replace the target file with the finished temporary file. Readers
+ * see either the old or the new file, never a partial one. The user is charged for
+ * the difference in size, and the blob of the replaced file is released.
+ * 
+ * @param server 
+ * @param dirfd The directory of both files
+ * @param temp_name 
+ * @param filename 
+ * @param account The account to charge, or NULL
+ * @return 0 on success, -1 on failure (the temporary file is removed); errno is EDQUOT
+ * if the quota would be exceeded
+ */
+int commit_upload_file(struct server_state *server, int dirfd, const char *temp_name, const char *filename,
+    struct usage_account *account);
 
-void handle_command_list(struct server_client_state *client);
+/**
+ * @brief Make the finished temporary file durable according to SERVER_DURABILITY_MODE
+ * and put it in place, so that the file survives a crash once this returns (files
+ * that are not on disk are just put in place)
+ * 
+ * @param server 
+ * @param dirfd The directory of both files
+ * @param fd The temporary file
+ * @param temp_name 
+ * @param filename 
+ * @param account The account to charge, or NULL
+ * @return 0 on success, -1 on failure (the temporary file is removed, unless only the
+ * flush after the rename failed); errno is EDQUOT if the quota would be exceeded
+ */
+int commit_upload_file_durably(struct server_state *server, int dirfd, int fd,
+    const char *temp_name, const char *filename, struct usage_account *account);
 
-void handle_command_change_directory(struct server_state *server, struct server_client_state *client, char *command);
+/**
+ * @brief Get the size of a file, or 0 if it is not a regular file or does not exist
+ * 
+ * @param storage 
+ * @param dirfd 
+ * @param name 
+ * @return The size
+ */
+off_t regular_file_size(const struct storage *storage, int dirfd, const char *name);
 
-void handle_command_print_directory(struct server_state *server, struct server_client_state *client);
+/**
+ * @brief Check that replacing a file with one of the given size fits in the user's quota,
+ * replying 552 if it does not
+ * 
+ * @param client 
+ * @param dirfd The directory of the file
+ * @param filename 
+ * @param size The size of the new file
+ * @return 0 if it fits, -1 if the reply was sent
+ */
+int check_upload_quota(struct server_client_state *client, int dirfd, const char *filename, off_t size);
+
+/**
+ * @brief Reply that an upload could not be put in place: 552 if errno is EDQUOT, 451 otherwise
+ * 
+ * @param client 
+ */
+void send_upload_failed(struct server_client_state *client);
+
+/**
+ * @brief Flush a directory, making the renames in it durable
+ * 
+ * @param dirfd The directory (may be opened with O_PATH)
+ * @return 0 on success, -1 on failure
+ */
+int sync_directory(int dirfd);
+
+/**
+ * @brief Get the name of the client's blob with the given content hash, beneath the
+ * content-addressed index. Each user has their own blobs, so that a content hash alone
+ * neither gives access to another user's files nor tells whether another user has them.
+ * 
+ * @param client 
+ * @param content_hash 
+ * @param result Buffer of at least BLOB_NAME_MAX bytes
+ */
+void format_blob_name(struct server_client_state *client, const uint8_t *content_hash, char *result);
+
+/**
+ * @brief Create the file in the client's current directory from the stored blob with
+ * the given content hash, as a reflink (copy-on-write clone) if the filesystem supports
+ * it, or as a hard link otherwise. No data is transferred.
+ * 
+ * @param server 
+ * @param client 
+ * @param content_hash 
+ * @param filename 
+ * @return 0 on success, -1 if there is no such blob or the file could not be created
+ */
+int materialize_blob(struct server_state *server, struct server_client_state *client,
+    const uint8_t *content_hash, const char *filename);
+
+/**
+ * @brief Add the open file to the client's part of the content-addressed index under
+ * its content hash, unless the client has a blob with that hash already
+ * 
+ * @param server 
+ * @param client 
+ * @param fd 
+ * @param content_hash 
+ */
+void index_blob(struct server_state *server, struct server_client_state *client, int fd, const uint8_t *content_hash);
+
+/**
+ * @brief Find the blob that a file is a hard link of, before the file is removed or
+ * replaced, so that the blob can be released afterwards
+ * 
+ * @param server 
+ * @param dirfd 
+ * @param name 
+ * @param stat_result The metadata of the file
+ * @param blob_name Location to store the name of the blob, of at least BLOB_NAME_MAX bytes
+ * @return 1 if the file is a hard link of a blob, 0 otherwise
+ */
+int find_file_blob(struct server_state *server, int dirfd, const char *name, const struct stat *stat_result,
+    char *blob_name);
+
+/**
+ * @brief Remove a blob from the index if no file links to it any more. A file that
+ * is linked to it at the same time keeps its data, but is no longer indexed.
+ * 
+ * @param server 
+ * @param blob_name 
+ */
+void release_blob(struct server_state *server, const char *blob_name);
+
+/**
+ * @brief Remove the blobs that no file links to any more, which a crash between removing
+ * a file and releasing its blob leaves behind, and the blobs of the index from before it
+ * was split by user. Run once at startup.
+ * 
+ * @param server 
+ */
+void sweep_blobs(struct server_state *server);
+
+/**
+ * @brief Remove the blobs of one user that no file links to any more
+ * 
+ * @param server 
+ * @param username 
+ */
+void sweep_user_blobs(struct server_state *server, const char *username);
+
+/**
+ * @brief Receive an upload through the data socket into a file of the storage. Files
+ * on disk are written sparsely (see sparse_write), so blocks of zeros become holes.
+ * 
+ * @param storage 
+ * @param data_sockfd 
+ * @param fd The new, empty file
+ * @param hashes Hash computations every received byte is added to
+ * @param hash_count 
+ * @return 0 on success, -1 if receiving or writing failed
+ */
+int receive_stored_file(const struct storage *storage, int data_sockfd, int fd, struct hash_ctx *hashes, int hash_count);
+
+/**
+ * @brief Handle RETR
+ * 
+ * @return 1 if a transfer was started (which then holds the transfer slot), 0 otherwise
+ */
+int handle_command_retrieve(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Open a regular file in the client's current directory for reading, replying
+ * with the error if it cannot be opened
+ * 
+ * @param client 
+ * @param filename The name given by the client, which must not contain slashes
+ * @param stat_result Location to store the metadata of the file
+ * @return The handle of the file, or -1 if an error reply was sent
+ */
+int open_client_file(struct server_client_state *client, const char *filename, struct stat *stat_result);
+
+/**
+ * @brief Handle XSIG <filename>: send the block signatures of the file (see delta.h),
+ * so that the client can send a delta against it with XDLT
+ * 
+ * @return 1 if a transfer was started (which then holds the transfer slot), 0 otherwise
+ */
+int handle_command_signature(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Handle XDLT <filename>: like STOR, but receive a delta against the current
+ * version of the file and rebuild the new version from both. The content must have
+ * been announced with XSHA, so that a delta against a file that changed in between
+ * cannot go unnoticed.
+ * 
+ * @return 1 if a transfer was started (which then holds the transfer slot), 0 otherwise
+ */
+int handle_command_delta_store(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Send a small file through the data socket, from the hot file cache if it
+ * is cached there. Otherwise read it from disk and offer it to the cache.
+ * 
+ * @param server 
+ * @param data_sockfd 
+ * @param fd The open file
+ * @param stat_result The result of fstat() on fd; the size is at most HOT_CACHE_MAX_FILE_SIZE
+ * @param checksum Hash computation every sent byte is added to
+ * @return 0 on success, -1 if reading or sending failed
+ */
+int send_small_file(struct server_state *server, int data_sockfd, int fd, struct stat *stat_result,
+    struct hash_ctx *checksum);
+
+/**
+ * @brief Send a large file through the data socket, with page cache hints that depend
+ * on its size: sequential readahead, dropping pages already sent, or direct I/O
+ * (see the RETRIEVE_* constants). The holes of a sparse file are not read.
+ * 
+ * @param data_sockfd 
+ * @param fd The open file
+ * @param stat_result The result of fstat() on fd
+ * @param checksum Hash computation every sent byte is added to
+ * @return 0 on success, -1 if reading or sending failed
+ */
+int send_large_file(int data_sockfd, int fd, struct stat *stat_result, struct hash_ctx *checksum);
+
+/**
+ * @brief Send a file of a storage that does not use file descriptors through the data
+ * socket, reading it through the storage
+ * 
+ * @param storage 
+ * @param data_sockfd 
+ * @param fd The handle of the open file
+ * @param checksum Hash computation every sent byte is added to
+ * @return 0 on success, -1 if reading or sending failed
+ */
+int send_stored_file(const struct storage *storage, int data_sockfd, int fd, struct hash_ctx *checksum);
+
+/**
+ * @brief Send the 226 reply for a completed transfer, including the checksum of the
+ * transferred data so that the client can verify it
+ * 
+ * @param client 
+ * @param checksum The transfer checksum computation
+ */
+void send_transfer_completed(struct server_client_state *client, struct hash_ctx *checksum);
+
+/**
+ * @brief Handle LIST and MLSD
+ * 
+ * @param server 
+ * @param client 
+ * @param command 
+ * @param kind TRANSFER_KIND_LIST for the names only, or TRANSFER_KIND_MACHINE_LIST for
+ * one line of facts per file (RFC 3659)
+ * @return 1 if a transfer was started (which then holds the transfer slot), 0 otherwise
+ */
+int handle_command_list(struct server_state *server, struct server_client_state *client, char *command, int kind);
+
+/**
+ * @brief Add a name to a LIST listing (a storage_list_callback)
+ * 
+ * @param name 
+ * @param stat_result 
+ * @param data The struct directory_listing
+ * @return 1 once the listing is full, 0 otherwise
+ */
+int append_list_entry(const char *name, const struct stat *stat_result, void *data);
+
+/**
+ * @brief Add the facts of a file or directory to an MLSD listing, sending the listing
+ * whenever the buffer is full (a storage_list_callback)
+ * 
+ * @param name 
+ * @param stat_result 
+ * @param data The struct directory_listing
+ * @return 1 if sending failed, 0 otherwise
+ */
+int append_machine_list_entry(const char *name, const struct stat *stat_result, void *data);
+
+void handle_command_options(struct server_client_state *client, char *command);
+
+/**
+ * @brief Handle HASH <filename>: answer from the cached hash of the file, or hash it in a
+ * child process that sends the reply
+ * 
+ * @return 1 if a process was started (which then holds the transfer slot), 0 otherwise
+ */
+int handle_command_hash(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Hash a file of the storage, from its current position to its end
+ * 
+ * @param storage 
+ * @param fd 
+ * @param algorithm 
+ * @param hex Buffer of at least HASH_HEX_MAX bytes
+ * @return 0 on success, -1 if reading failed
+ */
+int hash_stored_file(const struct storage *storage, int fd, enum hash_algorithm algorithm, char *hex);
+
+/**
+ * @brief Get the hash of the file cached in its extended attributes, if it was computed
+ * for the current version (modification time and size) of the file
+ * 
+ * @param fd 
+ * @param stat_result The result of fstat() on fd
+ * @param algorithm 
+ * @param hex Buffer of at least HASH_HEX_MAX bytes
+ * @return 0 if a valid cached hash was found, -1 otherwise
+ */
+int read_cached_hash(int fd, const struct stat *stat_result, enum hash_algorithm algorithm, char *hex);
+
+/**
+ * @brief Cache the hash of the file in its extended attributes, together with the
+ * modification time and size it was computed for
+ * 
+ * @param fd 
+ * @param stat_result The result of fstat() on fd before hashing
+ * @param algorithm 
+ * @param hex 
+ */
+void write_cached_hash(int fd, const struct stat *stat_result, enum hash_algorithm algorithm, const char *hex);
+
+void handle_command_change_directory(struct server_client_state *client, char *command);
+
+void handle_command_print_directory(struct server_client_state *client);
+
+/**
+ * @brief Open the parent directory of a path beneath the user's directory
+ * 
+ * @param client 
+ * @param path A normalized path, relative to the user's directory, that is not the directory itself
+ * @param name Location to store a pointer to the last component of the path
+ * @return The handle of the directory, opened with O_PATH, or -1 if it does not exist
+ */
+int open_parent_directory(struct server_client_state *client, const char *path, const char **name);
+
+/**
+ * @brief Handle MKD: create a directory, confined to the user's directory like CWD
+ * 
+ * @param client 
+ * @param command 
+ */
+void handle_command_make_directory(struct server_client_state *client, char *command);
+
+/**
+ * @brief Handle RNFR: remember the file or directory to rename with the RNTO that follows
+ * 
+ * @param client 
+ * @param command 
+ */
+void handle_command_rename_from(struct server_client_state *client, char *command);
+
+/**
+ * @brief Handle RNTO: rename the file or directory given with RNFR. Both paths are
+ * confined to the user's directory like CWD.
+ * 
+ * @param server 
+ * @param client 
+ * @param command 
+ */
+void handle_command_rename_to(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Handle DELE: delete a file, confined to the user's directory like CWD
+ * 
+ * @param server 
+ * @param client 
+ * @param command 
+ */
+void handle_command_delete(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Handle SITE: run one of the SITE_COMMAND_* commands
+ * 
+ * @param server 
+ * @param client 
+ * @param command 
+ * @return 1 if a process was started (which then holds the transfer slot), 0 otherwise
+ */
+int handle_command_site(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Handle SITE COPY: copy a file on the server, without the data passing through the
+ * client. Both paths are confined to the user's directory like CWD. The copy replaces the
+ * target atomically, and is made in a child process that sends the reply.
+ * 
+ * @param server 
+ * @param client 
+ * @return 1 if a process was started (which then holds the transfer slot), 0 otherwise
+ */
+int handle_site_command_copy(struct server_state *server, struct server_client_state *client);
+
+/**
+ * @brief Handle SITE QUOTA: reply with the disk usage and quota of the user
+ * 
+ * @param client 
+ */
+void handle_site_command_quota(struct server_client_state *client);
+
+/**
+ * @brief Copy the data of a file as cheaply as the filesystem allows: as a reflink,
+ * sharing all extents, or else with copy_file_range(), or else through userspace
+ * (the only way for storage that does not use file descriptors)
+ * 
+ * @param storage 
+ * @param from_fd The file to copy, read from its current position
+ * @param fd The new, empty file
+ * @param size The size of the file to copy
+ * @return 0 on success, -1 on failure
+ */
+int copy_file_data(const struct storage *storage, int from_fd, int fd, off_t size);
+
+/**
+ * @brief Look up a file in the client's current directory through the stat cache,
+ * replying with the error if it is not a regular file
+ * 
+ * @param server 
+ * @param client 
+ * @param command The command, whose argument is the name of the file
+ * @param info Location to store the metadata of the file
+ * @return 0 on success, -1 if an error reply was sent
+ */
+int look_up_client_file(struct server_state *server, struct server_client_state *client, char *command,
+    struct stat_cache_info *info);
+
+/**
+ * @brief Handle SIZE (RFC 3659): reply with the size of a file
+ * 
+ * @param server 
+ * @param client 
+ * @param command 
+ */
+void handle_command_size(struct server_state *server, struct server_client_state *client, char *command);
+
+/**
+ * @brief Handle MDTM (RFC 3659): reply with the modification time of a file, in UTC
+ * 
+ * @param server 
+ * @param client 
+ * @param command 
+ */
+void handle_command_modification_time(struct server_state *server, struct server_client_state *client, char *command);
 
 void handle_command_quit(struct server_state *server, struct server_client_state *client);
 
@@ -0,0 +1,65 @@
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Objects are aligned like the strictest fundamental type
+#define SLAB_ALIGNMENT (sizeof(max_align_t))
+
+void slab_init(struct slab_allocator *allocator, size_t object_size, size_t objects_per_slab) {
+    // Every free object stores the pointer to the next free object
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+
+    // Round the object size up so that every object in a slab is aligned
+    allocator->object_size = (object_size + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT * SLAB_ALIGNMENT;
+    allocator->objects_per_slab = objects_per_slab > 0 ? objects_per_slab : 1;
+    allocator->free_list = NULL;
+    allocator->slabs = NULL;
+    allocator->objects_in_use = 0;
+}
+
+/**
+ * @brief Allocate a new slab and put all of its objects on the free list
+ */
+static void slab_grow(struct slab_allocator *allocator) {
+    size_t header_size = (sizeof(struct slab) + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT * SLAB_ALIGNMENT;
+    struct slab *slab = malloc(header_size + allocator->object_size * allocator->objects_per_slab);
+    if (slab == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    slab->next = allocator->slabs;
+    allocator->slabs = slab;
+
+    // Thread the objects onto the free list, last one first so that
+    // allocations hand out objects in address order
+    char *objects = (char *)slab + header_size;
+    for (size_t i = allocator->objects_per_slab; i > 0; i--) {
+        void *object = objects + (i - 1) * allocator->object_size;
+        *(void **)object = allocator->free_list;
+        allocator->free_list = object;
+    }
+}
+
+void* slab_alloc(struct slab_allocator *allocator) {
+    if (allocator->free_list == NULL) {
+        slab_grow(allocator);
+    }
+
+    // Pop the head of the free list
+    void *object = allocator->free_list;
+    allocator->free_list = *(void **)object;
+    allocator->objects_in_use++;
+
+    return object;
+}
+
+void slab_free(struct slab_allocator *allocator, void *object) {
+    // Push the object onto the free list
+    *(void **)object = allocator->free_list;
+    allocator->free_list = object;
+    allocator->objects_in_use--;
+}
@@ -0,0 +1,52 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+
+/**
+ * @brief A chunk of memory holding objects_per_slab objects of the same size
+ */
+struct slab {
+    struct slab *next;  // The next slab owned by the same allocator
+    char objects[];     // Storage for the objects
+};
+
+/**
+ * @brief Pool allocator for many objects of one fixed size. Memory is requested
+ * from malloc() one slab at a time, and freed objects are kept on a free list for
+ * reuse, so allocating and freeing are O(1) and objects are packed together.
+ */
+struct slab_allocator {
+    size_t object_size;         // The size of every object, rounded up for alignment
+    size_t objects_per_slab;    // How many objects are carved out of a single slab
+    void *free_list;            // Singly linked list of free objects
+    struct slab *slabs;         // All slabs owned by this allocator
+    size_t objects_in_use;      // Number of objects currently allocated
+};
+
+/**
+ * @brief Initialize the allocator for objects of the given size
+ * 
+ * @param allocator 
+ * @param object_size 
+ * @param objects_per_slab 
+ */
+void slab_init(struct slab_allocator *allocator, size_t object_size, size_t objects_per_slab);
+
+/**
+ * @brief Allocate one object. Exits the process if out of memory.
+ * 
+ * @param allocator 
+ * @return Pointer to an uninitialized object
+ */
+void* slab_alloc(struct slab_allocator *allocator);
+
+/**
+ * @brief Return an object to the allocator
+ * 
+ * @param allocator 
+ * @param object 
+ */
+void slab_free(struct slab_allocator *allocator, void *object);
+
+#endif
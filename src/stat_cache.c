@@ -0,0 +1,230 @@
+#include "stat_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+// Changes that make cached metadata of a name stale
+#define STAT_CACHE_EVENTS (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO \
+    | IN_DELETE_SELF | IN_ONLYDIR)
+
+/**
+ * @brief FNV-1a hash of a name
+ */
+static unsigned int hash_name(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void free_directory(struct stat_cache *cache, int index, int remove_watch) {
+    struct stat_cache_directory *directory = cache->directories[index];
+    if (remove_watch) {
+        inotify_rm_watch(cache->inotify_fd, directory->watch);
+    }
+    for (int i = 0; i < STAT_CACHE_BUCKETS; i++) {
+        struct stat_cache_entry *entry = directory->buckets[i];
+        while (entry != NULL) {
+            struct stat_cache_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(directory);
+
+    // Keep the array dense
+    cache->directories[index] = cache->directories[--cache->directory_count];
+}
+
+static void drop_all(struct stat_cache *cache) {
+    while (cache->directory_count > 0) {
+        free_directory(cache, cache->directory_count - 1, 1);
+    }
+}
+
+static struct stat_cache_directory* find_directory(struct stat_cache *cache, dev_t dev, ino_t ino) {
+    for (int i = 0; i < cache->directory_count; i++) {
+        struct stat_cache_directory *directory = cache->directories[i];
+        if (directory->dev == dev && directory->ino == ino) {
+            return directory;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start caching the directory, evicting the least recently used one if needed
+ *
+ * @return The new directory, or NULL if it cannot be watched
+ */
+static struct stat_cache_directory* add_directory(struct stat_cache *cache, int dirfd, dev_t dev, ino_t ino) {
+    static char fd_path[64];
+
+    if (cache->directory_count == STAT_CACHE_MAX_DIRECTORIES) {
+        int oldest = 0;
+        for (int i = 1; i < cache->directory_count; i++) {
+            if (cache->directories[i]->last_used < cache->directories[oldest]->last_used) {
+                oldest = i;
+            }
+        }
+        free_directory(cache, oldest, 1);
+    }
+
+    // inotify needs a path; the /proc entry of the descriptor leads to the directory itself
+    sprintf(fd_path, "/proc/self/fd/%d", dirfd);
+    int watch = inotify_add_watch(cache->inotify_fd, fd_path, STAT_CACHE_EVENTS);
+    if (watch == -1) {
+        perror("inotify_add_watch");
+        return NULL;
+    }
+
+    // Hard links to a directory are impossible, but bind mounts would give the same watch twice
+    for (int i = 0; i < cache->directory_count; i++) {
+        if (cache->directories[i]->watch == watch) {
+            free_directory(cache, i, 0);
+            break;
+        }
+    }
+
+    struct stat_cache_directory *directory = calloc(1, sizeof(struct stat_cache_directory));
+    if (directory == NULL) {
+        perror("calloc");
+        inotify_rm_watch(cache->inotify_fd, watch);
+        return NULL;
+    }
+    directory->dev = dev;
+    directory->ino = ino;
+    directory->watch = watch;
+    cache->directories[cache->directory_count++] = directory;
+    return directory;
+}
+
+static struct stat_cache_entry** find_entry(struct stat_cache_directory *directory, const char *name, unsigned int hash) {
+    struct stat_cache_entry **link = &(directory->buckets[hash % STAT_CACHE_BUCKETS]);
+    while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->name, name) != 0)) {
+        link = &((*link)->next);
+    }
+    return link;
+}
+
+static int stat_name(int dirfd, const char *name, struct stat_cache_info *info) {
+    struct stat stat_result;
+    if (fstatat(dirfd, name, &stat_result, AT_SYMLINK_NOFOLLOW) == -1) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            return -1;
+        }
+        info->exists = 0;
+        return 0;
+    }
+    info->exists = 1;
+    info->mode = stat_result.st_mode;
+    info->size = stat_result.st_size;
+    info->mtime = stat_result.st_mtim;
+    return 0;
+}
+
+void stat_cache_init(struct stat_cache *cache) {
+    memset(cache, 0, sizeof(*cache));
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify_fd == -1) {
+        perror("inotify_init1");
+    }
+}
+
+int stat_cache_lookup(struct stat_cache *cache, int dirfd, dev_t dev, ino_t ino, const char *name,
+    struct stat_cache_info *info) {
+    if (cache->inotify_fd == -1) {
+        return stat_name(dirfd, name, info);
+    }
+
+    cache->clock++;
+    struct stat_cache_directory *directory = find_directory(cache, dev, ino);
+    unsigned int hash = hash_name(name);
+    if (directory != NULL) {
+        directory->last_used = cache->clock;
+        struct stat_cache_entry *entry = *find_entry(directory, name, hash);
+        if (entry != NULL) {
+            cache->hits++;
+            *info = entry->info;
+            return 0;
+        }
+    }
+    cache->misses++;
+
+    // Watch the directory before looking at the name, so that no change goes unnoticed
+    if (directory == NULL) {
+        directory = add_directory(cache, dirfd, dev, ino);
+        if (directory != NULL) {
+            directory->last_used = cache->clock;
+        }
+    }
+    if (stat_name(dirfd, name, info) == -1) {
+        return -1;
+    }
+    if (directory == NULL || directory->entry_count == STAT_CACHE_MAX_ENTRIES) {
+        return 0;
+    }
+
+    size_t length = strlen(name);
+    struct stat_cache_entry *entry = malloc(sizeof(struct stat_cache_entry) + length + 1);
+    if (entry == NULL) {
+        return 0;
+    }
+    entry->hash = hash;
+    entry->info = *info;
+    memcpy(entry->name, name, length + 1);
+    struct stat_cache_entry **bucket = &(directory->buckets[hash % STAT_CACHE_BUCKETS]);
+    entry->next = *bucket;
+    *bucket = entry;
+    directory->entry_count++;
+    return 0;
+}
+
+void stat_cache_handle_events(struct stat_cache *cache) {
+    static char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t length;
+    while ((length = read(cache->inotify_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + length;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            // Events were lost, so anything may have changed
+            if (event->mask & IN_Q_OVERFLOW) {
+                drop_all(cache);
+                continue;
+            }
+
+            int index = 0;
+            while (index < cache->directory_count && cache->directories[index]->watch != event->wd) {
+                index++;
+            }
+            if (index == cache->directory_count) {
+                continue;
+            }
+            struct stat_cache_directory *directory = cache->directories[index];
+
+            if (event->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+                // The directory is gone (its watch is removed by the kernel)
+                free_directory(cache, index, 0);
+            } else if (event->len > 0) {
+                // Drop the name that changed
+                struct stat_cache_entry **link = find_entry(directory, event->name, hash_name(event->name));
+                if (*link != NULL) {
+                    struct stat_cache_entry *entry = *link;
+                    *link = entry->next;
+                    free(entry);
+                    directory->entry_count--;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef STAT_CACHE_H_
+#define STAT_CACHE_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+// Number of directories cached at once by each reactor; each has an inotify watch
+#define STAT_CACHE_MAX_DIRECTORIES (256)
+// Number of names cached per directory; lookups of more names are not cached
+#define STAT_CACHE_MAX_ENTRIES (4096)
+// Number of hash buckets per directory
+#define STAT_CACHE_BUCKETS (256)
+
+/**
+ * @brief What is cached of the metadata of a name
+ */
+struct stat_cache_info {
+    int exists;                 // 0 if the name does not exist (the other fields are then unused)
+    mode_t mode;
+    off_t size;
+    struct timespec mtime;
+};
+
+/**
+ * @brief A cached name of a directory
+ */
+struct stat_cache_entry {
+    struct stat_cache_entry *next;  // The next entry in the same bucket
+    unsigned int hash;              // Hash of the name
+    struct stat_cache_info info;
+    char name[];                    // The null-terminated name
+};
+
+/**
+ * @brief The cached names of one directory, identified by its inode
+ */
+struct stat_cache_directory {
+    dev_t dev;
+    ino_t ino;
+    int watch;                      // inotify watch descriptor of the directory
+    unsigned int entry_count;
+    uint64_t last_used;             // Value of the cache's clock at the last lookup
+    struct stat_cache_entry *buckets[STAT_CACHE_BUCKETS];
+};
+
+/**
+ * @brief Cache of the metadata of names in directories, for answering SIZE and MDTM
+ * without touching the filesystem. Each reactor has its own. Names are cached when
+ * first looked up (including names that do not exist), and inotify reports every
+ * change to a cached directory, including those made by transfer processes or from
+ * outside the server, which drops the changed name.
+ */
+struct stat_cache {
+    int inotify_fd;                 // Watches the cached directories, or -1 if the cache is disabled
+    uint64_t clock;                 // Number of lookups so far
+    int directory_count;
+    struct stat_cache_directory *directories[STAT_CACHE_MAX_DIRECTORIES];
+    uint64_t hits;                  // Statistics
+    uint64_t misses;
+};
+
+/**
+ * @brief Initialize an empty cache. Without inotify, the cache is disabled and every
+ * lookup goes to the filesystem.
+ *
+ * @param cache
+ */
+void stat_cache_init(struct stat_cache *cache);
+
+/**
+ * @brief Look up the metadata of a name in a directory, from the cache if possible.
+ * Symbolic links are not followed.
+ *
+ * @param cache
+ * @param dirfd The directory (may be opened with O_PATH)
+ * @param dev The device of the directory, which together with ino identifies it
+ * @param ino The inode of the directory
+ * @param name A name in the directory, without slashes
+ * @param info Location to store the metadata
+ * @return 0 on success (info->exists tells whether the name exists), -1 if it could not be looked up
+ */
+int stat_cache_lookup(struct stat_cache *cache, int dirfd, dev_t dev, ino_t ino, const char *name,
+    struct stat_cache_info *info);
+
+/**
+ * @brief Read the pending inotify events and drop what they changed. Call when the
+ * inotify descriptor is readable, before handling commands that look up the cache.
+ *
+ * @param cache
+ */
+void stat_cache_handle_events(struct stat_cache *cache);
+
+#endif
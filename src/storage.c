@@ -0,0 +1,931 @@
+#include "storage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sandbox.h"
+
+int storage_open(const struct storage *storage, int dir, const char *path, int flags, mode_t mode) {
+    return storage->ops->open(storage->state, dir, path, flags, mode);
+}
+
+int storage_close(const struct storage *storage, int handle) {
+    return storage->ops->close(storage->state, handle);
+}
+
+ssize_t storage_read(const struct storage *storage, int handle, void *buf, size_t count) {
+    return storage->ops->read(storage->state, handle, buf, count);
+}
+
+int storage_write(const struct storage *storage, int handle, const void *buf, size_t count) {
+    return storage->ops->write(storage->state, handle, buf, count);
+}
+
+int storage_stat(const struct storage *storage, int dir, const char *name, struct stat *stat_result) {
+    return storage->ops->stat(storage->state, dir, name, stat_result);
+}
+
+int storage_list(const struct storage *storage, int dir, storage_list_callback callback, void *data) {
+    return storage->ops->list(storage->state, dir, callback, data);
+}
+
+int storage_mkdir(const struct storage *storage, int dir, const char *name, mode_t mode) {
+    return storage->ops->mkdir(storage->state, dir, name, mode);
+}
+
+int storage_rename(const struct storage *storage, int from_dir, const char *from_name, int to_dir, const char *to_name) {
+    return storage->ops->rename(storage->state, from_dir, from_name, to_dir, to_name);
+}
+
+int storage_unlink(const struct storage *storage, int dir, const char *name) {
+    return storage->ops->unlink(storage->state, dir, name);
+}
+
+int storage_truncate(const struct storage *storage, int handle, off_t length) {
+    return storage->ops->truncate(storage->state, handle, length);
+}
+
+/* POSIX backend: handles are file descriptors */
+
+static int posix_open(void *state, int dir, const char *path, int flags, mode_t mode) {
+    (void)state;
+    int fd = sandbox_open(dir, path, flags, mode);
+    if (fd != -1 && (flags & O_NONBLOCK) && !(flags & O_PATH)) {
+        // O_NONBLOCK only keeps opening a FIFO from blocking; reads of the file must block
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    }
+    return fd;
+}
+
+static int posix_close(void *state, int handle) {
+    (void)state;
+    return close(handle);
+}
+
+static ssize_t posix_read(void *state, int handle, void *buf, size_t count) {
+    (void)state;
+    ssize_t bytes;
+    do {
+        bytes = read(handle, buf, count);
+    } while (bytes == -1 && errno == EINTR);
+    return bytes;
+}
+
+static int posix_write(void *state, int handle, const void *buf, size_t count) {
+    (void)state;
+    const char *data = buf;
+    while (count > 0) {
+        ssize_t bytes = write(handle, data, count);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += bytes;
+        count -= bytes;
+    }
+    return 0;
+}
+
+static int posix_stat(void *state, int dir, const char *name, struct stat *stat_result) {
+    (void)state;
+    if (name == NULL) {
+        return fstat(dir, stat_result);
+    }
+    return fstatat(dir, name, stat_result, AT_SYMLINK_NOFOLLOW);
+}
+
+static int posix_list(void *state, int dir, storage_list_callback callback, void *data) {
+    (void)state;
+    // Directories may be held as O_PATH descriptors, which cannot be read
+    int fd = openat(dir, ".", O_RDONLY | O_DIRECTORY);
+    DIR *stream = fd == -1 ? NULL : fdopendir(fd);
+    if (stream == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(stream)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        // Entries removed since they were read are skipped
+        struct stat stat_result;
+        if (fstatat(dirfd(stream), entry->d_name, &stat_result, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        if (callback(entry->d_name, &stat_result, data) != 0) {
+            break;
+        }
+    }
+
+    closedir(stream);
+    return 0;
+}
+
+static int posix_mkdir(void *state, int dir, const char *name, mode_t mode) {
+    (void)state;
+    return mkdirat(dir, name, mode);
+}
+
+static int posix_rename(void *state, int from_dir, const char *from_name, int to_dir, const char *to_name) {
+    (void)state;
+    return renameat(from_dir, from_name, to_dir, to_name);
+}
+
+static int posix_unlink(void *state, int dir, const char *name) {
+    (void)state;
+    return unlinkat(dir, name, 0);
+}
+
+static int posix_truncate(void *state, int handle, off_t length) {
+    (void)state;
+    return ftruncate(handle, length);
+}
+
+static const struct storage_ops posix_ops = {
+    .open = posix_open,
+    .close = posix_close,
+    .read = posix_read,
+    .write = posix_write,
+    .stat = posix_stat,
+    .list = posix_list,
+    .mkdir = posix_mkdir,
+    .rename = posix_rename,
+    .unlink = posix_unlink,
+    .truncate = posix_truncate,
+};
+
+void storage_create_posix(struct storage *storage, int root_dirfd) {
+    storage->ops = &posix_ops;
+    storage->state = NULL;
+    storage->root = root_dirfd;
+    storage->uses_fds = 1;
+}
+
+/* RAM backend: handles index a table private to each process */
+
+static struct ram_handle ram_handles[STORAGE_RAM_MAX_HANDLES];
+
+/**
+ * @brief Get the data blocks, which follow the header at the next page boundary
+ */
+static size_t ram_header_size() {
+    return (sizeof(struct ram_storage) + 4095) & ~(size_t)4095;
+}
+
+static char* get_block_data(struct ram_storage *ram, int block) {
+    return (char *)ram + ram_header_size() + (size_t)block * STORAGE_RAM_BLOCK_SIZE;
+}
+
+static void lock_ram(struct ram_storage *ram) {
+    if (pthread_mutex_lock(&(ram->lock)) == EOWNERDEAD) {
+        // A process died while holding the lock. Every change is a handful of
+        // stores, and processes are only killed between commands, so carry on.
+        pthread_mutex_consistent(&(ram->lock));
+    }
+}
+
+static void unlock_ram(struct ram_storage *ram) {
+    pthread_mutex_unlock(&(ram->lock));
+}
+
+static uint32_t hash_name(int parent, const char *name) {
+    // FNV-1a, seeded with the directory
+    uint32_t hash = 2166136261u ^ (uint32_t)parent;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+    return hash & (STORAGE_RAM_BUCKETS - 1);
+}
+
+/**
+ * @brief Find an entry of a directory
+ *
+ * @return The node of the entry, or -1 if there is none
+ */
+static int find_child(struct ram_storage *ram, int parent, const char *name) {
+    for (int i = ram->buckets[hash_name(parent, name)]; i != -1; i = ram->nodes[i].hash_next) {
+        if (ram->nodes[i].parent == parent && strcmp(ram->nodes[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Add a node to a directory, under its name
+ */
+static void link_child(struct ram_storage *ram, int parent, int node) {
+    struct ram_node *child = &(ram->nodes[node]);
+    struct ram_node *dir = &(ram->nodes[parent]);
+    child->parent = parent;
+    child->prev_sibling = -1;
+    child->next_sibling = dir->first_child;
+    if (dir->first_child != -1) {
+        ram->nodes[dir->first_child].prev_sibling = node;
+    }
+    dir->first_child = node;
+
+    int *bucket = &(ram->buckets[hash_name(parent, child->name)]);
+    child->hash_next = *bucket;
+    *bucket = node;
+    clock_gettime(CLOCK_REALTIME, &(dir->mtime));
+}
+
+/**
+ * @brief Remove a node from its directory, keeping the node
+ */
+static void unlink_child(struct ram_storage *ram, int node) {
+    struct ram_node *child = &(ram->nodes[node]);
+    struct ram_node *dir = &(ram->nodes[child->parent]);
+    if (child->prev_sibling != -1) {
+        ram->nodes[child->prev_sibling].next_sibling = child->next_sibling;
+    } else {
+        dir->first_child = child->next_sibling;
+    }
+    if (child->next_sibling != -1) {
+        ram->nodes[child->next_sibling].prev_sibling = child->prev_sibling;
+    }
+
+    int *link = &(ram->buckets[hash_name(child->parent, child->name)]);
+    while (*link != node) {
+        link = &(ram->nodes[*link].hash_next);
+    }
+    *link = child->hash_next;
+    clock_gettime(CLOCK_REALTIME, &(dir->mtime));
+    child->parent = -1;
+}
+
+/**
+ * @brief Allocate a node, and add it to a directory
+ *
+ * @return The node, or -1 with errno set if there is no free node
+ */
+static int create_node(struct ram_storage *ram, int parent, const char *name, int is_directory) {
+    int node;
+    if (ram->free_node != -1) {
+        node = ram->free_node;
+        ram->free_node = ram->nodes[node].next_sibling;
+    } else if (ram->unused_nodes < STORAGE_RAM_MAX_NODES) {
+        node = ram->unused_nodes++;
+    } else {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    struct ram_node *entry = &(ram->nodes[node]);
+    entry->in_use = 1;
+    entry->is_directory = is_directory;
+    entry->first_child = -1;
+    entry->first_block = -1;
+    entry->last_block = -1;
+    entry->block_count = 0;
+    entry->size = 0;
+    clock_gettime(CLOCK_REALTIME, &(entry->mtime));
+    strcpy(entry->name, name);
+    if (parent != -1) {
+        link_child(ram, parent, node);
+    } else {
+        entry->parent = -1;
+    }
+    return node;
+}
+
+/**
+ * @brief Free the blocks of a file from a given index in the file on
+ */
+static void free_blocks_from(struct ram_storage *ram, int node, int index) {
+    struct ram_node *file = &(ram->nodes[node]);
+    if (index >= file->block_count) {
+        return;
+    }
+
+    int previous = -1;
+    int block = file->first_block;
+    for (int i = 0; i < index; i++) {
+        previous = block;
+        block = ram->block_next[block];
+    }
+
+    // The freed blocks are moved as a whole to the front of the free list
+    ram->block_next[file->last_block] = ram->free_block;
+    ram->free_block = block;
+
+    if (previous == -1) {
+        file->first_block = -1;
+    } else {
+        ram->block_next[previous] = -1;
+    }
+    file->last_block = previous;
+    file->block_count = index;
+    file->layout++;
+}
+
+/**
+ * @brief Free a node that is no longer in a directory; its handles become stale
+ */
+static void free_node(struct ram_storage *ram, int node) {
+    free_blocks_from(ram, node, 0);
+    struct ram_node *entry = &(ram->nodes[node]);
+    entry->in_use = 0;
+    entry->generation++;
+    entry->next_sibling = ram->free_node;
+    ram->free_node = node;
+}
+
+/**
+ * @brief Add blocks to the end of a file until it has the given number of blocks
+ *
+ * @return 0 on success, -1 with errno set if storage is full (the blocks added so far are kept)
+ */
+static int grow_blocks(struct ram_storage *ram, int node, int block_count) {
+    struct ram_node *file = &(ram->nodes[node]);
+    while (file->block_count < block_count) {
+        int block;
+        if (ram->free_block != -1) {
+            block = ram->free_block;
+            ram->free_block = ram->block_next[block];
+        } else if (ram->unused_blocks < STORAGE_RAM_BLOCK_COUNT) {
+            block = ram->unused_blocks++;
+        } else {
+            errno = ENOSPC;
+            return -1;
+        }
+
+        ram->block_next[block] = -1;
+        if (file->last_block == -1) {
+            file->first_block = block;
+        } else {
+            ram->block_next[file->last_block] = block;
+        }
+        file->last_block = block;
+        file->block_count++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the block at an index of the file of a handle, starting from the cursor
+ * of the handle when it is not past it, and leave the cursor there
+ */
+static int seek_block(struct ram_storage *ram, struct ram_handle *handle, int index) {
+    struct ram_node *file = &(ram->nodes[handle->node]);
+    if (handle->layout != file->layout || handle->cursor_index == -1 || handle->cursor_index > index) {
+        handle->layout = file->layout;
+        handle->cursor_index = 0;
+        handle->cursor_block = file->first_block;
+    }
+    while (handle->cursor_index < index) {
+        handle->cursor_block = ram->block_next[handle->cursor_block];
+        handle->cursor_index++;
+    }
+    return handle->cursor_block;
+}
+
+/**
+ * @brief Copy between a buffer and a file, or zero part of a file (if buf is NULL).
+ * The blocks of the range must exist.
+ */
+static void copy_file_range_data(struct ram_storage *ram, struct ram_handle *handle, off_t offset,
+    char *to_buf, const char *from_buf, size_t count) {
+    while (count > 0) {
+        int block = seek_block(ram, handle, (int)(offset / STORAGE_RAM_BLOCK_SIZE));
+        size_t block_offset = offset % STORAGE_RAM_BLOCK_SIZE;
+        size_t chunk = STORAGE_RAM_BLOCK_SIZE - block_offset;
+        if (chunk > count) {
+            chunk = count;
+        }
+
+        char *data = get_block_data(ram, block) + block_offset;
+        if (to_buf != NULL) {
+            memcpy(to_buf, data, chunk);
+            to_buf += chunk;
+        } else if (from_buf != NULL) {
+            memcpy(data, from_buf, chunk);
+            from_buf += chunk;
+        } else {
+            memset(data, 0, chunk);
+        }
+        offset += chunk;
+        count -= chunk;
+    }
+}
+
+/**
+ * @brief Get the handle of a handle number, if it is open and its node still exists
+ *
+ * @return The handle, or NULL with errno set
+ */
+static struct ram_handle* get_handle(struct ram_storage *ram, int number) {
+    if (number < 0 || number >= STORAGE_RAM_MAX_HANDLES || !ram_handles[number].in_use) {
+        errno = EBADF;
+        return NULL;
+    }
+    struct ram_handle *handle = &(ram_handles[number]);
+    if (ram->nodes[handle->node].generation != handle->generation) {
+        // Removed or replaced since it was opened
+        errno = ESTALE;
+        return NULL;
+    }
+    return handle;
+}
+
+/**
+ * @brief Get the directory node of a handle
+ *
+ * @return The node, or -1 with errno set
+ */
+static int get_directory(struct ram_storage *ram, int number) {
+    struct ram_handle *handle = get_handle(ram, number);
+    if (handle == NULL) {
+        return -1;
+    }
+    if (!ram->nodes[handle->node].is_directory) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    return handle->node;
+}
+
+/**
+ * @brief Check that a name is a single component that can be created
+ */
+static int check_name(const char *name) {
+    if (strchr(name, '/') != NULL || strcmp(name, "..") == 0) {
+        errno = EXDEV;
+        return -1;
+    }
+    if (name[0] == '\0' || strcmp(name, ".") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (strlen(name) > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Resolve a path beneath a directory, as sandbox_open() does: ".." fails with EXDEV
+ *
+ * @param ram
+ * @param dir
+ * @param path
+ * @param last Location to store the last component, or "" if the path names dir itself
+ * @return The directory holding the last component, or -1 with errno set
+ */
+static int resolve_parent(struct ram_storage *ram, int dir, const char *path, char *last) {
+    if (path[0] == '/') {
+        errno = EXDEV;
+        return -1;
+    }
+
+    last[0] = '\0';
+    while (*path != '\0') {
+        size_t length = strcspn(path, "/");
+        const char *next = path + length + (path[length] == '/');
+        if (length == 0 || (length == 1 && path[0] == '.')) {
+            path = next;
+            continue;
+        }
+        if (length == 2 && path[0] == '.' && path[1] == '.') {
+            errno = EXDEV;
+            return -1;
+        }
+        if (length > NAME_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        // Step into the previous component, now that there is another one
+        if (last[0] != '\0') {
+            int child = find_child(ram, dir, last);
+            if (child == -1) {
+                errno = ENOENT;
+                return -1;
+            }
+            if (!ram->nodes[child].is_directory) {
+                errno = ENOTDIR;
+                return -1;
+            }
+            dir = child;
+        }
+        memcpy(last, path, length);
+        last[length] = '\0';
+        path = next;
+    }
+    return dir;
+}
+
+static void fill_stat(struct ram_storage *ram, int node, struct stat *stat_result) {
+    struct ram_node *entry = &(ram->nodes[node]);
+    memset(stat_result, 0, sizeof(*stat_result));
+    stat_result->st_ino = node + 1;
+    stat_result->st_dev = 0;
+    stat_result->st_nlink = 1;
+    stat_result->st_mode = entry->is_directory ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+    stat_result->st_uid = getuid();
+    stat_result->st_gid = getgid();
+    stat_result->st_size = entry->size;
+    stat_result->st_blksize = STORAGE_RAM_BLOCK_SIZE;
+    stat_result->st_blocks = (blkcnt_t)entry->block_count * (STORAGE_RAM_BLOCK_SIZE / 512);
+    stat_result->st_mtim = entry->mtime;
+    stat_result->st_ctim = entry->mtime;
+    stat_result->st_atim = entry->mtime;
+}
+
+static int ram_open(void *state, int dir, const char *path, int flags, mode_t mode) {
+    (void)mode;
+    struct ram_storage *ram = state;
+    char last[NAME_MAX + 1];
+    int access = flags & O_ACCMODE;
+
+    int number = 0;
+    while (number < STORAGE_RAM_MAX_HANDLES && ram_handles[number].in_use) {
+        number++;
+    }
+    if (number == STORAGE_RAM_MAX_HANDLES) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    lock_ram(ram);
+    int parent = get_directory(ram, dir);
+    int node = parent == -1 ? -1 : resolve_parent(ram, parent, path, last);
+    if (node != -1 && last[0] != '\0') {
+        parent = node;
+        node = find_child(ram, parent, last);
+        if (node == -1 && (flags & O_CREAT)) {
+            node = create_node(ram, parent, last, 0);
+        } else if (node == -1) {
+            errno = ENOENT;
+        } else if ((flags & O_CREAT) && (flags & O_EXCL)) {
+            errno = EEXIST;
+            node = -1;
+        }
+    }
+
+    if (node != -1 && (flags & O_DIRECTORY) && !ram->nodes[node].is_directory) {
+        errno = ENOTDIR;
+        node = -1;
+    } else if (node != -1 && ram->nodes[node].is_directory && access != O_RDONLY) {
+        errno = EISDIR;
+        node = -1;
+    } else if (node != -1 && (flags & O_TRUNC) && access != O_RDONLY) {
+        free_blocks_from(ram, node, 0);
+        ram->nodes[node].size = 0;
+        clock_gettime(CLOCK_REALTIME, &(ram->nodes[node].mtime));
+    }
+
+    if (node != -1) {
+        struct ram_handle *handle = &(ram_handles[number]);
+        handle->in_use = 1;
+        handle->node = node;
+        handle->generation = ram->nodes[node].generation;
+        handle->flags = access;
+        handle->offset = 0;
+        handle->cursor_index = -1;
+    }
+    unlock_ram(ram);
+    return node == -1 ? -1 : number;
+}
+
+static int ram_close(void *state, int handle) {
+    (void)state;
+    if (handle < 0 || handle >= STORAGE_RAM_MAX_HANDLES || !ram_handles[handle].in_use) {
+        errno = EBADF;
+        return -1;
+    }
+    ram_handles[handle].in_use = 0;
+    return 0;
+}
+
+static ssize_t ram_read(void *state, int number, void *buf, size_t count) {
+    struct ram_storage *ram = state;
+    lock_ram(ram);
+    struct ram_handle *handle = get_handle(ram, number);
+    if (handle == NULL || ram->nodes[handle->node].is_directory) {
+        if (handle != NULL) {
+            errno = EISDIR;
+        }
+        unlock_ram(ram);
+        return -1;
+    }
+
+    off_t size = ram->nodes[handle->node].size;
+    if (handle->offset >= size) {
+        count = 0;
+    } else if ((off_t)count > size - handle->offset) {
+        count = size - handle->offset;
+    }
+    copy_file_range_data(ram, handle, handle->offset, buf, NULL, count);
+    handle->offset += count;
+    unlock_ram(ram);
+    return count;
+}
+
+/**
+ * @brief Resize a file, zeroing the bytes it grows by
+ *
+ * @return 0 on success, -1 with errno set if storage is full
+ */
+static int resize_file(struct ram_storage *ram, struct ram_handle *handle, off_t length) {
+    struct ram_node *file = &(ram->nodes[handle->node]);
+    int block_count = (int)((length + STORAGE_RAM_BLOCK_SIZE - 1) / STORAGE_RAM_BLOCK_SIZE);
+    if (length < file->size) {
+        free_blocks_from(ram, handle->node, block_count);
+    } else if (length > file->size) {
+        if (grow_blocks(ram, handle->node, block_count) == -1) {
+            // Keep only the blocks the file needs
+            free_blocks_from(ram, handle->node,
+                (int)((file->size + STORAGE_RAM_BLOCK_SIZE - 1) / STORAGE_RAM_BLOCK_SIZE));
+            return -1;
+        }
+        copy_file_range_data(ram, handle, file->size, NULL, NULL, length - file->size);
+    }
+    file->size = length;
+    clock_gettime(CLOCK_REALTIME, &(file->mtime));
+    return 0;
+}
+
+static int ram_write(void *state, int number, const void *buf, size_t count) {
+    struct ram_storage *ram = state;
+    lock_ram(ram);
+    struct ram_handle *handle = get_handle(ram, number);
+    if (handle == NULL || handle->flags == O_RDONLY) {
+        if (handle != NULL) {
+            errno = EBADF;
+        }
+        unlock_ram(ram);
+        return -1;
+    }
+
+    struct ram_node *file = &(ram->nodes[handle->node]);
+    off_t end = handle->offset + count;
+    int status = 0;
+    if (end > file->size) {
+        // Zero any gap before the written bytes, then make room for them
+        off_t old_size = file->size;
+        status = resize_file(ram, handle, handle->offset > old_size ? handle->offset : old_size);
+        if (status == 0 && grow_blocks(ram, handle->node,
+            (int)((end + STORAGE_RAM_BLOCK_SIZE - 1) / STORAGE_RAM_BLOCK_SIZE)) == -1) {
+            resize_file(ram, handle, old_size);
+            status = -1;
+        }
+    }
+    if (status == 0) {
+        copy_file_range_data(ram, handle, handle->offset, NULL, buf, count);
+        handle->offset = end;
+        if (end > file->size) {
+            file->size = end;
+        }
+        clock_gettime(CLOCK_REALTIME, &(file->mtime));
+    }
+    unlock_ram(ram);
+    return status;
+}
+
+static int ram_stat(void *state, int dir, const char *name, struct stat *stat_result) {
+    struct ram_storage *ram = state;
+    lock_ram(ram);
+    int node;
+    if (name == NULL) {
+        struct ram_handle *handle = get_handle(ram, dir);
+        node = handle == NULL ? -1 : handle->node;
+    } else {
+        char last[NAME_MAX + 1];
+        node = get_directory(ram, dir);
+        node = node == -1 ? -1 : resolve_parent(ram, node, name, last);
+        if (node != -1 && last[0] != '\0') {
+            node = find_child(ram, node, last);
+            if (node == -1) {
+                errno = ENOENT;
+            }
+        }
+    }
+    if (node != -1) {
+        fill_stat(ram, node, stat_result);
+    }
+    unlock_ram(ram);
+    return node == -1 ? -1 : 0;
+}
+
+static int ram_list(void *state, int dir, storage_list_callback callback, void *data) {
+    struct ram_storage *ram = state;
+    static char names[STORAGE_RAM_LIST_BATCH][NAME_MAX + 1];
+    static struct stat stats[STORAGE_RAM_LIST_BATCH];
+
+    // Entries are copied in batches, so callbacks (which may block on a socket) run unlocked.
+    // The position is the entry following the last one copied; if it goes away in between,
+    // the listing stops early, as a directory listed while it changes may anyway miss entries.
+    lock_ram(ram);
+    int node = get_directory(ram, dir);
+    if (node == -1) {
+        unlock_ram(ram);
+        return -1;
+    }
+    int next = ram->nodes[node].first_child;
+    uint32_t next_generation = next == -1 ? 0 : ram->nodes[next].generation;
+    unlock_ram(ram);
+
+    while (next != -1) {
+        int count = 0;
+        lock_ram(ram);
+        if (ram->nodes[next].generation != next_generation || ram->nodes[next].parent != node) {
+            unlock_ram(ram);
+            break;
+        }
+        while (next != -1 && count < STORAGE_RAM_LIST_BATCH) {
+            strcpy(names[count], ram->nodes[next].name);
+            fill_stat(ram, next, &(stats[count]));
+            count++;
+            next = ram->nodes[next].next_sibling;
+        }
+        next_generation = next == -1 ? 0 : ram->nodes[next].generation;
+        unlock_ram(ram);
+
+        for (int i = 0; i < count; i++) {
+            if (callback(names[i], &(stats[i]), data) != 0) {
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static int ram_mkdir(void *state, int dir, const char *name, mode_t mode) {
+    (void)mode;
+    struct ram_storage *ram = state;
+    if (check_name(name) == -1) {
+        return -1;
+    }
+
+    lock_ram(ram);
+    int parent = get_directory(ram, dir);
+    int status = -1;
+    if (parent != -1 && find_child(ram, parent, name) != -1) {
+        errno = EEXIST;
+    } else if (parent != -1 && create_node(ram, parent, name, 1) != -1) {
+        status = 0;
+    }
+    unlock_ram(ram);
+    return status;
+}
+
+static int ram_rename(void *state, int from_dir, const char *from_name, int to_dir, const char *to_name) {
+    struct ram_storage *ram = state;
+    if (check_name(from_name) == -1 || check_name(to_name) == -1) {
+        return -1;
+    }
+
+    lock_ram(ram);
+    int from_parent = get_directory(ram, from_dir);
+    int to_parent = from_parent == -1 ? -1 : get_directory(ram, to_dir);
+    int node = to_parent == -1 ? -1 : find_child(ram, from_parent, from_name);
+    int status = -1;
+    if (to_parent != -1 && node == -1) {
+        errno = ENOENT;
+    } else if (node != -1) {
+        // A directory cannot be moved beneath itself
+        int ancestor = to_parent;
+        while (ancestor != -1 && ancestor != node) {
+            ancestor = ram->nodes[ancestor].parent;
+        }
+
+        int target = find_child(ram, to_parent, to_name);
+        struct ram_node *entry = &(ram->nodes[node]);
+        if (ancestor == node) {
+            errno = EINVAL;
+        } else if (target == node) {
+            status = 0;
+        } else if (target != -1 && entry->is_directory && !ram->nodes[target].is_directory) {
+            errno = ENOTDIR;
+        } else if (target != -1 && !entry->is_directory && ram->nodes[target].is_directory) {
+            errno = EISDIR;
+        } else if (target != -1 && ram->nodes[target].first_child != -1) {
+            errno = ENOTEMPTY;
+        } else {
+            if (target != -1) {
+                unlink_child(ram, target);
+                free_node(ram, target);
+            }
+            unlink_child(ram, node);
+            strcpy(entry->name, to_name);
+            link_child(ram, to_parent, node);
+            status = 0;
+        }
+    }
+    unlock_ram(ram);
+    return status;
+}
+
+static int ram_unlink(void *state, int dir, const char *name) {
+    struct ram_storage *ram = state;
+    if (check_name(name) == -1) {
+        return -1;
+    }
+
+    lock_ram(ram);
+    int parent = get_directory(ram, dir);
+    int node = parent == -1 ? -1 : find_child(ram, parent, name);
+    int status = -1;
+    if (parent != -1 && node == -1) {
+        errno = ENOENT;
+    } else if (node != -1 && ram->nodes[node].is_directory) {
+        errno = EISDIR;
+    } else if (node != -1) {
+        // Unlike a file of the filesystem, the data goes away at once: its open handles become stale
+        unlink_child(ram, node);
+        free_node(ram, node);
+        status = 0;
+    }
+    unlock_ram(ram);
+    return status;
+}
+
+static int ram_truncate(void *state, int number, off_t length) {
+    struct ram_storage *ram = state;
+    if (length < 0 || length > STORAGE_RAM_CAPACITY) {
+        errno = length < 0 ? EINVAL : EFBIG;
+        return -1;
+    }
+
+    lock_ram(ram);
+    struct ram_handle *handle = get_handle(ram, number);
+    int status = -1;
+    if (handle != NULL && (handle->flags == O_RDONLY || ram->nodes[handle->node].is_directory)) {
+        errno = EINVAL;
+    } else if (handle != NULL) {
+        status = resize_file(ram, handle, length);
+    }
+    unlock_ram(ram);
+    return status;
+}
+
+static const struct storage_ops ram_ops = {
+    .open = ram_open,
+    .close = ram_close,
+    .read = ram_read,
+    .write = ram_write,
+    .stat = ram_stat,
+    .list = ram_list,
+    .mkdir = ram_mkdir,
+    .rename = ram_rename,
+    .unlink = ram_unlink,
+    .truncate = ram_truncate,
+};
+
+void storage_create_ram(struct storage *storage) {
+    size_t size = ram_header_size() + (size_t)STORAGE_RAM_CAPACITY;
+
+    // Anonymous shared memory is inherited by forked processes; nothing is reserved
+    // in swap, and pages are only backed by memory once files are written to them
+    struct ram_storage *ram = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ram == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    // The lock must work across processes, and survive a process dying while holding it
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&(ram->lock), &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    ram->free_node = -1;
+    ram->free_block = -1;
+    for (int i = 0; i < STORAGE_RAM_BUCKETS; i++) {
+        ram->buckets[i] = -1;
+    }
+
+    // The root directory, which holds the user directories
+    int root = create_node(ram, -1, "", 1);
+
+    storage->ops = &ram_ops;
+    storage->state = ram;
+    storage->uses_fds = 0;
+    storage->root = 0;
+    ram_handles[0].in_use = 1;
+    ram_handles[0].node = root;
+    ram_handles[0].generation = ram->nodes[root].generation;
+    ram_handles[0].flags = O_RDONLY;
+    ram_handles[0].cursor_index = -1;
+}
@@ -0,0 +1,153 @@
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Storage backends, selected with SERVER_STORAGE_BACKEND in server.h
+#define STORAGE_BACKEND_POSIX (0)   // Files of the filesystem, in bin/server/users
+#define STORAGE_BACKEND_RAM (1)     // Files in shared memory, lost when the server stops
+
+// Limits of the RAM backend, whose memory is reserved once when the server starts
+// (pages are only backed by memory once they are used)
+#define STORAGE_RAM_CAPACITY (1024LL * 1024 * 1024)  // Bytes of file data
+#define STORAGE_RAM_BLOCK_SIZE (64 * 1024)          // File data is allocated in blocks of this size
+#define STORAGE_RAM_BLOCK_COUNT ((int)(STORAGE_RAM_CAPACITY / STORAGE_RAM_BLOCK_SIZE))
+#define STORAGE_RAM_MAX_NODES (64 * 1024)           // Files and directories
+#define STORAGE_RAM_BUCKETS (64 * 1024)             // Hash buckets of the index of names (a power of two)
+#define STORAGE_RAM_MAX_HANDLES (4096)              // Handles open at once in each process
+#define STORAGE_RAM_LIST_BATCH (64)                 // Entries read per hold of the lock when listing
+
+/**
+ * @brief Called for each entry of a listed directory, except "." and ".."
+ *
+ * @param name
+ * @param stat_result The metadata of the entry (symlinks are not followed)
+ * @param data
+ * @return 0 to go on, anything else to stop listing
+ */
+typedef int (*storage_list_callback)(const char *name, const struct stat *stat_result, void *data);
+
+/**
+ * @brief Operations of a storage backend. Files and directories are opened as handles,
+ * and names are resolved relative to an open directory, as with the *at() system calls.
+ * Paths never leave the directory they are resolved from. Every operation returns -1
+ * with errno set on failure, with the errno values of the matching system call.
+ */
+struct storage_ops {
+    // Open a path beneath a directory. Flags are those of open(): O_RDONLY, O_WRONLY, O_RDWR,
+    // O_CREAT, O_EXCL, O_TRUNC, O_DIRECTORY; O_PATH, O_NOFOLLOW and O_NONBLOCK only affect
+    // the POSIX backend, where O_NONBLOCK keeps opening a FIFO from blocking.
+    int (*open)(void *state, int dir, const char *path, int flags, mode_t mode);
+    int (*close)(void *state, int handle);
+    // Read from the position of the handle, which moves forward; 0 at the end of the file
+    ssize_t (*read)(void *state, int handle, void *buf, size_t count);
+    // Write all of buf at the position of the handle, which moves forward
+    int (*write)(void *state, int handle, const void *buf, size_t count);
+    // The metadata of a name in a directory, or of the handle itself if name is NULL
+    int (*stat)(void *state, int dir, const char *name, struct stat *stat_result);
+    int (*list)(void *state, int dir, storage_list_callback callback, void *data);
+    int (*mkdir)(void *state, int dir, const char *name, mode_t mode);
+    // Move a name, replacing the target as rename() does
+    int (*rename)(void *state, int from_dir, const char *from_name, int to_dir, const char *to_name);
+    // Remove a file (not a directory)
+    int (*unlink)(void *state, int dir, const char *name);
+    int (*truncate)(void *state, int handle, off_t length);
+};
+
+/**
+ * @brief A storage backend, through which the server reaches every user file
+ */
+struct storage {
+    const struct storage_ops *ops;
+    void *state;                // The backend's own state
+    int root;                   // The directory holding the user directories
+    int uses_fds;               // Whether handles are file descriptors, which may also be given to
+                                // system calls directly (reflinks, extended attributes, page cache
+                                // hints, flushes, inotify)
+};
+
+/**
+ * @brief A file or directory of the RAM backend
+ */
+struct ram_node {
+    int in_use;
+    int is_directory;
+    uint32_t generation;        // Incremented whenever the node is freed, so that stale handles fail
+    uint32_t layout;            // Incremented whenever blocks are freed, so that cached block positions are dropped
+    int parent;                 // The directory of the node, or -1 for the root
+    int first_child;            // Directories: the entries, linked through next_sibling and prev_sibling
+    int next_sibling;           // Also links the free nodes
+    int prev_sibling;
+    int hash_next;              // The next node in the same bucket of the index of names
+    int first_block;            // Files: the data, linked through block_next, or -1
+    int last_block;
+    int block_count;
+    off_t size;
+    struct timespec mtime;
+    char name[NAME_MAX + 1];
+};
+
+/**
+ * @brief The RAM backend. It lives in shared memory that is mapped before the reactors
+ * are forked, so all reactors and their transfer processes see the same files.
+ */
+struct ram_storage {
+    pthread_mutex_t lock;       // Process-shared, robust lock protecting everything below
+    int free_node;              // The first free node that was used before, or -1
+    int unused_nodes;           // Nodes from this index on were never used
+    int free_block;             // The first free block that was used before, or -1
+    int unused_blocks;          // Blocks from this index on were never used
+    int buckets[STORAGE_RAM_BUCKETS];   // Index of names: first node of each bucket, or -1
+    int block_next[STORAGE_RAM_BLOCK_COUNT]; // The next block of the same file (or free block), or -1
+    struct ram_node nodes[STORAGE_RAM_MAX_NODES];
+    // Followed in the same mapping, at a page boundary, by the data blocks
+};
+
+/**
+ * @brief An open file or directory of the RAM backend, private to one process
+ * (forked processes get a copy of the handles of their parent)
+ */
+struct ram_handle {
+    int in_use;
+    int node;
+    uint32_t generation;        // The generation of the node when it was opened
+    int flags;                  // The access mode it was opened with
+    off_t offset;               // Where the next read or write happens
+    uint32_t layout;            // The layout of the node when the cursor was set
+    int cursor_index;           // A block of the file and its index in the file, or -1, so that
+    int cursor_block;           // sequential reads and writes need not walk the list of blocks
+};
+
+/**
+ * @brief Use the filesystem, beneath the directory holding the user directories
+ *
+ * @param storage
+ * @param root_dirfd The directory holding the user directories
+ */
+void storage_create_posix(struct storage *storage, int root_dirfd);
+
+/**
+ * @brief Create an empty RAM backend in shared anonymous memory. Must be called
+ * before forking the processes that share it.
+ *
+ * @param storage (exits the process on failure)
+ */
+void storage_create_ram(struct storage *storage);
+
+int storage_open(const struct storage *storage, int dir, const char *path, int flags, mode_t mode);
+int storage_close(const struct storage *storage, int handle);
+ssize_t storage_read(const struct storage *storage, int handle, void *buf, size_t count);
+int storage_write(const struct storage *storage, int handle, const void *buf, size_t count);
+int storage_stat(const struct storage *storage, int dir, const char *name, struct stat *stat_result);
+int storage_list(const struct storage *storage, int dir, storage_list_callback callback, void *data);
+int storage_mkdir(const struct storage *storage, int dir, const char *name, mode_t mode);
+int storage_rename(const struct storage *storage, int from_dir, const char *from_name, int to_dir, const char *to_name);
+int storage_unlink(const struct storage *storage, int dir, const char *name);
+int storage_truncate(const struct storage *storage, int handle, off_t length);
+
+#endif
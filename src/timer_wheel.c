@@ -0,0 +1,175 @@
+#include "timer_wheel.h"
+
+#include <stddef.h>
+#include <time.h>
+
+uint64_t timer_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void list_init(struct timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_insert(struct timer *head, struct timer *timer) {
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_remove(struct timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer;
+    timer->prev = timer;
+}
+
+/**
+ * @brief Move all timers of the list onto another (empty) list head
+ */
+static void list_move_all(struct timer *from, struct timer *to) {
+    if (from->next == from) {
+        list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms) {
+    wheel->current_tick = now_ms / TIMER_WHEEL_TICK_MS;
+    wheel->timer_count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            list_init(&(wheel->slots[level][slot]));
+        }
+    }
+}
+
+void timer_init(struct timer *timer, timer_callback callback, void *data) {
+    timer->next = timer;
+    timer->prev = timer;
+    timer->expires = 0;
+    timer->scheduled = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+/**
+ * @brief Put a timer into the slot for its expiry tick, relative to the current tick
+ */
+static void add_timer(struct timer_wheel *wheel, struct timer *timer) {
+    uint64_t expires = timer->expires;
+    if (expires < wheel->current_tick) {
+        // Already due: fire at the next processed tick
+        expires = wheel->current_tick;
+    }
+
+    // Find the lowest level whose range covers the delay
+    uint64_t delta = expires - wheel->current_tick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+        level++;
+    }
+    if (level == TIMER_WHEEL_LEVELS - 1) {
+        // Clamp timers beyond the range of the wheel to its last slot
+        uint64_t max_delta = (1ull << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1;
+        if (delta > max_delta) {
+            expires = wheel->current_tick + max_delta;
+        }
+    }
+
+    int slot = (expires >> (level * TIMER_WHEEL_SLOT_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+    list_insert(&(wheel->slots[level][slot]), timer);
+}
+
+void timer_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t expires_ms) {
+    timer_cancel(wheel, timer);
+    timer->expires = (expires_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    timer->scheduled = 1;
+    wheel->timer_count++;
+    add_timer(wheel, timer);
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+    if (!timer->scheduled) {
+        return;
+    }
+    list_remove(timer);
+    timer->scheduled = 0;
+    wheel->timer_count--;
+}
+
+/**
+ * @brief Re-add the timers of a higher-level slot, which now fall into lower levels
+ */
+static void cascade(struct timer_wheel *wheel, int level, int slot) {
+    struct timer list;
+    list_move_all(&(wheel->slots[level][slot]), &list);
+    while (list.next != &list) {
+        struct timer *timer = list.next;
+        list_remove(timer);
+        add_timer(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms) {
+    uint64_t now_tick = now_ms / TIMER_WHEEL_TICK_MS;
+
+    while (wheel->current_tick <= now_tick) {
+        // Nothing to do for idle stretches of time
+        if (wheel->timer_count == 0) {
+            wheel->current_tick = now_tick + 1;
+            break;
+        }
+
+        // At the start of every turn of a level, bring down the timers of the next slot above it
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            uint64_t lower_bits = wheel->current_tick & ((1ull << (level * TIMER_WHEEL_SLOT_BITS)) - 1);
+            if (lower_bits != 0) {
+                break;
+            }
+            int slot = (wheel->current_tick >> (level * TIMER_WHEEL_SLOT_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+            cascade(wheel, level, slot);
+        }
+
+        // Fire the timers of this tick. They are detached first, so a callback
+        // may cancel or schedule any timer, including itself.
+        struct timer expired;
+        list_move_all(&(wheel->slots[0][wheel->current_tick & (TIMER_WHEEL_SLOTS - 1)]), &expired);
+        wheel->current_tick++;
+        while (expired.next != &expired) {
+            struct timer *timer = expired.next;
+            list_remove(timer);
+            timer->scheduled = 0;
+            wheel->timer_count--;
+            timer->callback(timer, timer->data);
+        }
+    }
+}
+
+int64_t timer_wheel_next_timeout_ms(struct timer_wheel *wheel, uint64_t now_ms) {
+    if (wheel->timer_count == 0) {
+        return -1;
+    }
+
+    // Look for the next non-empty slot of level 0 within the current turn
+    uint64_t tick = wheel->current_tick;
+    do {
+        if (wheel->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)].next != &(wheel->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)])) {
+            break;
+        }
+        tick++;
+    } while ((tick & (TIMER_WHEEL_SLOTS - 1)) != 0);
+    // If there is none, wake up at the end of the turn to cascade the next timers down
+
+    uint64_t wake_ms = tick * TIMER_WHEEL_TICK_MS;
+    return wake_ms > now_ms ? (int64_t)(wake_ms - now_ms) : 0;
+}
@@ -0,0 +1,98 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+// Resolution of the wheel: timers fire at most this late
+#define TIMER_WHEEL_TICK_MS (100)
+// Each level has 2^TIMER_WHEEL_SLOT_BITS slots; level n covers 2^(n * TIMER_WHEEL_SLOT_BITS) ticks per slot.
+// With 4 levels of 64 slots and 100 ms ticks, timers can be up to about 19 days away.
+#define TIMER_WHEEL_SLOT_BITS (6)
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS (4)
+
+struct timer;
+
+typedef void (*timer_callback)(struct timer *timer, void *data);
+
+/**
+ * @brief A timer, embedded in the object it belongs to. Timers in the same slot
+ * form a circular doubly linked list, so scheduling and cancelling are O(1).
+ */
+struct timer {
+    struct timer *next;
+    struct timer *prev;
+    uint64_t expires;           // The tick at which the timer fires
+    int scheduled;              // Whether the timer is in the wheel
+    timer_callback callback;    // Called when the timer fires, after it has been removed
+    void *data;                 // Passed to the callback
+};
+
+/**
+ * @brief Hierarchical timing wheel. Level 0 has one slot per tick; a slot of each
+ * higher level covers a whole turn of the level below, and its timers are moved
+ * down ("cascaded") when that turn comes around.
+ */
+struct timer_wheel {
+    uint64_t current_tick;  // The next tick to be processed
+    int timer_count;        // Number of scheduled timers
+    struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // List heads
+};
+
+/**
+ * @brief Get the time of a monotonic clock in milliseconds
+ */
+uint64_t timer_now_ms();
+
+/**
+ * @brief Initialize an empty wheel starting at the given time
+ * 
+ * @param wheel 
+ * @param now_ms 
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms);
+
+/**
+ * @brief Initialize a timer that is not scheduled
+ * 
+ * @param timer 
+ * @param callback 
+ * @param data 
+ */
+void timer_init(struct timer *timer, timer_callback callback, void *data);
+
+/**
+ * @brief Schedule the timer to fire at the given time, rescheduling it if it is scheduled already
+ * 
+ * @param wheel 
+ * @param timer 
+ * @param expires_ms 
+ */
+void timer_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t expires_ms);
+
+/**
+ * @brief Remove the timer from the wheel, if it is scheduled
+ * 
+ * @param wheel 
+ * @param timer 
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+/**
+ * @brief Get how long the event loop may wait before it has to advance the wheel
+ * 
+ * @param wheel 
+ * @param now_ms 
+ * @return The time in milliseconds, or -1 if no timer is scheduled
+ */
+int64_t timer_wheel_next_timeout_ms(struct timer_wheel *wheel, uint64_t now_ms);
+
+/**
+ * @brief Process all ticks up to the given time, calling the callbacks of the expired timers
+ * 
+ * @param wheel 
+ * @param now_ms 
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms);
+
+#endif
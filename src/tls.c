@@ -0,0 +1,345 @@
+#include "tls.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+// One context per process: the server side in the server, the client side in the client
+static SSL_CTX *context = NULL;
+
+// Session attached to each socket, if any
+static SSL *sessions[TLS_MAX_SOCKETS];
+
+static SSL* get_session(int sockfd) {
+    if (sockfd < 0 || sockfd >= TLS_MAX_SOCKETS) {
+        return NULL;
+    }
+    return sessions[sockfd];
+}
+
+static SSL* attach_session(int sockfd) {
+    if (context == NULL || sockfd < 0 || sockfd >= TLS_MAX_SOCKETS) {
+        return NULL;
+    }
+
+    SSL *ssl = SSL_new(context);
+    if (ssl == NULL || SSL_set_fd(ssl, sockfd) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return NULL;
+    }
+    sessions[sockfd] = ssl;
+    return ssl;
+}
+
+static int write_private_key(const char *path, EVP_PKEY *key) {
+    // Only the server may read the key
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    FILE *file = fdopen(fd, "w");
+    if (file == NULL) {
+        perror("fdopen");
+        close(fd);
+        return -1;
+    }
+
+    int status = PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL) == 1 ? 0 : -1;
+    if (fclose(file) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+static int write_certificate(const char *path, X509 *certificate) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    int status = PEM_write_X509(file, certificate) == 1 ? 0 : -1;
+    if (fclose(file) != 0) {
+        status = -1;
+    }
+    return status;
+}
+
+static int generate_self_signed_certificate(const char *certificate_path, const char *private_key_path) {
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *certificate = X509_new();
+    if (key == NULL || certificate == NULL) {
+        ERR_print_errors_fp(stderr);
+        EVP_PKEY_free(key);
+        X509_free(certificate);
+        return -1;
+    }
+
+    uint64_t serial;
+    RAND_bytes((unsigned char *)&serial, sizeof(serial));
+    X509_set_version(certificate, X509_VERSION_3);
+    ASN1_INTEGER_set_uint64(X509_get_serialNumber(certificate), serial >> 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), (long)TLS_CERTIFICATE_DAYS * 24 * 60 * 60);
+    X509_set_pubkey(certificate, key);
+
+    // The certificate is its own issuer
+    X509_NAME *name = X509_get_subject_name(certificate);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)TLS_CERTIFICATE_NAME, -1, -1, 0);
+    X509_set_issuer_name(certificate, name);
+
+    // Clients check the name or address they connected to against the alternative names
+    X509V3_CTX extension_context;
+    X509V3_set_ctx_nodb(&extension_context);
+    X509V3_set_ctx(&extension_context, certificate, certificate, NULL, NULL, 0);
+    X509_EXTENSION *extension = X509V3_EXT_conf_nid(NULL, &extension_context, NID_subject_alt_name,
+        "DNS:" TLS_CERTIFICATE_NAME ",IP:" TLS_CERTIFICATE_IP);
+    if (extension == NULL || X509_add_ext(certificate, extension, -1) != 1
+        || X509_sign(certificate, key, EVP_sha256()) == 0) {
+        ERR_print_errors_fp(stderr);
+        X509_EXTENSION_free(extension);
+        EVP_PKEY_free(key);
+        X509_free(certificate);
+        return -1;
+    }
+    X509_EXTENSION_free(extension);
+
+    int status = write_private_key(private_key_path, key) == 0 && write_certificate(certificate_path, certificate) == 0
+        ? 0
+        : -1;
+    EVP_PKEY_free(key);
+    X509_free(certificate);
+    return status;
+}
+
+int tls_create_server_context(const char *certificate_path, const char *private_key_path) {
+    if (access(certificate_path, F_OK) == -1 || access(private_key_path, F_OK) == -1) {
+        printf("Generating a self-signed TLS certificate in %s\n", certificate_path);
+        fflush(stdout);
+        if (generate_self_signed_certificate(certificate_path, private_key_path) == -1) {
+            return -1;
+        }
+    }
+
+    context = SSL_CTX_new(TLS_server_method());
+    if (context == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+
+    // Let the kernel do the record encryption where it can, so that data can be
+    // written straight to the socket
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+
+    // Data connections resume the session of their control connection. TLS 1.2
+    // sessions are found in the cache, which transfer processes inherit from their
+    // reactor; TLS 1.3 tickets are decrypted with the keys of this context, which
+    // all processes inherit from the supervisor.
+    SSL_CTX_set_session_id_context(context, (const unsigned char *)"ftp", 3);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+
+    if (SSL_CTX_use_certificate_chain_file(context, certificate_path) != 1
+        || SSL_CTX_use_PrivateKey_file(context, private_key_path, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(context) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(context);
+        context = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int tls_create_client_context(const char *trusted_certificate_path, const char *server_ip) {
+    context = SSL_CTX_new(TLS_client_method());
+    if (context == NULL) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+
+    if (trusted_certificate_path == NULL) {
+        return 0;
+    }
+    if (SSL_CTX_load_verify_locations(context, trusted_certificate_path, NULL) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(context);
+        context = NULL;
+        return -1;
+    }
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_CTX_get0_param(context), server_ip);
+    return 1;
+}
+
+int tls_accept(int sockfd, int resumable) {
+    SSL *ssl = get_session(sockfd);
+    if (ssl == NULL) {
+        if ((ssl = attach_session(sockfd)) == NULL) {
+            return -1;
+        }
+        if (!resumable) {
+            SSL_set_num_tickets(ssl, 0);
+        }
+    }
+
+    int status = SSL_accept(ssl);
+    if (status == 1) {
+        return 1;
+    }
+
+    int error = SSL_get_error(ssl, status);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        return 0;
+    }
+    ERR_print_errors_fp(stderr);
+    tls_detach(sockfd);
+    return -1;
+}
+
+int tls_connect(int sockfd, int resume_sockfd) {
+    SSL *ssl = attach_session(sockfd);
+    if (ssl == NULL) {
+        return -1;
+    }
+
+    // Offer the session of the other connection, so that no full handshake is needed
+    SSL *resume_ssl = get_session(resume_sockfd);
+    if (resume_ssl != NULL) {
+        SSL_SESSION *session = SSL_get1_session(resume_ssl);
+        if (session != NULL) {
+            SSL_set_session(ssl, session);
+            SSL_SESSION_free(session);
+        }
+    }
+
+    if (SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        tls_detach(sockfd);
+        return -1;
+    }
+    return 0;
+}
+
+int tls_is_attached(int sockfd) {
+    return get_session(sockfd) != NULL;
+}
+
+int tls_is_resumed(int sockfd) {
+    SSL *ssl = get_session(sockfd);
+    return ssl != NULL && SSL_session_reused(ssl);
+}
+
+int tls_is_send_offloaded(int sockfd) {
+    SSL *ssl = get_session(sockfd);
+    return ssl != NULL && BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+/**
+ * @brief After a failed SSL_write() or SSL_read(), wait until it can be retried
+ *
+ * @return 0 to retry, -1 if it failed for good (errno is set)
+ */
+static int wait_to_retry(int sockfd, SSL *ssl) {
+    int error = SSL_get_error(ssl, 0);
+    if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+        if (error != SSL_ERROR_SYSCALL || errno == 0) {
+            errno = EPROTO;
+        }
+        ERR_clear_error();
+        return -1;
+    }
+
+    // On a blocking socket, this means its send or receive timeout expired
+    if (!(fcntl(sockfd, F_GETFL) & O_NONBLOCK)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    struct pollfd pollfd = { .fd = sockfd, .events = error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT };
+    if (poll(&pollfd, 1, TLS_SEND_TIMEOUT_MS) == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t tls_send(int sockfd, const void *buf, size_t length) {
+    SSL *ssl = get_session(sockfd);
+    if (ssl == NULL) {
+        return send(sockfd, buf, length, 0);
+    }
+    if (length == 0) {
+        return 0;
+    }
+
+    // Like a blocking send(), wait for room even on a non-blocking socket, for a while
+    size_t bytes_sent;
+    while (SSL_write_ex(ssl, buf, length, &bytes_sent) != 1) {
+        if (wait_to_retry(sockfd, ssl) == -1) {
+            return -1;
+        }
+    }
+    return bytes_sent;
+}
+
+ssize_t tls_recv(int sockfd, void *buf, size_t length) {
+    SSL *ssl = get_session(sockfd);
+    if (ssl == NULL) {
+        return recv(sockfd, buf, length, 0);
+    }
+
+    size_t bytes_received;
+    if (SSL_read_ex(ssl, buf, length, &bytes_received) == 1) {
+        return bytes_received;
+    }
+
+    int error = SSL_get_error(ssl, 0);
+    if (error == SSL_ERROR_ZERO_RETURN) {
+        // The peer sent close_notify; an end of the connection without it is an error
+        return 0;
+    } else if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (error != SSL_ERROR_SYSCALL || errno == 0) {
+        errno = EPROTO;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+void tls_shutdown(int sockfd) {
+    SSL *ssl = get_session(sockfd);
+    if (ssl == NULL) {
+        return;
+    }
+
+    // Only send close_notify; the connection is closed right after
+    SSL_shutdown(ssl);
+    ERR_clear_error();
+    tls_detach(sockfd);
+}
+
+void tls_detach(int sockfd) {
+    SSL *ssl = get_session(sockfd);
+    if (ssl == NULL) {
+        return;
+    }
+
+    SSL_free(ssl);
+    sessions[sockfd] = NULL;
+}
@@ -0,0 +1,133 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+// Sockets with numbers up to this can have a TLS session attached
+// (every socket of the server is in a select() set anyway)
+#define TLS_MAX_SOCKETS (FD_SETSIZE)
+// How long a send on a non-blocking socket waits for the peer to make room, since the loop
+// serving the socket serves other connections too
+#define TLS_SEND_TIMEOUT_MS (1000)
+// Validity of the self-signed certificate generated when the server has none
+#define TLS_CERTIFICATE_DAYS (365)
+// Names the generated certificate is valid for; the client connects to 127.0.0.1
+#define TLS_CERTIFICATE_NAME "localhost"
+#define TLS_CERTIFICATE_IP "127.0.0.1"
+
+/**
+ * @brief Create the TLS context for the server side of connections. Loads the
+ * certificate and private key, generating a self-signed pair first if they do not
+ * exist. Must be called before forking the processes that share it, so that they
+ * can all resume the sessions (and decrypt the session tickets) of one another.
+ * Kernel TLS offload is requested on every connection.
+ *
+ * @param certificate_path
+ * @param private_key_path
+ * @return 0 on success, -1 on failure
+ */
+int tls_create_server_context(const char *certificate_path, const char *private_key_path);
+
+/**
+ * @brief Create the TLS context for the client side of connections
+ *
+ * @param trusted_certificate_path Certificate to verify the server against,
+ * or NULL to not verify the server
+ * @param server_ip Address the server certificate must be valid for
+ * @return 1 if the server will be verified, 0 if not, -1 on failure
+ * (including a certificate that cannot be loaded)
+ */
+int tls_create_client_context(const char *trusted_certificate_path, const char *server_ip);
+
+/**
+ * @brief Run the server side of the handshake on the socket, attaching a new
+ * session to it first if needed. On a non-blocking socket, call again whenever
+ * the socket becomes readable until it is done.
+ *
+ * @param sockfd
+ * @param resumable Whether to give the client tickets for resuming the session
+ * later. Without tickets, the connection carries no data the client did not ask
+ * for, which a client that only sends would never read.
+ * @return 1 when the handshake is done, 0 if it needs more data from the peer
+ * (or a blocking socket timed out), -1 if it failed (the session is detached)
+ */
+int tls_accept(int sockfd, int resumable);
+
+/**
+ * @brief Attach a new session to the socket and run the client side of the handshake
+ *
+ * @param sockfd
+ * @param resume_sockfd Socket whose session to resume, or -1 for a full handshake
+ * @return 0 on success, -1 on failure (the session is detached)
+ */
+int tls_connect(int sockfd, int resume_sockfd);
+
+/**
+ * @brief Whether a TLS session is attached to the socket
+ *
+ * @param sockfd
+ * @return 1 if so, 0 otherwise
+ */
+int tls_is_attached(int sockfd);
+
+/**
+ * @brief Whether the session of the socket was resumed rather than fully negotiated
+ *
+ * @param sockfd
+ * @return 1 if so, 0 otherwise
+ */
+int tls_is_resumed(int sockfd);
+
+/**
+ * @brief Whether the kernel encrypts what is sent through the socket (kTLS), so that
+ * plain send() and sendfile() on it, from any process, produce TLS records
+ *
+ * @param sockfd
+ * @return 1 if so, 0 otherwise
+ */
+int tls_is_send_offloaded(int sockfd);
+
+/**
+ * @brief Send through the TLS session of the socket, or directly if it has none.
+ * Sends all of the buffer or fails. On a non-blocking socket, fails with ETIMEDOUT
+ * if the peer does not make room within TLS_SEND_TIMEOUT_MS.
+ *
+ * @param sockfd
+ * @param buf
+ * @param length
+ * @return The number of bytes sent, or -1 on failure
+ */
+ssize_t tls_send(int sockfd, const void *buf, size_t length);
+
+/**
+ * @brief Receive through the TLS session of the socket, or directly if it has none
+ *
+ * @param sockfd
+ * @param buf
+ * @param length
+ * @return The number of bytes received, 0 if the peer closed the connection
+ * properly, -1 on failure (errno is EAGAIN if no whole record is available yet
+ * on a non-blocking socket, or if a blocking socket timed out)
+ */
+ssize_t tls_recv(int sockfd, void *buf, size_t length);
+
+/**
+ * @brief Tell the peer that nothing more will be sent, and detach the session.
+ * Without this, the peer cannot tell a complete transfer from a truncated one.
+ * Does nothing if the socket has no session.
+ *
+ * @param sockfd
+ */
+void tls_shutdown(int sockfd);
+
+/**
+ * @brief Detach and free the session of the socket without telling the peer.
+ * Used after fork() for sessions that remain in use by the other process.
+ *
+ * @param sockfd
+ */
+void tls_detach(int sockfd);
+
+#endif
@@ -0,0 +1,125 @@
+#include "trace.h"
+#include "common.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t trace_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int trace_create(int dirfd) {
+    static char name[64];
+    static char header[64];
+    static unsigned int counter = 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t start_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    // The start time, process id and a counter make the name unique among all reactors
+    snprintf(name, sizeof(name), "%llu-%d-%u.trace", (unsigned long long)start_us, (int)getpid(), counter++);
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("openat");
+        return -1;
+    }
+
+    int length = snprintf(header, sizeof(header), "%s %d %llu\n", TRACE_MAGIC, TRACE_VERSION,
+        (unsigned long long)start_us);
+    if (write_all(fd, header, length) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void trace_record(int fd, uint64_t offset_us, const char *command) {
+    static char line[COMMAND_STR_MAX + 32];
+
+    int length = snprintf(line, sizeof(line), "%llu ", (unsigned long long)offset_us);
+    if (check_first_token(command, COMMAND_PASSWORD)) {
+        length += snprintf(line + length, sizeof(line) - length, "%s %s", COMMAND_PASSWORD, TRACE_REDACTED);
+    } else {
+        // Keep the command on one line
+        for (const char *c = command; *c != '\0' && length < (int)sizeof(line) - 2; c++) {
+            line[length++] = (*c == '\r' || *c == '\n') ? ' ' : *c;
+        }
+        while (length > 0 && line[length - 1] == ' ') {
+            length--;
+        }
+    }
+    line[length++] = '\n';
+
+    // Recording is best effort; a full disk must not stop the session
+    if (write_all(fd, line, length) == -1) {
+        perror("write");
+    }
+}
+
+int trace_load(const char *path, struct trace *trace) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    int version;
+    unsigned long long start_us;
+    if (fscanf(file, TRACE_MAGIC " %d %llu\n", &version, &start_us) != 2 || version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a trace\n", path);
+        fclose(file);
+        return -1;
+    }
+    trace->start_us = start_us;
+    trace->command_count = 0;
+    trace->commands = NULL;
+
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    while ((line_length = getline(&line, &line_capacity, file)) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        char *command;
+        unsigned long long offset_us = strtoull(line, &command, 10);
+        if (command == line || *command != ' ') {
+            continue;
+        }
+
+        if (trace->command_count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            trace->commands = realloc(trace->commands, capacity * sizeof(struct trace_command));
+            if (trace->commands == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        struct trace_command *entry = &(trace->commands[trace->command_count++]);
+        entry->offset_us = offset_us;
+        entry->command = strdup(command + 1);
+        if (entry->command == NULL) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+void trace_free(struct trace *trace) {
+    for (size_t i = 0; i < trace->command_count; i++) {
+        free(trace->commands[i].command);
+    }
+    free(trace->commands);
+    trace->commands = NULL;
+    trace->command_count = 0;
+}
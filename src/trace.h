@@ -0,0 +1,69 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A trace is a text file holding the commands of one control connection:
+// a header line "FTPTRACE <version> <start>", then one "<offset> <command>" line
+// per command. Times are in microseconds; the start is wall-clock time, and
+// offsets count from the start of the session.
+#define TRACE_MAGIC "FTPTRACE"
+#define TRACE_VERSION (1)
+
+// What the password of PASS is replaced with
+#define TRACE_REDACTED "*"
+
+/**
+ * @brief A recorded command
+ */
+struct trace_command {
+    uint64_t offset_us;     // When the command arrived, after the start of the session
+    char *command;          // The command, without line terminator
+};
+
+/**
+ * @brief A trace loaded for replay
+ */
+struct trace {
+    uint64_t start_us;      // When the session started (wall-clock time)
+    size_t command_count;
+    struct trace_command *commands;
+};
+
+/**
+ * @brief Current monotonic time, in microseconds
+ */
+uint64_t trace_now_us();
+
+/**
+ * @brief Create the trace file of a new session and write its header
+ *
+ * @param dirfd The directory of the traces
+ * @return The file descriptor, or -1 on failure
+ */
+int trace_create(int dirfd);
+
+/**
+ * @brief Append a command to a trace. Credentials are redacted, and line terminators
+ * are removed. Each command is written with a single write(), so that nothing is
+ * left in a buffer when the process forks.
+ *
+ * @param fd The trace
+ * @param offset_us Time since the start of the session
+ * @param command
+ */
+void trace_record(int fd, uint64_t offset_us, const char *command);
+
+/**
+ * @brief Load a trace
+ *
+ * @param path
+ * @param trace Location to store the trace, to be freed with trace_free
+ * @return 0 on success, -1 if the file could not be read or is not a trace
+ */
+int trace_load(const char *path, struct trace *trace);
+
+void trace_free(struct trace *trace);
+
+#endif
@@ -0,0 +1,249 @@
+#include "usage.h"
+#include "admission.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static uint64_t mix_key(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key;
+}
+
+static struct usage_table* map_table(int fd) {
+    struct usage_table *table = mmap(NULL, sizeof(struct usage_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (table == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return table;
+}
+
+struct usage_table* usage_open(const char *path) {
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat stat_result;
+    if (fstat(fd, &stat_result) == -1 || stat_result.st_size != sizeof(struct usage_table)) {
+        close(fd);
+        fprintf(stderr, "%s is not a valid usage file\n", path);
+        return NULL;
+    }
+    struct usage_table *table = map_table(fd);
+    close(fd);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    if (memcmp(table->magic, USAGE_MAGIC, sizeof(table->magic)) != 0 || table->version != USAGE_VERSION
+        || table->size != USAGE_TABLE_SIZE) {
+        fprintf(stderr, "%s is not a valid usage file\n", path);
+        munmap(table, sizeof(struct usage_table));
+        return NULL;
+    }
+    return table;
+}
+
+struct usage_table* usage_create() {
+    struct usage_table *table = mmap(NULL, sizeof(struct usage_table), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(table->magic, USAGE_MAGIC, sizeof(table->magic));
+    table->version = USAGE_VERSION;
+    table->size = USAGE_TABLE_SIZE;
+    return table;
+}
+
+/**
+ * @brief Add up the sizes of the regular files beneath a directory
+ *
+ * @param dirfd The directory, which is closed
+ * @param skip_prefix Files whose name starts with this are not counted
+ * @return The total size
+ */
+static int64_t count_directory(int dirfd, const char *skip_prefix) {
+    DIR *dir = fdopendir(dirfd);
+    if (dir == NULL) {
+        perror("fdopendir");
+        close(dirfd);
+        return 0;
+    }
+
+    int64_t total = 0;
+    size_t skip_length = strlen(skip_prefix);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+            || strncmp(entry->d_name, skip_prefix, skip_length) == 0) {
+            continue;
+        }
+
+        struct stat stat_result;
+        if (fstatat(dirfd, entry->d_name, &stat_result, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        if (S_ISREG(stat_result.st_mode)) {
+            total += stat_result.st_size;
+        } else if (S_ISDIR(stat_result.st_mode)) {
+            int child_fd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (child_fd != -1) {
+                total += count_directory(child_fd, skip_prefix);
+            }
+        }
+    }
+
+    closedir(dir);
+    return total;
+}
+
+/**
+ * @brief Count the user directories given to one worker: every worker_count-th one,
+ * starting at the worker's index
+ */
+static void count_users(struct usage_table *table, int users_dirfd, int worker, int worker_count,
+    const char *skip_prefix) {
+    int dirfd = openat(users_dirfd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = dirfd == -1 ? NULL : fdopendir(dirfd);
+    if (dir == NULL) {
+        perror("opendir");
+        exit(EXIT_FAILURE);
+    }
+
+    // Nothing changes the directory while the table is built, so every worker sees the same order
+    int index = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (index++ % worker_count != worker) {
+            continue;
+        }
+
+        int user_dirfd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (user_dirfd == -1) {
+            continue;
+        }
+        struct usage_account *account = usage_find(table, admission_user_key(entry->d_name));
+        int64_t bytes = count_directory(user_dirfd, skip_prefix);
+        if (account != NULL) {
+            __atomic_add_fetch(&(account->bytes), bytes, __ATOMIC_RELAXED);
+        }
+    }
+    closedir(dir);
+}
+
+struct usage_table* usage_build(const char *path, int users_dirfd, int worker_count, const char *skip_prefix) {
+    static char temp_path[PATH_MAX];
+
+    // Build into a temporary file, so that an interrupted build is started over
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >= (int)sizeof(temp_path)) {
+        fprintf(stderr, "Usage file path is too long\n");
+        exit(EXIT_FAILURE);
+    }
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, sizeof(struct usage_table)) == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+    struct usage_table *table = map_table(fd);
+    if (table == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(table->magic, USAGE_MAGIC, sizeof(table->magic));
+    table->version = USAGE_VERSION;
+    table->size = USAGE_TABLE_SIZE;
+
+    // The workers add to the shared mapping directly
+    for (int worker = 0; worker < worker_count; worker++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        } else if (pid == 0) {
+            count_users(table, users_dirfd, worker, worker_count, skip_prefix);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    int status;
+    int failed = 0;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            failed = 1;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "Could not count the disk usage of the users\n");
+        unlink(temp_path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fsync(fd) == -1 || rename(temp_path, path) == -1) {
+        perror("rename");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    return table;
+}
+
+struct usage_account* usage_find(struct usage_table *table, uint64_t key) {
+    uint32_t mask = USAGE_TABLE_SIZE - 1;
+    for (uint32_t i = mix_key(key) & mask, probes = 0; probes < USAGE_TABLE_SIZE; i = (i + 1) & mask, probes++) {
+        struct usage_account *account = &(table->accounts[i]);
+        uint64_t current = __atomic_load_n(&(account->key), __ATOMIC_ACQUIRE);
+        if (current == 0) {
+            // Claim the empty account, unless another process claims it first
+            if (__atomic_compare_exchange_n(&(account->key), &current, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                return account;
+            }
+        }
+        if (current == key) {
+            return account;
+        }
+    }
+    return NULL;
+}
+
+int usage_exceeds_quota(const struct usage_account *account, int64_t growth) {
+    if (account == NULL || growth <= 0) {
+        return 0;
+    }
+    int64_t quota = __atomic_load_n(&(account->quota), __ATOMIC_RELAXED);
+    return quota > 0 && __atomic_load_n(&(account->bytes), __ATOMIC_RELAXED) + growth > quota;
+}
+
+int usage_charge(struct usage_account *account, int64_t growth) {
+    if (account == NULL) {
+        return 0;
+    }
+    if (growth <= 0) {
+        __atomic_add_fetch(&(account->bytes), growth, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // Add only if the result stays within the quota, even when other processes charge at the same time
+    int64_t bytes = __atomic_load_n(&(account->bytes), __ATOMIC_RELAXED);
+    do {
+        int64_t quota = __atomic_load_n(&(account->quota), __ATOMIC_RELAXED);
+        if (quota > 0 && bytes + growth > quota) {
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&(account->bytes), &bytes, bytes + growth, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef USAGE_H_
+#define USAGE_H_
+
+#include <stdint.h>
+
+#define USAGE_MAGIC "FTPUSAGE"
+#define USAGE_VERSION (1)
+
+// Number of users whose usage can be counted (a power of two)
+#define USAGE_TABLE_SIZE (16384)
+
+/**
+ * @brief Disk usage of one user
+ */
+struct usage_account {
+    uint64_t key;       // admission_user_key() of the username, or 0 if the account is empty
+    int64_t bytes;      // Total size of the user's files
+    int64_t quota;      // Most bytes the user may store, or 0 for no limit; set at each login
+};
+
+/**
+ * @brief The usage of all users. It lives in a file mapped by every process of the
+ * server, so changes are shared right away and persist across restarts without ever
+ * being written out explicitly. Accounts are only ever changed with atomic operations.
+ */
+struct usage_table {
+    char magic[8];      // USAGE_MAGIC, without null terminator
+    uint32_t version;   // USAGE_VERSION
+    uint32_t size;      // USAGE_TABLE_SIZE
+    struct usage_account accounts[USAGE_TABLE_SIZE]; // Open addressing, linear probing
+};
+
+/**
+ * @brief Map an existing usage file
+ *
+ * @param path
+ * @return The table, or NULL if the file is missing or not a valid usage file
+ */
+struct usage_table* usage_open(const char *path);
+
+/**
+ * @brief Create an empty table in shared anonymous memory, for storage that does not
+ * outlive the server (and so starts empty). Must be called before forking.
+ *
+ * @return The table (exits the process on failure)
+ */
+struct usage_table* usage_create();
+
+/**
+ * @brief Create the usage file by adding up the files in every user directory. The
+ * directories are shared among worker processes, which walk them in parallel.
+ *
+ * @param path
+ * @param users_dirfd The directory containing one directory per user
+ * @param worker_count Number of worker processes
+ * @param skip_prefix Files whose name starts with this are not counted (unfinished uploads)
+ * @return The table (exits the process on failure)
+ */
+struct usage_table* usage_build(const char *path, int users_dirfd, int worker_count, const char *skip_prefix);
+
+/**
+ * @brief Find the account of a user, creating it if needed
+ *
+ * @param table
+ * @param key admission_user_key() of the username
+ * @return The account, or NULL if the table is full
+ */
+struct usage_account* usage_find(struct usage_table *table, uint64_t key);
+
+/**
+ * @brief Check whether growing the user's files by some bytes would exceed the quota
+ *
+ * @param account The account, or NULL if the usage is not counted
+ * @param growth
+ * @return 1 if it would, 0 otherwise
+ */
+int usage_exceeds_quota(const struct usage_account *account, int64_t growth);
+
+/**
+ * @brief Add to the usage of a user. Growth beyond the quota is refused as a whole.
+ *
+ * @param account The account, or NULL if the usage is not counted
+ * @param growth Bytes added, or removed if negative
+ * @return 0 on success, -1 if the growth would exceed the quota
+ */
+int usage_charge(struct usage_account *account, int64_t growth);
+
+#endif
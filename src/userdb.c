@@ -0,0 +1,467 @@
+#include "userdb.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const struct userdb_header* get_header(const struct userdb *db) {
+    return (const struct userdb_header *)db->base;
+}
+
+static const struct userdb_record* get_records(const struct userdb *db) {
+    return (const struct userdb_record *)((const char *)db->base + get_header(db)->records_offset);
+}
+
+static const uint32_t* get_slots(const struct userdb *db) {
+    return (const uint32_t *)((const char *)db->base + get_header(db)->slots_offset);
+}
+
+static const char* get_strings(const struct userdb *db) {
+    return (const char *)db->base + get_header(db)->strings_offset;
+}
+
+/**
+ * @brief FNV-1a hash of a username
+ */
+static uint64_t hash_username(const char *username) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const char *c = username; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/**
+ * @brief Check that the mapped file is a database this version understands,
+ * and that all of its offsets stay within the file
+ */
+static int validate(const struct userdb *db) {
+    if (db->size < sizeof(struct userdb_header)) {
+        return -1;
+    }
+
+    const struct userdb_header *header = get_header(db);
+    if (memcmp(header->magic, USERDB_MAGIC, sizeof(header->magic)) != 0 || header->version != USERDB_VERSION
+        || header->size != db->size) {
+        return -1;
+    }
+    if (header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) != 0
+        || header->user_count >= header->slot_count) {
+        return -1;
+    }
+    if (header->records_offset + (uint64_t)header->user_count * sizeof(struct userdb_record) > db->size
+        || header->slots_offset + (uint64_t)header->slot_count * sizeof(uint32_t) > db->size
+        || header->strings_offset > db->size || db->size - header->strings_offset == 0
+        || ((const char *)db->base)[db->size - 1] != '\0') {
+        return -1;
+    }
+
+    // Every string must start inside the string table
+    uint64_t strings_size = db->size - header->strings_offset;
+    const struct userdb_record *records = get_records(db);
+    for (uint32_t i = 0; i < header->user_count; i++) {
+        if (records[i].username_offset >= strings_size || records[i].password_offset >= strings_size) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int userdb_open(const char *path, struct userdb *db) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat stat_result;
+    if (fstat(fd, &stat_result) == -1 || stat_result.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, stat_result.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    db->base = base;
+    db->size = stat_result.st_size;
+    db->is_mapped = 1;
+
+    if (validate(db) == -1) {
+        fprintf(stderr, "%s is not a valid user database\n", path);
+        userdb_close(db);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Growable byte buffer used while building a database
+ */
+struct buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+static void buffer_reserve(struct buffer *buffer, size_t extra) {
+    if (buffer->length + extra <= buffer->capacity) {
+        return;
+    }
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < buffer->length + extra) {
+        capacity *= 2;
+    }
+    buffer->data = realloc(buffer->data, capacity);
+    if (buffer->data == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    buffer->capacity = capacity;
+}
+
+static size_t buffer_append(struct buffer *buffer, const void *data, size_t length) {
+    buffer_reserve(buffer, length);
+    size_t offset = buffer->length;
+    memcpy(buffer->data + offset, data, length);
+    buffer->length += length;
+    return offset;
+}
+
+/**
+ * @brief Whether the username can safely be used as the name of a directory
+ */
+static int is_valid_username(const char *username) {
+    return strchr(username, '/') == NULL && strcmp(username, ".") != 0 && strcmp(username, "..") != 0;
+}
+
+/**
+ * @brief Parse a quota: a number of bytes, optionally followed by K, M or G
+ *
+ * @return 0 on success, -1 if the quota is invalid
+ */
+static int parse_quota(const char *text, uint64_t *quota) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || text[0] == '-') {
+        return -1;
+    }
+
+    int shift = 0;
+    if (*end == 'K') {
+        shift = 10;
+    } else if (*end == 'M') {
+        shift = 20;
+    } else if (*end == 'G') {
+        shift = 30;
+    }
+    if (shift != 0) {
+        end++;
+    }
+    if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+        return -1;
+    }
+    *quota = (uint64_t)value << shift;
+    return 0;
+}
+
+/**
+ * @brief Lay out the header, records, slots and strings into a single allocation
+ */
+static void build_image(struct userdb *db, struct buffer *records, struct buffer *strings) {
+    uint32_t user_count = records->length / sizeof(struct userdb_record);
+
+    // Keep the table at most half full
+    uint32_t slot_count = 16;
+    while (slot_count < 2 * user_count) {
+        slot_count *= 2;
+    }
+
+    // The string table always contains at least the empty string
+    if (strings->length == 0) {
+        buffer_append(strings, "", 1);
+    }
+
+    size_t records_offset = sizeof(struct userdb_header);
+    size_t slots_offset = records_offset + records->length;
+    size_t strings_offset = slots_offset + (size_t)slot_count * sizeof(uint32_t);
+    size_t size = strings_offset + strings->length;
+
+    char *base = calloc(1, size);
+    if (base == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    struct userdb_header *header = (struct userdb_header *)base;
+    memcpy(header->magic, USERDB_MAGIC, sizeof(header->magic));
+    header->version = USERDB_VERSION;
+    header->user_count = user_count;
+    header->slot_count = slot_count;
+    header->records_offset = records_offset;
+    header->slots_offset = slots_offset;
+    header->strings_offset = strings_offset;
+    header->size = size;
+
+    memcpy(base + records_offset, records->data, records->length);
+    memcpy(base + strings_offset, strings->data, strings->length);
+
+    // Insert every record with linear probing
+    struct userdb_record *record_array = (struct userdb_record *)(base + records_offset);
+    uint32_t *slots = (uint32_t *)(base + slots_offset);
+    for (uint32_t i = 0; i < user_count; i++) {
+        uint32_t slot = record_array[i].hash & (slot_count - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = i + 1;
+    }
+
+    db->base = base;
+    db->size = size;
+    db->is_mapped = 0;
+}
+
+/**
+ * @brief Hash table over the records being built, used to detect duplicate usernames
+ */
+struct build_index {
+    uint32_t *slots;        // Record index + 1, or 0 if empty
+    uint32_t slot_count;    // A power of two
+};
+
+/**
+ * @brief Double the size of the index (or create it) and reinsert all records
+ */
+static void grow_build_index(struct build_index *index, const struct buffer *records) {
+    uint32_t slot_count = index->slot_count > 0 ? index->slot_count * 2 : 1024;
+    uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+    if (slots == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    const struct userdb_record *record_array = (const struct userdb_record *)records->data;
+    for (uint32_t i = 0; i < records->length / sizeof(struct userdb_record); i++) {
+        uint32_t slot = record_array[i].hash & (slot_count - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = i + 1;
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->slot_count = slot_count;
+}
+
+/**
+ * @brief Find the slot holding the username, or the empty slot where it belongs
+ */
+static uint32_t* find_build_slot(struct build_index *index, const struct buffer *records,
+    const struct buffer *strings, uint64_t hash, const char *username) {
+    const struct userdb_record *record_array = (const struct userdb_record *)records->data;
+    uint32_t mask = index->slot_count - 1;
+    uint32_t slot = hash & mask;
+    while (index->slots[slot] != 0) {
+        const struct userdb_record *record = &record_array[index->slots[slot] - 1];
+        if (record->hash == hash && strcmp(strings->data + record->username_offset, username) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return &index->slots[slot];
+}
+
+void userdb_init_empty(struct userdb *db) {
+    struct buffer records = { 0 }, strings = { 0 };
+    build_image(db, &records, &strings);
+    free(strings.data);
+}
+
+int userdb_compile_text(const char *path, struct userdb *db) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    struct buffer records = { 0 }, strings = { 0 };
+    struct build_index index = { NULL, 0 };
+    grow_build_index(&index, &records);
+
+    // Read each line from the file and parse username and password
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, file) != -1) {
+        // Remove trailing newline
+        line[strcspn(line, "\r\n")] = '\0';
+
+        // Extract username and password
+        char *username = strtok(line, " ");
+        char *password = strtok(NULL, " ");
+        char *quota_text = strtok(NULL, " ");
+
+        // Skip line if it is invalid or empty
+        uint64_t quota = 0;
+        if (username == NULL || password == NULL || !is_valid_username(username)
+            || (quota_text != NULL && parse_quota(quota_text, &quota) == -1)) {
+            continue;
+        }
+
+        uint32_t password_offset = buffer_append(&strings, password, strlen(password) + 1);
+
+        // If the user exists already, the later line wins
+        uint64_t hash = hash_username(username);
+        uint32_t *slot = find_build_slot(&index, &records, &strings, hash, username);
+        if (*slot != 0) {
+            ((struct userdb_record *)records.data)[*slot - 1].password_offset = password_offset;
+            ((struct userdb_record *)records.data)[*slot - 1].quota = quota;
+            continue;
+        }
+
+        struct userdb_record record;
+        record.hash = hash;
+        record.username_offset = buffer_append(&strings, username, strlen(username) + 1);
+        record.password_offset = password_offset;
+        record.quota = quota;
+        buffer_append(&records, &record, sizeof(record));
+        *slot = records.length / sizeof(struct userdb_record);
+
+        if (2 * (records.length / sizeof(struct userdb_record)) >= index.slot_count) {
+            grow_build_index(&index, &records);
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    build_image(db, &records, &strings);
+    free(index.slots);
+    free(records.data);
+    free(strings.data);
+    return 0;
+}
+
+int userdb_write(const struct userdb *db, const char *path) {
+    static char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    const char *data = db->base;
+    size_t remaining = db->size;
+    while (remaining > 0) {
+        ssize_t bytes_written = write(fd, data, remaining);
+        if (bytes_written == -1) {
+            perror("write");
+            close(fd);
+            unlink(temp_path);
+            return -1;
+        }
+        data += bytes_written;
+        remaining -= bytes_written;
+    }
+
+    if (fsync(fd) == -1 || close(fd) == -1) {
+        perror("fsync");
+        unlink(temp_path);
+        return -1;
+    }
+
+    // Readers that mapped the old file keep using it; new readers get the new one
+    if (rename(temp_path, path) == -1) {
+        perror("rename");
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void userdb_close(struct userdb *db) {
+    if (db->base == NULL) {
+        return;
+    }
+    if (db->is_mapped) {
+        munmap(db->base, db->size);
+    } else {
+        free(db->base);
+    }
+    db->base = NULL;
+    db->size = 0;
+}
+
+const struct userdb_record* userdb_find(const struct userdb *db, const char *username) {
+    const struct userdb_header *header = get_header(db);
+    const struct userdb_record *records = get_records(db);
+    const uint32_t *slots = get_slots(db);
+    const char *strings = get_strings(db);
+
+    uint64_t hash = hash_username(username);
+    uint32_t mask = header->slot_count - 1;
+    for (uint32_t slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+        uint32_t index = slots[slot] - 1;
+        if (index >= header->user_count) {
+            return NULL;
+        }
+        const struct userdb_record *record = &records[index];
+        if (record->hash == hash && strcmp(strings + record->username_offset, username) == 0) {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+const char* userdb_username(const struct userdb *db, const struct userdb_record *record) {
+    return get_strings(db) + record->username_offset;
+}
+
+const char* userdb_password(const struct userdb *db, const struct userdb_record *record) {
+    return get_strings(db) + record->password_offset;
+}
+
+uint64_t userdb_quota(const struct userdb *db, const struct userdb_record *record) {
+    (void)db;
+    return record->quota;
+}
+
+uint32_t userdb_user_count(const struct userdb *db) {
+    return get_header(db)->user_count;
+}
+
+struct userdb_snapshot* userdb_snapshot_create(const struct userdb *db) {
+    struct userdb_snapshot *snapshot = malloc(sizeof(struct userdb_snapshot));
+    if (snapshot == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    snapshot->db = *db;
+    snapshot->refcount = 1;
+    return snapshot;
+}
+
+struct userdb_snapshot* userdb_snapshot_retain(struct userdb_snapshot *snapshot) {
+    snapshot->refcount++;
+    return snapshot;
+}
+
+void userdb_snapshot_release(struct userdb_snapshot *snapshot) {
+    if (--snapshot->refcount == 0) {
+        userdb_close(&(snapshot->db));
+        free(snapshot);
+    }
+}
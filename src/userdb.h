@@ -0,0 +1,144 @@
+#ifndef USERDB_H_
+#define USERDB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define USERDB_MAGIC "FTPUSRDB"
+#define USERDB_VERSION (2)
+
+/**
+ * @brief Header at the start of a compiled user database. The file is position
+ * independent (it only contains offsets), so it can be used directly after mmap().
+ */
+struct userdb_header {
+    char magic[8];              // USERDB_MAGIC, without null terminator
+    uint32_t version;           // USERDB_VERSION
+    uint32_t user_count;        // Number of records
+    uint32_t slot_count;        // Number of hash table slots, a power of two
+    uint32_t reserved;
+    uint64_t records_offset;    // Offset of struct userdb_record[user_count]
+    uint64_t slots_offset;      // Offset of uint32_t[slot_count]: record index + 1, or 0 if empty
+    uint64_t strings_offset;    // Offset of the null-terminated usernames and passwords
+    uint64_t size;              // Size of the whole database
+};
+
+/**
+ * @brief One user in a compiled user database
+ */
+struct userdb_record {
+    uint64_t hash;              // Hash of the username
+    uint32_t username_offset;   // Offset of the username in the strings
+    uint32_t password_offset;   // Offset of the password in the strings
+    uint64_t quota;             // Most bytes the user may store, or 0 for no limit
+};
+
+/**
+ * @brief A user database, either mapped from a compiled file or built in memory
+ */
+struct userdb {
+    void *base;         // Start of the database (the header)
+    size_t size;        // Size of the database
+    int is_mapped;      // Whether base was mmap()ed (1) or malloc()ed (0)
+};
+
+/**
+ * @brief A reference-counted version of the user database. When the database is
+ * reloaded, sessions that started with an older snapshot keep using it; it is
+ * closed once the last of them lets go.
+ */
+struct userdb_snapshot {
+    struct userdb db;
+    unsigned int refcount;
+};
+
+/**
+ * @brief Map a compiled user database file
+ * 
+ * @param path 
+ * @param db 
+ * @return 0 on success, -1 if the file is missing or not a valid database
+ */
+int userdb_open(const char *path, struct userdb *db);
+
+/**
+ * @brief Build a user database in memory from a text file with one "username password [quota]"
+ * line per user. The optional quota is in bytes, or in KiB, MiB or GiB with a K, M or G suffix.
+ * Invalid lines are skipped; if a username appears twice, the last line wins.
+ * 
+ * @param path 
+ * @param db 
+ * @return 0 on success, -1 if the file could not be read
+ */
+int userdb_compile_text(const char *path, struct userdb *db);
+
+/**
+ * @brief Create an empty user database in memory
+ * 
+ * @param db 
+ */
+void userdb_init_empty(struct userdb *db);
+
+/**
+ * @brief Write the database to a file, atomically replacing any existing one
+ * 
+ * @param db 
+ * @param path 
+ * @return 0 on success, -1 on failure
+ */
+int userdb_write(const struct userdb *db, const char *path);
+
+/**
+ * @brief Unmap or free the database
+ * 
+ * @param db 
+ */
+void userdb_close(struct userdb *db);
+
+/**
+ * @brief Find a user by username
+ * 
+ * @param db 
+ * @param username 
+ * @return The record, or NULL if there is no such user
+ */
+const struct userdb_record* userdb_find(const struct userdb *db, const char *username);
+
+const char* userdb_username(const struct userdb *db, const struct userdb_record *record);
+
+const char* userdb_password(const struct userdb *db, const struct userdb_record *record);
+
+/**
+ * @brief Most bytes the user may store, or 0 for no limit
+ */
+uint64_t userdb_quota(const struct userdb *db, const struct userdb_record *record);
+
+/**
+ * @brief Number of users in the database
+ */
+uint32_t userdb_user_count(const struct userdb *db);
+
+/**
+ * @brief Create a snapshot that takes over the given database, with a reference count of 1
+ * 
+ * @param db 
+ * @return The snapshot
+ */
+struct userdb_snapshot* userdb_snapshot_create(const struct userdb *db);
+
+/**
+ * @brief Take another reference to the snapshot
+ * 
+ * @param snapshot 
+ * @return The snapshot
+ */
+struct userdb_snapshot* userdb_snapshot_retain(struct userdb_snapshot *snapshot);
+
+/**
+ * @brief Drop a reference to the snapshot, closing its database when it was the last one
+ * 
+ * @param snapshot 
+ */
+void userdb_snapshot_release(struct userdb_snapshot *snapshot);
+
+#endif